@@ -12,27 +12,277 @@
  */
 #include <pthread.h>
 #include <time.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/wait.h>
 #include "errors.h"
+#include "alarm.h"
+#include "alarm_queue.h"
+#include "alarm_chain.h"
+#include "alarm_ticker.h"
+#include "alarm_pool.h"
+#include "alarm_source.h"
+#include "alarm_shard.h"
+#include "alarm_dgram.h"
+#include "alarm_events.h"
+#include "alarm_stats.h"
+#include "alarm_wal.h"
+#include "alarm_limits.h"
+#include "alarm_reorder.h"
+#include "alarm_pqueue.h"
+#include "alarm_usage.h"
+#include "alarm_output.h"
+
+pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t display_cond[2] = {
+    PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+queue_t *alarm_queue = NULL;   /* pending alarms, see alarm_queue.h */
+alarm_t *current_alarm = NULL;  /* current alarm to process */
+int current_display;            /* display thread it is for */
+int report_stats = 0;           /* -s: print accounting at EOF */
+int ticker_mode = 0;            /* -t: bulk countdown, alarm_ticker.h */
+events_t *alarm_events = NULL;  /* -e: fired alarms, alarm_events.h */
+unsigned long alarm_budget = 0; /* most alarms pending, 0 for no limit */
+reorder_t *alarm_reorder = NULL;        /* -O: alarm_reorder.h */
+pthread_cond_t reorder_cond;    /* wakes the reorder thread */
+shard_t *shard_table = NULL;    /* -P: every scheduler, alarm_shard.h */
+int shard_self = -1;            /* this scheduler, or -1 */
+int shard_count = 0;
+forward_t shard_forward;        /* where migrated alarms went */
+int rebalance = 0;              /* -R: move alarms between schedulers */
+int spread_window = 0;          /* -J: seconds fires are spread over */
+int usage_seconds = 0;          /* -U: seconds between usage reports */
+char usage_label[32] = "the server";    /* this process, in the report */
 
 /*
- * The "alarm" structure now contains the time_t (time since the
- * Epoch, in seconds) for each alarm, so that they can be
- * sorted. Storing the requested number of seconds would not be
- * enough, since the "alarm thread" cannot tell how long it has
- * been on the list.
+ * Display thread health (-D). In the bulk countdown mode (-t) a
+ * display thread formats its lines with alarm_mutex locked, and
+ * hands them to the output thread once it has unlocked it (see
+ * alarm_output.h). The thread stamps its heartbeat whenever it is
+ * back under the mutex. The watchdog thread looks once a second,
+ * and takes a thread that has been out for watchdog_seconds to be
+ * stalled: the alarms in its ticker table, and any handed to it and
+ * not yet claimed, are moved to the other display thread, which is
+ * also given new alarms until the stalled one is back.
+ *
+ * A stdout that nobody reads no longer stalls a display thread; it
+ * holds up the output thread, which the watchdog watches as well.
+ * Moving alarms can't help there, as every thread's lines go to the
+ * same stdout: the alarms go on firing on time, and their lines
+ * wait in the output buffer. The watchdog reports on stderr, with
+ * alarm_mutex unlocked.
  */
-typedef struct alarm_tag {
-    struct alarm_tag    *link;
-    int                 seconds;
-    time_t              time;   /* seconds from EPOCH */
-    char                message[64];
-} alarm_t;
+typedef struct worker_tag {
+    ticker_t            ticker;         /* alarms counting down */
+    time_t              heartbeat;      /* last back under alarm_mutex */
+    int                 writing;        /* out writing its lines */
+    int                 stalled;        /* found stalled by the watchdog */
+    char                *out;           /* lines to write */
+    size_t              length, size;
+} worker_t;
 
-pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t d1_cond = PTHREAD_COND_INITIALIZER;
-pthread_cond_t d2_cond = PTHREAD_COND_INITIALIZER;
-alarm_t *alarm_list = NULL;
-alarm_t *current_alarm = NULL;  /* current alarm to process */
+worker_t worker[2];
+int watchdog_seconds = 0;       /* stall threshold, 0 for no watchdog */
+unsigned long watchdog_stalls = 0, watchdog_rescued = 0,
+    watchdog_recovered = 0, watchdog_output_stalls = 0;
+
+/*
+ * Sizing from the detected limits (alarm_limits.h). A scheduler
+ * process is given at least SHARD_MEMORY of the memory limit, and
+ * half of the limit goes to pending alarms, each of which costs its
+ * record and its share of the id index.
+ */
+#define SHARD_MEMORY    (32ULL * 1024 * 1024)
+#define ALARM_COST      (sizeof (alarm_t) + 4 * sizeof (void*))
+
+/*
+ * Late alarm policy (-p). By default an alarm whose deadline has
+ * already passed is handed to a display thread like any other,
+ * one per alarm thread iteration, which makes a backlog drain at
+ * one alarm per second. The policies are:
+ *
+ *      catchup   the alarm thread expires overdue alarms itself,
+ *                in bulk, at most catchup_rate (-r) per second
+ *                (0 for no limit);
+ *      coalesce  display threads fold countdown ticks they missed
+ *                while held up into a single line;
+ *      shed      alarms more than max_lateness (-m) seconds past
+ *                their deadline are discarded.
+ */
+#define LATE_NONE       0
+#define LATE_CATCHUP    1
+#define LATE_COALESCE   2
+#define LATE_SHED       3
+
+int late_policy = LATE_NONE;
+int catchup_rate = 0;
+int max_lateness = 10;
+
+/*
+ * Write out a fire event: its line of output, and its event in the
+ * -e ring. With -O the event goes through the reorder buffer, and
+ * is written out when the reorder thread releases it.
+ */
+void fire_output (const reorder_entry_t *entry, void *arg)
+{
+    alarm_t alarm;
+
+    output_write (entry->line, strlen (entry->line));
+    if (alarm_events != NULL) {
+        alarm.id = entry->id;
+        alarm.time = entry->deadline;
+        alarm.seconds = entry->seconds;
+        events_publish (alarm_events, &alarm, entry->text, entry->length,
+            entry->display, entry->fired);
+    }
+}
+
+/*
+ * Add a line to what a display thread will write out once it has
+ * unlocked alarm_mutex. Called by that thread, with alarm_mutex
+ * locked.
+ */
+void worker_printf (worker_t *self, const char *format, ...)
+{
+    va_list ap;
+    int length;
+
+    while (1) {
+        va_start (ap, format);
+        length = vsnprintf (self->out + self->length,
+            self->size - self->length, format, ap);
+        va_end (ap);
+        if (self->length + length < self->size)
+            break;
+        self->size = self->size ? self->size * 2 : 4096;
+        self->out = (char*)realloc (self->out, self->size);
+        if (self->out == NULL)
+            errno_abort ("Allocate display output");
+    }
+    self->length += length;
+}
+
+/*
+ * Hand a display thread's lines to the output thread, with
+ * alarm_mutex unlocked, and account for the thread being back.
+ */
+void worker_write (worker_t *self)
+{
+    int status;
+
+    self->writing = 1;
+    status = pthread_mutex_unlock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    output_write (self->out, self->length);
+    status = pthread_mutex_lock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    self->writing = 0;
+    self->length = 0;
+    self->heartbeat = time (NULL);
+    if (self->stalled) {
+        self->stalled = 0;
+        watchdog_recovered++;
+    }
+}
+
+/*
+ * Report that an alarm has fired, with "line" as its output. Called
+ * with alarm_mutex locked. In the bulk countdown mode, a display
+ * thread's line is written out with its others (see worker_t).
+ */
+void report_fire (int display, alarm_t *alarm, const char *line, time_t now)
+{
+    reorder_entry_t entry;
+    int status;
+
+    if (alarm_reorder == NULL) {
+        if (ticker_mode && display > 0)
+            worker_printf (&worker[display - 1], "%s", line);
+        else
+            output_write (line, strlen (line));
+        if (alarm_events != NULL)
+            events_publish (alarm_events, alarm, alarm_text (alarm),
+                alarm_length (alarm), display, now);
+        return;
+    }
+    entry.id = alarm->id;
+    entry.deadline = alarm->time;
+    entry.fired = now;
+    entry.seconds = alarm->seconds;
+    entry.display = display;
+    entry.length = alarm_length (alarm);
+    if (entry.length > sizeof (entry.text))
+        entry.length = sizeof (entry.text);
+    memcpy (entry.text, alarm_text (alarm), entry.length);
+    snprintf (entry.line, sizeof (entry.line), "%s", line);
+    reorder_put (alarm_reorder, &entry, reorder_clock ());
+    if (alarm_reorder->count == 1) {
+        status = pthread_cond_signal (&reorder_cond);
+        if (status != 0)
+            err_abort (status, "Signal cond");
+    }
+}
+
+/*
+ * Deal with the overdue alarms at the head of the queue according
+ * to the catchup or shed policy. The queue is sorted, so the head
+ * is always the latest of them. Called by the alarm thread with
+ * alarm_mutex locked.
+ */
+void late_alarms (time_t now)
+{
+    alarm_t *alarm;
+    char buf[160];
+    int count = 0;
+
+    while ((alarm = queue_peek (alarm_queue)) != NULL && alarm->time < now) {
+        if (late_policy == LATE_SHED) {
+            if (now - alarm->time <= max_lateness)
+                break;
+            queue_pop (alarm_queue);
+            output_printf ("Alarm Thread Shed Late Alarm at %d: %d %.*s, "
+                "ExpiryTime is %d\n", now, alarm->seconds,
+                alarm_length (alarm), alarm_text (alarm), alarm->time);
+            stats_shed (alarm->id);
+            if (alarm_wal != NULL)
+                wal_done (alarm_wal, alarm->id);
+            if (alarm->chain != NULL)
+                chain_abandon (alarm);
+        } else {
+            if (catchup_rate > 0 && count >= catchup_rate)
+                break;
+            queue_pop (alarm_queue);
+            snprintf (buf, sizeof (buf), "Alarm Thread: Late Alarm Expired "
+                "at %d: %d %.*s, ExpiryTime is %d\n", now, alarm->seconds,
+                alarm_length (alarm), alarm_text (alarm), alarm->time);
+            report_fire (0, alarm, buf, now);
+            if (alarm->chain != NULL)
+                chain_fired (alarm, now, alarm_queue);
+            stats_fire (alarm->id);
+            if (alarm_wal != NULL)
+                wal_done (alarm_wal, alarm->id);
+        }
+        alarm_free (alarm);
+        count++;
+    }
+}
+
+/*
+ * Publish the depth of this scheduler's queue, and how many alarms
+ * have left it, for the front end's rebalancer. Called with
+ * alarm_mutex locked.
+ */
+void shard_publish (void)
+{
+    shard_t *self = &shard_table[shard_self];
+
+    __atomic_store_n (&self->depth, queue_count (alarm_queue),
+        __ATOMIC_RELAXED);
+    __atomic_store_n (&self->progress, stats_progress (), __ATOMIC_RELAXED);
+}
 
 /*
  * The alarm thread's start routine.
@@ -40,10 +290,12 @@ alarm_t *current_alarm = NULL;  /* current alarm to process */
 void *alarm_thread (void *arg)
 {
     alarm_t *alarm;
-    time_t now;
     int status;
     int sleep_time;
+    int display;
+    int snapshot;
 
+    usage_register ("alarm-thread");
     /*
      * Loop forever, retreiving alarms. The alarm thread will
      * be disintegrated when the process exits.
@@ -53,47 +305,71 @@ void *alarm_thread (void *arg)
         status = pthread_mutex_lock (&alarm_mutex);
         if (status != 0)
             err_abort (status, "Lock mutex");
-        alarm = alarm_list;
+        if (late_policy == LATE_CATCHUP || late_policy == LATE_SHED)
+            late_alarms (time (NULL));
+        if (shard_self >= 0)
+            shard_publish ();
+        alarm = queue_pop (alarm_queue);
+        sleep_time = 1;
 
         /*
-         * If the alarm list is empty, wait for one second. This
+         * If the alarm queue is empty, wait for one second. This
          * allows the main thread to run, and read another
-         * command. If the list is not empty, remove the first
+         * command. If the queue is not empty, remove the first
          * item. Get the expiry time, and assign display thread 1
 	 * to process the alarm if the expiry time is odd, or display
          * thread 2 if the expiry time is even.
          */
-        if (alarm == NULL)
-	   sleep_time = 1;
-        else
+        if (alarm != NULL)
 	{ 	    
-            alarm_list = alarm->link;
-	    current_alarm = alarm;
-	    if (alarm->time % 2 == 1)
-            {
-		/* 
-		 * Message to indicate that the current alarm has been passed to
-		 * display thread 1
-		 */
-	   	printf("Alarm Thread Passed on Alarm Request to Display Thread 1 "
-			"at %d: %d %s\n", time (NULL), alarm->seconds, alarm->message);
-		/* Wake up display thread 1 to process the current alarm */
-		status = pthread_cond_signal(&d1_cond);
-		if (status != 0)
-	    		err_abort(status, "Signal cond");
+	    /*
+	     * If the previous alarm is still sitting in current_alarm,
+	     * no display thread was waiting when it was signalled, and
+	     * it is about to be lost. Account for it, and release it.
+	     */
+	    if (current_alarm != NULL)
+	    {
+		stats_drop (current_alarm->id);
+		if (alarm_wal != NULL)
+		    wal_done (alarm_wal, current_alarm->id);
+		if (current_alarm->chain != NULL)
+		    chain_abandon (current_alarm);
+		alarm_free (current_alarm);
 	    }
-	    else
+	    current_alarm = alarm;
+	    display = (alarm->time % 2 == 1) ? 1 : 2;
+	    if (worker[display - 1].stalled && !worker[2 - display].stalled)
+		display = 3 - display;
+	    current_display = display;
+
+	    /* 
+	     * Message to indicate that the current alarm has been passed to
+	     * the display thread
+	     */
+	    output_printf("Alarm Thread Passed on Alarm Request to Display Thread %d "
+		    "at %d: %d %.*s\n", display, time (NULL), alarm->seconds,
+		    alarm_length (alarm), alarm_text (alarm));
+	    stats_handoff (alarm->id);
+	    /* Wake up the display thread to process the current alarm */
+	    status = pthread_cond_signal(&display_cond[display - 1]);
+	    if (status != 0)
+	    	err_abort(status, "Signal cond");
+	}
+
+	/*
+	 * Write out the log records gathered in the last second, and
+	 * start the log again from a snapshot once it has grown. Only
+	 * the copy of the pending alarms is made under the mutex; the
+	 * snapshot is written and synced once it is unlocked.
+	 */
+	snapshot = 0;
+	if (alarm_wal != NULL)
+	{
+	    wal_flush (alarm_wal);
+	    if (alarm_wal->log.bytes >= WAL_SNAPSHOT_BYTES)
 	    {
-		/* 
-		 * Message to indicate that the current alarm has been passed to
-		 * display thread 2
-		 */
-		printf("Alarm Thread Passed on Alarm Request to Display Thread 2 "
-			"at %d: %d %s\n", time (NULL), alarm->seconds, alarm->message);
-		/* Wake up display thread 2 to process the current alarm */
-		status = pthread_cond_signal(&d2_cond);
-		if (status != 0)
-	    		err_abort(status, "Signal cond");
+		wal_snapshot_begin (alarm_wal, alarm_queue, current_alarm);
+		snapshot = 1;
 	    }
 	}
 
@@ -105,16 +381,258 @@ void *alarm_thread (void *arg)
         status = pthread_mutex_unlock (&alarm_mutex);
         if (status != 0)
             err_abort (status, "Unlock mutex");
+	if (snapshot)
+	    wal_snapshot_write (alarm_wal);
 	sleep(sleep_time);
     }
 }
 
-/* Display 1 start routine */
-void *display_thread_1(void *arg)
+/*
+ * Print the expiry of an alarm, arm the next stage of its chain if
+ * it has one, and account for it. Called by a display thread with
+ * alarm_mutex locked. The caller frees the alarm.
+ */
+void display_expire (int number, alarm_t *alarm)
 {
+    char buf[128];
+
+    /* Prints a message saying that the current alarm has expired */
+    alarm_format_expired (buf, sizeof (buf), number, time (NULL), alarm);
+    report_fire (number, alarm, buf, time (NULL));
+    /*
+     * Arm the next stage, if this alarm completes one of a chain.
+     * This is done before the alarm is accounted as fired, so that
+     * the server never looks drained between stages.
+     */
+    if (alarm->chain != NULL)
+        chain_fired (alarm, time (NULL), alarm_queue);
+    stats_fire (alarm->id);
+    if (alarm_wal != NULL)
+        wal_done (alarm_wal, alarm->id);
+}
+
+/*
+ * The reorder thread (-O). It sleeps until the oldest event held
+ * in the reorder buffer has been held for the latency budget, and
+ * releases it, with any events ahead of it in deadline order.
+ */
+void *reorder_thread (void *arg)
+{
+    struct timespec wake;
+    long long next;
     int status;
+
+    usage_register ("alarm-reorder");
+    status = pthread_mutex_lock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    while (1) {
+        reorder_drain (alarm_reorder, reorder_clock ());
+        next = reorder_next (alarm_reorder);
+        if (next < 0)
+            status = pthread_cond_wait (&reorder_cond, &alarm_mutex);
+        else {
+            wake.tv_sec = next / 1000000000LL;
+            wake.tv_nsec = next % 1000000000LL;
+            status = pthread_cond_timedwait (
+                &reorder_cond, &alarm_mutex, &wake);
+            if (status == ETIMEDOUT)
+                status = 0;
+        }
+        if (status != 0)
+            err_abort (status, "Wait on cond");
+    }
+}
+
+/*
+ * The watchdog thread (-D). Once a second, look for a display
+ * thread that has been out writing its lines for watchdog_seconds,
+ * and move its alarms to the other one (see worker_t), unless that
+ * one is stalled too. A stalled thread finds its table empty when
+ * it gets back. Also look for the output thread having been held up
+ * in a write as long. What is found is written to stderr once
+ * alarm_mutex is unlocked.
+ */
+void *watchdog_thread (void *arg)
+{
+    worker_t *self, *other;
+    char report[6][160];
+    int reported[2] = {0, 0};
+    time_t now, since, output_reported = 0;
+    int status, i, n, moved;
+
+    usage_register ("alarm-watchdog");
+    while (1) {
+        sleep (1);
+        n = 0;
+        status = pthread_mutex_lock (&alarm_mutex);
+        if (status != 0)
+            err_abort (status, "Lock mutex");
+        now = time (NULL);
+        for (i = 0; i < 2; i++) {
+            self = &worker[i];
+            other = &worker[1 - i];
+            if (reported[i] && !self->stalled) {
+                reported[i] = 0;
+                snprintf (report[n++], sizeof (report[0]), "Watchdog: "
+                    "Display Thread %d Recovered at %d\n", i + 1, now);
+            }
+            if (!self->writing || self->stalled
+                    || now - self->heartbeat < watchdog_seconds)
+                continue;
+            self->stalled = 1;
+            watchdog_stalls++;
+            moved = 0;
+            if (!other->stalled) {
+                while (self->ticker.count > 0) {
+                    ticker_move (&self->ticker, self->ticker.count - 1,
+                        &other->ticker);
+                    moved++;
+                }
+                if (current_alarm != NULL && current_display == i + 1) {
+                    current_display = 2 - i;
+                    moved++;
+                }
+                status = pthread_cond_signal (&display_cond[1 - i]);
+                if (status != 0)
+                    err_abort (status, "Signal cond");
+            }
+            watchdog_rescued += moved;
+            reported[i] = 1;
+            snprintf (report[n++], sizeof (report[0]), "Watchdog: Display "
+                "Thread %d Stalled for %d Seconds at %d, %d Alarms Moved "
+                "to Display Thread %d\n", i + 1,
+                (int)(now - self->heartbeat), now, moved, 2 - i);
+        }
+        status = pthread_mutex_unlock (&alarm_mutex);
+        if (status != 0)
+            err_abort (status, "Unlock mutex");
+
+        since = output_stalled ();
+        if (output_reported != 0 && since != output_reported) {
+            output_reported = 0;
+            snprintf (report[n++], sizeof (report[0]),
+                "Watchdog: Output Recovered at %d\n", now);
+        }
+        if (since != 0 && output_reported == 0
+                && now - since >= watchdog_seconds) {
+            output_reported = since;
+            watchdog_output_stalls++;
+            snprintf (report[n++], sizeof (report[0]), "Watchdog: Output "
+                "Stalled for %d Seconds at %d, %lu Lines Dropped\n",
+                (int)(now - since), now, output_dropped ());
+        }
+        for (i = 0; i < n; i++)
+            fputs (report[i], stderr);
+    }
+}
+
+/*
+ * Display thread body for the bulk countdown mode (-t). The thread
+ * keeps every alarm it has received in its ticker table, and wakes
+ * once a second (or when the alarm thread hands it another alarm)
+ * to scan the table: expired alarms are reported and released, and
+ * running ones due for a countdown line get one. alarm_mutex is
+ * only held while the thread is working, never while it waits or
+ * writes its lines out (see worker_t).
+ */
+void ticker_display (int number)
+{
+    worker_t *self = &worker[number - 1];
+    ticker_t *ticker = &self->ticker;
+    struct timespec wake;
     alarm_t *alarm;
     time_t now;
+    int status, i, j, nexpired, ndue, missed;
+
+    status = pthread_mutex_lock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    ticker_init (ticker);
+    while (1) {
+        self->heartbeat = time (NULL);
+        if (current_alarm != NULL && current_display == number) {
+            alarm = current_alarm;
+            current_alarm = NULL;
+            worker_printf (self, "Display Thread %d: Received Alarm Request "
+                "at %d: %d %.*s, ExpiryTime is %d \n", number, time (NULL),
+                alarm->seconds, alarm_length (alarm), alarm_text (alarm),
+                alarm->time);
+            ticker_add (ticker, alarm, time (NULL));
+        }
+
+        now = time (NULL);
+        ticker_scan (ticker->deadline, ticker->next_tick, ticker->count, now,
+            ticker->remaining, ticker->expired, &nexpired,
+            ticker->due, &ndue);
+        for (i = 0; i < ndue; i++) {
+            j = ticker->due[i];
+            alarm = ticker->alarm[j];
+            missed = (now - ticker->next_tick[j]) / TICKER_INTERVAL;
+            if (late_policy == LATE_COALESCE && missed > 0)
+                worker_printf (self, "Display Thread %d: Number of Seconds "
+                    "Left %d: Time: %d: %d %.*s (%d ticks coalesced)\n",
+                    number, (int)ticker->remaining[j],
+                    (int)ticker->received[j], alarm->seconds,
+                    alarm_length (alarm), alarm_text (alarm), missed);
+            else
+                worker_printf (self, "Display Thread %d: Number of Seconds "
+                    "Left %d: Time: %d: %d %.*s\n", number,
+                    (int)ticker->remaining[j], (int)ticker->received[j],
+                    alarm->seconds, alarm_length (alarm), alarm_text (alarm));
+            ticker->next_tick[j] += TICKER_INTERVAL * (missed + 1);
+        }
+        /*
+         * Remove expired entries from the highest index down, as
+         * ticker_remove moves the last entry into the hole.
+         */
+        for (i = nexpired - 1; i >= 0; i--) {
+            j = ticker->expired[i];
+            alarm = ticker->alarm[j];
+            ticker_remove (ticker, j);
+            display_expire (number, alarm);
+            alarm_free (alarm);
+        }
+        if (self->length > 0)
+            worker_write (self);
+
+        if (ticker->count == 0 && self->length == 0)
+            status = pthread_cond_wait (
+                &display_cond[number - 1], &alarm_mutex);
+        else {
+            wake.tv_sec = time (NULL) + 1;
+            wake.tv_nsec = 0;
+            status = pthread_cond_timedwait (
+                &display_cond[number - 1], &alarm_mutex, &wake);
+            if (status == ETIMEDOUT)
+                status = 0;
+        }
+        if (status != 0)
+            err_abort (status, "Wait on cond");
+    }
+}
+
+/*
+ * Display thread start routine. The argument is the display
+ * thread number (1 or 2), which selects the condition variable
+ * the thread waits on.
+ */
+void *display_thread(void *arg)
+{
+    int status;
+    int number = *(int*)arg;
+    alarm_t *alarm;
+    time_t now, current, next_tick;
+    int missed;
+    char name[16];
+
+    snprintf (name, sizeof (name), "alarm-display%d", number);
+    usage_register (name);
+    if (ticker_mode)
+    {
+	ticker_display (number);
+	return NULL;
+    }
 
     /*
      * Loop forever, processing alarms. The display thread will
@@ -129,164 +647,1357 @@ void *display_thread_1(void *arg)
 	 * Wait for the alarm thread to signal when an alarm is ready to be
       	 * procced.
 	 */
-	status = pthread_cond_wait(&d1_cond, &alarm_mutex);
+	status = pthread_cond_wait(&display_cond[number - 1], &alarm_mutex);
 	if (status != 0)
 	    err_abort(status, "Wait on cond");
+
+	/*
+	 * Claim the current alarm, so that the alarm thread can tell
+	 * it was picked up. If there is none for this thread, this was
+	 * a spurious wakeup.
+	 */
         alarm = current_alarm;
-	/* Message to indicate that display thread 1 has received the alarm */
-	printf("Display Thread 1: Received Alarm Request at %d: %d %s,"
-		" ExpiryTime is %d \n", time (NULL), alarm->seconds,
-		alarm->message, alarm->time);
+	if (alarm == NULL || current_display != number)
+	{
+	    status = pthread_mutex_unlock(&alarm_mutex);
+	    if (status != 0)
+		err_abort(status, "unlock mutex");
+	    continue;
+	}
+	current_alarm = NULL;
+
+	/* Message to indicate that the display thread has received the alarm */
+	output_printf("Display Thread %d: Received Alarm Request at %d: %d %.*s,"
+		" ExpiryTime is %d \n", number, time (NULL), alarm->seconds,
+		alarm_length (alarm), alarm_text (alarm), alarm->time);
 	now = time (NULL);
+	next_tick = now;
 	/* While the alarm has yet to expiry, print a message every 2 seconds */
 	while(alarm->time > time (NULL))
 	{
-	    printf("Display Thread 1: Number of Seconds Left %d: Time: %d: "
-			"%d %s\n",alarm->time - time (NULL), now
-				, alarm->seconds, alarm->message);
+	    /*
+	     * With the coalesce policy, ticks are due every 2 seconds
+	     * from receipt. If the thread was held up past more than
+	     * one of them, report the missed ones in a single line
+	     * instead of falling further behind.
+	     */
+	    if (late_policy == LATE_COALESCE)
+	    {
+		current = time (NULL);
+		missed = current > next_tick ? (current - next_tick) / 2 : 0;
+		next_tick += 2 * (missed + 1);
+		if (missed > 0)
+		    output_printf("Display Thread %d: Number of Seconds Left %d: "
+			    "Time: %d: %d %.*s (%d ticks coalesced)\n", number,
+			    alarm->time - current, now, alarm->seconds,
+			    alarm_length (alarm), alarm_text (alarm), missed);
+		else
+		    output_printf("Display Thread %d: Number of Seconds Left %d: "
+			    "Time: %d: %d %.*s\n", number, alarm->time - current,
+			    now, alarm->seconds, alarm_length (alarm),
+			    alarm_text (alarm));
+		if (next_tick > current)
+		    sleep(next_tick - current);
+		continue;
+	    }
+	    output_printf("Display Thread %d: Number of Seconds Left %d: Time: %d: "
+			"%d %.*s\n", number, alarm->time - time (NULL), now
+				, alarm->seconds, alarm_length (alarm),
+				alarm_text (alarm));
 	    sleep(2);
 	}
-	/* Prints a message saying that the current alarm has expired */
-	printf("Display Thread 1: Alarm Expired at %d: "
-			"%d %s\n", time (NULL), alarm->seconds, alarm->message);
+	display_expire (number, alarm);
 	status = pthread_mutex_unlock(&alarm_mutex);
     	if (status != 0)
 	    err_abort(status, "unlock mutex");
-	free(alarm);
+	alarm_free(alarm);
      }	
 }
 
-/* Display 2 start routine */
-void *display_thread_2(void *arg)
+/*
+ * Print the memory each part of the server holds (-U): the queue
+ * and its index, the record pools and regions, the accounting
+ * tables, and the display threads' ticker tables and line buffers,
+ * against the resident size of the process.
+ */
+void memory_report (FILE *out)
+{
+    size_t queue, index, display = 0, pools, regions;
+    long resident = 0;
+    FILE *statm;
+    int status, i;
+
+    status = pthread_mutex_lock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    queue = queue_bytes (alarm_queue);
+    index = queue_index_bytes (alarm_queue);
+    for (i = 0; i < 2; i++)
+        display += worker[i].ticker.size * (4 * sizeof (long long)
+            + sizeof (alarm_t*) + 2 * sizeof (int)) + worker[i].size;
+    status = pthread_mutex_unlock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    alarm_alloc_bytes (&pools, &regions);
+    statm = fopen ("/proc/self/statm", "r");
+    if (statm != NULL) {
+        if (fscanf (statm, "%*ld %ld", &resident) != 1)
+            resident = 0;
+        fclose (statm);
+    }
+    fprintf (out, "Memory: queue (%s) %luKB, index %luKB, record pools "
+        "%luKB, regions %luKB, accounting %luKB, display %luKB, "
+        "resident %luKB\n", queue_name (alarm_queue),
+        (unsigned long)(queue / 1024), (unsigned long)(index / 1024),
+        (unsigned long)(pools / 1024), (unsigned long)(regions / 1024),
+        (unsigned long)(stats_bytes () / 1024),
+        (unsigned long)(display / 1024),
+        resident * (sysconf (_SC_PAGESIZE) / 1024));
+}
+
+/*
+ * The usage thread (-U). Every usage_seconds it reports the CPU
+ * time and context switches of each thread (see alarm_usage.h),
+ * and, in a process that holds alarms, their memory. "arg" names
+ * the process in the report.
+ */
+void *usage_thread (void *arg)
+{
+    const char *label = (const char*)arg;
+
+    usage_register ("alarm-usage");
+    while (1) {
+        sleep (usage_seconds);
+        usage_report (stderr, label);
+        if (alarm_queue != NULL)
+            memory_report (stderr);
+    }
+}
+
+/*
+ * Write out what the server is still holding at exit: fire events
+ * in the reorder buffer, log records not yet written, and the queue
+ * file.
+ */
+void server_flush (void)
 {
     int status;
+
+    status = pthread_mutex_lock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    if (alarm_reorder != NULL)
+        reorder_flush (alarm_reorder, reorder_clock ());
+    if (alarm_wal != NULL)
+        wal_flush (alarm_wal);
+    if (pqueue_records != NULL)
+        pqueue_sync (alarm_queue, 1);
+    status = pthread_mutex_unlock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+}
+
+/*
+ * Called by the main thread at end of input when -s was given.
+ * Wait for the alarms still in the server to fire, and then print
+ * the accounting report to "out". Give up once every deadline has
+ * passed and nothing has left the server for a few seconds, since
+ * dropped handoffs that were never noticed would otherwise keep
+ * us waiting forever.
+ */
+void drain_and_report (FILE *out)
+{
+    unsigned long progress, last_progress = 0;
+    time_t last_change = time (NULL);
+
+    while (stats_pending () > 0) {
+        progress = stats_progress ();
+        if (progress != last_progress) {
+            last_progress = progress;
+            last_change = time (NULL);
+        } else if (time (NULL) > stats_last_deadline ()
+                && time (NULL) - last_change >= 5)
+            break;
+        sleep (1);
+    }
+    server_flush ();
+    output_flush ();
+    stats_report (out);
+    if (alarm_reorder != NULL)
+        reorder_print (out, alarm_reorder);
+    if (watchdog_seconds > 0)
+        fprintf (out, "Watchdog: %lu stalls detected, %lu alarms rescued, "
+            "%lu recoveries, %lu output stalls\n", watchdog_stalls,
+            watchdog_rescued, watchdog_recovered, watchdog_output_stalls);
+    if (output_dropped () > 0)
+        fprintf (out, "Output: %lu lines dropped (buffer full)\n",
+            output_dropped ());
+    alarm_alloc_print (out);
+    if (usage_seconds > 0) {
+        usage_report (out, usage_label);
+        memory_report (out);
+    }
+}
+
+/*
+ * Parse a request line into a request_t (see alarm_shard.h). An
+ * alarm may give the window its fire is spread over itself, in
+ * place of the -J window (0 for none):
+ *
+ *      <seconds>~<window> <message>
+ *
+ * The commands that act on a pending alarm name it by the id it was
+ * given when it was received:
+ *
+ *      cancel <id>
+ *      reschedule <id> <seconds>
+ *
+ * and those that act on every pending alarm due within a window of
+ * seconds from now (list on its own lists them all):
+ *
+ *      list [<from> <to>]
+ *      purge <from> <to>
+ *
+ * Chain lines are only recognized here; they are parsed into a
+ * chain when the request is carried out. Returns 0, or -1 if the
+ * line is not a valid request.
+ */
+int parse_request (const char *line, request_t *request)
+{
+    alarm_t alarm;
+
+    if (sscanf (line, "cancel %lu", &request->id) == 1)
+        request->kind = REQUEST_CANCEL;
+    else if (sscanf (line, "list %d %d",
+            &request->seconds, &request->until) == 2)
+        request->kind = REQUEST_LIST;
+    else if (strncmp (line, "list", 4) == 0
+            && (line[4] == '\0' || isspace ((unsigned char)line[4]))) {
+        request->kind = REQUEST_LIST;
+        request->seconds = 0;
+        request->until = -1;
+    } else if (sscanf (line, "purge %d %d",
+            &request->seconds, &request->until) == 2)
+        request->kind = REQUEST_PURGE;
+    else if (sscanf (line, "reschedule %lu %d",
+            &request->id, &request->seconds) == 2)
+        request->kind = REQUEST_RESCHEDULE;
+    else if (chain_is_chain (line)) {
+        request->kind = REQUEST_CHAIN;
+        strcpy (request->text, line);
+    } else if (sscanf (line, "%d~%d %64[^\n]", &request->seconds,
+            &request->until, request->text) == 3) {
+        if (request->until < 0)
+            return -1;
+        request->kind = REQUEST_ALARM;
+    } else {
+        if (alarm_parse (line, &alarm) != 0)
+            return -1;
+        request->kind = REQUEST_ALARM;
+        request->seconds = alarm.seconds;
+        request->until = -1;
+        strcpy (request->text, alarm.message);
+    }
+    return 0;
+}
+
+/*
+ * Cancel or reschedule a pending alarm. An alarm can only be
+ * changed while it is in the queue; once the alarm thread has
+ * handed it to a display thread, it is too late. Returns the
+ * scheduler to forward the request to, if the alarm was migrated
+ * there, or -1. Called with alarm_mutex locked.
+ */
+int alarm_change (const request_t *request)
+{
     alarm_t *alarm;
-    time_t now;
+    int target;
+
+    alarm = queue_find (alarm_queue, request->id);
+    if (alarm == NULL && shard_self >= 0
+            && (target = forward_find (&shard_forward, request->id)) >= 0)
+        return target;
+    if (alarm == NULL)
+        output_printf ("Main Thread: Alarm %lu is not pending\n", request->id);
+    else if (request->kind == REQUEST_CANCEL) {
+        queue_remove (alarm_queue, alarm);
+        output_printf ("Main Thread Cancelled Alarm Request at %d: %d %.*s\n",
+            time (NULL), alarm->seconds, alarm_length (alarm),
+            alarm_text (alarm));
+        stats_cancel (alarm->id);
+        if (alarm_wal != NULL)
+            wal_done (alarm_wal, alarm->id);
+        if (alarm->chain != NULL)
+            chain_abandon (alarm);
+        alarm_free (alarm);
+    } else {
+        alarm->seconds = request->seconds;
+        queue_reschedule (alarm_queue, alarm, time (NULL) + alarm->seconds);
+        output_printf ("Main Thread Rescheduled Alarm Request at %d: %d %.*s, "
+            "ExpiryTime is %d\n", time (NULL), alarm->seconds,
+            alarm_length (alarm), alarm_text (alarm), alarm->time);
+        stats_reschedule (alarm->id, alarm->time);
+        if (alarm_wal != NULL)
+            wal_reschedule (alarm_wal, alarm);
+    }
+    return -1;
+}
+
+/*
+ * Print a pending alarm for the list command.
+ */
+static void list_alarm (alarm_t *alarm, void *arg)
+{
+    output_printf ("Alarm %lu: %d %.*s, ExpiryTime is %d\n", alarm->id,
+        alarm->seconds, alarm_length (alarm), alarm_text (alarm),
+        alarm->time);
+}
+
+/*
+ * Cancel an alarm the purge command has taken out of the queue.
+ */
+static void purge_alarm (alarm_t *alarm, void *arg)
+{
+    stats_cancel (alarm->id);
+    if (alarm_wal != NULL)
+        wal_done (alarm_wal, alarm->id);
+    if (alarm->chain != NULL)
+        chain_abandon (alarm);
+    alarm_free (alarm);
+}
+
+/*
+ * List or purge the pending alarms due within a window of seconds
+ * from now, in deadline order. The btree backend walks its leaves
+ * for this; the others sort what they find in the index. Called
+ * with alarm_mutex locked.
+ */
+void alarm_range (const request_t *request)
+{
+    time_t now = time (NULL), from = 0, to = (time_t)LONG_MAX;
+    long n;
+
+    if (request->until >= 0) {
+        from = now + request->seconds;
+        to = now + request->until;
+    }
+    if (request->kind == REQUEST_LIST) {
+        n = queue_range (alarm_queue, from, to, list_alarm, NULL);
+        output_printf ("Main Thread Listed %ld Pending Alarm Requests at %d\n",
+            n, now);
+    } else {
+        n = queue_remove_range (alarm_queue, from, to, purge_alarm, NULL);
+        output_printf ("Main Thread Purged %ld Alarm Requests at %d, "
+            "due %d to %d\n", n, now, from, to);
+    }
+}
+
+/*
+ * Spread the fire of a new alarm, which has its id, past its
+ * deadline by its offset in a window of "window" seconds (see
+ * alarm_spread), or in the -J window if "window" is negative. The
+ * alarm is simply queued for the later time, so the spread costs
+ * no timers of its own. Returns the offset.
+ */
+int spread_alarm (alarm_t *alarm, int window)
+{
+    int offset;
+
+    offset = alarm_spread (alarm->id, window < 0 ? spread_window : window);
+    if (offset > 0) {
+        alarm->time += offset;
+        stats_spread (alarm->id, offset);
+    }
+    return offset;
+}
+
+/*
+ * Give a new alarm its expiry time and id, spread its fire over
+ * "window" seconds (-1 for the -J window), and queue it. Called
+ * with alarm_mutex locked.
+ */
+void ingest_alarm (alarm_t *alarm, int window)
+{
+    int offset;
+#ifdef DEBUG
+    alarm_t *next;
+#endif
 
     /*
-     * Loop forever, processing alarms. The display thread will
-     * be disintegrated when the process exits.
+     * Past its share of the memory limit, the server refuses new
+     * alarms rather than be killed with all of them.
      */
-    while(1)
-    {
-        status = pthread_mutex_lock(&alarm_mutex);
-    	if (status != 0)
-	    err_abort(status, "Lock mutex");
-	/* 
-	 * Wait for the alarm thread to signal when an alarm is ready to be
-      	 * procced.
-	 */
-	status = pthread_cond_wait(&d2_cond, &alarm_mutex);
-	if (status != 0)
-	    err_abort(status, "Wait on cond");
-        alarm = current_alarm;
-	/* Message to indicate that display thread 2 has received the alarm */
-	printf("Display Thread 2: Received Alarm Request at %d: %d %s,"
-		" ExpiryTime is %d \n", time (NULL), alarm->seconds,
-		alarm->message, alarm->time);
-	now = time (NULL);
-	/* While the alarm has yet to expiry, print a message every 2 seconds */
-	while(alarm->time > time (NULL))
-	{
-	    printf("Display Thread 2: Number of Seconds Left %d: Time: %d: "
-			"%d %s\n",alarm->time - time (NULL), now
-				, alarm->seconds, alarm->message);
-	    sleep(2);
-	}
-	/* Prints a message saying that the current alarm has expired */
-	printf("Display Thread 2: Alarm Expired at %d: "
-			"%d %s\n", time (NULL), alarm->seconds, alarm->message);
-	status = pthread_mutex_unlock(&alarm_mutex);
-    	if (status != 0)
-	    err_abort(status, "unlock mutex");
-	free(alarm);
-     }	
+    if (alarm_budget > 0 && queue_count (alarm_queue) >= alarm_budget) {
+        output_printf ("Main Thread Refused Alarm Request at %d: %d %.*s, "
+            "Memory Limit Reached\n", time (NULL), alarm->seconds,
+            alarm_length (alarm), alarm_text (alarm));
+        alarm_free (alarm);
+        return;
+    }
+    if (!alarm_queueable (alarm)) {
+        output_printf ("Main Thread Refused Alarm Request at %d: %d %.*s, "
+            "Queue File Full\n", time (NULL), alarm->seconds,
+            alarm_length (alarm), alarm_text (alarm));
+        alarm_free (alarm);
+        return;
+    }
+    alarm->time = time (NULL) + alarm->seconds;
+    alarm->id = stats_ingest (alarm->time);
+    offset = spread_alarm (alarm, window);
+
+    /*
+     * Alarm request received message, with the id that cancel
+     * and reschedule commands refer to it by
+     */
+    output_printf("Main Thread Received Alarm Request at %d: %d %.*s, "
+        "Id is %lu", time(NULL), alarm->seconds,
+        alarm_length (alarm), alarm_text (alarm), alarm->id);
+    if (offset > 0)
+        output_printf (", Spread by %d Seconds", offset);
+    output_printf ("\n");
+
+    queue_insert (alarm_queue, alarm);
+    if (alarm_wal != NULL)
+        wal_ingest (alarm_wal, alarm);
+#ifdef DEBUG
+    next = queue_peek (alarm_queue);
+    output_printf ("[%s queue: %lu alarms, next %d(%d)[\"%.*s\"]]\n",
+        queue_name (alarm_queue), queue_count (alarm_queue),
+        next->time, next->time - time (NULL), alarm_length (next),
+        alarm_text (next));
+#endif
 }
 
-int main (int argc, char *argv[])
+/*
+ * Move up to "count" pending alarms to scheduler "target", as the
+ * front end's rebalancer asked (see alarm_shard.h). The alarms are
+ * taken out of the queue with alarm_mutex locked, and sent on once
+ * it is unlocked.
+ */
+typedef struct migrate_tag {
+    time_t              after;          /* due no sooner than this */
+    int                 count, n;
+    alarm_t             *alarm[MIGRATE_BATCH];
+} migrate_t;
+
+static void migrate_pick (alarm_t *alarm, void *arg)
 {
+    migrate_t *m = (migrate_t*)arg;
+
+    if (m->n < m->count && alarm->chain == NULL && alarm->time >= m->after
+            && (alarm->id - 1) % shard_count == shard_self)
+        m->alarm[m->n++] = alarm;
+}
+
+void migrate_alarms (int count, int target)
+{
+    static migrate_t m;
+    static request_t request;
+    alarm_t *alarm;
+    int status, i;
+
+    status = pthread_mutex_lock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    m.after = time (NULL) + MIGRATE_AHEAD;
+    m.count = count < MIGRATE_BATCH ? count : MIGRATE_BATCH;
+    m.n = 0;
+    queue_foreach (alarm_queue, migrate_pick, &m);
+    for (i = 0; i < m.n; i++) {
+        queue_remove (alarm_queue, m.alarm[i]);
+        stats_migrate (m.alarm[i]->id);
+        forward_add (&shard_forward, m.alarm[i]->id, target);
+    }
+    shard_publish ();
+    output_printf ("Main Thread Migrated %d Alarm Requests to Scheduler "
+        "%d at %d\n", m.n, target, time (NULL));
+    status = pthread_mutex_unlock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+
+    for (i = 0; i < m.n; i++) {
+        alarm = m.alarm[i];
+        request.kind = REQUEST_ADOPT;
+        request.id = alarm->id;
+        request.seconds = alarm->seconds;
+        request.until = alarm->time;
+        snprintf (request.text, sizeof (request.text), "%.*s",
+            alarm_length (alarm), alarm_text (alarm));
+        ring_put (&shard_table[target].inbox, &request);
+        alarm_free (alarm);
+    }
+    __atomic_add_fetch (&shard_table[shard_self].moved_out, m.n,
+        __ATOMIC_RELAXED);
+    __atomic_store_n (&shard_table[shard_self].migrating, 0,
+        __ATOMIC_RELEASE);
+}
+
+/*
+ * Queue an alarm migrated here from another scheduler, with the id
+ * and expiry time it was given there.
+ */
+void adopt_alarm (const request_t *request)
+{
+    alarm_t *alarm;
     int status;
-    char line[128];
-    alarm_t *alarm, **last, *next;
-    pthread_t a_thread; /* Alarm thread */
-    pthread_t d1_thread; /* Display thread 1 */
-    pthread_t d2_thread; /* Display thread 2 */
 
-    status = pthread_create (
-        &a_thread, NULL, alarm_thread, NULL);
+    alarm = alarm_alloc_due (request->until);
+    alarm->id = request->id;
+    alarm->seconds = request->seconds;
+    alarm->time = request->until;
+    strcpy (alarm->message, request->text);
+    status = pthread_mutex_lock (&alarm_mutex);
     if (status != 0)
-        err_abort (status, "Create alarm thread");
-    status = pthread_create (
-	&d1_thread, NULL, display_thread_1, NULL);
+        err_abort (status, "Lock mutex");
+    stats_adopt (alarm->id, alarm->time);
+    queue_insert (alarm_queue, alarm);
+    shard_publish ();
+    status = pthread_mutex_unlock (&alarm_mutex);
     if (status != 0)
-	err_abort (status, "Create display thread 1");
-    status = pthread_create (
-	&d2_thread, NULL, display_thread_2, NULL);
+        err_abort (status, "Unlock mutex");
+    __atomic_add_fetch (&shard_table[shard_self].moved_in, 1,
+        __ATOMIC_RELAXED);
+}
+
+/*
+ * Carry out a request, read from standard input or, in a sharded
+ * server, from the front end's ring.
+ */
+void do_request (const request_t *request)
+{
+    int status, forward = -1;
+    alarm_t *alarm = NULL;
+    chain_t *chain = NULL;
+
+    if (request->kind == REQUEST_MIGRATE) {
+        migrate_alarms (request->seconds, request->id);
+        return;
+    } else if (request->kind == REQUEST_ADOPT) {
+        adopt_alarm (request);
+        return;
+    }
+
+    /*
+     * A line declaring follow-on alarms is parsed into a chain
+     * once, and the chain arms each stage as the one before it
+     * fires. See alarm_chain.h.
+     */
+    if (request->kind == REQUEST_CHAIN) {
+        chain = chain_parse (request->text);
+        if (chain == NULL) {
+            fprintf (stderr, "Bad command\n");
+            return;
+        }
+    } else if (request->kind == REQUEST_ALARM) {
+        alarm = alarm_alloc_due (time (NULL) + request->seconds);
+        alarm->seconds = request->seconds;
+        strcpy (alarm->message, request->text);
+    }
+
+    status = pthread_mutex_lock (&alarm_mutex);
     if (status != 0)
-	err_abort (status, "Create display thread 2");
+        err_abort (status, "Lock mutex");
+    if (chain != NULL) {
+        output_printf ("Main Thread Received Alarm Chain Request at %d: %s",
+            time (NULL), request->text);
+        chain_arm (chain, time (NULL), alarm_queue);
+    } else if (alarm != NULL)
+        ingest_alarm (alarm, request->until);
+    else if (request->kind == REQUEST_LIST || request->kind == REQUEST_PURGE)
+        alarm_range (request);
+    else
+        forward = alarm_change (request);
+    status = pthread_mutex_unlock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    if (forward >= 0)
+        ring_put (&shard_table[forward].inbox, request);
+}
+
+/*
+ * The inbox thread of a scheduler: carries out the alarms and
+ * commands other schedulers send it.
+ */
+void *inbox_thread (void *arg)
+{
+    request_t request;
+
+    usage_register ("alarm-inbox");
+    while (ring_get (&shard_table[shard_self].inbox, &request) == 0)
+        do_request (&request);
+    return NULL;
+}
+
+/*
+ * Queue the new alarms of a datagram batch under a single lock of
+ * alarm_mutex.
+ */
+static void dgram_ingest (alarm_t **batch, int *window, int nalarms)
+{
+    int status, i;
+
+    if (nalarms == 0)
+        return;
+    status = pthread_mutex_lock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    for (i = 0; i < nalarms; i++)
+        ingest_alarm (batch[i], window[i]);
+    status = pthread_mutex_unlock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+}
+
+/*
+ * The datagram ingest thread (-u). Each recvmmsg call brings in a
+ * batch of requests, which are parsed in their receive buffers.
+ * Runs of new alarms are queued under a single lock of alarm_mutex;
+ * chains and commands are carried out one by one, once the alarms
+ * sent ahead of them are queued, so that a batch is carried out in
+ * the order it arrived.
+ */
+void *dgram_thread (void *arg)
+{
+    int fd = *(int*)arg;
+    static dgram_t dgram;
+    request_t request;
+    alarm_t *batch[DGRAM_BATCH];
+    int window[DGRAM_BATCH];
+    int n, i, nalarms;
+
+    usage_register ("alarm-dgram");
+    dgram_init (&dgram);
+    while (1) {
+        n = dgram_receive (fd, &dgram);
+        nalarms = 0;
+        for (i = 0; i < n; i++) {
+            if (parse_request (dgram.buf[i], &request) != 0)
+                fprintf (stderr, "Bad datagram\n");
+            else if (request.kind != REQUEST_ALARM) {
+                dgram_ingest (batch, window, nalarms);
+                nalarms = 0;
+                do_request (&request);
+            } else {
+                batch[nalarms] = alarm_alloc_due (
+                    time (NULL) + request.seconds);
+                batch[nalarms]->seconds = request.seconds;
+                strcpy (batch[nalarms]->message, request.text);
+                window[nalarms] = request.until;
+                nalarms++;
+            }
+        }
+        dgram_ingest (batch, window, nalarms);
+    }
+}
+
+/*
+ * The front end's rebalancer (-R). Once a second it reads what each
+ * scheduler has published, and once the last batch it asked for has
+ * arrived, plans the next (shard_plan) and asks the donor to move
+ * it (see alarm_shard.h).
+ */
+typedef struct rebalancer_tag {
+    shard_t             *shard;
+    int                 shards;
+    int                 stop;
+    unsigned long       migrations;
+} rebalancer_t;
+
+/*
+ * Whether every batch asked for has arrived.
+ */
+static int rebalance_idle (shard_t *shard, int shards)
+{
+    unsigned long out = 0, in = 0;
+    int i;
+
+    for (i = 0; i < shards; i++) {
+        if (__atomic_load_n (&shard[i].migrating, __ATOMIC_ACQUIRE))
+            return 0;
+        out += __atomic_load_n (&shard[i].moved_out, __ATOMIC_RELAXED);
+        in += __atomic_load_n (&shard[i].moved_in, __ATOMIC_RELAXED);
+    }
+    return out == in;
+}
+
+void *rebalance_thread (void *arg)
+{
+    rebalancer_t *r = (rebalancer_t*)arg;
+    unsigned long depth[SHARD_MAX], rate[SHARD_MAX], last[SHARD_MAX];
+    unsigned long progress;
+    request_t request;
+    int i, donor, recipient, count;
+
+    usage_register ("alarm-rebalance");
+    memset (last, 0, sizeof (last));
+    while (!__atomic_load_n (&r->stop, __ATOMIC_ACQUIRE)) {
+        sleep (1);
+        for (i = 0; i < r->shards; i++) {
+            depth[i] = __atomic_load_n (&r->shard[i].depth, __ATOMIC_RELAXED);
+            progress = __atomic_load_n (
+                &r->shard[i].progress, __ATOMIC_RELAXED);
+            rate[i] = progress - last[i];
+            last[i] = progress;
+        }
+        if (!rebalance_idle (r->shard, r->shards))
+            continue;
+        count = shard_plan (depth, rate, r->shards, &donor, &recipient);
+        if (count == 0)
+            continue;
+        memset (&request, 0, sizeof (request));
+        request.kind = REQUEST_MIGRATE;
+        request.seconds = count;
+        request.id = recipient;
+        __atomic_store_n (&r->shard[donor].migrating, 1, __ATOMIC_RELEASE);
+        ring_put (&r->shard[donor].ring, &request);
+        r->migrations++;
+    }
+    return NULL;
+}
+
+/*
+ * The front end of a sharded server (-P). Read and parse requests,
+ * and route each to a scheduler process: new alarms and chains to
+ * each in turn, list and purge to all of them, and commands on an
+ * alarm to the scheduler that owns its id. At end of input, stop
+ * the rebalancer and let the last batch arrive, close the rings,
+ * wait for the schedulers to finish, and print their merged
+ * accounting.
+ */
+void front_end (shard_t *shard, int shards)
+{
+    char line[512];
+    request_t request;
+    stats_summary_t total;
+    rebalancer_t rebalancer;
+    pthread_t thread, u_thread;
+    unsigned long next = 0, moved = 0;
+    int i, target, status;
+
+    usage_register ("alarm-front");
+    if (usage_seconds > 0) {
+        strcpy (usage_label, "the front end");
+        status = pthread_create (&u_thread, NULL, usage_thread, usage_label);
+        if (status != 0)
+            err_abort (status, "Create usage thread");
+    }
+    if (rebalance) {
+        memset (&rebalancer, 0, sizeof (rebalancer));
+        rebalancer.shard = shard;
+        rebalancer.shards = shards;
+        status = pthread_create (&thread, NULL, rebalance_thread, &rebalancer);
+        if (status != 0)
+            err_abort (status, "Create rebalancer thread");
+    }
+
     while (1) {
         printf ("alarm> ");
-        if (fgets (line, sizeof (line), stdin) == NULL) exit (0);
+        fflush (stdout);
+        if (fgets (line, sizeof (line), stdin) == NULL)
+            break;
         if (strlen (line) <= 1) continue;
-        alarm = (alarm_t*)malloc (sizeof (alarm_t));
-        if (alarm == NULL)
-            errno_abort ("Allocate alarm");
+        if (parse_request (line, &request) != 0
+                || ((request.kind == REQUEST_CANCEL
+                    || request.kind == REQUEST_RESCHEDULE)
+                    && request.id == 0)) {
+            fprintf (stderr, "Bad command\n");
+            continue;
+        }
+        if (request.kind == REQUEST_LIST || request.kind == REQUEST_PURGE) {
+            for (i = 0; i < shards; i++)
+                ring_put (&shard[i].ring, &request);
+            continue;
+        }
+        if (request.kind == REQUEST_CANCEL
+                || request.kind == REQUEST_RESCHEDULE)
+            target = (request.id - 1) % shards;
+        else
+            target = next++ % shards;
+        ring_put (&shard[target].ring, &request);
+    }
+
+    if (rebalance) {
+        __atomic_store_n (&rebalancer.stop, 1, __ATOMIC_RELEASE);
+        status = pthread_join (thread, NULL);
+        if (status != 0)
+            err_abort (status, "Join rebalancer thread");
+        while (!rebalance_idle (shard, shards))
+            sleep (1);
+        for (i = 0; i < shards; i++)
+            moved += shard[i].moved_out;
+    }
+    for (i = 0; i < shards; i++)
+        ring_close (&shard[i].ring);
+    while (wait (NULL) > 0)
+        ;
+    if (report_stats) {
+        memset (&total, 0, sizeof (total));
+        for (i = 0; i < shards; i++)
+            if (shard[i].reported)
+                stats_merge (&total, &shard[i].summary);
+        fflush (stdout);
+        stats_print (stderr, &total);
+        if (rebalance)
+            fprintf (stderr, "Rebalancer: %lu batches, %lu alarms moved\n",
+                rebalancer.migrations, moved);
+    }
+    if (usage_seconds > 0)
+        usage_report (stderr, usage_label);
+    exit (0);
+}
+
+/*
+ * Preload a schedule file (-f) of alarm requests, one per line as
+ * they would be typed. The file is mapped, and its alarms refer to
+ * their messages in the mapping rather than copying them (see
+ * alarm_source.h). Chain requests are copied and parsed as usual.
+ * alarm_mutex is taken for a batch of requests at a time, so that
+ * the server keeps running while a large file loads. If the queue
+ * backend takes sorted runs (lsm), each batch is parsed and sorted
+ * before the mutex is taken, and handed over in one queue_load.
+ */
+#define LOAD_BATCH      1024
+#define LOAD_RUN        65536
+
+static void load_lock (void)
+{
+    int status;
 
+    status = pthread_mutex_lock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+}
+
+static void load_unlock (void)
+{
+    int status;
+
+    status = pthread_mutex_unlock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+}
+
+void load_schedule (const char *path)
+{
+    source_t *source;
+    alarm_t *alarm, **run = NULL;
+    chain_t *chain;
+    const char *p, *nl, *end;
+    char line[512];
+    unsigned long loaded = 0, bad = 0, refused = 0, full = 0, room = 0;
+    int n, i, nrun, batch = LOAD_BATCH;
+    int runs = queue_can_load (alarm_queue);
+
+    source = source_open (path);
+    if (source == NULL)
+        errno_abort ("Open schedule");
+    if (runs) {
+        batch = LOAD_RUN;
+        run = (alarm_t**)malloc (LOAD_RUN * sizeof (alarm_t*));
+        if (run == NULL)
+            errno_abort ("Allocate run");
+    }
+    end = source->addr + source->size;
+    p = source->addr;
+    while (p < end) {
         /*
-         * Parse input line into seconds (%d) and a message
-         * (%64[^\n]), consisting of up to 64 characters
-         * separated from the seconds by whitespace.
+         * Outside the mutex, a run can only take as many alarms as
+         * the memory limit had room for when it was started.
          */
-        if (sscanf (line, "%d %64[^\n]", 
-            &alarm->seconds, alarm->message) < 2) {
-            fprintf (stderr, "Bad command\n");
-            free (alarm);
-        } else {
-            status = pthread_mutex_lock (&alarm_mutex);
-            if (status != 0)
-                err_abort (status, "Lock mutex");
+        load_lock ();
+        if (runs) {
+            room = alarm_budget > queue_count (alarm_queue) ?
+                alarm_budget - queue_count (alarm_queue) : 0;
+            load_unlock ();
+        }
+        for (n = nrun = 0; n < batch && p < end; n++, p = nl + 1) {
+            nl = memchr (p, '\n', end - p);
+            if (nl == NULL)
+                nl = end;
+            if (nl - p < sizeof (line) && (memchr (p, '=', nl - p) != NULL
+                    || memchr (p, '&', nl - p) != NULL)) {
+                memcpy (line, p, nl - p);
+                line[nl - p] = '\0';
+                if (chain_is_chain (line)) {
+                    chain = chain_parse (line);
+                    if (chain == NULL)
+                        bad++;
+                    else {
+                        if (runs)
+                            load_lock ();
+                        chain_arm (chain, time (NULL), alarm_queue);
+                        if (runs)
+                            load_unlock ();
+                        loaded++;
+                    }
+                    continue;
+                }
+            }
+            alarm = source_parse (source, p - source->addr, nl - source->addr);
+            if (alarm == NULL) {
+                if (nl > p)
+                    bad++;
+                continue;
+            }
+            if (alarm_budget > 0 && (runs ? nrun >= room
+                    : queue_count (alarm_queue) >= alarm_budget)) {
+                alarm_free (alarm);
+                refused++;
+                continue;
+            }
+            alarm->time = time (NULL) + alarm->seconds;
+            if (pqueue_records != NULL)
+                alarm = alarm_unmap (alarm);
+            if (!alarm_queueable (alarm)) {
+                alarm_free (alarm);
+                full++;
+                continue;
+            }
+            alarm->id = stats_ingest (alarm->time);
+            spread_alarm (alarm, -1);
+            if (runs)
+                run[nrun++] = alarm;
+            else {
+                queue_insert (alarm_queue, alarm);
+                if (alarm_wal != NULL)
+                    wal_ingest (alarm_wal, alarm);
+            }
+            loaded++;
+        }
+        if (runs) {
+            queue_sort (run, nrun);
+            load_lock ();
+            queue_load (alarm_queue, run, nrun);
+            if (alarm_wal != NULL)
+                for (i = 0; i < nrun; i++)
+                    wal_ingest (alarm_wal, run[i]);
+        }
+        load_unlock ();
+    }
+    output_printf ("Main Thread Loaded %lu Alarm Requests from %s at %d",
+        loaded, path, time (NULL));
+    if (bad > 0)
+        output_printf (", %lu Bad Lines", bad);
+    if (refused > 0)
+        output_printf (", %lu Refused (Memory Limit)", refused);
+    if (full > 0)
+        output_printf (", %lu Refused (Queue File Full)", full);
+    output_printf ("\n");
+    free (run);
+    source_release (source);
+}
 
-	    /* Alarm request received message */
-	    printf("Main Thread Received Alarm Request at %d: %d %s\n",
-			time(NULL), alarm->seconds, alarm->message);
+/*
+ * Recover the alarms left pending by an earlier run logging to
+ * "dir" (-W), and start logging. Recovered alarms keep their
+ * expiry times, so any that fell due while the server was down
+ * fire straight away, but they are given new ids.
+ */
+void recover_alarms (const char *dir, int flags)
+{
+    queue_t *recovered;
+    alarm_t *alarm;
+    long count;
 
-            alarm->time = time (NULL) + alarm->seconds;
+    recovered = queue_create ("pheap");
+    queue_index (recovered);
+    count = wal_recover (dir, recovered);
+    while ((alarm = queue_pop (recovered)) != NULL) {
+        alarm->id = stats_ingest (alarm->time);
+        queue_insert (alarm_queue, alarm);
+    }
+    queue_destroy (recovered);
+    output_printf ("Main Thread Recovered %ld Alarm Requests from %s at %d\n",
+        count, dir, time (NULL));
+    alarm_wal = wal_open (dir, flags, alarm_queue, NULL);
+}
 
-            /*
-             * Insert the new alarm into the list of alarms,
-             * sorted by expiration time.
-             */
-            last = &alarm_list;
-            next = *last;
-            while (next != NULL) {
-                if (next->time >= alarm->time) {
-                    alarm->link = next;
-                    *last = alarm;
-                    break;
-                }
-                last = &next->link;
-                next = next->link;
+/*
+ * Map the queue file at "path" (-M) as the alarm queue, creating it
+ * if need be, and allocate alarm records from it. Alarms left in it
+ * by an earlier run fire from where they are, with the ids they
+ * had, so new alarms are numbered after them. Some records are kept
+ * back from the memory limit for alarms being fired or parsed.
+ */
+void resume_alarms (const char *path)
+{
+    unsigned long room;
+
+    alarm_queue = pqueue_open (path, PQUEUE_CAPACITY);
+    pqueue_records = alarm_queue;
+    stats_skip (pqueue_max_id (alarm_queue));
+    room = pqueue_capacity (alarm_queue) - pqueue_capacity (alarm_queue) / 8;
+    if (alarm_budget == 0 || alarm_budget > room)
+        alarm_budget = room;
+    output_printf ("Main Thread Resumed %lu Pending Alarm Requests from "
+        "%s at %d\n", queue_count (alarm_queue), path, time (NULL));
+}
+
+int main (int argc, char *argv[])
+{
+    int status;
+    int c;
+    char line[512];
+    request_t request;
+    pthread_t a_thread; /* Alarm thread */
+    pthread_t d_thread[2]; /* Display threads */
+    pthread_t u_thread; /* Datagram ingest thread */
+    pthread_t r_thread; /* Reorder thread */
+    pthread_t w_thread; /* Watchdog thread */
+    pthread_t i_thread; /* Inbox thread */
+    pthread_t t_thread; /* Usage thread */
+    pthread_condattr_t attr;
+    double reorder_ms = -1;
+    static int dgram_fd;
+    const char *dgram_path = NULL;
+    const char *events_name = NULL;
+    static int d_number[2] = {1, 2};
+    int late_seconds = 1;
+    const char *backend = "list";
+    const char *schedule = NULL;
+    const char *wal_dir = NULL;
+    const char *queue_file = NULL;
+    int wal_options = WAL_DICT | WAL_LZ;
+    int shards = 0, shard_index = -1, i;
+    shard_t *shard = NULL;
+    pid_t pid;
+    limits_t limits;
+
+    /*
+     * -s prints the alarm accounting report once input runs out,
+     * and -l sets how many seconds past its deadline an alarm must
+     * fire to be counted as late. -p, -r and -m select the late
+     * alarm policy and its parameters. -b selects the queue
+     * backend that holds pending alarms (see alarm_queue.h), and
+     * -t has display threads count down many alarms at once.
+     * -H selects huge pages for alarm records and queue memory
+     * (see alarm_pool.h), and -a allocates alarm records from
+     * regions by deadline (see alarm_region.h). -f preloads a
+     * schedule file before reading commands. -P shares the alarms
+     * out between that many scheduler processes (see alarm_shard.h),
+     * or as many as the CPU quota allows with -P auto (see
+     * alarm_limits.h). -u also takes requests as datagrams on a Unix
+     * socket (see alarm_dgram.h). -e publishes fired alarms to a
+     * shared memory ring (see alarm_events.h). -W logs alarm traffic
+     * to a directory, and recovers the pending alarms from it at
+     * startup; -Z selects how the log is compressed (see alarm_wal.h).
+     * -O holds fired alarms for up to that many milliseconds, to write
+     * them out in deadline order (see alarm_reorder.h). -M keeps the
+     * pending alarms in a mapped queue file in place of the -b
+     * backend, and resumes those left in it at startup (see
+     * alarm_pqueue.h). -D moves the alarms of a display thread stalled
+     * for that many seconds to the other one, with -t (see worker_t).
+     * -R moves pending alarms from deep schedulers to shallow ones,
+     * with -P (see alarm_shard.h). -J spreads the fires of alarms that
+     * share a deadline over that many seconds (see alarm_spread). -U
+     * reports the CPU time and context switches of every thread, and
+     * the memory held for alarms, every that many seconds (see
+     * alarm_usage.h).
+     */
+    while ((c = getopt (argc, argv,
+            "sl:p:r:m:b:tH:a:f:P:u:e:W:Z:O:M:D:RJ:U:")) != -1) {
+        switch (c) {
+        case 's':
+            report_stats = 1;
+            break;
+        case 'l':
+            late_seconds = atoi (optarg);
+            break;
+        case 'p':
+            if (strcmp (optarg, "catchup") == 0)
+                late_policy = LATE_CATCHUP;
+            else if (strcmp (optarg, "coalesce") == 0)
+                late_policy = LATE_COALESCE;
+            else if (strcmp (optarg, "shed") == 0)
+                late_policy = LATE_SHED;
+            else {
+                fprintf (stderr, "Unknown late policy %s\n", optarg);
+                exit (1);
+            }
+            break;
+        case 'r':
+            catchup_rate = atoi (optarg);
+            break;
+        case 'm':
+            max_lateness = atoi (optarg);
+            break;
+        case 't':
+            ticker_mode = 1;
+            break;
+        case 'H':
+            if (pool_huge_mode (optarg) < 0) {
+                fprintf (stderr, "Unknown huge page mode %s\n", optarg);
+                exit (1);
+            }
+            pool_set_huge (pool_huge_mode (optarg));
+            break;
+        case 'a':
+            if (alarm_alloc_mode (optarg) < 0) {
+                fprintf (stderr, "Unknown allocator %s\n", optarg);
+                exit (1);
+            }
+            alarm_set_alloc (alarm_alloc_mode (optarg));
+            break;
+        case 'f':
+            schedule = optarg;
+            break;
+        case 'u':
+            dgram_path = optarg;
+            break;
+        case 'e':
+            events_name = optarg;
+            break;
+        case 'W':
+            wal_dir = optarg;
+            break;
+        case 'M':
+            queue_file = optarg;
+            break;
+        case 'R':
+            rebalance = 1;
+            break;
+        case 'U':
+            usage_seconds = atoi (optarg);
+            if (usage_seconds < 1) {
+                fprintf (stderr, "Usage report interval must be positive\n");
+                exit (1);
+            }
+            break;
+        case 'J':
+            spread_window = atoi (optarg);
+            if (spread_window < 0) {
+                fprintf (stderr, "Spread window can't be negative\n");
+                exit (1);
             }
+            break;
+        case 'D':
+            watchdog_seconds = atoi (optarg);
+            if (watchdog_seconds < 1) {
+                fprintf (stderr, "Stall threshold must be positive\n");
+                exit (1);
+            }
+            break;
+        case 'O':
+            reorder_ms = atof (optarg);
+            if (reorder_ms < 0) {
+                fprintf (stderr, "Reorder budget can't be negative\n");
+                exit (1);
+            }
+            break;
+        case 'Z':
+            wal_options = wal_flags (optarg);
+            if (wal_options < 0) {
+                fprintf (stderr, "Unknown log compression %s\n", optarg);
+                exit (1);
+            }
+            break;
+        case 'P':
+            if (strcmp (optarg, "auto") == 0) {
+                shards = -1;
+                break;
+            }
+            shards = atoi (optarg);
+            if (shards < 1 || shards > SHARD_MAX) {
+                fprintf (stderr, "Shards must be 1 to %d, or auto\n",
+                    SHARD_MAX);
+                exit (1);
+            }
+            break;
+        case 'b':
+            if (!queue_backend_valid (optarg)) {
+                fprintf (stderr, "Unknown queue backend %s\n", optarg);
+                exit (1);
+            }
+            backend = optarg;
+            break;
+        default:
+            fprintf (stderr, "Usage: %s [-s] [-l late_seconds] "
+                "[-p catchup|coalesce|shed] [-r catchup_rate] "
+                "[-m max_lateness] "
+                "[-b list|wheel|pheap|adaptive|merge|lsm|btree] "
+                "[-t] [-H none|thp|explicit] [-a pool|region] [-f schedule] "
+                "[-P shards|auto] [-u socket] [-e /ring] [-W dir] "
+                "[-Z none|dict|lz|all] [-O budget_ms] [-M queue_file] "
+                "[-D stall_seconds] [-R] [-J spread_seconds] "
+                "[-U usage_seconds]\n", argv[0]);
+            exit (1);
+        }
+    }
+    if (shards != 0 && (schedule != NULL || dgram_path != NULL
+            || events_name != NULL || wal_dir != NULL || queue_file != NULL)) {
+        fprintf (stderr, "-f, -u, -e, -W and -M can't be used with -P\n");
+        exit (1);
+    }
+    if (rebalance && shards == 0) {
+        fprintf (stderr, "-R can only be used with -P\n");
+        exit (1);
+    }
+    if (watchdog_seconds > 0 && !ticker_mode) {
+        fprintf (stderr, "-D can only be used with -t\n");
+        exit (1);
+    }
+    if (wal_dir != NULL && queue_file != NULL) {
+        fprintf (stderr, "-W and -M can't be used together\n");
+        exit (1);
+    }
+
+    /*
+     * Size the server to the CPU quota and memory limit it runs
+     * under. The front end of a sharded server needs a CPU of its
+     * own, and the schedulers share the memory limit.
+     */
+    limits_detect (&limits);
+    limits_print (stderr, &limits);
+    if (shards < 0) {
+        shards = limits.cpus - 1;
+        if (limits.memory > 0 && shards > limits.memory / SHARD_MEMORY)
+            shards = limits.memory / SHARD_MEMORY;
+        if (shards < 1)
+            shards = 1;
+        if (shards > SHARD_MAX)
+            shards = SHARD_MAX;
+        fprintf (stderr, "Limits: -P auto runs %d scheduler%s\n",
+            shards, shards == 1 ? "" : "s");
+    }
+    if (limits.memory > 0) {
+        alarm_budget = limits.memory / 2 / (shards > 0 ? shards : 1)
+            / ALARM_COST;
+        fprintf (stderr, "Limits: at most %lu pending alarms per "
+            "scheduler\n", alarm_budget);
+    }
+
+    /*
+     * Fork the scheduler processes before any threads exist. Each
+     * writes to its own output file, and numbers its alarms so
+     * that the front end can tell which scheduler owns an id.
+     */
+    if (shards > 0) {
+        shard = shard_create (shards);
+        fflush (stdout);
+        for (i = 0; i < shards; i++) {
+            pid = fork ();
+            if (pid < 0)
+                errno_abort ("Fork scheduler");
+            if (pid == 0) {
+                shard_index = i;
+                break;
+            }
+        }
+        if (shard_index < 0)
+            front_end (shard, shards);
+        sprintf (line, "alarm-shard%d.out", shard_index);
+        if (freopen (line, "w", stdout) == NULL)
+            errno_abort ("Open shard output");
+        stats_ids (shard_index + 1, shards);
+        sprintf (usage_label, "scheduler %d", shard_index);
+        shard_table = shard;
+        shard_self = shard_index;
+        shard_count = shards;
+    }
+    usage_register ("alarm-main");
+    output_start ();
+    stats_init (late_seconds);
+    if (events_name != NULL)
+        alarm_events = events_create (events_name);
+
+    /*
+     * The adaptive backend says when it moves the pending alarms
+     * to another backend.
+     */
+    queue_log = output_file;
+    if (queue_file != NULL)
+        resume_alarms (queue_file);
+    else
+        alarm_queue = queue_create (backend);
+    queue_index (alarm_queue);
+    if (wal_dir != NULL)
+        recover_alarms (wal_dir, wal_options);
+
+    /*
+     * The reorder thread waits on the monotonic clock, which the
+     * buffer keeps its times on.
+     */
+    if (reorder_ms >= 0) {
+        alarm_reorder = reorder_create ((long long)(reorder_ms * 1e6),
+            REORDER_SIZE, fire_output, NULL);
+        pthread_condattr_init (&attr);
+        pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+        status = pthread_cond_init (&reorder_cond, &attr);
+        if (status != 0)
+            err_abort (status, "Init reorder cond");
+        pthread_condattr_destroy (&attr);
+        status = pthread_create (&r_thread, NULL, reorder_thread, NULL);
+        if (status != 0)
+            err_abort (status, "Create reorder thread");
+    }
+
+    status = pthread_create (
+        &a_thread, NULL, alarm_thread, NULL);
+    if (status != 0)
+        err_abort (status, "Create alarm thread");
+    status = pthread_create (
+	&d_thread[0], NULL, display_thread, &d_number[0]);
+    if (status != 0)
+	err_abort (status, "Create display thread 1");
+    status = pthread_create (
+	&d_thread[1], NULL, display_thread, &d_number[1]);
+    if (status != 0)
+	err_abort (status, "Create display thread 2");
+    if (shard_self >= 0) {
+        status = pthread_create (&i_thread, NULL, inbox_thread, NULL);
+        if (status != 0)
+            err_abort (status, "Create inbox thread");
+    }
+    if (watchdog_seconds > 0) {
+        status = pthread_create (&w_thread, NULL, watchdog_thread, NULL);
+        if (status != 0)
+            err_abort (status, "Create watchdog thread");
+    }
+    if (usage_seconds > 0) {
+        status = pthread_create (&t_thread, NULL, usage_thread, usage_label);
+        if (status != 0)
+            err_abort (status, "Create usage thread");
+    }
+    if (dgram_path != NULL) {
+        dgram_fd = dgram_open (dgram_path);
+        status = pthread_create (
+            &u_thread, NULL, dgram_thread, &dgram_fd);
+        if (status != 0)
+            err_abort (status, "Create datagram thread");
+    }
+    if (schedule != NULL)
+        load_schedule (schedule);
+    /*
+     * A scheduler process takes its requests from its ring, and
+     * leaves its accounting for the front end when they run out.
+     */
+    if (shard_index >= 0) {
+        while (ring_get (&shard[shard_index].ring, &request) == 0)
+            do_request (&request);
+        if (report_stats)
+            drain_and_report (stdout);
+        server_flush ();
+        stats_summarize (&shard[shard_index].summary);
+        shard[shard_index].reported = 1;
+        output_flush ();
+        exit (0);
+    }
+    while (1) {
+        output_printf ("alarm> ");
+        if (fgets (line, sizeof (line), stdin) == NULL) {
+            if (report_stats)
+                drain_and_report (stderr);
             /*
-             * If we reached the end of the list, insert the new
-             * alarm there. ("next" is NULL, and "last" points
-             * to the link field of the last item, or to the
-             * list header).
+             * Alarms still pending stay in the log, for the next run.
              */
-            if (next == NULL) {
-                *last = alarm;
-                alarm->link = NULL;
-            }
-#ifdef DEBUG
-            printf ("[list: ");
-            for (next = alarm_list; next != NULL; next = next->link)
-                printf ("%d(%d)[\"%s\"] ", next->time,
-                    next->time - time (NULL), next->message);
-            printf ("]\n");
-#endif
-            status = pthread_mutex_unlock (&alarm_mutex);
-            if (status != 0)
-                err_abort (status, "Unlock mutex");
+            server_flush ();
+            output_flush ();
+            exit (0);
         }
+        if (strlen (line) <= 1) continue;
+        if (parse_request (line, &request) != 0)
+            fprintf (stderr, "Bad command\n");
+        else
+            do_request (&request);
     }
 }
@@ -0,0 +1,315 @@
+/*
+ * alarm.c
+ *
+ * Alarm record helpers shared by the alarm server and alarm_bench.
+ */
+#include "errors.h"
+#include "alarm.h"
+#include "alarm_pool.h"
+#include "alarm_region.h"
+#include "alarm_pqueue.h"
+#include "alarm_source.h"
+
+/*
+ * Alarm records come from a pool of 2MB chunks, which may be backed
+ * by huge pages (see alarm_pool.h).
+ */
+static pool_t alarm_pool = POOL_INITIALIZER (sizeof (alarm_t));
+
+/*
+ * Records for alarms loaded from a mapped schedule stop short of
+ * the message array.
+ */
+static pool_t mapped_pool = POOL_INITIALIZER (offsetof (alarm_t, message));
+
+/*
+ * With -a region, records are carved from regions by deadline
+ * instead (see alarm_region.h). The choice is made once, before
+ * the first record is allocated.
+ */
+static int alarm_regions = 0;
+
+int alarm_alloc_mode (const char *name)
+{
+    if (strcmp (name, "pool") == 0)
+        return ALARM_ALLOC_POOL;
+    if (strcmp (name, "region") == 0)
+        return ALARM_ALLOC_REGION;
+    return -1;
+}
+
+void alarm_set_alloc (int mode)
+{
+    alarm_regions = mode == ALARM_ALLOC_REGION;
+}
+
+/*
+ * Allocate an alarm record for an alarm due at "due". Aborts if
+ * memory is exhausted, as the server has no way to recover from
+ * that. While a queue file is open (-M), records come from the file
+ * as long as it has room.
+ */
+alarm_t *alarm_alloc_due (time_t due)
+{
+    alarm_t *alarm = NULL;
+
+    if (pqueue_records != NULL)
+        alarm = pqueue_alloc (pqueue_records);
+    if (alarm == NULL && alarm_regions)
+        alarm = (alarm_t*)region_get (due, sizeof (alarm_t));
+    else if (alarm == NULL)
+        alarm = (alarm_t*)pool_get (&alarm_pool);
+    alarm->link = NULL;
+    alarm->chain = NULL;
+    alarm->child = NULL;
+    alarm->prev = NULL;
+    alarm->owner = NULL;
+    alarm->source = NULL;
+    return alarm;
+}
+
+/*
+ * Allocate a record for an alarm whose deadline isn't known yet,
+ * which in region mode is taken to be now.
+ */
+alarm_t *alarm_alloc (void)
+{
+    return alarm_alloc_due (alarm_regions ? time (NULL) : 0);
+}
+
+/*
+ * Allocate a record without a message array. The caller sets its
+ * source, and holds a reference to the source for it, which
+ * alarm_free releases.
+ */
+alarm_t *alarm_alloc_mapped (void)
+{
+    alarm_t *alarm;
+
+    alarm = (alarm_t*)pool_get (&mapped_pool);
+    alarm->link = NULL;
+    alarm->chain = NULL;
+    alarm->child = NULL;
+    alarm->prev = NULL;
+    alarm->owner = NULL;
+    alarm->source = NULL;
+    return alarm;
+}
+
+/*
+ * Return a record that can be queued in a queue file: "alarm"
+ * itself, unless its message is left in a mapped schedule, in which
+ * case it is copied into a record of its own, and freed.
+ */
+alarm_t *alarm_unmap (alarm_t *alarm)
+{
+    alarm_t *copy;
+    int length;
+
+    if (alarm->source == NULL)
+        return alarm;
+    copy = alarm_alloc_due (alarm->time);
+    copy->id = alarm->id;
+    copy->seconds = alarm->seconds;
+    copy->time = alarm->time;
+    length = alarm_length (alarm);
+    if (length >= sizeof (copy->message))
+        length = sizeof (copy->message) - 1;
+    memcpy (copy->message, alarm_text (alarm), length);
+    copy->message[length] = '\0';
+    alarm_free (alarm);
+    return copy;
+}
+
+/*
+ * Whether a record can be queued. While a queue file is open (-M),
+ * only records in the file can; one allocated elsewhere means the
+ * file was full, and the alarm must be refused.
+ */
+int alarm_queueable (alarm_t *alarm)
+{
+    return pqueue_records == NULL || pqueue_owns (pqueue_records, alarm);
+}
+
+void alarm_free (alarm_t *alarm)
+{
+    if (pqueue_records != NULL && pqueue_owns (pqueue_records, alarm))
+        pqueue_free (pqueue_records, alarm);
+    else if (alarm->source != NULL) {
+        source_release (alarm->source);
+        pool_put (&mapped_pool, alarm);
+    } else if (alarm_regions)
+        region_put (alarm);
+    else
+        pool_put (&alarm_pool, alarm);
+}
+
+/*
+ * Print how much of the memory held for alarm records holds live
+ * ones, and how much of the queue file has been used, for the -s
+ * report.
+ */
+void alarm_alloc_print (FILE *out)
+{
+    region_summary_t region;
+    unsigned long held, live;
+
+    if (pqueue_records != NULL)
+        fprintf (out, "Queue file: %lu of %lu records ever used\n",
+            pqueue_used (pqueue_records), pqueue_capacity (pqueue_records));
+    if (alarm_regions) {
+        region_summarize (&region);
+        held = (region.mapped - region.spare) * REGION_SIZE;
+        live = region.objects * sizeof (alarm_t);
+        fprintf (out, "Allocator: region, %lu regions of %dKB (%lu spare), "
+            "%lu records, %.1f%% of held memory live, "
+            "%lu regions recycled whole\n",
+            region.mapped, REGION_SIZE / 1024, region.spare, region.objects,
+            held > 0 ? 100.0 * live / held : 100.0, region.recycled);
+    } else {
+        held = alarm_pool.nchunks * POOL_CHUNK_SIZE;
+        live = alarm_pool.in_use * sizeof (alarm_t);
+        fprintf (out, "Allocator: pool, %lu chunks of %dKB, "
+            "%lu records, %.1f%% of held memory live\n",
+            alarm_pool.nchunks, POOL_CHUNK_SIZE / 1024, alarm_pool.in_use,
+            held > 0 ? 100.0 * live / held : 100.0);
+    }
+}
+
+/*
+ * Memory held for alarm records: the chunks of the record pools,
+ * and the regions of -a region, spares included.
+ */
+void alarm_alloc_bytes (size_t *pools, size_t *regions)
+{
+    region_summary_t region;
+
+    *pools = pool_bytes (&alarm_pool) + pool_bytes (&mapped_pool);
+    region_summarize (&region);
+    *regions = region.mapped * REGION_SIZE;
+}
+
+const char *alarm_source_text (alarm_t *alarm)
+{
+    return alarm->source->addr + alarm->offset;
+}
+
+/*
+ * Parse input line into seconds (%d) and a message
+ * (%64[^\n]), consisting of up to 64 characters
+ * separated from the seconds by whitespace. Returns 0 on
+ * success, or -1 if the line is not a valid request.
+ */
+int alarm_parse (const char *line, alarm_t *alarm)
+{
+    if (sscanf (line, "%d %64[^\n]",
+        &alarm->seconds, alarm->message) < 2)
+        return -1;
+    return 0;
+}
+
+/*
+ * Insert the new alarm into the list of alarms,
+ * sorted by expiration time.
+ */
+void alarm_insert (alarm_t **list, alarm_t *alarm)
+{
+    alarm_t **last, *next;
+
+    last = list;
+    next = *last;
+    while (next != NULL) {
+        if (next->time >= alarm->time) {
+            alarm->link = next;
+            *last = alarm;
+            break;
+        }
+        last = &next->link;
+        next = next->link;
+    }
+    /*
+     * If we reached the end of the list, insert the new
+     * alarm there. ("next" is NULL, and "last" points
+     * to the link field of the last item, or to the
+     * list header).
+     */
+    if (next == NULL) {
+        *last = alarm;
+        alarm->link = NULL;
+    }
+}
+
+/*
+ * Insert a batch of alarms, already sorted by expiration time, into
+ * the list in a single walk, by merging the two. An alarm in the
+ * batch goes ahead of list entries with the same expiration time,
+ * as it would with alarm_insert.
+ */
+void alarm_insert_batch (alarm_t **list, alarm_t *batch)
+{
+    alarm_t **last = list, *next;
+
+    while (batch != NULL) {
+        next = *last;
+        if (next == NULL) {
+            *last = batch;
+            break;
+        }
+        if (next->time >= batch->time) {
+            *last = batch;
+            batch = batch->link;
+            (*last)->link = next;
+        }
+        last = &(*last)->link;
+    }
+}
+
+/*
+ * Remove an alarm from a list. Returns 0, or -1 if the alarm isn't
+ * on the list.
+ */
+int alarm_unlink (alarm_t **list, alarm_t *alarm)
+{
+    alarm_t **last;
+
+    for (last = list; *last != NULL; last = &(*last)->link)
+        if (*last == alarm) {
+            *last = alarm->link;
+            alarm->link = NULL;
+            return 0;
+        }
+    return -1;
+}
+
+/*
+ * The number of seconds, from 0 to window - 1, that the fire of
+ * alarm "id" is spread past its deadline when fires are spread over
+ * "window" seconds (-J). The offset is a hash of the id, so alarms
+ * that share a deadline are spread evenly over the window, and an
+ * alarm always gets the same offset.
+ */
+int alarm_spread (unsigned long id, int window)
+{
+    unsigned long long x = id;
+
+    if (window <= 1)
+        return 0;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return (int)(x % window);
+}
+
+/*
+ * Format the line a display thread prints when an alarm expires.
+ * Returns the length of the formatted line, as snprintf does.
+ */
+int alarm_format_expired (
+    char *buf, size_t size, int display, time_t now, alarm_t *alarm)
+{
+    return snprintf (buf, size, "Display Thread %d: Alarm Expired at %d: "
+        "%d %.*s\n", display, (int)now, alarm->seconds,
+        alarm_length (alarm), alarm_text (alarm));
+}
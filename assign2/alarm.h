@@ -0,0 +1,73 @@
+/*
+ * alarm.h
+ *
+ * The alarm record, and the pieces of the alarm server that work
+ * on a single alarm or on the alarm list: allocating records,
+ * parsing request lines, inserting into the sorted list, and
+ * formatting output lines. They live here, rather than in
+ * My_Alarm.c, so that alarm_bench can measure them in isolation.
+ */
+#ifndef __alarm_h
+#define __alarm_h
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * The "alarm" structure now contains the time_t (time since the
+ * Epoch, in seconds) for each alarm, so that they can be
+ * sorted. Storing the requested number of seconds would not be
+ * enough, since the "alarm thread" cannot tell how long it has
+ * been on the list.
+ */
+typedef struct alarm_tag {
+    struct alarm_tag    *link;
+    unsigned long       id;     /* accounting id, see alarm_stats.h */
+    int                 seconds;
+    time_t              time;   /* seconds from EPOCH */
+    struct chain_tag    *chain; /* chain it belongs to, or NULL */
+    struct alarm_tag    *child; /* pairing heap handle: first child */
+    struct alarm_tag    *prev;  /* and parent or previous sibling */
+    struct queue_tag    *owner; /* adaptive backend: inner queue */
+    struct source_tag   *source; /* mapped schedule, or NULL */
+    unsigned long       offset; /* of the message in the source */
+    int                 length; /* of the message in the source */
+    char                message[64];    /* must be last */
+} alarm_t;
+
+/*
+ * The message of an alarm from a mapped schedule file is left in
+ * the file (see alarm_source.h), and such records have no message
+ * array. Print any alarm's message with "%.*s", alarm_length (alarm),
+ * alarm_text (alarm).
+ */
+#define alarm_text(a) \
+    ((a)->source != NULL ? alarm_source_text (a) : (a)->message)
+#define alarm_length(a) \
+    ((a)->source != NULL ? (a)->length : (int)strlen ((a)->message))
+
+#define ALARM_ALLOC_POOL        0       /* -a pool (the default) */
+#define ALARM_ALLOC_REGION      1       /* -a region */
+
+extern int alarm_alloc_mode (const char *name);
+extern void alarm_set_alloc (int mode);
+extern alarm_t *alarm_alloc_due (time_t due);
+extern alarm_t *alarm_alloc (void);
+extern alarm_t *alarm_alloc_mapped (void);
+extern const char *alarm_source_text (alarm_t *alarm);
+extern alarm_t *alarm_unmap (alarm_t *alarm);
+extern int alarm_queueable (alarm_t *alarm);
+extern void alarm_free (alarm_t *alarm);
+extern void alarm_alloc_print (FILE *out);
+extern void alarm_alloc_bytes (size_t *pools, size_t *regions);
+extern int alarm_parse (const char *line, alarm_t *alarm);
+extern void alarm_insert (alarm_t **list, alarm_t *alarm);
+extern void alarm_insert_batch (alarm_t **list, alarm_t *batch);
+extern int alarm_unlink (alarm_t **list, alarm_t *alarm);
+extern int alarm_spread (unsigned long id, int window);
+extern int alarm_format_expired (
+    char *buf, size_t size, int display, time_t now, alarm_t *alarm);
+
+#endif
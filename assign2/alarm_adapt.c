@@ -0,0 +1,258 @@
+/*
+ * alarm_adapt.c
+ *
+ * The adaptive backend. It holds the pending alarms in one of the
+ * other backends, and keeps counts of what the server does with
+ * them over a window of queue operations: how many alarms are
+ * pending, how many are cancelled or rescheduled, and how many are
+ * inserted further ahead of the earliest pending alarm than the
+ * wheel reaches. At the end of each window it picks the backend
+ * those counts favour:
+ *
+ *      list    few alarms pending, where walking a short list
+ *              beats any bookkeeping;
+ *      pheap   many alarms changed after they are inserted, or
+ *              many due beyond the wheel, where the wheel would
+ *              keep them on its sorted overflow list;
+ *      wheel   otherwise: bursts and spreads within the next hour
+ *              or so.
+ *
+ * A backend must be picked for ADAPT_VOTES windows running before
+ * the queue moves to it, so that a workload on the edge doesn't
+ * flip back and forth. Moving is done online: new alarms go into
+ * the new backend straight away, while the old one is drained into
+ * it ADAPT_BATCH alarms per queue operation, so no operation takes
+ * more than a bounded time. Until it is empty, pop and peek take
+ * the earlier of the two heads. Each alarm records the inner queue
+ * holding it ("owner"), so cancel and reschedule know where to
+ * find it.
+ */
+#include "errors.h"
+#include "alarm.h"
+#include "alarm_queue.h"
+
+#define ADAPT_WINDOW    4096    /* queue operations per sample */
+#define ADAPT_VOTES     2       /* windows in a row to move */
+#define ADAPT_BATCH     64      /* alarms moved per operation */
+#define ADAPT_SMALL     64      /* "few alarms" */
+#define ADAPT_SPAN      4096    /* seconds the wheel reaches */
+
+typedef struct adapt_queue_tag {
+    queue_t             queue;
+    queue_t             *active;        /* takes new alarms */
+    queue_t             *draining;      /* being moved, or NULL */
+    unsigned long       ops;            /* in this window */
+    unsigned long       inserts;
+    unsigned long       changes;        /* cancels and reschedules */
+    unsigned long       far;            /* inserted beyond the span */
+    const char          *choice;        /* last window's pick */
+    int                 votes;          /* windows in a row for it */
+    unsigned long       moves;          /* backend changes so far */
+} adapt_queue_t;
+
+static queue_t *adapt_create (void)
+{
+    adapt_queue_t *aq;
+
+    aq = (adapt_queue_t*)calloc (1, sizeof (adapt_queue_t));
+    if (aq == NULL)
+        errno_abort ("Allocate adaptive queue");
+    aq->queue.ops = &adapt_queue_ops;
+    /*
+     * Start on the pairing heap, which has no bad case while the
+     * first window is sampled.
+     */
+    aq->active = queue_create ("pheap");
+    return &aq->queue;
+}
+
+static void adapt_destroy (queue_t *queue)
+{
+    adapt_queue_t *aq = (adapt_queue_t*)queue;
+
+    if (aq->draining != NULL)
+        queue_destroy (aq->draining);
+    queue_destroy (aq->active);
+    free (aq);
+}
+
+/*
+ * Move up to ADAPT_BATCH alarms from the draining backend to the
+ * active one, and release the draining backend once it is empty.
+ */
+static void adapt_drain (adapt_queue_t *aq)
+{
+    alarm_t *alarm;
+    int i;
+
+    for (i = 0; i < ADAPT_BATCH; i++) {
+        alarm = queue_pop (aq->draining);
+        if (alarm == NULL) {
+            queue_destroy (aq->draining);
+            aq->draining = NULL;
+            return;
+        }
+        alarm->owner = aq->active;
+        queue_insert (aq->active, alarm);
+    }
+}
+
+/*
+ * Pick the backend this window's counts favour.
+ */
+static const char *adapt_choose (adapt_queue_t *aq)
+{
+    if (aq->queue.count < ADAPT_SMALL)
+        return "list";
+    if (aq->changes * 8 >= aq->ops || aq->far * 4 >= aq->inserts + 1)
+        return "pheap";
+    return "wheel";
+}
+
+/*
+ * Account for one queue operation: carry on draining the old
+ * backend, and at the end of a window, start moving to another
+ * backend if it has been picked often enough.
+ */
+static void adapt_step (adapt_queue_t *aq)
+{
+    const char *choice;
+
+    if (aq->draining != NULL)
+        adapt_drain (aq);
+    if (++aq->ops < ADAPT_WINDOW)
+        return;
+
+    choice = adapt_choose (aq);
+    if (choice == aq->choice)
+        aq->votes++;
+    else {
+        aq->choice = choice;
+        aq->votes = 1;
+    }
+    if (aq->votes >= ADAPT_VOTES && aq->draining == NULL
+            && strcmp (choice, queue_name (aq->active)) != 0) {
+        if (queue_log != NULL)
+            fprintf (queue_log, "Alarm Queue Moving %lu Alarms from %s "
+                "to %s\n", aq->queue.count, queue_name (aq->active),
+                choice);
+        aq->draining = aq->active;
+        aq->active = queue_create (choice);
+        aq->moves++;
+    }
+    aq->ops = aq->inserts = aq->changes = aq->far = 0;
+}
+
+static void adapt_insert (queue_t *queue, alarm_t *alarm)
+{
+    adapt_queue_t *aq = (adapt_queue_t*)queue;
+    alarm_t *first = queue_peek (queue);
+
+    aq->inserts++;
+    if (first != NULL && alarm->time - first->time >= ADAPT_SPAN)
+        aq->far++;
+    alarm->owner = aq->active;
+    queue_insert (aq->active, alarm);
+    queue->count++;
+    adapt_step (aq);
+}
+
+static void adapt_insert_batch (queue_t *queue, alarm_t *batch)
+{
+    alarm_t *next;
+
+    while (batch != NULL) {
+        next = batch->link;
+        adapt_insert (queue, batch);
+        batch = next;
+    }
+}
+
+/*
+ * Return the inner queue whose head is the earliest alarm. Alarms
+ * in the draining backend were there first, so they win ties.
+ */
+static queue_t *adapt_first (adapt_queue_t *aq)
+{
+    alarm_t *a, *d;
+
+    if (aq->draining == NULL)
+        return aq->active;
+    a = queue_peek (aq->active);
+    d = queue_peek (aq->draining);
+    if (d != NULL && (a == NULL || d->time <= a->time))
+        return aq->draining;
+    return aq->active;
+}
+
+static alarm_t *adapt_peek (queue_t *queue)
+{
+    return queue_peek (adapt_first ((adapt_queue_t*)queue));
+}
+
+static alarm_t *adapt_pop (queue_t *queue)
+{
+    adapt_queue_t *aq = (adapt_queue_t*)queue;
+    alarm_t *alarm = queue_pop (adapt_first (aq));
+
+    if (alarm != NULL) {
+        alarm->owner = NULL;
+        queue->count--;
+    }
+    adapt_step (aq);
+    return alarm;
+}
+
+static void adapt_remove (queue_t *queue, alarm_t *alarm)
+{
+    adapt_queue_t *aq = (adapt_queue_t*)queue;
+
+    queue_remove (alarm->owner, alarm);
+    alarm->owner = NULL;
+    queue->count--;
+    aq->changes++;
+    adapt_step (aq);
+}
+
+static void adapt_reschedule (queue_t *queue, alarm_t *alarm, time_t time)
+{
+    adapt_queue_t *aq = (adapt_queue_t*)queue;
+
+    if (alarm->owner == aq->active)
+        queue_reschedule (aq->active, alarm, time);
+    else {
+        queue_remove (alarm->owner, alarm);
+        alarm->time = time;
+        alarm->owner = aq->active;
+        queue_insert (aq->active, alarm);
+    }
+    aq->changes++;
+    adapt_step (aq);
+}
+
+static size_t adapt_bytes (queue_t *queue)
+{
+    adapt_queue_t *aq = (adapt_queue_t*)queue;
+    size_t bytes = sizeof (adapt_queue_t) + queue_bytes (aq->active);
+
+    if (aq->draining != NULL)
+        bytes += queue_bytes (aq->draining);
+    return bytes;
+}
+
+const queue_ops_t adapt_queue_ops = {
+    "adaptive",
+    adapt_create,
+    adapt_destroy,
+    adapt_insert,
+    adapt_insert_batch,
+    adapt_peek,
+    adapt_pop,
+    adapt_remove,
+    adapt_reschedule,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    adapt_bytes,
+};
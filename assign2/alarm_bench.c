@@ -0,0 +1,1667 @@
+/*
+ * alarm_bench.c
+ *
+ * Microbenchmarks for the pieces of the alarm server, each run in
+ * isolation: the sorted list insert done by the main thread, list
+ * push/pop, the mutex and condition variable handoff between the
+ * alarm thread and a display thread, the alarm allocator (and a
+ * simulated long run of each -a allocator, with the share of its
+ * memory that ends up live), the request parser, and the output
+ * formatter. The queue backends of
+ * alarm_queue.h are compared under the same insert/pop load, and
+ * the wheel's bitmap search for the next occupied bucket against
+ * a plain scan, on sparse and dense schedules. The ticker scan
+ * kernels of alarm_ticker.h are compared per table entry. The
+ * merge backend's loser tree over 4 to 256 shards is compared with
+ * scanning the shard heads. A preloaded schedule is loaded as one
+ * sorted run and drained through each backend, lsm included. Range
+ * scans and bulk deletes of the alarms due in a window are timed on
+ * the btree backend and through the index of the others. The
+ * write-ahead log is written and recovered with each compression
+ * option, reporting the bytes written per record, and a restart
+ * with the pending alarms in the log is compared with one that maps
+ * the queue file (-M). The reorder buffer is fed a stream of fire
+ * events reported out of order, with several latency budgets,
+ * reporting the time events were held and how many still came out
+ * of order. A skewed load over 4 schedulers is simulated with and
+ * without the -R rebalancer's plan, reporting how many alarms fired
+ * late. A million alarms sharing a deadline are queued with their
+ * fires spread over a window (-J), reporting the busiest second.
+ * Alarm records are chased at random with and without
+ * huge pages, which also reports data TLB misses per operation
+ * where the kernel lets us count them.
+ *
+ * Each benchmark is run for a number of warmup repetitions, whose
+ * results are thrown away, and then for a number of measured
+ * repetitions. The per-operation time of every measured repetition
+ * is kept, and summarized as median, median absolute deviation, and
+ * percentiles. Results go to stdout as a table, CSV (-c) or JSON
+ * (-j); -t attaches a tag (a commit id, say) to every result so
+ * that runs from different commits can be compared.
+ *
+ *      ./alarm_bench -c -t `git rev-parse --short HEAD` > bench.csv
+ */
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "errors.h"
+#include "alarm.h"
+#include "alarm_bitmap.h"
+#include "alarm_queue.h"
+#include "alarm_ticker.h"
+#include "alarm_pool.h"
+#include "alarm_source.h"
+#include "alarm_shard.h"
+#include "alarm_dgram.h"
+#include "alarm_events.h"
+#include "alarm_wal.h"
+#include "alarm_reorder.h"
+#include "alarm_pqueue.h"
+
+/*
+ * A benchmark runs "iters" operations and returns the elapsed time
+ * in nanoseconds. Any setup it needs is done before it starts its
+ * own clock, and any teardown after it stops it. "arg" lets one
+ * routine serve several entries, such as one per queue backend.
+ */
+typedef double (*bench_fn)(long iters, const char *arg);
+
+typedef struct bench_tag {
+    const char          *name;
+    bench_fn            run;
+    long                iters;  /* operations per repetition */
+    const char          *arg;
+} bench_t;
+
+/*
+ * Small, fast pseudo-random generator (xorshift64), so that the
+ * benchmarks don't measure rand()'s lock.
+ */
+static unsigned long long rng_state = 88172645463325252ULL;
+static volatile long bench_sink;        /* keeps results live */
+
+static unsigned long long rng (void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double bench_clock (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Build a sorted list of "depth" alarms with deadlines spread over
+ * the next hour, as the main thread would have built it.
+ */
+static alarm_t *build_list (long depth, time_t base)
+{
+    alarm_t *list = NULL, *alarm;
+    long i;
+
+    for (i = 0; i < depth; i++) {
+        alarm = alarm_alloc ();
+        alarm->seconds = rng () % 3600;
+        alarm->time = base + alarm->seconds;
+        alarm_insert (&list, alarm);
+    }
+    return list;
+}
+
+static void free_list (alarm_t *list)
+{
+    alarm_t *next;
+
+    while (list != NULL) {
+        next = list->link;
+        alarm_free (list);
+        list = next;
+    }
+}
+
+/*
+ * Sorted insert into a list 1000 alarms deep. Each operation
+ * inserts an alarm with a random deadline, and pops the head so
+ * the depth stays constant.
+ */
+static double bench_list_insert (long iters, const char *arg)
+{
+    time_t base = time (NULL);
+    alarm_t *list = build_list (1000, base), *alarm, *spare;
+    double start, elapsed;
+    long i;
+
+    spare = alarm_alloc ();
+    start = bench_clock ();
+    for (i = 0; i < iters; i++) {
+        spare->time = base + rng () % 3600;
+        alarm_insert (&list, spare);
+        alarm = list;
+        list = alarm->link;
+        spare = alarm;
+    }
+    elapsed = bench_clock () - start;
+    alarm_free (spare);
+    free_list (list);
+    return elapsed;
+}
+
+/*
+ * Push/pop on a short list: the main thread inserts an alarm that
+ * lands near the head, and the alarm thread takes the head. This is
+ * the common case when the alarm thread is keeping up.
+ */
+static double bench_queue_push_pop (long iters, const char *arg)
+{
+    time_t base = time (NULL);
+    alarm_t *list = build_list (4, base + 3600), *alarm, *spare;
+    double start, elapsed;
+    long i;
+
+    spare = alarm_alloc ();
+    start = bench_clock ();
+    for (i = 0; i < iters; i++) {
+        spare->time = base + (i & 15);
+        alarm_insert (&list, spare);
+        alarm = list;
+        list = alarm->link;
+        spare = alarm;
+    }
+    elapsed = bench_clock () - start;
+    alarm_free (spare);
+    free_list (list);
+    return elapsed;
+}
+
+/*
+ * Handoff: the alarm thread's protocol of setting current_alarm and
+ * signalling a display thread, which claims it. Here the "display"
+ * thread hands each alarm straight back, so one operation is a
+ * round trip through the mutex and both condition variables.
+ */
+static pthread_mutex_t handoff_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handoff_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t handback_cond = PTHREAD_COND_INITIALIZER;
+static alarm_t *handoff_alarm;
+static alarm_t *handback_alarm;
+
+static void *handoff_display (void *arg)
+{
+    long iters = *(long*)arg, i;
+    alarm_t *alarm;
+
+    pthread_mutex_lock (&handoff_mutex);
+    for (i = 0; i < iters; i++) {
+        while (handoff_alarm == NULL)
+            pthread_cond_wait (&handoff_cond, &handoff_mutex);
+        alarm = handoff_alarm;
+        handoff_alarm = NULL;
+        handback_alarm = alarm;
+        pthread_cond_signal (&handback_cond);
+    }
+    pthread_mutex_unlock (&handoff_mutex);
+    return NULL;
+}
+
+static double bench_handoff (long iters, const char *arg)
+{
+    pthread_t thread;
+    alarm_t *alarm = alarm_alloc ();
+    double start, elapsed;
+    long i;
+    int status;
+
+    status = pthread_create (&thread, NULL, handoff_display, &iters);
+    if (status != 0)
+        err_abort (status, "Create handoff thread");
+    start = bench_clock ();
+    pthread_mutex_lock (&handoff_mutex);
+    for (i = 0; i < iters; i++) {
+        handoff_alarm = alarm;
+        pthread_cond_signal (&handoff_cond);
+        while (handback_alarm == NULL)
+            pthread_cond_wait (&handback_cond, &handoff_mutex);
+        handback_alarm = NULL;
+    }
+    pthread_mutex_unlock (&handoff_mutex);
+    elapsed = bench_clock () - start;
+    pthread_join (thread, NULL);
+    alarm_free (alarm);
+    return elapsed;
+}
+
+/*
+ * Ingest through the sharded server's rings: the front end parses
+ * each request and routes it, in turn, to one of "arg" forked
+ * scheduler processes, which take it off their ring and queue it.
+ * "0" does the same work in one process, queueing under a mutex
+ * as the main thread does. One operation is one request; the time
+ * runs until every scheduler has queued all of its requests.
+ */
+static void shard_consume (ring_t *ring)
+{
+    queue_t *queue = queue_create ("wheel");
+    request_t request;
+    alarm_t *alarm;
+    time_t now = time (NULL);
+
+    while (ring_get (ring, &request) == 0) {
+        alarm = alarm_alloc ();
+        alarm->seconds = request.seconds;
+        strcpy (alarm->message, request.text);
+        alarm->time = now + alarm->seconds;
+        queue_insert (queue, alarm);
+    }
+    _exit (0);
+}
+
+static double bench_shard (long iters, const char *arg)
+{
+    int shards = atoi (arg), i;
+    shard_t *shard = NULL;
+    queue_t *queue = NULL;
+    request_t request;
+    alarm_t parsed, *alarm;
+    time_t now = time (NULL);
+    double start, elapsed;
+    long n;
+
+    if (shards > 0) {
+        shard = shard_create (shards);
+        for (i = 0; i < shards; i++)
+            if (fork () == 0)
+                shard_consume (&shard[i].ring);
+    } else
+        queue = queue_create ("wheel");
+
+    start = bench_clock ();
+    for (n = 0; n < iters; n++) {
+        if (alarm_parse ("20 POSIX IS SO FUN\n", &parsed) != 0)
+            abort ();
+        if (shards > 0) {
+            request.kind = REQUEST_ALARM;
+            request.seconds = parsed.seconds;
+            strcpy (request.text, parsed.message);
+            ring_put (&shard[n % shards].ring, &request);
+        } else {
+            alarm = alarm_alloc ();
+            alarm->seconds = parsed.seconds;
+            strcpy (alarm->message, parsed.message);
+            pthread_mutex_lock (&handoff_mutex);
+            alarm->time = now + alarm->seconds;
+            queue_insert (queue, alarm);
+            pthread_mutex_unlock (&handoff_mutex);
+        }
+    }
+    if (shards > 0) {
+        for (i = 0; i < shards; i++)
+            ring_close (&shard[i].ring);
+        while (wait (NULL) > 0)
+            ;
+    }
+    elapsed = bench_clock () - start;
+
+    if (shards > 0)
+        munmap (shard, shards * sizeof (shard_t));
+    else {
+        while ((alarm = queue_pop (queue)) != NULL)
+            alarm_free (alarm);
+        queue_destroy (queue);
+    }
+    return elapsed;
+}
+
+/*
+ * Ingest throughput: a producer thread sends requests as fast as it
+ * can, and the receiver reads and parses them. "dgram" sends one
+ * datagram per request and receives them in batches with recvmmsg
+ * (alarm_dgram.h); "dgram1" receives them one recv at a time;
+ * "stream" sends lines over a stream socket, and "stdin" through a
+ * pipe, both read with fgets as the main thread reads standard
+ * input. One operation is one request.
+ */
+typedef struct ingest_arg_tag {
+    int                 fd;
+    long                iters;
+    int                 lines;          /* newline terminated */
+} ingest_arg_t;
+
+static void *ingest_producer (void *arg)
+{
+    ingest_arg_t *ia = (ingest_arg_t*)arg;
+    static const char request[] = "20 POSIX IS SO FUN\n";
+    char buf[4096];
+    int len = sizeof (request) - 1, n = 0;
+    long i;
+
+    for (i = 0; i < ia->iters; i++) {
+        if (!ia->lines) {
+            if (send (ia->fd, request, len - 1, 0) < 0)
+                errno_abort ("Send datagram");
+            continue;
+        }
+        memcpy (buf + n, request, len);
+        n += len;
+        if (n + len > sizeof (buf) || i == ia->iters - 1) {
+            if (write (ia->fd, buf, n) != n)
+                errno_abort ("Write requests");
+            n = 0;
+        }
+    }
+    close (ia->fd);
+    return NULL;
+}
+
+static double bench_ingest (long iters, const char *mode)
+{
+    static dgram_t dgram;
+    ingest_arg_t ia;
+    pthread_t thread;
+    alarm_t alarm;
+    char line[512];
+    FILE *in;
+    int fd[2], n, i, status;
+    long received = 0;
+    double start, elapsed;
+
+    if (strcmp (mode, "stdin") == 0) {
+        if (pipe (fd) < 0)
+            errno_abort ("Create pipe");
+        n = fd[0];
+        fd[0] = fd[1];
+        fd[1] = n;
+    } else if (socketpair (AF_UNIX, strcmp (mode, "stream") == 0 ?
+            SOCK_STREAM : SOCK_DGRAM, 0, fd) < 0)
+        errno_abort ("Create socket pair");
+    ia.fd = fd[0];
+    ia.iters = iters;
+    ia.lines = strncmp (mode, "dgram", 5) != 0;
+    dgram_init (&dgram);
+
+    start = bench_clock ();
+    status = pthread_create (&thread, NULL, ingest_producer, &ia);
+    if (status != 0)
+        err_abort (status, "Create producer");
+    if (strcmp (mode, "dgram") == 0)
+        while (received < iters) {
+            n = dgram_receive (fd[1], &dgram);
+            for (i = 0; i < n; i++)
+                if (alarm_parse (dgram.buf[i], &alarm) != 0)
+                    abort ();
+            received += n;
+        }
+    else if (strcmp (mode, "dgram1") == 0)
+        while (received < iters) {
+            n = recv (fd[1], line, sizeof (line) - 1, 0);
+            if (n < 0)
+                errno_abort ("Receive datagram");
+            line[n] = '\0';
+            if (alarm_parse (line, &alarm) != 0)
+                abort ();
+            received++;
+        }
+    else {
+        in = fdopen (fd[1], "r");
+        while (fgets (line, sizeof (line), in) != NULL) {
+            if (alarm_parse (line, &alarm) != 0)
+                abort ();
+            received++;
+        }
+        fclose (in);
+        fd[1] = -1;
+    }
+    elapsed = bench_clock () - start;
+    pthread_join (thread, NULL);
+    if (fd[1] >= 0)
+        close (fd[1]);
+    if (received != iters)
+        abort ();
+    return elapsed;
+}
+
+/*
+ * Publishing fired alarms to the shared memory event ring, which
+ * display threads do with alarm_mutex held, so it must be cheap.
+ * "reader" has another process following the ring meanwhile.
+ */
+static double bench_events (long iters, const char *mode)
+{
+    static const char name[] = "/alarm_bench_events";
+    events_t *events = events_create (name);
+    alarm_t *alarm = alarm_alloc ();
+    unsigned long next = 1;
+    event_t event;
+    double start, elapsed;
+    pid_t pid = 0;
+    long i;
+
+    alarm->seconds = 20;
+    alarm->id = 0;
+    strcpy (alarm->message, "POSIX IS SO FUN");
+    if (strcmp (mode, "reader") == 0) {
+        pid = fork ();
+        if (pid == 0) {
+            while (next <= iters)
+                events_read (events, &next, &event);
+            _exit (0);
+        }
+    }
+    start = bench_clock ();
+    for (i = 0; i < iters; i++) {
+        alarm->time = i;
+        events_publish (events, alarm, alarm_text (alarm),
+            alarm_length (alarm), 1, i);
+    }
+    elapsed = bench_clock () - start;
+    if (pid > 0)
+        waitpid (pid, NULL, 0);
+    alarm_free (alarm);
+    events_destroy (name, events);
+    return elapsed;
+}
+
+/*
+ * Allocator: bursts of 64 allocations followed by 64 frees, the
+ * pattern of a batch of requests arriving and later expiring.
+ */
+static double bench_alloc (long iters, const char *arg)
+{
+    alarm_t *batch[64];
+    double start;
+    long i;
+    int j;
+
+    start = bench_clock ();
+    for (i = 0; i < iters; i += 64) {
+        for (j = 0; j < 64; j++)
+            batch[j] = alarm_alloc ();
+        for (j = 0; j < 64; j++)
+            alarm_free (batch[j]);
+    }
+    return bench_clock () - start;
+}
+
+/*
+ * A long run of the allocator: alarms due up to 10 minutes out are
+ * allocated at 1000 a second of simulated time, and each second
+ * the alarms due in it are freed, after the run has been going for
+ * 10 minutes already. "arg" is the -a allocator. Prints how much of
+ * the memory held for records was live at the end.
+ */
+#define CHURN_SECONDS   600
+#define CHURN_RATE      1000
+
+static double bench_churn (long iters, const char *arg)
+{
+    alarm_t *due[CHURN_SECONDS], *alarm, *next;
+    time_t now = 0, when;
+    double start = 0, elapsed;
+    long i, warm = CHURN_SECONDS * CHURN_RATE;
+
+    alarm_set_alloc (alarm_alloc_mode (arg));
+    memset (due, 0, sizeof (due));
+    for (i = 0; i < warm + iters; i++) {
+        if (i == warm)
+            start = bench_clock ();
+        if (i % CHURN_RATE == 0) {
+            now++;
+            for (alarm = due[now % CHURN_SECONDS]; alarm != NULL;
+                    alarm = next) {
+                next = alarm->link;
+                alarm_free (alarm);
+            }
+            due[now % CHURN_SECONDS] = NULL;
+        }
+        when = now + 1 + rng () % (CHURN_SECONDS - 1);
+        alarm = alarm_alloc_due (when);
+        alarm->time = when;
+        alarm->link = due[when % CHURN_SECONDS];
+        due[when % CHURN_SECONDS] = alarm;
+    }
+    elapsed = bench_clock () - start;
+    fprintf (stderr, "churn/%s: ", arg);
+    alarm_alloc_print (stderr);
+    for (i = 0; i < CHURN_SECONDS; i++)
+        for (alarm = due[i]; alarm != NULL; alarm = next) {
+            next = alarm->link;
+            alarm_free (alarm);
+        }
+    alarm_set_alloc (ALARM_ALLOC_POOL);
+    return elapsed;
+}
+
+static double bench_parse (long iters, const char *arg)
+{
+    alarm_t alarm;
+    double start;
+    long i;
+
+    start = bench_clock ();
+    for (i = 0; i < iters; i++)
+        if (alarm_parse ("20 POSIX IS SO FUN\n", &alarm) != 0)
+            abort ();
+    return bench_clock () - start;
+}
+
+static double bench_format (long iters, const char *arg)
+{
+    alarm_t alarm;
+    char buf[128];
+    time_t now = time (NULL);
+    double start;
+    long i;
+
+    alarm.seconds = 20;
+    alarm.time = now + 20;
+    alarm.source = NULL;
+    strcpy (alarm.message, "POSIX IS SO FUN");
+    start = bench_clock ();
+    for (i = 0; i < iters; i++)
+        alarm_format_expired (buf, sizeof (buf), 1 + (i & 1), now, &alarm);
+    return bench_clock () - start;
+}
+
+/*
+ * Write-ahead log: each operation logs a new alarm, and every other
+ * one the end of an earlier alarm, with messages drawn from a small
+ * set as a real schedule's mostly are. "write" times logging (and
+ * writing out the blocks); "recover" times rebuilding the pending
+ * alarms from the log written.
+ */
+static double bench_wal (long iters, const char *arg, int recover)
+{
+    char dir[] = "/tmp/alarm_benchXXXXXX";
+    char path[64];
+    wal_t *wal;
+    queue_t *queue;
+    alarm_t *alarm;
+    double start, elapsed;
+    long i;
+
+    if (mkdtemp (dir) == NULL)
+        errno_abort ("Create log directory");
+    queue = queue_create ("pheap");
+    queue_index (queue);
+    alarm = alarm_alloc ();
+    start = bench_clock ();
+    wal = wal_open (dir, wal_flags (arg), queue, NULL);
+    for (i = 0; i < iters; i++) {
+        alarm->id = i + 1;
+        alarm->seconds = rng () % 3600;
+        alarm->time = 1700000000 + alarm->seconds;
+        sprintf (alarm->message, "Backup job %d finished", (int)(rng () % 64));
+        wal_ingest (wal, alarm);
+        if (i % 2 == 1)
+            wal_done (wal, i / 2 + 1);
+    }
+    wal_flush (wal);
+    elapsed = bench_clock () - start;
+    fprintf (stderr, "wal/%s: %.1f bytes per record\n", arg,
+        (double)wal->log.bytes / (iters + iters / 2));
+    wal_close (wal);
+    alarm_free (alarm);
+
+    if (recover) {
+        start = bench_clock ();
+        wal_recover (dir, queue);
+        elapsed = bench_clock () - start;
+        while ((alarm = queue_pop (queue)) != NULL)
+            alarm_free (alarm);
+    }
+    queue_destroy (queue);
+    sprintf (path, "%s/wal", dir);
+    unlink (path);
+    sprintf (path, "%s/snapshot", dir);
+    unlink (path);
+    rmdir (dir);
+    return elapsed;
+}
+
+static double bench_wal_write (long iters, const char *arg)
+{
+    return bench_wal (iters, arg, 0);
+}
+
+static double bench_wal_recover (long iters, const char *arg)
+{
+    return bench_wal (iters, arg, 1);
+}
+
+/*
+ * Restart: "iters" alarms are left pending, and the time is taken
+ * from starting over to the first alarm being ready to fire. "wal"
+ * recovers them from a write-ahead log (-W); "file" maps the queue
+ * file they were left in (-M).
+ */
+static double bench_restart (long iters, const char *arg)
+{
+    char dir[] = "/tmp/alarm_benchXXXXXX";
+    char path[64];
+    queue_t *queue;
+    wal_t *wal;
+    alarm_t *alarm;
+    double start, elapsed;
+    long i;
+
+    if (mkdtemp (dir) == NULL)
+        errno_abort ("Create restart directory");
+    if (strcmp (arg, "file") == 0) {
+        sprintf (path, "%s/queue", dir);
+        queue = pqueue_open (path, iters + 1);
+        pqueue_records = queue;
+    } else {
+        queue = queue_create ("pheap");
+        queue_index (queue);
+        wal = wal_open (dir, WAL_DICT | WAL_LZ, queue, NULL);
+    }
+    for (i = 0; i < iters; i++) {
+        alarm = alarm_alloc ();
+        alarm->id = i + 1;
+        alarm->seconds = rng () % 3600;
+        alarm->time = 1700000000 + alarm->seconds;
+        sprintf (alarm->message, "Backup job %d finished", (int)(rng () % 64));
+        if (pqueue_records == NULL)
+            wal_ingest (wal, alarm);
+        queue_insert (queue, alarm);
+    }
+    if (pqueue_records != NULL)
+        pqueue_close (queue);
+    else {
+        wal_flush (wal);
+        wal_close (wal);
+        while ((alarm = queue_pop (queue)) != NULL)
+            alarm_free (alarm);
+        queue_destroy (queue);
+    }
+
+    start = bench_clock ();
+    if (strcmp (arg, "file") == 0) {
+        queue = pqueue_open (path, 0);
+        pqueue_records = queue;
+    } else {
+        queue = queue_create ("pheap");
+        queue_index (queue);
+        wal_recover (dir, queue);
+    }
+    alarm = queue_pop (queue);
+    elapsed = bench_clock () - start;
+    fprintf (stderr, "restart/%s: %lu alarms, first ready in %.3f ms\n",
+        arg, queue_count (queue) + 1, elapsed / 1e6);
+    alarm_free (alarm);
+    if (pqueue_records != NULL) {
+        pqueue_close (queue);
+        unlink (path);
+    } else {
+        while ((alarm = queue_pop (queue)) != NULL)
+            alarm_free (alarm);
+        queue_destroy (queue);
+        sprintf (path, "%s/wal", dir);
+        unlink (path);
+        sprintf (path, "%s/snapshot", dir);
+        unlink (path);
+    }
+    rmdir (dir);
+    return elapsed;
+}
+
+/*
+ * Alarms that all share one deadline, queued with their fires
+ * spread over "arg" seconds (-J) and drained in order, reporting
+ * the most fired in any one second.
+ */
+static double bench_spread (long iters, const char *arg)
+{
+    queue_t *queue = queue_create ("pheap");
+    alarm_t *alarm;
+    time_t due = time (NULL) + 60, second = 0;
+    unsigned long n = 0, peak = 0;
+    int window = atoi (arg);
+    double start, elapsed;
+    long i;
+
+    start = bench_clock ();
+    for (i = 0; i < iters; i++) {
+        alarm = alarm_alloc ();
+        alarm->id = i + 1;
+        alarm->time = due + alarm_spread (alarm->id, window);
+        queue_insert (queue, alarm);
+    }
+    while ((alarm = queue_pop (queue)) != NULL) {
+        if (alarm->time != second) {
+            second = alarm->time;
+            n = 0;
+        }
+        if (++n > peak)
+            peak = n;
+        alarm_free (alarm);
+    }
+    elapsed = bench_clock () - start;
+    fprintf (stderr, "spread/%s: %ld alarms due together, last fired "
+        "+%lds, peak %lu in one second\n", arg, iters,
+        (long)(second - due), peak);
+    queue_destroy (queue);
+    return elapsed;
+}
+
+/*
+ * Reorder buffer: events fire one per microsecond of simulated
+ * time, each reported up to 2ms after its deadline (as threads are
+ * held up), and are released with a budget of "arg" microseconds.
+ */
+static void reorder_sink (const reorder_entry_t *entry, void *arg)
+{
+    bench_sink = entry->id;
+}
+
+static double bench_reorder (long iters, const char *arg)
+{
+    reorder_t *reorder;
+    reorder_entry_t entry;
+    long long now = 0;
+    double start, elapsed;
+    long i;
+
+    reorder = reorder_create (atol (arg) * 1000LL, REORDER_SIZE,
+        reorder_sink, NULL);
+    memset (&entry, 0, sizeof (entry));
+    start = bench_clock ();
+    for (i = 0; i < iters; i++) {
+        now += 1000;
+        entry.id = i + 1;
+        entry.deadline = now / 1000 - rng () % 2000;
+        reorder_put (reorder, &entry, now);
+        reorder_drain (reorder, now);
+    }
+    reorder_flush (reorder, now);
+    elapsed = bench_clock () - start;
+    fprintf (stderr, "reorder/%s: held mean %.0fus, max %.0fus, "
+        "%lu out of order, %lu forced\n", arg,
+        reorder->hold_total / 1e3 / reorder->events,
+        reorder->hold_max / 1e3, reorder->disordered, reorder->forced);
+    reorder_destroy (reorder);
+    return elapsed;
+}
+
+/*
+ * Skewed load across 4 schedulers, simulated a second at a time in
+ * one thread: each second 3000 alarms arrive, due 1 to 20 seconds
+ * out, a fifth of them on scheduler 0 on top of its share (as when
+ * one client's alarms all land in the same place), and each scheduler fires at most 1000
+ * due alarms. "static" leaves scheduler 0 to fall behind; with
+ * "rebalance", shard_plan is consulted every second, as the -R
+ * rebalancer does, and the alarms it asks for are moved. Reports
+ * how many alarms fired late and the deepest queue seen.
+ */
+#define SKEW_SHARDS     4
+#define SKEW_ARRIVE     3000
+#define SKEW_CAPACITY   1000
+
+typedef struct skew_pick_tag {
+    alarm_t             *alarm[MIGRATE_BATCH];
+    int                 n, count;
+    time_t              after;
+} skew_pick_t;
+
+static void skew_pick (alarm_t *alarm, void *arg)
+{
+    skew_pick_t *pick = (skew_pick_t*)arg;
+
+    if (pick->n < pick->count && alarm->time >= pick->after)
+        pick->alarm[pick->n++] = alarm;
+}
+
+static double bench_skew (long iters, const char *mode)
+{
+    queue_t *queue[SKEW_SHARDS];
+    unsigned long depth[SKEW_SHARDS], rate[SKEW_SHARDS];
+    unsigned long late = 0, deepest = 0, moved = 0, pending = 0;
+    skew_pick_t pick;
+    alarm_t *alarm;
+    time_t now = 0;
+    double start, elapsed;
+    long arrived = 0, i;
+    int rebalance = strcmp (mode, "rebalance") == 0, s, donor, recipient;
+
+    for (s = 0; s < SKEW_SHARDS; s++) {
+        queue[s] = queue_create ("pheap");
+        queue_index (queue[s]);
+        depth[s] = rate[s] = 0;
+    }
+    start = bench_clock ();
+    while (arrived < iters || pending > 0) {
+        now++;
+        for (i = 0; i < SKEW_ARRIVE && arrived < iters; i++, arrived++) {
+            alarm = alarm_alloc ();
+            alarm->id = arrived + 1;
+            alarm->time = now + 1 + rng () % 20;
+            s = rng () % 5 == 0 ? 0 : rng () % SKEW_SHARDS;
+            queue_insert (queue[s], alarm);
+            depth[s]++;
+            pending++;
+        }
+        for (s = 0; s < SKEW_SHARDS; s++) {
+            rate[s] = 0;
+            while (rate[s] < SKEW_CAPACITY
+                    && (alarm = queue_peek (queue[s])) != NULL
+                    && alarm->time <= now) {
+                queue_pop (queue[s]);
+                if (alarm->time < now)
+                    late++;
+                alarm_free (alarm);
+                rate[s]++;
+            }
+            depth[s] -= rate[s];
+            pending -= rate[s];
+            if (depth[s] > deepest)
+                deepest = depth[s];
+        }
+        if (!rebalance)
+            continue;
+        pick.count = shard_plan (depth, rate, SKEW_SHARDS,
+            &donor, &recipient);
+        if (pick.count == 0)
+            continue;
+        pick.n = 0;
+        pick.after = now + MIGRATE_AHEAD;
+        queue_foreach (queue[donor], skew_pick, &pick);
+        for (i = 0; i < pick.n; i++) {
+            queue_remove (queue[donor], pick.alarm[i]);
+            queue_insert (queue[recipient], pick.alarm[i]);
+        }
+        depth[donor] -= pick.n;
+        depth[recipient] += pick.n;
+        moved += pick.n;
+    }
+    elapsed = bench_clock () - start;
+    fprintf (stderr, "skew/%s: %lu of %ld alarms late, deepest queue %lu, "
+        "%lu moved, drained at %lds\n", mode, late, iters, deepest, moved,
+        (long)now);
+    for (s = 0; s < SKEW_SHARDS; s++)
+        queue_destroy (queue[s]);
+    return elapsed;
+}
+
+/*
+ * Loading a schedule file of "iters" requests into alarm records:
+ * "copy" reads it with stdio and copies each message into its
+ * record, as the server does for standard input; "mapped" maps it
+ * and leaves the messages in the file (alarm_source.h).
+ */
+static double bench_load (long iters, const char *mode)
+{
+    char path[] = "/tmp/alarm_benchXXXXXX";
+    char line[128];
+    FILE *file;
+    source_t *source;
+    alarm_t *alarm, *list = NULL;
+    const char *p, *nl, *end;
+    double start, elapsed;
+    long i;
+    int fd;
+
+    fd = mkstemp (path);
+    if (fd < 0)
+        errno_abort ("Create schedule file");
+    file = fdopen (fd, "w");
+    for (i = 0; i < iters; i++)
+        fprintf (file, "%ld Schedule entry number %ld\n", i % 3600, i);
+    fclose (file);
+
+    start = bench_clock ();
+    if (strcmp (mode, "copy") == 0) {
+        file = fopen (path, "r");
+        while (fgets (line, sizeof (line), file) != NULL) {
+            alarm = alarm_alloc ();
+            if (alarm_parse (line, alarm) != 0)
+                abort ();
+            alarm->link = list;
+            list = alarm;
+        }
+        fclose (file);
+    } else {
+        source = source_open (path);
+        end = source->addr + source->size;
+        for (p = source->addr; p < end; p = nl + 1) {
+            nl = memchr (p, '\n', end - p);
+            if (nl == NULL)
+                nl = end;
+            alarm = source_parse (
+                source, p - source->addr, nl - source->addr);
+            if (alarm == NULL)
+                abort ();
+            alarm->link = list;
+            list = alarm;
+        }
+        source_release (source);
+    }
+    elapsed = bench_clock () - start;
+    bench_sink = alarm_text (list)[0];
+
+    while ((alarm = list) != NULL) {
+        list = alarm->link;
+        alarm_free (alarm);
+    }
+    unlink (path);
+    return elapsed;
+}
+
+/*
+ * Steady state insert/pop through a queue backend holding "depth"
+ * alarms with deadlines spread over the next hour: each operation
+ * inserts an alarm due a random time after the last one popped,
+ * and pops the earliest, as the main and alarm threads do.
+ */
+static double bench_queue_run (long iters, queue_t *queue, long depth)
+{
+    time_t now = time (NULL);
+    alarm_t *alarm;
+    double start, elapsed;
+    long i;
+
+    for (i = 0; i < depth; i++) {
+        alarm = alarm_alloc ();
+        alarm->time = now + rng () % 3600;
+        alarm->id = i;
+        queue_insert (queue, alarm);
+    }
+    alarm = alarm_alloc ();
+    start = bench_clock ();
+    for (i = 0; i < iters; i++) {
+        alarm->time = now + rng () % 3600;
+        alarm->id = depth + i;
+        queue_insert (queue, alarm);
+        alarm = queue_pop (queue);
+        now = alarm->time;
+    }
+    elapsed = bench_clock () - start;
+    alarm_free (alarm);
+    while ((alarm = queue_pop (queue)) != NULL)
+        alarm_free (alarm);
+    queue_destroy (queue);
+    return elapsed;
+}
+
+static double bench_queue (long iters, const char *backend, long depth)
+{
+    return bench_queue_run (iters, queue_create (backend), depth);
+}
+
+/*
+ * The merge backend's loser tree against a scan of the shard heads,
+ * under the queue_10k load, for "shards/method".
+ */
+static double bench_merge (long iters, const char *arg)
+{
+    int shards = atoi (arg);
+
+    return bench_queue_run (iters, merge_queue_create (shards,
+        strstr (arg, "scan") != NULL ? MERGE_SCAN : MERGE_TREE), 10000);
+}
+
+/*
+ * A preloaded schedule: "iters" alarms, sorted as load_schedule
+ * sorts them outside alarm_mutex, handed to the backend with
+ * queue_load, and then all popped, with a live insert for every 16
+ * pops. Backends without a load operation take the run one alarm
+ * at a time; lsm keeps it as a sorted run.
+ */
+static double bench_preload (long iters, const char *backend)
+{
+    queue_t *queue = queue_create (backend);
+    alarm_t **run, *alarm;
+    time_t now = time (NULL);
+    double start, elapsed;
+    long i, live = 0;
+
+    run = (alarm_t**)malloc (iters * sizeof (alarm_t*));
+    if (run == NULL)
+        errno_abort ("Allocate run");
+    for (i = 0; i < iters; i++) {
+        run[i] = alarm_alloc ();
+        run[i]->time = now + rng () % 3600;
+        run[i]->id = i;
+    }
+    queue_sort (run, iters);
+    start = bench_clock ();
+    queue_load (queue, run, iters);
+    for (i = 0; (alarm = queue_pop (queue)) != NULL; i++) {
+        if (i % 16 == 0 && live < iters / 16) {
+            alarm->time = alarm->time + rng () % 60;
+            alarm->id = iters + live++;
+            queue_insert (queue, alarm);
+        } else
+            alarm_free (alarm);
+    }
+    elapsed = bench_clock () - start;
+    queue_destroy (queue);
+    free (run);
+    return elapsed;
+}
+
+/*
+ * Range-heavy loads over 100k pending alarms spread over an hour,
+ * through an indexed queue so that backends without range
+ * operations can gather from the index. "range" lists the alarms
+ * due in a random minute (about 1700 of them); "purge" removes
+ * those due in a random 10 seconds and puts them back.
+ */
+#define RANGE_DEPTH     100000
+
+static void bench_visit (alarm_t *alarm, void *arg)
+{
+    bench_sink += alarm->id;
+}
+
+static void bench_collect (alarm_t *alarm, void *arg)
+{
+    alarm_t ***next = (alarm_t***)arg;
+
+    *(*next)++ = alarm;
+}
+
+static double bench_ranges (long iters, const char *backend, int purge)
+{
+    queue_t *queue = queue_create (backend);
+    alarm_t *alarm, **removed, **next, **p;
+    time_t now = time (NULL), from;
+    double start, elapsed;
+    long i;
+
+    queue_index (queue);
+    removed = (alarm_t**)malloc (RANGE_DEPTH * sizeof (alarm_t*));
+    if (removed == NULL)
+        errno_abort ("Allocate range");
+    for (i = 0; i < RANGE_DEPTH; i++) {
+        alarm = alarm_alloc ();
+        alarm->time = now + rng () % 3600;
+        alarm->id = i + 1;
+        queue_insert (queue, alarm);
+    }
+    start = bench_clock ();
+    for (i = 0; i < iters; i++) {
+        from = now + rng () % 3600;
+        if (!purge) {
+            queue_range (queue, from, from + 59, bench_visit, NULL);
+            continue;
+        }
+        next = removed;
+        queue_remove_range (queue, from, from + 9, bench_collect, &next);
+        for (p = removed; p < next; p++)
+            queue_insert (queue, *p);
+    }
+    elapsed = bench_clock () - start;
+    while ((alarm = queue_pop (queue)) != NULL)
+        alarm_free (alarm);
+    queue_destroy (queue);
+    free (removed);
+    return elapsed;
+}
+
+static double bench_range (long iters, const char *backend)
+{
+    return bench_ranges (iters, backend, 0);
+}
+
+static double bench_purge (long iters, const char *backend)
+{
+    return bench_ranges (iters, backend, 1);
+}
+
+static double bench_queue_1k (long iters, const char *backend)
+{
+    return bench_queue (iters, backend, 1000);
+}
+
+static double bench_queue_10k (long iters, const char *backend)
+{
+    return bench_queue (iters, backend, 10000);
+}
+
+/*
+ * Reschedule-heavy load: 10k pending alarms, and each operation
+ * moves a random one of them to a new deadline, as clients that
+ * keep pushing their alarms around do. "earlier" only ever moves
+ * alarms forward in time (decrease-key); "mixed" moves them either
+ * way at random.
+ */
+static double bench_resched (long iters, const char *backend, int earlier)
+{
+    queue_t *queue = queue_create (backend);
+    alarm_t **pending;
+    time_t now = time (NULL), when;
+    double start, elapsed;
+    long i, depth = 10000;
+
+    pending = (alarm_t**)malloc (depth * sizeof (alarm_t*));
+    if (pending == NULL)
+        errno_abort ("Allocate pending");
+    for (i = 0; i < depth; i++) {
+        pending[i] = alarm_alloc ();
+        pending[i]->time = now + 3600 + rng () % 3600;
+        pending[i]->id = i;
+        queue_insert (queue, pending[i]);
+    }
+    start = bench_clock ();
+    for (i = 0; i < iters; i++) {
+        alarm_t *alarm = pending[rng () % depth];
+
+        if (earlier)
+            when = alarm->time - 1 - rng () % 4;
+        else
+            when = now + 3600 + rng () % 3600;
+        queue_reschedule (queue, alarm, when);
+    }
+    elapsed = bench_clock () - start;
+    bench_sink = queue_peek (queue)->time;
+    while (queue_pop (queue) != NULL)
+        ;
+    for (i = 0; i < depth; i++)
+        alarm_free (pending[i]);
+    free (pending);
+    queue_destroy (queue);
+    return elapsed;
+}
+
+/*
+ * A workload that changes character: 5k pending alarms, and three
+ * phases of equal length. The first inserts and pops alarms spread
+ * over the next ten minutes, the second does the same with alarms
+ * due hours to days ahead, and the third mostly reschedules. Each
+ * alarm's slot in "pending" is kept in its seconds field, so that
+ * a popped alarm can go straight back in with a new deadline.
+ */
+static double bench_phases (long iters, const char *backend)
+{
+    queue_t *queue = queue_create (backend);
+    alarm_t **pending, *alarm;
+    time_t now = time (NULL);
+    double start, elapsed;
+    long i, depth = 5000, phase;
+    unsigned long id = 0;
+
+    pending = (alarm_t**)malloc (depth * sizeof (alarm_t*));
+    if (pending == NULL)
+        errno_abort ("Allocate pending");
+    for (i = 0; i < depth; i++) {
+        pending[i] = alarm_alloc ();
+        pending[i]->time = now + rng () % 600;
+        pending[i]->id = id++;
+        pending[i]->seconds = i;
+        queue_insert (queue, pending[i]);
+    }
+    start = bench_clock ();
+    for (i = 0; i < iters; i++) {
+        phase = i * 3 / iters;
+        if (phase == 2 && (rng () & 7) != 0) {
+            alarm = pending[rng () % depth];
+            queue_reschedule (queue, alarm, now + rng () % 600);
+            continue;
+        }
+        alarm = queue_pop (queue);
+        if (alarm->time > now)
+            now = alarm->time;
+        alarm->id = id++;
+        if (phase == 1)
+            alarm->time = now + 3600 + rng () % 360000;
+        else
+            alarm->time = now + rng () % 600;
+        queue_insert (queue, alarm);
+    }
+    elapsed = bench_clock () - start;
+    while (queue_pop (queue) != NULL)
+        ;
+    for (i = 0; i < depth; i++)
+        alarm_free (pending[i]);
+    free (pending);
+    queue_destroy (queue);
+    return elapsed;
+}
+
+static double bench_resched_mixed (long iters, const char *backend)
+{
+    return bench_resched (iters, backend, 0);
+}
+
+static double bench_resched_earlier (long iters, const char *backend)
+{
+    return bench_resched (iters, backend, 1);
+}
+
+/*
+ * Next deadline queries over 4096 buckets, from random starting
+ * buckets. A sparse schedule has 8 occupied buckets, and a dense
+ * one has half of them occupied. "bitmap" searches the wheel's
+ * occupancy bitmap; "scan" steps through the buckets.
+ */
+#define NEXT_QUERIES    1024
+
+static double bench_next_deadline (
+    long iters, const char *method, int occupied)
+{
+    static bitmap_t bitmap;
+    static char bucket[BITMAP_BITS];
+    unsigned from[NEXT_QUERIES];
+    double start;
+    long i, sum = 0;
+    int j, slot;
+
+    memset (&bitmap, 0, sizeof (bitmap));
+    memset (bucket, 0, sizeof (bucket));
+    for (j = 0; j < occupied; j++) {
+        slot = rng () % BITMAP_BITS;
+        bitmap_set (&bitmap, slot);
+        bucket[slot] = 1;
+    }
+    for (j = 0; j < NEXT_QUERIES; j++)
+        from[j] = rng () % BITMAP_BITS;
+
+    start = bench_clock ();
+    if (strcmp (method, "bitmap") == 0)
+        for (i = 0; i < iters; i++)
+            sum += bitmap_next_cyclic (&bitmap, from[i & (NEXT_QUERIES - 1)]);
+    else
+        for (i = 0; i < iters; i++) {
+            slot = from[i & (NEXT_QUERIES - 1)];
+            for (j = 0; j < BITMAP_BITS; j++)
+                if (bucket[(slot + j) & (BITMAP_BITS - 1)])
+                    break;
+            sum += (slot + j) & (BITMAP_BITS - 1);
+        }
+    bench_sink = sum;
+    return bench_clock () - start;
+}
+
+static double bench_next_sparse (long iters, const char *method)
+{
+    return bench_next_deadline (iters, method, 8);
+}
+
+static double bench_next_dense (long iters, const char *method)
+{
+    return bench_next_deadline (iters, method, BITMAP_BITS / 2);
+}
+
+/*
+ * One ticker scan over a table of 4096 countdowns, with deadlines
+ * spread over the next minute and ticks due every 2 seconds, so
+ * that a scan finds a few expired entries and about half due. The
+ * operation count is per table entry. "simd" is whatever kernel
+ * the CPU dispatch picks, which may also be the scalar one.
+ */
+#define TICKER_ENTRIES  4096
+
+static double bench_ticker_scan (long iters, const char *kernel)
+{
+    static long long deadline[TICKER_ENTRIES], next_tick[TICKER_ENTRIES];
+    static long long remaining[TICKER_ENTRIES];
+    static int expired[TICKER_ENTRIES], due[TICKER_ENTRIES];
+    ticker_kernel_t scan = ticker_scan_scalar;
+    long long now = time (NULL);
+    double start;
+    long i, sum = 0;
+    int j, nexpired, ndue;
+
+    if (strcmp (kernel, "simd") == 0)
+        scan = ticker_kernel (NULL);
+    for (j = 0; j < TICKER_ENTRIES; j++) {
+        deadline[j] = now + rng () % 60;
+        next_tick[j] = now + rng () % 2;
+    }
+    start = bench_clock ();
+    for (i = 0; i < iters; i += TICKER_ENTRIES) {
+        scan (deadline, next_tick, TICKER_ENTRIES, now, remaining,
+            expired, &nexpired, due, &ndue);
+        sum += nexpired + ndue;
+    }
+    bench_sink = sum;
+    return bench_clock () - start;
+}
+
+/*
+ * Data TLB misses, counted with perf_event_open for this thread in
+ * user space only. A benchmark that counts them sets bench_dtlb to
+ * misses per operation; it stays negative if counting isn't
+ * possible (no PMU, or perf_event_paranoid forbids it).
+ */
+static double bench_dtlb = -1;
+
+static int dtlb_open (void)
+{
+    struct perf_event_attr attr;
+    int fd;
+
+    memset (&attr, 0, sizeof (attr));
+    attr.size = sizeof (attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB
+        | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+        | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = syscall (SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd >= 0)
+        ioctl (fd, PERF_EVENT_IOC_RESET, 0);
+    return fd;
+}
+
+static long long dtlb_read (int fd)
+{
+    long long count;
+
+    if (read (fd, &count, sizeof (count)) != sizeof (count))
+        return -1;
+    return count;
+}
+
+/*
+ * Random walk over 512K alarm records (about 56MB, far more than
+ * the TLB covers with 4KB pages) allocated from a pool mapped with
+ * the given huge page mode. The records are linked into one random
+ * cycle through their link fields, and each operation follows one
+ * link, as a queue operation would touch a record it hasn't seen
+ * lately.
+ */
+#define CHASE_RECORDS   (512 * 1024)
+
+static double bench_pool_chase (long iters, const char *mode)
+{
+    pool_t pool;
+    alarm_t **record, *alarm;
+    double start, elapsed;
+    long i, j;
+    int fd, old_mode = pool_get_huge ();
+    long long misses = -1;
+
+    pool_set_huge (pool_huge_mode (mode));
+    pool_init (&pool, sizeof (alarm_t));
+    record = (alarm_t**)malloc (CHASE_RECORDS * sizeof (alarm_t*));
+    if (record == NULL)
+        errno_abort ("Allocate records");
+    for (i = 0; i < CHASE_RECORDS; i++)
+        record[i] = (alarm_t*)pool_get (&pool);
+    for (i = CHASE_RECORDS - 1; i > 0; i--) {
+        j = rng () % (i + 1);
+        alarm = record[i];
+        record[i] = record[j];
+        record[j] = alarm;
+    }
+    for (i = 0; i < CHASE_RECORDS; i++)
+        record[i]->link = record[(i + 1) % CHASE_RECORDS];
+
+    alarm = record[0];
+    fd = dtlb_open ();
+    if (fd >= 0)
+        ioctl (fd, PERF_EVENT_IOC_ENABLE, 0);
+    start = bench_clock ();
+    for (i = 0; i < iters; i++)
+        alarm = alarm->link;
+    elapsed = bench_clock () - start;
+    if (fd >= 0) {
+        ioctl (fd, PERF_EVENT_IOC_DISABLE, 0);
+        misses = dtlb_read (fd);
+        close (fd);
+    }
+    bench_dtlb = misses >= 0 ? (double)misses / iters : -1;
+    bench_sink = (long)alarm;
+
+    free (record);
+    pool_destroy (&pool);
+    pool_set_huge (old_mode);
+    return elapsed;
+}
+
+static bench_t benches[] = {
+    {"list_insert",     bench_list_insert,      20000},
+    {"queue_push_pop",  bench_queue_push_pop,   1000000},
+    {"handoff",         bench_handoff,          20000},
+    {"ingest/dgram",    bench_ingest,           200000, "dgram"},
+    {"ingest/dgram1",   bench_ingest,           200000, "dgram1"},
+    {"ingest/stream",   bench_ingest,           200000, "stream"},
+    {"ingest/stdin",    bench_ingest,           200000, "stdin"},
+    {"events/alone",    bench_events,           1000000, "alone"},
+    {"events/reader",   bench_events,           1000000, "reader"},
+    {"shard/0",         bench_shard,            200000, "0"},
+    {"shard/1",         bench_shard,            200000, "1"},
+    {"shard/2",         bench_shard,            200000, "2"},
+    {"shard/4",         bench_shard,            200000, "4"},
+    {"alloc",           bench_alloc,            1000000},
+    {"churn/pool",      bench_churn,            2000000, "pool"},
+    {"churn/region",    bench_churn,            2000000, "region"},
+    {"parse",           bench_parse,            200000},
+    {"format",          bench_format,           200000},
+    {"wal/none",        bench_wal_write,        200000, "none"},
+    {"wal/dict",        bench_wal_write,        200000, "dict"},
+    {"wal/lz",          bench_wal_write,        200000, "lz"},
+    {"wal/all",         bench_wal_write,        200000, "all"},
+    {"recover/none",    bench_wal_recover,      200000, "none"},
+    {"recover/all",     bench_wal_recover,      200000, "all"},
+    {"restart/wal",     bench_restart,          200000, "wal"},
+    {"restart/file",    bench_restart,          200000, "file"},
+    {"skew/static",     bench_skew,             200000, "static"},
+    {"skew/rebalance",  bench_skew,             200000, "rebalance"},
+    {"spread/0",        bench_spread,           1000000, "0"},
+    {"spread/60",       bench_spread,           1000000, "60"},
+    {"reorder/0",       bench_reorder,          1000000, "0"},
+    {"reorder/500",     bench_reorder,          1000000, "500"},
+    {"reorder/2000",    bench_reorder,          1000000, "2000"},
+    {"reorder/10000",   bench_reorder,          1000000, "10000"},
+    {"load/copy",       bench_load,             200000, "copy"},
+    {"load/mapped",     bench_load,             200000, "mapped"},
+    {"queue_1k/list",   bench_queue_1k,         20000,  "list"},
+    {"queue_1k/wheel",  bench_queue_1k,         200000, "wheel"},
+    {"queue_10k/list",  bench_queue_10k,        2000,   "list"},
+    {"queue_10k/wheel", bench_queue_10k,        200000, "wheel"},
+    {"queue_1k/pheap",  bench_queue_1k,         200000, "pheap"},
+    {"queue_10k/pheap", bench_queue_10k,        200000, "pheap"},
+    {"queue_10k/merge", bench_queue_10k,        200000, "merge"},
+    {"queue_10k/btree", bench_queue_10k,        200000, "btree"},
+    {"range/pheap",     bench_range,            200,    "pheap"},
+    {"range/wheel",     bench_range,            200,    "wheel"},
+    {"range/btree",     bench_range,            200,    "btree"},
+    {"purge/pheap",     bench_purge,            200,    "pheap"},
+    {"purge/btree",     bench_purge,            200,    "btree"},
+    {"preload/pheap",   bench_preload,          200000, "pheap"},
+    {"preload/wheel",   bench_preload,          200000, "wheel"},
+    {"preload/lsm",     bench_preload,          200000, "lsm"},
+    {"preload/btree",   bench_preload,          200000, "btree"},
+    {"merge/4/tree",    bench_merge,            200000, "4/tree"},
+    {"merge/4/scan",    bench_merge,            200000, "4/scan"},
+    {"merge/16/tree",   bench_merge,            200000, "16/tree"},
+    {"merge/16/scan",   bench_merge,            200000, "16/scan"},
+    {"merge/64/tree",   bench_merge,            200000, "64/tree"},
+    {"merge/64/scan",   bench_merge,            200000, "64/scan"},
+    {"merge/256/tree",  bench_merge,            200000, "256/tree"},
+    {"merge/256/scan",  bench_merge,            200000, "256/scan"},
+    {"resched/list",    bench_resched_mixed,    2000,   "list"},
+    {"resched/wheel",   bench_resched_mixed,    20000,  "wheel"},
+    {"resched/pheap",   bench_resched_mixed,    200000, "pheap"},
+    {"resched_earlier/list", bench_resched_earlier, 2000, "list"},
+    {"resched_earlier/wheel", bench_resched_earlier, 20000, "wheel"},
+    {"resched_earlier/pheap", bench_resched_earlier, 200000, "pheap"},
+    {"phases/list",     bench_phases,           3000,   "list"},
+    {"phases/wheel",    bench_phases,           30000,  "wheel"},
+    {"phases/pheap",    bench_phases,           300000, "pheap"},
+    {"phases/adaptive", bench_phases,           300000, "adaptive"},
+    {"next_sparse/bitmap", bench_next_sparse,   1000000, "bitmap"},
+    {"next_sparse/scan", bench_next_sparse,     10000,  "scan"},
+    {"next_dense/bitmap", bench_next_dense,     1000000, "bitmap"},
+    {"next_dense/scan", bench_next_dense,       1000000, "scan"},
+    {"ticker/scalar",   bench_ticker_scan,      4096000, "scalar"},
+    {"ticker/simd",     bench_ticker_scan,      4096000, "simd"},
+    {"chase/none",      bench_pool_chase,       2000000, "none"},
+    {"chase/thp",       bench_pool_chase,       2000000, "thp"},
+    {"chase/explicit",  bench_pool_chase,       2000000, "explicit"},
+};
+
+#define NBENCH (sizeof (benches) / sizeof (benches[0]))
+
+static int compare_double (const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Percentile of a sorted sample, by linear interpolation between
+ * the closest ranks.
+ */
+static double percentile (double *sorted, int n, double p)
+{
+    double rank = p / 100.0 * (n - 1);
+    int lo = (int)rank;
+
+    if (lo + 1 >= n)
+        return sorted[n - 1];
+    return sorted[lo] + (rank - lo) * (sorted[lo + 1] - sorted[lo]);
+}
+
+typedef struct summary_tag {
+    double              median, mad, p5, p95, p99, min, max;
+} summary_t;
+
+static void summarize (double *sample, int n, summary_t *s)
+{
+    double *dev;
+    int i;
+
+    qsort (sample, n, sizeof (double), compare_double);
+    s->median = percentile (sample, n, 50);
+    s->p5 = percentile (sample, n, 5);
+    s->p95 = percentile (sample, n, 95);
+    s->p99 = percentile (sample, n, 99);
+    s->min = sample[0];
+    s->max = sample[n - 1];
+    dev = (double*)malloc (n * sizeof (double));
+    if (dev == NULL)
+        errno_abort ("Allocate deviations");
+    for (i = 0; i < n; i++)
+        dev[i] = sample[i] > s->median ?
+            sample[i] - s->median : s->median - sample[i];
+    qsort (dev, n, sizeof (double), compare_double);
+    s->mad = percentile (dev, n, 50);
+    free (dev);
+}
+
+enum { OUT_TABLE, OUT_CSV, OUT_JSON };
+
+int main (int argc, char *argv[])
+{
+    int c, i, r;
+    int warmup = 3, reps = 15, format = OUT_TABLE, first = 1;
+    double scale = 1.0;
+    const char *filter = NULL, *tag = "";
+    double *sample, *dtlb;
+    long iters;
+    summary_t s, d;
+
+    while ((c = getopt (argc, argv, "w:r:s:f:t:cj")) != -1) {
+        switch (c) {
+        case 'w':
+            warmup = atoi (optarg);
+            break;
+        case 'r':
+            reps = atoi (optarg);
+            break;
+        case 's':
+            scale = atof (optarg);
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 't':
+            tag = optarg;
+            break;
+        case 'c':
+            format = OUT_CSV;
+            break;
+        case 'j':
+            format = OUT_JSON;
+            break;
+        default:
+            fprintf (stderr, "Usage: %s [-w warmup] [-r reps] [-s scale] "
+                "[-f name] [-t tag] [-c | -j]\n", argv[0]);
+            exit (1);
+        }
+    }
+    if (reps < 1)
+        reps = 1;
+    sample = (double*)malloc (reps * sizeof (double));
+    dtlb = (double*)malloc (reps * sizeof (double));
+    if (sample == NULL || dtlb == NULL)
+        errno_abort ("Allocate samples");
+
+    if (format == OUT_CSV)
+        printf ("tag,name,iters,reps,median_ns,mad_ns,p5_ns,p95_ns,"
+            "p99_ns,min_ns,max_ns,dtlb_miss_per_op\n");
+    else if (format == OUT_JSON)
+        printf ("{\"tag\": \"%s\", \"benchmarks\": [", tag);
+    else
+        printf ("%-20s %10s %10s %10s %10s %10s  (ns/op)  %s\n",
+            "benchmark", "median", "mad", "p5", "p95", "p99", "dTLB/op");
+
+    for (i = 0; i < NBENCH; i++) {
+        if (filter != NULL && strstr (benches[i].name, filter) == NULL)
+            continue;
+        iters = (long)(benches[i].iters * scale);
+        if (iters < 1)
+            iters = 1;
+        for (r = 0; r < warmup; r++)
+            benches[i].run (iters, benches[i].arg);
+        for (r = 0; r < reps; r++) {
+            bench_dtlb = -1;
+            sample[r] = benches[i].run (iters, benches[i].arg) / iters;
+            dtlb[r] = bench_dtlb;
+        }
+        summarize (sample, reps, &s);
+        summarize (dtlb, reps, &d);
+
+        /*
+         * The dTLB figure is the median over repetitions, and is
+         * left empty (or null) when it couldn't be counted.
+         */
+        if (format == OUT_CSV) {
+            printf ("%s,%s,%ld,%d,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,",
+                tag, benches[i].name, iters, reps, s.median, s.mad,
+                s.p5, s.p95, s.p99, s.min, s.max);
+            if (d.median >= 0)
+                printf ("%.4f", d.median);
+            printf ("\n");
+        } else if (format == OUT_JSON) {
+            printf ("%s\n  {\"name\": \"%s\", \"iters\": %ld, \"reps\": %d, "
+                "\"median_ns\": %.2f, \"mad_ns\": %.2f, \"p5_ns\": %.2f, "
+                "\"p95_ns\": %.2f, \"p99_ns\": %.2f, \"min_ns\": %.2f, "
+                "\"max_ns\": %.2f, ", first ? "" : ",", benches[i].name,
+                iters, reps, s.median, s.mad, s.p5, s.p95, s.p99,
+                s.min, s.max);
+            if (d.median >= 0)
+                printf ("\"dtlb_miss_per_op\": %.4f}", d.median);
+            else
+                printf ("\"dtlb_miss_per_op\": null}");
+        } else {
+            printf ("%-20s %10.1f %10.1f %10.1f %10.1f %10.1f",
+                benches[i].name, s.median, s.mad, s.p5, s.p95, s.p99);
+            if (d.median >= 0)
+                printf ("  %15.4f", d.median);
+            printf ("\n");
+        }
+        fflush (stdout);
+        first = 0;
+    }
+    if (format == OUT_JSON)
+        printf ("\n]}\n");
+    free (sample);
+    free (dtlb);
+    return 0;
+}
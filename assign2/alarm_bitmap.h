@@ -0,0 +1,73 @@
+/*
+ * alarm_bitmap.h
+ *
+ * A two level occupancy bitmap over 4096 buckets. Each bit of the
+ * 64 words says whether a bucket is occupied, and each bit of the
+ * summary word says whether the corresponding word has any bit set.
+ * Finding the next occupied bucket is then at most two count
+ * trailing zeros operations, however sparse the buckets are,
+ * rather than a scan over all of them.
+ */
+#ifndef __alarm_bitmap_h
+#define __alarm_bitmap_h
+
+#define BITMAP_BITS     4096
+
+typedef struct bitmap_tag {
+    unsigned long long  summary;        /* bit w set if word[w] != 0 */
+    unsigned long long  word[BITMAP_BITS / 64];
+} bitmap_t;
+
+static inline void bitmap_set (bitmap_t *b, unsigned bit)
+{
+    b->word[bit >> 6] |= 1ULL << (bit & 63);
+    b->summary |= 1ULL << (bit >> 6);
+}
+
+static inline void bitmap_clear (bitmap_t *b, unsigned bit)
+{
+    b->word[bit >> 6] &= ~(1ULL << (bit & 63));
+    if (b->word[bit >> 6] == 0)
+        b->summary &= ~(1ULL << (bit >> 6));
+}
+
+static inline int bitmap_test (const bitmap_t *b, unsigned bit)
+{
+    return (b->word[bit >> 6] >> (bit & 63)) & 1;
+}
+
+/*
+ * Return the first set bit at or after "from", or -1 if there is
+ * none.
+ */
+static inline int bitmap_next (const bitmap_t *b, unsigned from)
+{
+    unsigned w = from >> 6;
+    unsigned long long bits;
+
+    bits = b->word[w] & (~0ULL << (from & 63));
+    if (bits != 0)
+        return (w << 6) + __builtin_ctzll (bits);
+    if (w == BITMAP_BITS / 64 - 1)
+        return -1;
+    bits = b->summary & (~0ULL << (w + 1));
+    if (bits == 0)
+        return -1;
+    w = __builtin_ctzll (bits);
+    return (w << 6) + __builtin_ctzll (b->word[w]);
+}
+
+/*
+ * As bitmap_next, but wrapping around to bit 0, for buckets used
+ * as a ring.
+ */
+static inline int bitmap_next_cyclic (const bitmap_t *b, unsigned from)
+{
+    int bit = bitmap_next (b, from);
+
+    if (bit < 0 && from != 0)
+        bit = bitmap_next (b, 0);
+    return bit;
+}
+
+#endif
@@ -0,0 +1,636 @@
+/*
+ * alarm_btree.c
+ *
+ * The B+tree backend. Alarms are kept in leaves keyed by expiration
+ * time and id, with the keys stored in the node next to the alarm
+ * pointers, so that a search or a scan reads keys a cache line at a
+ * time instead of following a pointer per alarm. Every node is
+ * BTREE_NODE bytes (four cache lines), aligned on a cache line.
+ * The leaves are linked in key order, so a range scan finds its
+ * first leaf once and then walks the chain.
+ *
+ * An inner node with n children holds n - 1 separators: child i
+ * holds keys k with key[i - 1] <= k < key[i]. A full node splits
+ * in half on insert. Nodes are not merged when they underflow;
+ * a leaf that empties is freed and its separator taken out of its
+ * parent (and so on up, for a parent left with no children), and
+ * the root shrinks while it has a single child. Removing keys never
+ * makes a separator wrong, so the tree stays searchable, and the
+ * common deletions (pop from the front, bulk deletes of a range)
+ * empty whole leaves anyway.
+ *
+ * Pop-min takes the first entry of the first leaf. A sorted batch
+ * given to queue_load on an empty tree is built bottom up, with
+ * full leaves, instead of being inserted one by one.
+ */
+#include "errors.h"
+#include "alarm.h"
+#include "alarm_queue.h"
+
+#define BTREE_NODE      256     /* bytes: four cache lines */
+#define BTREE_DEPTH     16      /* enough for any number of alarms */
+
+typedef struct btree_key_tag {
+    time_t              time;
+    unsigned long       id;
+} btree_key_t;
+
+typedef struct btree_node_tag {
+    int                 count;  /* entries (leaf) or children (inner) */
+    int                 leaf;
+} btree_node_t;
+
+/*
+ * Entries per leaf (9 on LP64), after its header and leaf links, and
+ * separators per inner node (10), with one more child than that.
+ */
+#define LEAF_KEYS \
+    ((BTREE_NODE - sizeof (btree_node_t) - 2 * sizeof (void*)) \
+        / (sizeof (btree_key_t) + sizeof (alarm_t*)))
+#define INNER_KEYS \
+    ((BTREE_NODE - sizeof (btree_node_t) - sizeof (void*)) \
+        / (sizeof (btree_key_t) + sizeof (void*)))
+
+typedef struct btree_leaf_tag {
+    btree_node_t        node;
+    struct btree_leaf_tag *next;
+    struct btree_leaf_tag *prev;
+    btree_key_t         key[LEAF_KEYS];
+    alarm_t             *alarm[LEAF_KEYS];
+} btree_leaf_t;
+
+typedef struct btree_inner_tag {
+    btree_node_t        node;
+    btree_key_t         key[INNER_KEYS];
+    btree_node_t        *child[INNER_KEYS + 1];
+} btree_inner_t;
+
+/*
+ * The way down to a leaf: the inner node and the child taken at each
+ * level, and the entry in the leaf.
+ */
+typedef struct btree_path_tag {
+    int                 depth;
+    btree_inner_t       *node[BTREE_DEPTH];
+    int                 index[BTREE_DEPTH];
+    btree_leaf_t        *leaf;
+    int                 pos;
+} btree_path_t;
+
+typedef struct btree_queue_tag {
+    queue_t             queue;
+    btree_node_t        *root;
+    btree_leaf_t        *head;          /* first leaf */
+    void                *spare;         /* freed nodes, for reuse */
+    unsigned long       nodes;          /* allocated, spares included */
+} btree_queue_t;
+
+#define key_before(a, b) \
+    ((a)->time < (b)->time || ((a)->time == (b)->time && (a)->id < (b)->id))
+
+static btree_node_t *node_alloc (btree_queue_t *bq, int leaf)
+{
+    btree_node_t *node;
+    int status;
+
+    if (bq->spare != NULL) {
+        node = (btree_node_t*)bq->spare;
+        bq->spare = *(void**)node;
+    } else {
+        status = posix_memalign ((void**)&node, 64, BTREE_NODE);
+        if (status != 0)
+            err_abort (status, "Allocate B+tree node");
+        bq->nodes++;
+    }
+    memset (node, 0, BTREE_NODE);
+    node->leaf = leaf;
+    return node;
+}
+
+static void node_free (btree_queue_t *bq, btree_node_t *node)
+{
+    *(void**)node = bq->spare;
+    bq->spare = node;
+}
+
+static queue_t *btree_create (void)
+{
+    btree_queue_t *bq;
+
+    bq = (btree_queue_t*)malloc (sizeof (btree_queue_t));
+    if (bq == NULL)
+        errno_abort ("Allocate B+tree");
+    bq->queue.ops = &btree_queue_ops;
+    bq->queue.count = 0;
+    bq->queue.index = NULL;
+    bq->spare = NULL;
+    bq->nodes = 0;
+    bq->root = node_alloc (bq, 1);
+    bq->head = (btree_leaf_t*)bq->root;
+    return &bq->queue;
+}
+
+static void btree_free (btree_node_t *node)
+{
+    btree_inner_t *inner = (btree_inner_t*)node;
+    int i;
+
+    if (!node->leaf)
+        for (i = 0; i < node->count; i++)
+            btree_free (inner->child[i]);
+    free (node);
+}
+
+static void btree_destroy (queue_t *queue)
+{
+    btree_queue_t *bq = (btree_queue_t*)queue;
+    void *node, *next;
+
+    btree_free (bq->root);
+    for (node = bq->spare; node != NULL; node = next) {
+        next = *(void**)node;
+        free (node);
+    }
+    free (bq);
+}
+
+/*
+ * Descend to the leaf where "key" belongs, recording the path. pos
+ * is the first entry of the leaf not before the key, which may be
+ * past its last entry.
+ */
+static void btree_descend (btree_queue_t *bq, const btree_key_t *key,
+    btree_path_t *path)
+{
+    btree_node_t *node = bq->root;
+    btree_inner_t *inner;
+    btree_leaf_t *leaf;
+    int i;
+
+    path->depth = 0;
+    while (!node->leaf) {
+        inner = (btree_inner_t*)node;
+        for (i = 0; i < node->count - 1 && !key_before (key, &inner->key[i]);
+                i++)
+            ;
+        path->node[path->depth] = inner;
+        path->index[path->depth++] = i;
+        node = inner->child[i];
+    }
+    leaf = (btree_leaf_t*)node;
+    for (i = 0; i < node->count && key_before (&leaf->key[i], key); i++)
+        ;
+    path->leaf = leaf;
+    path->pos = i;
+}
+
+/*
+ * Move the path to the first entry of the next leaf. Returns 0 if
+ * there is none.
+ */
+static int btree_advance (btree_path_t *path)
+{
+    btree_node_t *node;
+    int level;
+
+    for (level = path->depth - 1; level >= 0; level--)
+        if (path->index[level] + 1 < path->node[level]->node.count)
+            break;
+    if (level < 0)
+        return 0;
+    node = path->node[level]->child[++path->index[level]];
+    for (level++; !node->leaf; level++) {
+        path->node[level] = (btree_inner_t*)node;
+        path->index[level] = 0;
+        node = ((btree_inner_t*)node)->child[0];
+    }
+    path->leaf = (btree_leaf_t*)node;
+    path->pos = 0;
+    return 1;
+}
+
+/*
+ * Find the first entry not before "key", moving on to the next leaf
+ * if the key's own leaf has nothing after it. Returns 0 if there is
+ * no such entry.
+ */
+static int btree_seek (btree_queue_t *bq, const btree_key_t *key,
+    btree_path_t *path)
+{
+    btree_descend (bq, key, path);
+    while (path->pos == path->leaf->node.count)
+        if (!btree_advance (path))
+            return 0;
+    return 1;
+}
+
+/*
+ * Insert a separator and the child to its right into the inner node
+ * at "level" of the path, after the child the path went through.
+ * A full node is split, and the middle separator goes up a level;
+ * a full root gets a new root above it.
+ */
+static void btree_insert_child (btree_queue_t *bq, btree_path_t *path,
+    int level, btree_key_t key, btree_node_t *child)
+{
+    btree_key_t keys[INNER_KEYS + 1];
+    btree_node_t *children[INNER_KEYS + 2];
+    btree_inner_t *inner, *right, *root;
+    int pos, n, half;
+
+    if (level < 0) {
+        root = (btree_inner_t*)node_alloc (bq, 0);
+        root->node.count = 2;
+        root->child[0] = bq->root;
+        root->child[1] = child;
+        root->key[0] = key;
+        bq->root = &root->node;
+        return;
+    }
+    inner = path->node[level];
+    pos = path->index[level];
+    n = inner->node.count;
+    if (n < INNER_KEYS + 1) {
+        memmove (&inner->key[pos + 1], &inner->key[pos],
+            (n - 1 - pos) * sizeof (btree_key_t));
+        memmove (&inner->child[pos + 2], &inner->child[pos + 1],
+            (n - 1 - pos) * sizeof (btree_node_t*));
+        inner->key[pos] = key;
+        inner->child[pos + 1] = child;
+        inner->node.count++;
+        return;
+    }
+    memcpy (keys, inner->key, pos * sizeof (btree_key_t));
+    keys[pos] = key;
+    memcpy (&keys[pos + 1], &inner->key[pos],
+        (n - 1 - pos) * sizeof (btree_key_t));
+    memcpy (children, inner->child, (pos + 1) * sizeof (btree_node_t*));
+    children[pos + 1] = child;
+    memcpy (&children[pos + 2], &inner->child[pos + 1],
+        (n - 1 - pos) * sizeof (btree_node_t*));
+    n++;
+    half = n / 2;
+    right = (btree_inner_t*)node_alloc (bq, 0);
+    inner->node.count = half;
+    memcpy (inner->key, keys, (half - 1) * sizeof (btree_key_t));
+    memcpy (inner->child, children, half * sizeof (btree_node_t*));
+    right->node.count = n - half;
+    memcpy (right->key, &keys[half], (n - half - 1) * sizeof (btree_key_t));
+    memcpy (right->child, &children[half],
+        (n - half) * sizeof (btree_node_t*));
+    btree_insert_child (bq, path, level - 1, keys[half - 1], &right->node);
+}
+
+static void btree_insert (queue_t *queue, alarm_t *alarm)
+{
+    btree_queue_t *bq = (btree_queue_t*)queue;
+    btree_key_t key;
+    btree_path_t path;
+    btree_leaf_t *leaf, *right;
+    int pos, half;
+
+    key.time = alarm->time;
+    key.id = alarm->id;
+    btree_descend (bq, &key, &path);
+    leaf = path.leaf;
+    pos = path.pos;
+    if (leaf->node.count == LEAF_KEYS) {
+        right = (btree_leaf_t*)node_alloc (bq, 1);
+        half = LEAF_KEYS / 2;
+        right->node.count = LEAF_KEYS - half;
+        memcpy (right->key, &leaf->key[half],
+            right->node.count * sizeof (btree_key_t));
+        memcpy (right->alarm, &leaf->alarm[half],
+            right->node.count * sizeof (alarm_t*));
+        leaf->node.count = half;
+        right->next = leaf->next;
+        right->prev = leaf;
+        if (leaf->next != NULL)
+            leaf->next->prev = right;
+        leaf->next = right;
+        btree_insert_child (bq, &path, path.depth - 1,
+            right->key[0], &right->node);
+        if (pos > half) {
+            leaf = right;
+            pos -= half;
+        }
+    }
+    memmove (&leaf->key[pos + 1], &leaf->key[pos],
+        (leaf->node.count - pos) * sizeof (btree_key_t));
+    memmove (&leaf->alarm[pos + 1], &leaf->alarm[pos],
+        (leaf->node.count - pos) * sizeof (alarm_t*));
+    leaf->key[pos] = key;
+    leaf->alarm[pos] = alarm;
+    leaf->node.count++;
+    queue->count++;
+}
+
+static void btree_insert_batch (queue_t *queue, alarm_t *batch)
+{
+    alarm_t *next;
+
+    while (batch != NULL) {
+        next = batch->link;
+        btree_insert (queue, batch);
+        batch = next;
+    }
+}
+
+/*
+ * Take the empty leaf at the end of the path out of the tree, and
+ * any inner node that leaves childless. The path is no good after.
+ */
+static void btree_unlink_leaf (btree_queue_t *bq, btree_path_t *path)
+{
+    btree_leaf_t *leaf = path->leaf;
+    btree_inner_t *inner;
+    int level, i, n;
+
+    if (path->depth == 0)
+        return;                         /* the root stays, empty */
+    if (leaf->prev != NULL)
+        leaf->prev->next = leaf->next;
+    else
+        bq->head = leaf->next;
+    if (leaf->next != NULL)
+        leaf->next->prev = leaf->prev;
+    node_free (bq, &leaf->node);
+    for (level = path->depth - 1; level >= 0; level--) {
+        inner = path->node[level];
+        i = path->index[level];
+        n = --inner->node.count;
+        if (n > 0) {
+            /*
+             * Child i's keys fall to child i - 1, or, for the first
+             * child, to the one after it.
+             */
+            memmove (&inner->child[i], &inner->child[i + 1],
+                (n - i) * sizeof (btree_node_t*));
+            if (i > 0)
+                memmove (&inner->key[i - 1], &inner->key[i],
+                    (n - i) * sizeof (btree_key_t));
+            else
+                memmove (&inner->key[0], &inner->key[1],
+                    (n - 1) * sizeof (btree_key_t));
+            break;
+        }
+        if (level == 0) {
+            /*
+             * The root lost its last child: the tree is empty.
+             */
+            node_free (bq, &inner->node);
+            bq->root = node_alloc (bq, 1);
+            bq->head = (btree_leaf_t*)bq->root;
+            return;
+        }
+        node_free (bq, &inner->node);
+    }
+    while (!bq->root->leaf && bq->root->count == 1) {
+        inner = (btree_inner_t*)bq->root;
+        bq->root = inner->child[0];
+        node_free (bq, &inner->node);
+    }
+}
+
+/*
+ * Remove "n" entries from the leaf at the end of the path, starting
+ * at its pos, and the leaf itself if that empties it.
+ */
+static void btree_delete (btree_queue_t *bq, btree_path_t *path, int n)
+{
+    btree_leaf_t *leaf = path->leaf;
+    int rest = leaf->node.count - path->pos - n;
+
+    memmove (&leaf->key[path->pos], &leaf->key[path->pos + n],
+        rest * sizeof (btree_key_t));
+    memmove (&leaf->alarm[path->pos], &leaf->alarm[path->pos + n],
+        rest * sizeof (alarm_t*));
+    leaf->node.count -= n;
+    bq->queue.count -= n;
+    if (leaf->node.count == 0)
+        btree_unlink_leaf (bq, path);
+}
+
+static alarm_t *btree_peek (queue_t *queue)
+{
+    btree_leaf_t *head = ((btree_queue_t*)queue)->head;
+
+    return head->node.count > 0 ? head->alarm[0] : NULL;
+}
+
+static alarm_t *btree_pop (queue_t *queue)
+{
+    btree_queue_t *bq = (btree_queue_t*)queue;
+    btree_path_t path;
+    btree_node_t *node;
+    alarm_t *alarm;
+
+    if (bq->head->node.count == 0)
+        return NULL;
+    alarm = bq->head->alarm[0];
+    if (bq->head->node.count > 1) {
+        path.leaf = bq->head;
+        path.pos = 0;
+        path.depth = 0;
+        btree_delete (bq, &path, 1);
+        return alarm;
+    }
+    /*
+     * The last entry of the first leaf: the leaf goes, so build its
+     * path, which is the leftmost one.
+     */
+    path.depth = 0;
+    for (node = bq->root; !node->leaf;
+            node = ((btree_inner_t*)node)->child[0]) {
+        path.node[path.depth] = (btree_inner_t*)node;
+        path.index[path.depth++] = 0;
+    }
+    path.leaf = (btree_leaf_t*)node;
+    path.pos = 0;
+    btree_delete (bq, &path, 1);
+    return alarm;
+}
+
+/*
+ * Find a pending alarm's entry by its key. Keys are unique, but look
+ * for the alarm itself among equal keys all the same.
+ */
+static void btree_remove (queue_t *queue, alarm_t *alarm)
+{
+    btree_queue_t *bq = (btree_queue_t*)queue;
+    btree_key_t key;
+    btree_path_t path;
+
+    key.time = alarm->time;
+    key.id = alarm->id;
+    if (!btree_seek (bq, &key, &path))
+        return;
+    while (path.leaf->alarm[path.pos] != alarm) {
+        if (key_before (&key, &path.leaf->key[path.pos]))
+            return;
+        if (++path.pos == path.leaf->node.count && !btree_advance (&path))
+            return;
+    }
+    btree_delete (bq, &path, 1);
+}
+
+static void btree_reschedule (queue_t *queue, alarm_t *alarm, time_t time)
+{
+    btree_remove (queue, alarm);
+    alarm->time = time;
+    btree_insert (queue, alarm);
+}
+
+/*
+ * Call "func" for each alarm due from "from" to "to", in order,
+ * walking the linked leaves from the first one found.
+ */
+static long btree_range (queue_t *queue, time_t from, time_t to,
+    void (*func) (alarm_t *alarm, void *arg), void *arg)
+{
+    btree_queue_t *bq = (btree_queue_t*)queue;
+    btree_key_t key;
+    btree_path_t path;
+    btree_leaf_t *leaf;
+    long n = 0;
+    int i;
+
+    key.time = from;
+    key.id = 0;
+    if (!btree_seek (bq, &key, &path))
+        return 0;
+    for (leaf = path.leaf, i = path.pos; leaf != NULL;
+            leaf = leaf->next, i = 0)
+        for (; i < leaf->node.count; i++) {
+            if (leaf->key[i].time > to)
+                return n;
+            func (leaf->alarm[i], arg);
+            n++;
+        }
+    return n;
+}
+
+/*
+ * Remove every alarm due from "from" to "to". The range's entries
+ * are contiguous in each leaf, so they go a leaf at a time, and a
+ * leaf holding nothing else is freed whole. "func" is called for
+ * each alarm once it is out of the tree.
+ */
+static long btree_remove_range (queue_t *queue, time_t from, time_t to,
+    void (*func) (alarm_t *alarm, void *arg), void *arg)
+{
+    btree_queue_t *bq = (btree_queue_t*)queue;
+    alarm_t *removed[LEAF_KEYS];
+    btree_key_t key;
+    btree_path_t path;
+    btree_leaf_t *leaf;
+    long total = 0;
+    int i, n, more;
+
+    key.time = from;
+    key.id = 0;
+    while (btree_seek (bq, &key, &path)) {
+        leaf = path.leaf;
+        for (n = 0; path.pos + n < leaf->node.count
+                && leaf->key[path.pos + n].time <= to; n++)
+            removed[n] = leaf->alarm[path.pos + n];
+        if (n == 0)
+            break;
+        more = path.pos + n == leaf->node.count;
+        btree_delete (bq, &path, n);
+        for (i = 0; i < n; i++)
+            func (removed[i], arg);
+        total += n;
+        if (!more)
+            break;
+    }
+    return total;
+}
+
+/*
+ * Build the tree bottom up from a sorted batch, if the tree is empty:
+ * full leaves, then each level of inner nodes over the one below,
+ * until a level has a single node.
+ */
+static void btree_load (queue_t *queue, alarm_t **alarms, long n)
+{
+    btree_queue_t *bq = (btree_queue_t*)queue;
+    btree_node_t **level, *node;
+    btree_key_t *low;
+    btree_leaf_t *leaf, *prev = NULL;
+    btree_inner_t *inner;
+    long i, j, nodes, up;
+    int k;
+
+    if (queue->count > 0 || n <= LEAF_KEYS) {
+        for (i = 0; i < n; i++)
+            btree_insert (queue, alarms[i]);
+        return;
+    }
+    nodes = (n + LEAF_KEYS - 1) / LEAF_KEYS;
+    level = (btree_node_t**)malloc (nodes * sizeof (btree_node_t*));
+    low = (btree_key_t*)malloc (nodes * sizeof (btree_key_t));
+    if (level == NULL || low == NULL)
+        errno_abort ("Allocate B+tree load");
+    node_free (bq, bq->root);
+    for (i = j = 0; i < n; j++) {
+        leaf = (btree_leaf_t*)node_alloc (bq, 1);
+        for (k = 0; k < LEAF_KEYS && i < n; k++, i++) {
+            leaf->key[k].time = alarms[i]->time;
+            leaf->key[k].id = alarms[i]->id;
+            leaf->alarm[k] = alarms[i];
+        }
+        leaf->node.count = k;
+        leaf->prev = prev;
+        if (prev != NULL)
+            prev->next = leaf;
+        else
+            bq->head = leaf;
+        prev = leaf;
+        level[j] = &leaf->node;
+        low[j] = leaf->key[0];
+    }
+    while (nodes > 1) {
+        for (i = up = 0; i < nodes; up++) {
+            inner = (btree_inner_t*)node_alloc (bq, 0);
+            for (k = 0; k <= INNER_KEYS && i < nodes; k++, i++) {
+                inner->child[k] = level[i];
+                if (k > 0)
+                    inner->key[k - 1] = low[i];
+            }
+            inner->node.count = k;
+            node = &inner->node;
+            low[up] = low[i - k];
+            level[up] = node;
+        }
+        nodes = up;
+    }
+    bq->root = level[0];
+    queue->count = n;
+    free (level);
+    free (low);
+}
+
+static size_t btree_bytes (queue_t *queue)
+{
+    btree_queue_t *bq = (btree_queue_t*)queue;
+
+    return sizeof (btree_queue_t) + bq->nodes * BTREE_NODE;
+}
+
+const queue_ops_t btree_queue_ops = {
+    "btree",
+    btree_create,
+    btree_destroy,
+    btree_insert,
+    btree_insert_batch,
+    btree_peek,
+    btree_pop,
+    btree_remove,
+    btree_reschedule,
+    btree_load,
+    btree_range,
+    btree_remove_range,
+    NULL,
+    btree_bytes,
+};
@@ -0,0 +1,239 @@
+/*
+ * alarm_chain.c
+ *
+ * Parsing and arming of alarm chains. See alarm_chain.h for the
+ * request syntax. Everything here, apart from chain_parse, is
+ * called with alarm_mutex locked.
+ */
+#include <pthread.h>
+#include "errors.h"
+#include "alarm.h"
+#include "alarm_queue.h"
+#include "alarm_chain.h"
+#include "alarm_stats.h"
+#include "alarm_wal.h"
+#include "alarm_limits.h"
+#include "alarm_output.h"
+
+/*
+ * Parse one step, "seconds message", whose text runs from "start"
+ * up to (not including) "end". Returns the message length, or -1
+ * if the step is not a valid request.
+ */
+static int parse_step (
+    const char *start, const char *end, int *seconds, char *message)
+{
+    char step[128];
+    size_t len;
+
+    while (end > start && (end[-1] == ' ' || end[-1] == '\t'
+            || end[-1] == '\n'))
+        end--;
+    len = end - start;
+    if (len >= sizeof (step))
+        return -1;
+    memcpy (step, start, len);
+    step[len] = '\0';
+    if (sscanf (step, "%d %63[^\n]", seconds, message) < 2)
+        return -1;
+    return strlen (message);
+}
+
+/*
+ * Find the end of the step that starts at "p": the next stage or
+ * step separator, or the end of the line. Sets *stage_end if the
+ * step is the last of its stage.
+ */
+static const char *step_end (const char *p, int *stage_end)
+{
+    const char *stage = strstr (p, CHAIN_STAGE_SEP);
+    const char *step = strstr (p, CHAIN_STEP_SEP);
+
+    if (step != NULL && (stage == NULL || step < stage)) {
+        *stage_end = 0;
+        return step;
+    }
+    *stage_end = 1;
+    return stage != NULL ? stage : p + strlen (p);
+}
+
+/*
+ * Validate a chain request line, and size the chain it declares:
+ * the number of steps, and the bytes of their messages. Returns 0,
+ * or -1 if any step is not a valid request.
+ */
+static int chain_measure (const char *line, int *nsteps, size_t *text)
+{
+    const char *p, *end;
+    char message[64];
+    int seconds, len, stage_end;
+
+    *nsteps = 0;
+    *text = 0;
+    for (p = line; ; p = end + 2) {
+        end = step_end (p, &stage_end);
+        len = parse_step (p, end, &seconds, message);
+        if (len < 0)
+            return -1;
+        (*nsteps)++;
+        *text += len + 1;
+        if (*end == '\0')
+            return 0;
+    }
+}
+
+/*
+ * Is the request line a chain, rather than a single alarm? It is
+ * only if it has a separator, and every step around the separators
+ * is "<seconds> <message>"; otherwise the separators are taken to be
+ * part of a plain alarm's message ("5 build && test").
+ */
+int chain_is_chain (const char *line)
+{
+    int nsteps;
+    size_t text;
+
+    if (strstr (line, CHAIN_STAGE_SEP) == NULL
+            && strstr (line, CHAIN_STEP_SEP) == NULL)
+        return 0;
+    return chain_measure (line, &nsteps, &text) == 0;
+}
+
+/*
+ * Parse a chain request line. The line is walked twice: once to
+ * validate it and size the chain, and once to fill it in, so that
+ * the chain is a single allocation. Returns NULL if any step is
+ * not a valid request.
+ */
+chain_t *chain_parse (const char *line)
+{
+    const char *p, *end;
+    char message[64];
+    int seconds, len, nsteps, stage, stage_end, i;
+    size_t text;
+    chain_t *chain;
+
+    if (chain_measure (line, &nsteps, &text) != 0)
+        return NULL;
+
+    chain = (chain_t*)malloc (
+        sizeof (chain_t) + nsteps * sizeof (chain_step_t) + text);
+    if (chain == NULL)
+        errno_abort ("Allocate chain");
+    chain->nsteps = nsteps;
+    chain->stage = 0;
+    chain->outstanding = 0;
+    chain->abandoned = 0;
+    chain->next_step = 0;
+    chain->steps = (chain_step_t*)(chain + 1);
+    chain->text = (char*)(chain->steps + nsteps);
+
+    text = 0;
+    stage = 0;
+    for (p = line, i = 0; i < nsteps; p = end + 2, i++) {
+        end = step_end (p, &stage_end);
+        len = parse_step (p, end, &seconds, message);
+        chain->steps[i].seconds = seconds;
+        chain->steps[i].stage = stage;
+        chain->steps[i].text = text;
+        memcpy (chain->text + text, message, len + 1);
+        text += len + 1;
+        if (stage_end)
+            stage++;
+    }
+    return chain;
+}
+
+/*
+ * Arm the next stage of the chain: create an alarm for each of its
+ * steps, due "seconds" after now, and insert them into the queue as
+ * one sorted batch. A step that would take the queue past the
+ * memory limit (alarm_budget), or that finds the queue file full,
+ * is refused, and the stages after it are abandoned; if the whole
+ * stage is refused, the chain is freed.
+ * Returns the number of alarms armed.
+ */
+int chain_arm (chain_t *chain, time_t now, queue_t *queue)
+{
+    alarm_t *batch = NULL, *alarm;
+    chain_step_t *step;
+    int count = 0;
+
+    chain->stage = chain->steps[chain->next_step].stage;
+    while (chain->next_step < chain->nsteps) {
+        step = &chain->steps[chain->next_step];
+        if (step->stage != chain->stage)
+            break;
+        if (alarm_budget > 0
+                && queue_count (queue) + count >= alarm_budget) {
+            output_printf ("Chain Refused Alarm Request at %d: %d %s, "
+                "Memory Limit Reached\n", now, step->seconds,
+                chain->text + step->text);
+            chain->abandoned = 1;
+            chain->next_step++;
+            continue;
+        }
+        alarm = alarm_alloc_due (now + step->seconds);
+        if (!alarm_queueable (alarm)) {
+            output_printf ("Chain Refused Alarm Request at %d: %d %s, "
+                "Queue File Full\n", now, step->seconds,
+                chain->text + step->text);
+            alarm_free (alarm);
+            chain->abandoned = 1;
+            chain->next_step++;
+            continue;
+        }
+        alarm->seconds = step->seconds;
+        strcpy (alarm->message, chain->text + step->text);
+        alarm->time = now + step->seconds;
+        alarm->id = stats_ingest (alarm->time);
+        alarm->chain = chain;
+        if (alarm_wal != NULL)
+            wal_ingest (alarm_wal, alarm);
+        output_printf ("Chain Armed Alarm Request at %d: %d %s\n",
+            now, alarm->seconds, alarm->message);
+        alarm_insert (&batch, alarm);
+        chain->next_step++;
+        count++;
+    }
+    chain->outstanding = count;
+    if (count == 0) {
+        free (chain);
+        return 0;
+    }
+    queue_insert_batch (queue, batch);
+    return count;
+}
+
+/*
+ * An alarm belonging to a chain has fired. Once every alarm of its
+ * stage has fired, arm the next stage, or release the chain if that
+ * was the last. Returns the number of alarms armed.
+ */
+int chain_fired (alarm_t *alarm, time_t now, queue_t *queue)
+{
+    chain_t *chain = alarm->chain;
+
+    alarm->chain = NULL;
+    if (--chain->outstanding > 0)
+        return 0;
+    if (chain->abandoned || chain->next_step >= chain->nsteps) {
+        free (chain);
+        return 0;
+    }
+    return chain_arm (chain, now, queue);
+}
+
+/*
+ * An alarm belonging to a chain will never fire, so the stages after
+ * it are not armed.
+ */
+void chain_abandon (alarm_t *alarm)
+{
+    chain_t *chain = alarm->chain;
+
+    alarm->chain = NULL;
+    chain->abandoned = 1;
+    if (--chain->outstanding == 0)
+        free (chain);
+}
@@ -0,0 +1,54 @@
+/*
+ * alarm_chain.h
+ *
+ * Alarm chains. A request line may declare alarms that follow on
+ * from each other, so that the client doesn't have to watch the
+ * output and resubmit each step:
+ *
+ *      alarm> 2 Build => 30 Deploy && 10 Notify => 5 Done
+ *
+ * Steps are grouped into stages separated by "=>", and the steps of
+ * one stage are separated by "&&". The first stage is armed when the
+ * line is read. Each later stage is armed once every alarm of the
+ * stage before it has fired, and its alarms count their seconds from
+ * that moment. If an alarm of a stage is shed or dropped, the rest
+ * of its chain is abandoned. A line with a separator is only a chain
+ * if every step is "<seconds> <message>"; any other is a plain
+ * alarm, separators and all ("5 build && test").
+ *
+ * The whole chain is parsed once, and stored in a single allocation:
+ * a header, an array of steps, and the text of their messages.
+ */
+#ifndef __alarm_chain_h
+#define __alarm_chain_h
+
+#include <time.h>
+#include "alarm.h"
+#include "alarm_queue.h"
+
+#define CHAIN_STAGE_SEP "=>"
+#define CHAIN_STEP_SEP  "&&"
+
+typedef struct chain_step_tag {
+    int                 seconds;
+    unsigned short      stage;
+    unsigned short      text;   /* offset of message in chain text */
+} chain_step_t;
+
+typedef struct chain_tag {
+    int                 nsteps;
+    int                 stage;          /* stage now armed */
+    int                 outstanding;    /* its alarms still pending */
+    int                 abandoned;
+    int                 next_step;      /* first step of next stage */
+    chain_step_t        *steps;
+    char                *text;
+} chain_t;
+
+extern int chain_is_chain (const char *line);
+extern chain_t *chain_parse (const char *line);
+extern int chain_arm (chain_t *chain, time_t now, queue_t *queue);
+extern int chain_fired (alarm_t *alarm, time_t now, queue_t *queue);
+extern void chain_abandon (alarm_t *alarm);
+
+#endif
@@ -0,0 +1,71 @@
+/*
+ * alarm_dgram.c
+ *
+ * Receiving requests in batches from a Unix datagram socket. See
+ * alarm_dgram.h.
+ */
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "errors.h"
+#include "alarm_dgram.h"
+
+/*
+ * Bind a datagram socket to "path", replacing any socket left there
+ * by an earlier run. Aborts on failure.
+ */
+int dgram_open (const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen (path) >= sizeof (addr.sun_path)) {
+        fprintf (stderr, "Socket path too long: %s\n", path);
+        exit (1);
+    }
+    fd = socket (AF_UNIX, SOCK_DGRAM, 0);
+    if (fd < 0)
+        errno_abort ("Create datagram socket");
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strcpy (addr.sun_path, path);
+    unlink (path);
+    if (bind (fd, (struct sockaddr*)&addr, sizeof (addr)) < 0)
+        errno_abort ("Bind datagram socket");
+    return fd;
+}
+
+/*
+ * Point each message header at its buffer. A byte is kept back
+ * in each buffer for the terminating NUL.
+ */
+void dgram_init (dgram_t *dgram)
+{
+    int i;
+
+    memset (dgram->msg, 0, sizeof (dgram->msg));
+    for (i = 0; i < DGRAM_BATCH; i++) {
+        dgram->iov[i].iov_base = dgram->buf[i];
+        dgram->iov[i].iov_len = DGRAM_SIZE - 1;
+        dgram->msg[i].msg_hdr.msg_iov = &dgram->iov[i];
+        dgram->msg[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+/*
+ * Wait for at least one datagram, and take as many more as are
+ * already queued, up to DGRAM_BATCH, in the same call. Each one is
+ * NUL terminated in its buffer. Returns the number received.
+ */
+int dgram_receive (int fd, dgram_t *dgram)
+{
+    int n, i;
+
+    do
+        n = recvmmsg (fd, dgram->msg, DGRAM_BATCH, MSG_WAITFORONE, NULL);
+    while (n < 0 && errno == EINTR);
+    if (n < 0)
+        errno_abort ("Receive datagrams");
+    for (i = 0; i < n; i++)
+        dgram->buf[i][dgram->msg[i].msg_len] = '\0';
+    return n;
+}
@@ -0,0 +1,32 @@
+/*
+ * alarm_dgram.h
+ *
+ * Datagram ingest (-u). Producers that don't want to hold a
+ * connection open can send each request as a datagram, one request
+ * per datagram, to a Unix datagram socket. The server receives up to
+ * DGRAM_BATCH of them with a single recvmmsg call, into buffers set
+ * up once, and parses them where they landed.
+ *
+ * recvmmsg is a Linux call, declared only with _GNU_SOURCE, which
+ * the makefile defines.
+ */
+#ifndef __alarm_dgram_h
+#define __alarm_dgram_h
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define DGRAM_BATCH     64
+#define DGRAM_SIZE      512
+
+typedef struct dgram_tag {
+    struct mmsghdr      msg[DGRAM_BATCH];
+    struct iovec        iov[DGRAM_BATCH];
+    char                buf[DGRAM_BATCH][DGRAM_SIZE];
+} dgram_t;
+
+extern int dgram_open (const char *path);
+extern void dgram_init (dgram_t *dgram);
+extern int dgram_receive (int fd, dgram_t *dgram);
+
+#endif
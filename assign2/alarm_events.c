@@ -0,0 +1,141 @@
+/*
+ * alarm_events.c
+ *
+ * The broadcast ring of fired alarms. See alarm_events.h.
+ */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "errors.h"
+#include "alarm.h"
+#include "alarm_events.h"
+
+/*
+ * Create (or recreate) the ring as the POSIX shared memory object
+ * "name" (which starts with a slash). Aborts on failure.
+ */
+events_t *events_create (const char *name)
+{
+    events_t *events;
+    int fd;
+
+    fd = shm_open (name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        errno_abort ("Create event ring");
+    if (ftruncate (fd, sizeof (events_t)) < 0)
+        errno_abort ("Size event ring");
+    events = (events_t*)mmap (NULL, sizeof (events_t),
+        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (events == MAP_FAILED)
+        errno_abort ("Map event ring");
+    close (fd);
+    events->size = EVENTS_SIZE;
+    __atomic_store_n (&events->magic, EVENTS_MAGIC, __ATOMIC_RELEASE);
+    return events;
+}
+
+/*
+ * Map an existing ring read only, for a reader. Returns NULL if
+ * there is no such ring, or it isn't one.
+ */
+events_t *events_open (const char *name)
+{
+    events_t *events;
+    struct stat st;
+    int fd;
+
+    fd = shm_open (name, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+    if (fstat (fd, &st) < 0 || st.st_size < sizeof (events_t)) {
+        close (fd);
+        return NULL;
+    }
+    events = (events_t*)mmap (NULL, sizeof (events_t), PROT_READ,
+        MAP_SHARED, fd, 0);
+    close (fd);
+    if (events == MAP_FAILED)
+        return NULL;
+    if (__atomic_load_n (&events->magic, __ATOMIC_ACQUIRE) != EVENTS_MAGIC
+            || events->size != EVENTS_SIZE) {
+        munmap (events, sizeof (events_t));
+        return NULL;
+    }
+    return events;
+}
+
+void events_destroy (const char *name, events_t *events)
+{
+    munmap (events, sizeof (events_t));
+    if (name != NULL)
+        shm_unlink (name);
+}
+
+/*
+ * Write the event for a fired alarm, whose message is given as
+ * alarm_text and alarm_length return it (so that readers needn't
+ * link with the alarm record code). Called with alarm_mutex locked,
+ * which makes the server a single writer.
+ */
+void events_publish (events_t *events, alarm_t *alarm,
+    const char *text, int length, int display, time_t now)
+{
+    unsigned long seq = events->head + 1;
+    event_t *event = &events->slot[seq & (EVENTS_SIZE - 1)];
+
+    __atomic_store_n (&event->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+    event->id = alarm->id;
+    event->deadline = alarm->time;
+    event->fired = now;
+    event->display = display;
+    event->seconds = alarm->seconds;
+    if (length > sizeof (event->message) - 1)
+        length = sizeof (event->message) - 1;
+    memcpy (event->message, text, length);
+    event->message[length] = '\0';
+    __atomic_store_n (&event->seq, seq, __ATOMIC_RELEASE);
+    __atomic_store_n (&events->head, seq, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy event number *next into "event", if it has been written, and
+ * advance *next. Returns 1 for an event, 0 if there is none yet, or
+ * the (negated) number of events lost if the reader has fallen too
+ * far behind, in which case *next moves to the oldest event still
+ * in the ring.
+ */
+long events_read (
+    const events_t *events, unsigned long *next, event_t *event)
+{
+    unsigned long head, seq, oldest;
+    const event_t *slot;
+
+    head = __atomic_load_n (&events->head, __ATOMIC_ACQUIRE);
+    if (*next > head)
+        return 0;
+    oldest = head >= EVENTS_SIZE ? head - EVENTS_SIZE + 1 : 1;
+    if (*next < oldest) {
+        seq = *next;
+        *next = oldest;
+        return -(long)(oldest - seq);
+    }
+    slot = &events->slot[*next & (EVENTS_SIZE - 1)];
+    seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+    *event = *slot;
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    if (seq != *next
+            || __atomic_load_n (&slot->seq, __ATOMIC_RELAXED) != seq) {
+        /*
+         * The writer lapped us while we were copying.
+         */
+        head = __atomic_load_n (&events->head, __ATOMIC_ACQUIRE);
+        oldest = head >= EVENTS_SIZE ? head - EVENTS_SIZE + 1 : 1;
+        seq = *next;
+        *next = oldest > seq ? oldest : seq + 1;
+        return -(long)(*next - seq);
+    }
+    (*next)++;
+    event->seq = seq;
+    return 1;
+}
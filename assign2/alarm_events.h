@@ -0,0 +1,53 @@
+/*
+ * alarm_events.h
+ *
+ * A broadcast ring of fired alarms in shared memory (-e), so that
+ * local programs can follow expiries without parsing the server's
+ * output. The server is the only writer: every event is written
+ * with alarm_mutex held. Any number of readers map the ring read
+ * only and keep their own place in it; the server never waits for
+ * them, and they never make a system call while events are coming.
+ *
+ * Events are numbered from 1. The ring's head is the number of the
+ * last event written, and event n lives in slot n % EVENTS_SIZE.
+ * A slot's "seq" is set to 0 while it is being rewritten, and to
+ * the event's number once it is complete, so a reader that copies
+ * a slot and finds the same number in "seq" before and after has a
+ * consistent copy. A reader that has fallen a whole ring behind
+ * has lost events, and events_read says how many.
+ */
+#ifndef __alarm_events_h
+#define __alarm_events_h
+
+#include <time.h>
+#include "alarm.h"
+
+#define EVENTS_MAGIC    0x616c6576      /* "alev" */
+#define EVENTS_SIZE     4096            /* slots, power of 2 */
+
+typedef struct event_tag {
+    unsigned long       seq;
+    unsigned long       id;
+    long long           deadline;
+    long long           fired;
+    int                 display;        /* 0 for the alarm thread */
+    int                 seconds;
+    char                message[65];
+} event_t;
+
+typedef struct events_tag {
+    unsigned int        magic;
+    unsigned int        size;
+    unsigned long       head;
+    event_t             slot[EVENTS_SIZE];
+} events_t;
+
+extern events_t *events_create (const char *name);
+extern events_t *events_open (const char *name);
+extern void events_destroy (const char *name, events_t *events);
+extern void events_publish (events_t *events, alarm_t *alarm,
+    const char *text, int length, int display, time_t now);
+extern long events_read (
+    const events_t *events, unsigned long *next, event_t *event);
+
+#endif
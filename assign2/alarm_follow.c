@@ -0,0 +1,70 @@
+/*
+ * alarm_follow.c
+ *
+ * Follow the alarms a server run with -e fires, by reading its
+ * shared memory ring (see alarm_events.h). Prints one line per
+ * event:
+ *
+ *      <seq> <id> <fired> <deadline> <display> <seconds> <message>
+ *
+ * and a line saying how many were lost whenever this reader falls
+ * a whole ring behind the server:
+ *
+ *      ./alarm_follow /alarms
+ *
+ * By default it starts with the next event fired; -a starts with
+ * the oldest still in the ring. Any number of readers may follow
+ * the same ring.
+ */
+#include <time.h>
+#include "errors.h"
+#include "alarm_events.h"
+
+int main (int argc, char *argv[])
+{
+    events_t *events;
+    event_t event;
+    unsigned long next;
+    struct timespec idle = {0, 1000000};        /* 1ms */
+    long result;
+    int c, all = 0;
+
+    while ((c = getopt (argc, argv, "a")) != -1) {
+        switch (c) {
+        case 'a':
+            all = 1;
+            break;
+        default:
+            fprintf (stderr, "Usage: %s [-a] /ring\n", argv[0]);
+            exit (1);
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf (stderr, "Usage: %s [-a] /ring\n", argv[0]);
+        exit (1);
+    }
+    events = events_open (argv[optind]);
+    if (events == NULL) {
+        fprintf (stderr, "No event ring %s\n", argv[optind]);
+        exit (1);
+    }
+    next = all ? 1 : __atomic_load_n (&events->head, __ATOMIC_ACQUIRE) + 1;
+
+    while (1) {
+        result = events_read (events, &next, &event);
+        if (result > 0)
+            printf ("%lu %lu %lld %lld %d %d %s\n", event.seq, event.id,
+                event.fired, event.deadline, event.display,
+                event.seconds, event.message);
+        else if (result < 0)
+            printf ("Lost %ld events\n", -result);
+        else {
+            /*
+             * Nothing new. Wait a little, rather than spin, but
+             * only while the ring is idle.
+             */
+            fflush (stdout);
+            nanosleep (&idle, NULL);
+        }
+    }
+}
@@ -0,0 +1,211 @@
+/*
+ * alarm_limits.c
+ *
+ * Detection of CPU and memory limits. See alarm_limits.h.
+ */
+#include <sched.h>
+#include "errors.h"
+#include "alarm_limits.h"
+
+#ifndef CGROUP_ROOT
+#define CGROUP_ROOT     "/sys/fs/cgroup"
+#endif
+
+/*
+ * Read the first line of a file into "buf". Returns 0, or -1 if it
+ * can't be read.
+ */
+static int read_line (const char *path, char *buf, int size)
+{
+    FILE *file = fopen (path, "r");
+    int ok;
+
+    if (file == NULL)
+        return -1;
+    ok = fgets (buf, size, file) != NULL;
+    fclose (file);
+    return ok ? 0 : -1;
+}
+
+/*
+ * Find the server's group in a hierarchy, from /proc/self/cgroup:
+ * "0::/path" for v2, or "N:controllers:/path" for the v1 hierarchy
+ * whose controllers include "controller".
+ */
+static int cgroup_path (const char *controller, char *path, int size)
+{
+    FILE *file = fopen ("/proc/self/cgroup", "r");
+    char line[512], *list, *p;
+    int found = 0;
+
+    if (file == NULL)
+        return -1;
+    while (!found && fgets (line, sizeof (line), file) != NULL) {
+        line[strcspn (line, "\n")] = '\0';
+        list = strchr (line, ':');
+        if (list == NULL || (p = strchr (++list, ':')) == NULL)
+            continue;
+        *p++ = '\0';
+        if (controller == NULL)
+            found = strcmp (list, "") == 0;
+        else {
+            for (list = strtok (list, ","); list != NULL && !found;
+                    list = strtok (NULL, ","))
+                found = strcmp (list, controller) == 0;
+        }
+        if (found)
+            snprintf (path, size, "%s", p);
+    }
+    fclose (file);
+    return found ? 0 : -1;
+}
+
+/*
+ * Call "func" on the file "name" in the server's group and in each
+ * group above it, up to the mount point "mount". A group may not be
+ * visible at its own path inside a container, whose mount point is
+ * then its own group; the mount point is always tried last.
+ */
+static void cgroup_walk (const char *mount, const char *group,
+    const char *name, void (*func) (const char *line, void *arg),
+    void *arg)
+{
+    char dir[512], path[640], line[128], *slash;
+
+    snprintf (dir, sizeof (dir), "%s%s", mount, group);
+    while (strlen (dir) > strlen (mount)) {
+        snprintf (path, sizeof (path), "%s/%s", dir, name);
+        if (read_line (path, line, sizeof (line)) == 0)
+            func (line, arg);
+        slash = strrchr (dir, '/');
+        if (slash == NULL)
+            break;
+        *slash = '\0';
+    }
+    snprintf (path, sizeof (path), "%s/%s", mount, name);
+    if (read_line (path, line, sizeof (line)) == 0)
+        func (line, arg);
+}
+
+/*
+ * cgroup v2 cpu.max: "quota period", or "max period".
+ */
+static void cpu_max (const char *line, void *arg)
+{
+    double *quota = (double*)arg;
+    long long q, period;
+
+    if (sscanf (line, "%lld %lld", &q, &period) == 2 && period > 0
+            && (*quota == 0 || (double)q / period < *quota))
+        *quota = (double)q / period;
+}
+
+/*
+ * cgroup v1 cpu.cfs_quota_us (-1 for none); the period is read
+ * separately, and assumed the same through the hierarchy.
+ */
+static void cfs_quota (const char *line, void *arg)
+{
+    double *quota = (double*)arg;
+    long long q = atoll (line);
+
+    if (q > 0 && (*quota == 0 || q < *quota))
+        *quota = q;
+}
+
+/*
+ * memory.max ("max" for none) or memory.limit_in_bytes (a huge
+ * number for none).
+ */
+static void memory_max (const char *line, void *arg)
+{
+    unsigned long long *memory = (unsigned long long*)arg;
+    unsigned long long m;
+
+    if (sscanf (line, "%llu", &m) == 1 && (*memory == 0 || m < *memory))
+        *memory = m;
+}
+
+void limits_detect (limits_t *limits)
+{
+    char group[512], line[128];
+    cpu_set_t set;
+    double period;
+
+    memset (limits, 0, sizeof (limits_t));
+    if (sched_getaffinity (0, sizeof (set), &set) == 0)
+        limits->online = CPU_COUNT (&set);
+    else
+        limits->online = sysconf (_SC_NPROCESSORS_ONLN);
+    limits->physical = (unsigned long long)sysconf (_SC_PHYS_PAGES)
+        * sysconf (_SC_PAGESIZE);
+
+    /*
+     * cgroup v2 is mounted at the root on a unified system, or
+     * under "unified" on a hybrid one, where the controllers are
+     * still in v1 hierarchies.
+     */
+    if (cgroup_path (NULL, group, sizeof (group)) == 0) {
+        cgroup_walk (CGROUP_ROOT, group, "cpu.max", cpu_max,
+            &limits->quota);
+        cgroup_walk (CGROUP_ROOT, group, "memory.max", memory_max,
+            &limits->memory);
+        if (limits->quota > 0)
+            limits->cpu_from = "cgroup v2 cpu.max";
+        if (limits->memory > 0)
+            limits->memory_from = "cgroup v2 memory.max";
+    }
+    if (limits->quota == 0
+            && cgroup_path ("cpu", group, sizeof (group)) == 0) {
+        cgroup_walk (CGROUP_ROOT "/cpu", group, "cpu.cfs_quota_us",
+            cfs_quota, &limits->quota);
+        if (limits->quota > 0 && read_line (CGROUP_ROOT
+                "/cpu/cpu.cfs_period_us", line, sizeof (line)) == 0
+                && (period = atof (line)) > 0) {
+            limits->quota /= period;
+            limits->cpu_from = "cgroup v1 cpu.cfs_quota_us";
+        } else
+            limits->quota = 0;
+    }
+    if (limits->memory == 0
+            && cgroup_path ("memory", group, sizeof (group)) == 0) {
+        cgroup_walk (CGROUP_ROOT "/memory", group,
+            "memory.limit_in_bytes", memory_max, &limits->memory);
+        if (limits->memory > 0)
+            limits->memory_from = "cgroup v1 memory.limit_in_bytes";
+    }
+
+    /*
+     * A limit at or above what the machine has is no limit.
+     */
+    if (limits->memory >= limits->physical) {
+        limits->memory = 0;
+        limits->memory_from = NULL;
+    }
+    limits->cpus = limits->online;
+    if (limits->quota > 0 && limits->quota < limits->cpus) {
+        limits->cpus = (int)(limits->quota + 0.999);
+        if (limits->cpus < 1)
+            limits->cpus = 1;
+    } else {
+        limits->quota = 0;
+        limits->cpu_from = NULL;
+    }
+}
+
+void limits_print (FILE *out, const limits_t *limits)
+{
+    fprintf (out, "Limits: %d CPUs", limits->cpus);
+    if (limits->quota > 0)
+        fprintf (out, " (%.2f from %s, %d online)", limits->quota,
+            limits->cpu_from, limits->online);
+    else
+        fprintf (out, " (online, no quota)");
+    if (limits->memory > 0)
+        fprintf (out, ", %lluMB memory (%s)", limits->memory >> 20,
+            limits->memory_from);
+    else
+        fprintf (out, ", %lluMB memory (physical, no limit)",
+            limits->physical >> 20);
+    fprintf (out, "\n");
+}
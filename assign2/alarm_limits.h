@@ -0,0 +1,45 @@
+/*
+ * alarm_limits.h
+ *
+ * The resources the server may actually use. In a container the
+ * host's core count and memory say little: a CPU quota can hold the
+ * server to a fraction of the cores it sees, and a memory limit
+ * gets it killed long before the host runs short. limits_detect
+ * reads the limits of the server's control group (cgroup v2
+ * cpu.max and memory.max, or their v1 equivalents), and of every
+ * group above it, and combines them with the CPU affinity mask and
+ * the physical memory.
+ *
+ * The server uses them to choose the number of scheduler processes
+ * for -P auto, and the most alarms it will hold before refusing new
+ * ones (its share of the memory limit).
+ *
+ * sched_getaffinity and CPU_COUNT need _GNU_SOURCE, which the
+ * makefile defines.
+ */
+#ifndef __alarm_limits_h
+#define __alarm_limits_h
+
+#include <stdio.h>
+
+typedef struct limits_tag {
+    int                 online;         /* CPUs in the affinity mask */
+    double              quota;          /* CPUs of time, 0 if no quota */
+    int                 cpus;           /* CPUs worth running on */
+    unsigned long long  physical;       /* bytes of memory */
+    unsigned long long  memory;         /* bytes limit, 0 if no limit */
+    const char          *cpu_from;      /* where quota came from */
+    const char          *memory_from;   /* where memory came from */
+} limits_t;
+
+/*
+ * The most alarms the server holds before refusing new ones, or 0
+ * for no limit. It is set by the server from the memory limit, and
+ * checked wherever alarms are queued, chain stages included.
+ */
+extern unsigned long alarm_budget;
+
+extern void limits_detect (limits_t *limits);
+extern void limits_print (FILE *out, const limits_t *limits);
+
+#endif
@@ -0,0 +1,551 @@
+/*
+ * alarm_lsm.c
+ *
+ * The lsm backend, for schedules that are mostly a large preloaded
+ * batch with a trickle of live alarms. Preloaded alarms (queue_load)
+ * are kept in sorted runs: arrays of (deadline, id, alarm) entries,
+ * built and sorted by the loader before it takes alarm_mutex, and
+ * never changed afterwards except that a cancelled entry's alarm is
+ * cleared (a tombstone). Each run is consumed from the front by a
+ * cursor. Live alarms go to a small pairing heap, the delta, which
+ * is also where a preloaded alarm goes when it is rescheduled.
+ *
+ * The next alarm is the earliest of the delta's head and the runs'
+ * heads, so firing a preloaded alarm is a few comparisons and a
+ * cursor increment. To keep the runs few, once there are more than
+ * LSM_RUNS of them the two smallest are merged into one by a
+ * background thread, without alarm_mutex. The two runs stay in use
+ * while they are merged; alarms fired from them meanwhile are the
+ * earliest of the merged run, so when the merge is done the new
+ * run's cursor starts after the last of them, and entries cancelled
+ * meanwhile are noted and cleared in the new run. The merged run is
+ * put in place by the next queue operation.
+ *
+ * Alarms in the delta have "owner" set to it; those in runs have
+ * it NULL, and are found by binary search of the runs.
+ */
+#include <pthread.h>
+#include "errors.h"
+#include "alarm.h"
+#include "alarm_queue.h"
+#include "alarm_usage.h"
+
+#define LSM_RUNS        4       /* runs kept before merging */
+
+typedef struct lsm_entry_tag {
+    time_t              time;
+    unsigned long       id;
+    alarm_t             *alarm;         /* NULL once cancelled */
+} lsm_entry_t;
+
+typedef struct lsm_run_tag {
+    lsm_entry_t         *entry;
+    long                count;
+    long                cursor;         /* next entry to fire */
+    int                 merging;
+} lsm_run_t;
+
+typedef struct lsm_queue_tag {
+    queue_t             queue;
+    queue_t             *delta;
+    lsm_run_t           **run;
+    int                 nruns;
+    int                 size;
+    unsigned long       merges;
+
+    /*
+     * The merge in progress, if "merging" is set. The thread takes
+     * its work under "mutex", and sets "done" when the merged run
+     * is ready.
+     */
+    pthread_t           thread;
+    int                 started;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+    int                 pending;        /* for the thread to start */
+    int                 quit;
+    int                 merging;
+    int                 done;
+    lsm_run_t           *a, *b;
+    long                start_a, start_b;
+    lsm_run_t           *merged;
+    int                 fired;          /* from a or b, meanwhile */
+    time_t              last_time;      /* last of them */
+    unsigned long       last_id;
+    lsm_entry_t         *dead;          /* cancelled from a or b */
+    int                 ndead;
+    int                 dead_size;
+} lsm_queue_t;
+
+#define lsm_before(t1, i1, t2, i2) \
+    ((t1) < (t2) || ((t1) == (t2) && (i1) < (i2)))
+
+static lsm_run_t *run_alloc (long count)
+{
+    lsm_run_t *run = (lsm_run_t*)calloc (1, sizeof (lsm_run_t));
+
+    if (run == NULL)
+        errno_abort ("Allocate run");
+    run->entry = (lsm_entry_t*)malloc (
+        (count > 0 ? count : 1) * sizeof (lsm_entry_t));
+    if (run->entry == NULL)
+        errno_abort ("Allocate run");
+    run->count = count;
+    return run;
+}
+
+static void run_free (lsm_run_t *run)
+{
+    free (run->entry);
+    free (run);
+}
+
+/*
+ * The first entry from "lo" on whose key is not before (time, id).
+ */
+static long run_search (lsm_run_t *run, long lo, time_t time,
+    unsigned long id)
+{
+    long hi = run->count, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (lsm_before (run->entry[mid].time, run->entry[mid].id, time, id))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * The run's next live entry, skipping tombstones, or NULL.
+ */
+static lsm_entry_t *run_head (lsm_run_t *run)
+{
+    while (run->cursor < run->count && run->entry[run->cursor].alarm == NULL)
+        run->cursor++;
+    return run->cursor < run->count ? &run->entry[run->cursor] : NULL;
+}
+
+/*
+ * The merge thread: merge the live part of two runs, tombstones
+ * and all, so that positions in the result follow the order of
+ * the keys. Alarm pointers are read atomically, as the queue may be
+ * clearing them at the same time.
+ */
+static void *lsm_thread (void *arg)
+{
+    lsm_queue_t *lq = (lsm_queue_t*)arg;
+    lsm_run_t *a, *b, *c;
+    lsm_entry_t *ea, *eb, *ec;
+    long i, j, k;
+    int status;
+
+    usage_register ("alarm-lsm-merge");
+    status = pthread_mutex_lock (&lq->mutex);
+    if (status != 0)
+        err_abort (status, "Lock merge mutex");
+    while (1) {
+        while (!lq->pending && !lq->quit) {
+            status = pthread_cond_wait (&lq->cond, &lq->mutex);
+            if (status != 0)
+                err_abort (status, "Wait on merge cond");
+        }
+        if (lq->quit)
+            break;
+        lq->pending = 0;
+        a = lq->a;
+        b = lq->b;
+        i = lq->start_a;
+        j = lq->start_b;
+        status = pthread_mutex_unlock (&lq->mutex);
+        if (status != 0)
+            err_abort (status, "Unlock merge mutex");
+
+        c = run_alloc ((a->count - i) + (b->count - j));
+        for (k = 0; k < c->count; k++) {
+            ea = &a->entry[i];
+            eb = &b->entry[j];
+            if (j >= b->count || (i < a->count
+                    && lsm_before (ea->time, ea->id, eb->time, eb->id)))
+                ea = &a->entry[i++];
+            else
+                ea = &b->entry[j++];
+            ec = &c->entry[k];
+            ec->time = ea->time;
+            ec->id = ea->id;
+            ec->alarm = __atomic_load_n (&ea->alarm, __ATOMIC_RELAXED);
+        }
+
+        status = pthread_mutex_lock (&lq->mutex);
+        if (status != 0)
+            err_abort (status, "Lock merge mutex");
+        lq->merged = c;
+        __atomic_store_n (&lq->done, 1, __ATOMIC_RELEASE);
+    }
+    status = pthread_mutex_unlock (&lq->mutex);
+    if (status != 0)
+        err_abort (status, "Unlock merge mutex");
+    return NULL;
+}
+
+static void lsm_add_run (lsm_queue_t *lq, lsm_run_t *run)
+{
+    if (lq->nruns == lq->size) {
+        lq->size = lq->size ? lq->size * 2 : 8;
+        lq->run = (lsm_run_t**)realloc (lq->run,
+            lq->size * sizeof (lsm_run_t*));
+        if (lq->run == NULL)
+            errno_abort ("Allocate runs");
+    }
+    lq->run[lq->nruns++] = run;
+}
+
+static void lsm_drop_run (lsm_queue_t *lq, int i)
+{
+    lq->run[i] = lq->run[--lq->nruns];
+}
+
+/*
+ * Start merging the two smallest runs, if there are too many and
+ * no merge is under way.
+ */
+static void lsm_maybe_merge (lsm_queue_t *lq)
+{
+    int i, a = -1, b = -1, status;
+    long left, la = 0, lb = 0;
+
+    if (lq->merging || lq->nruns <= LSM_RUNS)
+        return;
+    for (i = 0; i < lq->nruns; i++) {
+        left = lq->run[i]->count - lq->run[i]->cursor;
+        if (a < 0 || left < la) {
+            b = a;
+            lb = la;
+            a = i;
+            la = left;
+        } else if (b < 0 || left < lb) {
+            b = i;
+            lb = left;
+        }
+    }
+    if (!lq->started) {
+        status = pthread_create (&lq->thread, NULL, lsm_thread, lq);
+        if (status != 0)
+            err_abort (status, "Create merge thread");
+        lq->started = 1;
+    }
+    status = pthread_mutex_lock (&lq->mutex);
+    if (status != 0)
+        err_abort (status, "Lock merge mutex");
+    lq->a = lq->run[a];
+    lq->b = lq->run[b];
+    lq->a->merging = lq->b->merging = 1;
+    lq->start_a = lq->a->cursor;
+    lq->start_b = lq->b->cursor;
+    lq->fired = 0;
+    lq->ndead = 0;
+    lq->merging = 1;
+    lq->pending = 1;
+    status = pthread_cond_signal (&lq->cond);
+    if (status != 0)
+        err_abort (status, "Signal merge cond");
+    status = pthread_mutex_unlock (&lq->mutex);
+    if (status != 0)
+        err_abort (status, "Unlock merge mutex");
+}
+
+/*
+ * If the merge thread has finished, put the merged run in place of
+ * the two it came from: skip what fired from them in the meantime,
+ * and clear what was cancelled.
+ */
+static void lsm_install (lsm_queue_t *lq)
+{
+    lsm_run_t *c;
+    long k;
+    int i;
+
+    if (!lq->merging || !__atomic_load_n (&lq->done, __ATOMIC_ACQUIRE))
+        return;
+    c = lq->merged;
+    if (lq->fired)
+        c->cursor = run_search (c, 0, lq->last_time, lq->last_id + 1);
+    for (i = 0; i < lq->ndead; i++) {
+        k = run_search (c, c->cursor, lq->dead[i].time, lq->dead[i].id);
+        if (k < c->count && c->entry[k].id == lq->dead[i].id)
+            c->entry[k].alarm = NULL;
+    }
+    for (i = lq->nruns - 1; i >= 0; i--)
+        if (lq->run[i] == lq->a || lq->run[i] == lq->b)
+            lsm_drop_run (lq, i);
+    run_free (lq->a);
+    run_free (lq->b);
+    if (run_head (c) != NULL)
+        lsm_add_run (lq, c);
+    else
+        run_free (c);
+    lq->merged = NULL;
+    lq->done = 0;
+    lq->merging = 0;
+    lq->merges++;
+    lsm_maybe_merge (lq);
+}
+
+static queue_t *lsm_create (void)
+{
+    lsm_queue_t *lq;
+    int status;
+
+    lq = (lsm_queue_t*)calloc (1, sizeof (lsm_queue_t));
+    if (lq == NULL)
+        errno_abort ("Allocate lsm queue");
+    lq->queue.ops = &lsm_queue_ops;
+    lq->delta = queue_create ("pheap");
+    status = pthread_mutex_init (&lq->mutex, NULL);
+    if (status != 0)
+        err_abort (status, "Init merge mutex");
+    status = pthread_cond_init (&lq->cond, NULL);
+    if (status != 0)
+        err_abort (status, "Init merge cond");
+    return &lq->queue;
+}
+
+static void lsm_destroy (queue_t *queue)
+{
+    lsm_queue_t *lq = (lsm_queue_t*)queue;
+    int i, status;
+
+    if (lq->started) {
+        status = pthread_mutex_lock (&lq->mutex);
+        if (status != 0)
+            err_abort (status, "Lock merge mutex");
+        lq->quit = 1;
+        status = pthread_cond_signal (&lq->cond);
+        if (status != 0)
+            err_abort (status, "Signal merge cond");
+        status = pthread_mutex_unlock (&lq->mutex);
+        if (status != 0)
+            err_abort (status, "Unlock merge mutex");
+        pthread_join (lq->thread, NULL);
+    }
+    if (lq->merged != NULL)
+        run_free (lq->merged);
+    for (i = 0; i < lq->nruns; i++)
+        run_free (lq->run[i]);
+    free (lq->run);
+    free (lq->dead);
+    queue_destroy (lq->delta);
+    pthread_mutex_destroy (&lq->mutex);
+    pthread_cond_destroy (&lq->cond);
+    free (lq);
+}
+
+static void lsm_insert (queue_t *queue, alarm_t *alarm)
+{
+    lsm_queue_t *lq = (lsm_queue_t*)queue;
+
+    lsm_install (lq);
+    alarm->owner = lq->delta;
+    queue_insert (lq->delta, alarm);
+    queue->count++;
+}
+
+static void lsm_insert_batch (queue_t *queue, alarm_t *batch)
+{
+    alarm_t *next;
+
+    while (batch != NULL) {
+        next = batch->link;
+        lsm_insert (queue, batch);
+        batch = next;
+    }
+}
+
+/*
+ * Make a run of "n" alarms, sorted by deadline and id.
+ */
+static void lsm_load (queue_t *queue, alarm_t **alarms, long n)
+{
+    lsm_queue_t *lq = (lsm_queue_t*)queue;
+    lsm_run_t *run;
+    long i;
+
+    lsm_install (lq);
+    if (n == 0)
+        return;
+    run = run_alloc (n);
+    for (i = 0; i < n; i++) {
+        run->entry[i].time = alarms[i]->time;
+        run->entry[i].id = alarms[i]->id;
+        run->entry[i].alarm = alarms[i];
+        alarms[i]->owner = NULL;
+    }
+    lsm_add_run (lq, run);
+    queue->count += n;
+    lsm_maybe_merge (lq);
+}
+
+/*
+ * The run whose head fires next, or -1 for the delta (or if the
+ * queue is empty).
+ */
+static int lsm_first (lsm_queue_t *lq)
+{
+    alarm_t *d = queue_peek (lq->delta);
+    lsm_entry_t *e, *best = NULL;
+    int i, first = -1;
+
+    for (i = 0; i < lq->nruns; i++) {
+        e = run_head (lq->run[i]);
+        if (e != NULL && (best == NULL
+                || lsm_before (e->time, e->id, best->time, best->id))) {
+            best = e;
+            first = i;
+        }
+    }
+    if (d != NULL && best != NULL
+            && lsm_before (d->time, d->id, best->time, best->id))
+        first = -1;
+    return first;
+}
+
+static alarm_t *lsm_peek (queue_t *queue)
+{
+    lsm_queue_t *lq = (lsm_queue_t*)queue;
+    int first = lsm_first (lq);
+
+    if (first < 0)
+        return queue_peek (lq->delta);
+    return run_head (lq->run[first])->alarm;
+}
+
+static alarm_t *lsm_pop (queue_t *queue)
+{
+    lsm_queue_t *lq = (lsm_queue_t*)queue;
+    lsm_run_t *run;
+    lsm_entry_t *e;
+    alarm_t *alarm;
+    int first;
+
+    lsm_install (lq);
+    first = lsm_first (lq);
+    if (first < 0) {
+        alarm = queue_pop (lq->delta);
+        if (alarm == NULL)
+            return NULL;
+        alarm->owner = NULL;
+    } else {
+        run = lq->run[first];
+        e = run_head (run);
+        alarm = e->alarm;
+        run->cursor++;
+        if (run->merging) {
+            lq->fired = 1;
+            lq->last_time = e->time;
+            lq->last_id = e->id;
+        } else if (run_head (run) == NULL) {
+            lsm_drop_run (lq, first);
+            run_free (run);
+        }
+    }
+    queue->count--;
+    return alarm;
+}
+
+/*
+ * Clear the entry of an alarm held in a run.
+ */
+static void lsm_tombstone (lsm_queue_t *lq, alarm_t *alarm)
+{
+    lsm_run_t *run;
+    long k;
+    int i;
+
+    for (i = 0; i < lq->nruns; i++) {
+        run = lq->run[i];
+        k = run_search (run, run->cursor, alarm->time, alarm->id);
+        if (k < run->count && run->entry[k].alarm == alarm)
+            break;
+    }
+    if (i == lq->nruns)
+        return;
+    __atomic_store_n (&run->entry[k].alarm, NULL, __ATOMIC_RELAXED);
+    if (run->merging) {
+        if (lq->ndead == lq->dead_size) {
+            lq->dead_size = lq->dead_size ? lq->dead_size * 2 : 64;
+            lq->dead = (lsm_entry_t*)realloc (lq->dead,
+                lq->dead_size * sizeof (lsm_entry_t));
+            if (lq->dead == NULL)
+                errno_abort ("Allocate tombstones");
+        }
+        lq->dead[lq->ndead++] = run->entry[k];
+    } else if (run_head (run) == NULL) {
+        lsm_drop_run (lq, i);
+        run_free (run);
+    }
+}
+
+static void lsm_remove (queue_t *queue, alarm_t *alarm)
+{
+    lsm_queue_t *lq = (lsm_queue_t*)queue;
+
+    lsm_install (lq);
+    if (alarm->owner == lq->delta)
+        queue_remove (lq->delta, alarm);
+    else
+        lsm_tombstone (lq, alarm);
+    alarm->owner = NULL;
+    queue->count--;
+}
+
+static void lsm_reschedule (queue_t *queue, alarm_t *alarm, time_t time)
+{
+    lsm_queue_t *lq = (lsm_queue_t*)queue;
+
+    lsm_install (lq);
+    if (alarm->owner == lq->delta)
+        queue_reschedule (lq->delta, alarm, time);
+    else {
+        lsm_tombstone (lq, alarm);
+        alarm->time = time;
+        alarm->owner = lq->delta;
+        queue_insert (lq->delta, alarm);
+    }
+}
+
+/*
+ * The runs, the cancelled entries and the delta heap. A merged run
+ * still being built belongs to the merge thread, and isn't counted.
+ */
+static size_t lsm_bytes (queue_t *queue)
+{
+    lsm_queue_t *lq = (lsm_queue_t*)queue;
+    size_t bytes;
+    int i;
+
+    bytes = sizeof (lsm_queue_t) + lq->size * sizeof (lsm_run_t*)
+        + lq->dead_size * sizeof (lsm_entry_t) + queue_bytes (lq->delta);
+    for (i = 0; i < lq->nruns; i++)
+        bytes += sizeof (lsm_run_t)
+            + lq->run[i]->count * sizeof (lsm_entry_t);
+    return bytes;
+}
+
+const queue_ops_t lsm_queue_ops = {
+    "lsm",
+    lsm_create,
+    lsm_destroy,
+    lsm_insert,
+    lsm_insert_batch,
+    lsm_peek,
+    lsm_pop,
+    lsm_remove,
+    lsm_reschedule,
+    lsm_load,
+    NULL,
+    NULL,
+    NULL,
+    lsm_bytes,
+};
@@ -0,0 +1,174 @@
+/*
+ * alarm_lz.c
+ *
+ * The LZ block codec. See alarm_lz.h.
+ */
+#include "errors.h"
+#include "alarm_lz.h"
+
+#define LZ_HASH_BITS    12
+#define LZ_HASH_SIZE    (1 << LZ_HASH_BITS)
+
+static unsigned lz_read32 (const char *p)
+{
+    unsigned v;
+
+    memcpy (&v, p, sizeof (v));
+    return v;
+}
+
+static unsigned lz_hash (const char *p)
+{
+    return (lz_read32 (p) * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+ * Write a length nibble's continuation bytes.
+ */
+static char *lz_put_length (char *op, size_t n)
+{
+    while (n >= 255) {
+        *op++ = (char)255;
+        n -= 255;
+    }
+    *op++ = (char)n;
+    return op;
+}
+
+static char *lz_put_sequence (char *op, const char *lit, size_t nlit,
+    size_t offset, size_t match)
+{
+    char *token = op++;
+    size_t m = match ? match - LZ_MIN_MATCH : 0;
+
+    *token = (char)(((nlit < 15 ? nlit : 15) << 4) | (m < 15 ? m : 15));
+    if (nlit >= 15)
+        op = lz_put_length (op, nlit - 15);
+    memcpy (op, lit, nlit);
+    op += nlit;
+    if (match) {
+        *op++ = (char)(offset & 0xff);
+        *op++ = (char)(offset >> 8);
+        if (m >= 15)
+            op = lz_put_length (op, m - 15);
+    }
+    return op;
+}
+
+/*
+ * Compress base[start, end) into dst, which must hold at least
+ * LZ_BOUND (end - start) bytes. The hash table is primed with the
+ * last 64KB before "start", so that matches can reach into it.
+ * Returns the compressed size.
+ */
+size_t lz_compress (
+    const char *base, size_t start, size_t end, char *dst)
+{
+    size_t table[LZ_HASH_SIZE];
+    size_t pos, anchor = start, cand, len, limit, h;
+    char *op = dst;
+
+    memset (table, 0xff, sizeof (table));
+    pos = start > LZ_MAX_OFFSET ? start - LZ_MAX_OFFSET : 0;
+    for (; pos + LZ_MIN_MATCH <= start; pos++)
+        table[lz_hash (base + pos)] = pos;
+
+    /*
+     * The last few bytes are always literals, so that a match
+     * never needs to read past the end.
+     */
+    limit = end > start + 12 ? end - 5 : start;
+    pos = start;
+    while (pos < limit) {
+        h = lz_hash (base + pos);
+        cand = table[h];
+        table[h] = pos;
+        if (cand == (size_t)-1 || pos - cand > LZ_MAX_OFFSET
+                || lz_read32 (base + cand) != lz_read32 (base + pos)) {
+            pos++;
+            continue;
+        }
+        len = LZ_MIN_MATCH;
+        while (pos + len < limit && base[cand + len] == base[pos + len])
+            len++;
+        op = lz_put_sequence (op, base + anchor, pos - anchor,
+            pos - cand, len);
+        pos += len;
+        anchor = pos;
+    }
+    op = lz_put_sequence (op, base + anchor, end - anchor, 0, 0);
+    return op - dst;
+}
+
+/*
+ * Read a length nibble's continuation bytes. Returns -1 if the
+ * block ends first.
+ */
+static long lz_get_length (const unsigned char **ip,
+    const unsigned char *iend)
+{
+    long n = 0;
+    unsigned char b;
+
+    do {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        n += b;
+    } while (b == 255);
+    return n;
+}
+
+/*
+ * Decompress a block into base + start, with at most "cap" bytes of
+ * output. Matches may reach back before "start". Returns the number
+ * of bytes written, or -1 if the block is corrupt.
+ */
+long lz_decompress (
+    const char *src, size_t len, char *base, size_t start, size_t cap)
+{
+    const unsigned char *ip = (const unsigned char*)src;
+    const unsigned char *iend = ip + len;
+    size_t out = start, end = start + cap, offset;
+    long nlit, match, extra;
+    unsigned char token;
+
+    while (ip < iend) {
+        token = *ip++;
+        nlit = token >> 4;
+        if (nlit == 15) {
+            if ((extra = lz_get_length (&ip, iend)) < 0)
+                return -1;
+            nlit += extra;
+        }
+        if (nlit > iend - ip || out + nlit > end)
+            return -1;
+        memcpy (base + out, ip, nlit);
+        ip += nlit;
+        out += nlit;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        match = token & 15;
+        if (match == 15) {
+            if ((extra = lz_get_length (&ip, iend)) < 0)
+                return -1;
+            match += extra;
+        }
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out || out + match > end)
+            return -1;
+        /*
+         * Byte by byte, since a match may overlap its own output.
+         */
+        while (match-- > 0) {
+            base[out] = base[out - offset];
+            out++;
+        }
+    }
+    return out - start;
+}
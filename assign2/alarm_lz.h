@@ -0,0 +1,38 @@
+/*
+ * alarm_lz.h
+ *
+ * A small LZ77 block codec for the write-ahead log and snapshots
+ * (alarm_wal.h), in the style of LZ4: a block is a series of
+ * sequences, each a run of literal bytes followed by a match, a
+ * copy of at least LZ_MIN_MATCH bytes from up to 64KB back.
+ *
+ * Each sequence starts with a token byte, whose high nibble is the
+ * literal count and low nibble the match length less LZ_MIN_MATCH;
+ * a nibble of 15 is continued by extra bytes, added up until one is
+ * less than 255. Then come the literals, and the match offset as
+ * two bytes, low byte first. The last sequence has literals only.
+ *
+ * Both ends work on a window: the bytes to (de)compress start at
+ * "start" in a buffer, and matches may reach back before "start"
+ * into whatever the buffer holds there, which is how the log uses
+ * the previous block as a dictionary for the next.
+ */
+#ifndef __alarm_lz_h
+#define __alarm_lz_h
+
+#include <stddef.h>
+
+#define LZ_MIN_MATCH    4
+#define LZ_MAX_OFFSET   65535
+
+/*
+ * Worst case size of a compressed block of n bytes.
+ */
+#define LZ_BOUND(n)     ((n) + (n) / 255 + 16)
+
+extern size_t lz_compress (
+    const char *base, size_t start, size_t end, char *dst);
+extern long lz_decompress (
+    const char *src, size_t len, char *base, size_t start, size_t cap);
+
+#endif
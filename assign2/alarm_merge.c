@@ -0,0 +1,277 @@
+/*
+ * alarm_merge.c
+ *
+ * The merge backend. Pending alarms are partitioned by id across a
+ * number of shards, each a pairing heap of its own, as the alarms
+ * of separate tenants would be, and the next alarm to fire is the
+ * earliest of the shard heads.
+ *
+ * The heads are kept in a tournament tree of losers: each internal
+ * node holds the shard that lost the match played there, and the
+ * overall winner is the earliest head. When the winner's shard
+ * changes (it fires, most often), the new head is replayed from its
+ * leaf up to the root against the losers on its path, which is
+ * log2(shards) comparisons, touching one node per level and no
+ * siblings. A change to another shard's head (an insert, cancel or
+ * reschedule there) can't be replayed that way, since the winners
+ * of the subtrees it passes aren't stored with the losers; each
+ * node also keeps the winner of its subtree, and such a change
+ * replays the path comparing the two children's winners instead.
+ *
+ * The shard heads' deadlines and ids are copied into arrays, so
+ * that a match reads no alarm records. merge_queue_create can also
+ * build the queue to find the earliest head by scanning those
+ * arrays, for comparison (alarm_bench merge/<k>/{tree,scan}).
+ */
+#include <limits.h>
+#include "errors.h"
+#include "alarm.h"
+#include "alarm_queue.h"
+
+#define MERGE_EMPTY     ((time_t)LONG_MAX)
+
+typedef struct merge_queue_tag {
+    queue_t             queue;
+    int                 shards;
+    int                 size;           /* leaves: a power of 2 */
+    int                 method;
+    queue_t             **shard;
+    time_t              *key;           /* head deadline, by leaf */
+    unsigned long       *seq;           /* head id, by leaf */
+    int                 *loser;         /* by node, 1 to size - 1 */
+    int                 *winner;
+} merge_queue_t;
+
+/*
+ * Does the head of leaf a fire before the head of leaf b? Ties go
+ * by id, so alarms due together still leave in the order they were
+ * ingested, and empty leaves by leaf number.
+ */
+static int merge_before (merge_queue_t *mq, int a, int b)
+{
+    if (mq->key[a] != mq->key[b])
+        return mq->key[a] < mq->key[b];
+    if (mq->seq[a] != mq->seq[b])
+        return mq->seq[a] < mq->seq[b];
+    return a < b;
+}
+
+/*
+ * The winner of the subtree at "node": a leaf's own number, or the
+ * winner an internal node keeps.
+ */
+static int merge_winner (merge_queue_t *mq, int node)
+{
+    return node >= mq->size ? node - mq->size : mq->winner[node];
+}
+
+/*
+ * Play the match at an internal node between its children's
+ * winners.
+ */
+static void merge_play (merge_queue_t *mq, int node)
+{
+    int a = merge_winner (mq, 2 * node);
+    int b = merge_winner (mq, 2 * node + 1);
+
+    if (merge_before (mq, b, a)) {
+        mq->winner[node] = b;
+        mq->loser[node] = a;
+    } else {
+        mq->winner[node] = a;
+        mq->loser[node] = b;
+    }
+}
+
+/*
+ * The head of shard "leaf" has changed: refresh its key, and bring
+ * the tree up to date. The winner replays against the losers on
+ * its path; any other leaf replays its path from the children.
+ */
+static void merge_update (merge_queue_t *mq, int leaf)
+{
+    alarm_t *head = queue_peek (mq->shard[leaf]);
+    int node, c, t;
+
+    mq->key[leaf] = head != NULL ? head->time : MERGE_EMPTY;
+    mq->seq[leaf] = head != NULL ? head->id : 0;
+    if (mq->method == MERGE_SCAN)
+        return;
+    if (leaf == mq->winner[1]) {
+        c = leaf;
+        for (node = (mq->size + leaf) / 2; node >= 1; node /= 2) {
+            if (merge_before (mq, mq->loser[node], c)) {
+                t = mq->loser[node];
+                mq->loser[node] = c;
+                c = t;
+            }
+            mq->winner[node] = c;
+        }
+    } else {
+        for (node = (mq->size + leaf) / 2; node >= 1; node /= 2)
+            merge_play (mq, node);
+    }
+}
+
+/*
+ * The shard whose head fires next.
+ */
+static int merge_first (merge_queue_t *mq)
+{
+    int leaf, best = 0;
+
+    if (mq->method == MERGE_TREE)
+        return mq->winner[1];
+    for (leaf = 1; leaf < mq->shards; leaf++)
+        if (merge_before (mq, leaf, best))
+            best = leaf;
+    return best;
+}
+
+queue_t *merge_queue_create (int shards, int method)
+{
+    merge_queue_t *mq;
+    int i;
+
+    mq = (merge_queue_t*)calloc (1, sizeof (merge_queue_t));
+    if (mq == NULL)
+        errno_abort ("Allocate merge queue");
+    mq->queue.ops = &merge_queue_ops;
+    mq->shards = shards;
+    mq->method = method;
+    for (mq->size = 2; mq->size < shards; mq->size *= 2)
+        ;
+    mq->shard = (queue_t**)malloc (shards * sizeof (queue_t*));
+    mq->key = (time_t*)malloc (mq->size * sizeof (time_t));
+    mq->seq = (unsigned long*)malloc (mq->size * sizeof (unsigned long));
+    mq->loser = (int*)malloc (mq->size * sizeof (int));
+    mq->winner = (int*)malloc (mq->size * sizeof (int));
+    if (mq->shard == NULL || mq->key == NULL || mq->seq == NULL
+            || mq->loser == NULL || mq->winner == NULL)
+        errno_abort ("Allocate merge queue");
+    for (i = 0; i < shards; i++)
+        mq->shard[i] = queue_create ("pheap");
+    for (i = 0; i < mq->size; i++) {
+        mq->key[i] = MERGE_EMPTY;
+        mq->seq[i] = 0;
+    }
+    for (i = mq->size - 1; i >= 1; i--)
+        merge_play (mq, i);
+    return &mq->queue;
+}
+
+static queue_t *merge_create (void)
+{
+    return merge_queue_create (MERGE_SHARDS, MERGE_TREE);
+}
+
+static void merge_destroy (queue_t *queue)
+{
+    merge_queue_t *mq = (merge_queue_t*)queue;
+    int i;
+
+    for (i = 0; i < mq->shards; i++)
+        queue_destroy (mq->shard[i]);
+    free (mq->shard);
+    free (mq->key);
+    free (mq->seq);
+    free (mq->loser);
+    free (mq->winner);
+    free (mq);
+}
+
+static void merge_insert (queue_t *queue, alarm_t *alarm)
+{
+    merge_queue_t *mq = (merge_queue_t*)queue;
+    int leaf = alarm->id % mq->shards;
+
+    queue_insert (mq->shard[leaf], alarm);
+    queue->count++;
+    if (queue_peek (mq->shard[leaf]) == alarm)
+        merge_update (mq, leaf);
+}
+
+static void merge_insert_batch (queue_t *queue, alarm_t *batch)
+{
+    alarm_t *next;
+
+    while (batch != NULL) {
+        next = batch->link;
+        merge_insert (queue, batch);
+        batch = next;
+    }
+}
+
+static alarm_t *merge_peek (queue_t *queue)
+{
+    merge_queue_t *mq = (merge_queue_t*)queue;
+
+    return queue_peek (mq->shard[merge_first (mq)]);
+}
+
+static alarm_t *merge_pop (queue_t *queue)
+{
+    merge_queue_t *mq = (merge_queue_t*)queue;
+    int leaf = merge_first (mq);
+    alarm_t *alarm = queue_pop (mq->shard[leaf]);
+
+    if (alarm != NULL) {
+        queue->count--;
+        merge_update (mq, leaf);
+    }
+    return alarm;
+}
+
+static void merge_remove (queue_t *queue, alarm_t *alarm)
+{
+    merge_queue_t *mq = (merge_queue_t*)queue;
+    int leaf = alarm->id % mq->shards;
+    int head = queue_peek (mq->shard[leaf]) == alarm;
+
+    queue_remove (mq->shard[leaf], alarm);
+    queue->count--;
+    if (head)
+        merge_update (mq, leaf);
+}
+
+static void merge_reschedule (queue_t *queue, alarm_t *alarm, time_t time)
+{
+    merge_queue_t *mq = (merge_queue_t*)queue;
+    int leaf = alarm->id % mq->shards;
+    alarm_t *head = queue_peek (mq->shard[leaf]);
+
+    queue_reschedule (mq->shard[leaf], alarm, time);
+    if (head == alarm || queue_peek (mq->shard[leaf]) != head)
+        merge_update (mq, leaf);
+}
+
+static size_t merge_bytes (queue_t *queue)
+{
+    merge_queue_t *mq = (merge_queue_t*)queue;
+    size_t bytes;
+    int i;
+
+    bytes = sizeof (merge_queue_t) + mq->shards * sizeof (queue_t*)
+        + mq->size * (sizeof (time_t) + sizeof (unsigned long)
+            + 2 * sizeof (int));
+    for (i = 0; i < mq->shards; i++)
+        bytes += queue_bytes (mq->shard[i]);
+    return bytes;
+}
+
+const queue_ops_t merge_queue_ops = {
+    "merge",
+    merge_create,
+    merge_destroy,
+    merge_insert,
+    merge_insert_batch,
+    merge_peek,
+    merge_pop,
+    merge_remove,
+    merge_reschedule,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    merge_bytes,
+};
@@ -0,0 +1,212 @@
+/*
+ * alarm_output.c
+ *
+ * The output buffer and thread. See alarm_output.h.
+ */
+#include <pthread.h>
+#include <stdarg.h>
+#include "errors.h"
+#include "alarm_output.h"
+#include "alarm_usage.h"
+
+typedef struct output_buffer_tag {
+    char                *data;
+    size_t              length, size;
+} output_buffer_t;
+
+static pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t output_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t output_idle = PTHREAD_COND_INITIALIZER;
+static output_buffer_t output_pending;  /* lines waiting */
+static output_buffer_t output_writing;  /* lines being written */
+static time_t output_since = 0;         /* when that write began, or 0 */
+static unsigned long output_drops = 0;
+FILE *output_file = NULL;
+
+static void output_lock (void)
+{
+    int status;
+
+    status = pthread_mutex_lock (&output_mutex);
+    if (status != 0)
+        err_abort (status, "Lock output mutex");
+}
+
+static void output_unlock (void)
+{
+    int status;
+
+    status = pthread_mutex_unlock (&output_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock output mutex");
+}
+
+/*
+ * Make room for "length" more bytes (and a terminating null) in the
+ * waiting lines, and wake the output thread if they were empty.
+ * Returns 0, or -1 if the lines would pass OUTPUT_LIMIT, in which
+ * case they are counted as dropped. Called with output_mutex
+ * locked.
+ */
+static int output_reserve (size_t length)
+{
+    size_t size;
+    int status;
+
+    if (output_pending.length + output_writing.length + length
+            > OUTPUT_LIMIT) {
+        output_drops++;
+        return -1;
+    }
+    size = output_pending.size ? output_pending.size : 4096;
+    while (size < output_pending.length + length + 1)
+        size *= 2;
+    if (size != output_pending.size) {
+        output_pending.data = (char*)realloc (output_pending.data, size);
+        if (output_pending.data == NULL)
+            errno_abort ("Allocate output");
+        output_pending.size = size;
+    }
+    if (output_pending.length == 0) {
+        status = pthread_cond_signal (&output_ready);
+        if (status != 0)
+            err_abort (status, "Signal output cond");
+    }
+    return 0;
+}
+
+void output_write (const char *data, size_t length)
+{
+    output_lock ();
+    if (output_reserve (length) == 0) {
+        memcpy (output_pending.data + output_pending.length, data, length);
+        output_pending.length += length;
+    }
+    output_unlock ();
+}
+
+void output_printf (const char *format, ...)
+{
+    va_list ap;
+    int length;
+
+    va_start (ap, format);
+    length = vsnprintf (NULL, 0, format, ap);
+    va_end (ap);
+    output_lock ();
+    if (output_reserve (length) == 0) {
+        va_start (ap, format);
+        vsnprintf (output_pending.data + output_pending.length,
+            length + 1, format, ap);
+        va_end (ap);
+        output_pending.length += length;
+    }
+    output_unlock ();
+}
+
+/*
+ * Write for output_file, which adapts code that prints to a FILE
+ * (such as queue_log) to the buffer.
+ */
+static ssize_t output_cookie_write (void *cookie, const char *data,
+    size_t length)
+{
+    output_write (data, length);
+    return length;
+}
+
+/*
+ * The output thread's start routine. It takes all the lines waiting
+ * at once, and writes them out with output_mutex unlocked, so that
+ * more can be added while it is held up.
+ */
+static void *output_thread (void *arg)
+{
+    output_buffer_t swap;
+    int status;
+
+    usage_register ("alarm-output");
+    output_lock ();
+    while (1) {
+        while (output_pending.length == 0) {
+            status = pthread_cond_wait (&output_ready, &output_mutex);
+            if (status != 0)
+                err_abort (status, "Wait on output cond");
+        }
+        swap = output_writing;
+        output_writing = output_pending;
+        output_pending = swap;
+        output_since = time (NULL);
+        output_unlock ();
+        fwrite (output_writing.data, 1, output_writing.length, stdout);
+        fflush (stdout);
+        output_lock ();
+        output_since = 0;
+        output_writing.length = 0;
+        if (output_pending.length == 0) {
+            status = pthread_cond_broadcast (&output_idle);
+            if (status != 0)
+                err_abort (status, "Broadcast output cond");
+        }
+    }
+}
+
+void output_start (void)
+{
+    cookie_io_functions_t io = {NULL, output_cookie_write, NULL, NULL};
+    pthread_t thread;
+    int status;
+
+    output_file = fopencookie (NULL, "w", io);
+    if (output_file == NULL)
+        errno_abort ("Open output stream");
+    setvbuf (output_file, NULL, _IOLBF, BUFSIZ);
+    status = pthread_create (&thread, NULL, output_thread, NULL);
+    if (status != 0)
+        err_abort (status, "Create output thread");
+}
+
+/*
+ * Wait until every line added so far has been written out.
+ */
+void output_flush (void)
+{
+    int status;
+
+    if (output_file != NULL)
+        fflush (output_file);
+    output_lock ();
+    while (output_pending.length > 0 || output_since != 0) {
+        status = pthread_cond_wait (&output_idle, &output_mutex);
+        if (status != 0)
+            err_abort (status, "Wait on output cond");
+    }
+    output_unlock ();
+}
+
+/*
+ * When the write in progress began, or 0 if the output thread is
+ * not writing.
+ */
+time_t output_stalled (void)
+{
+    time_t since;
+
+    output_lock ();
+    since = output_since;
+    output_unlock ();
+    return since;
+}
+
+/*
+ * How many lines were dropped because the buffer was full.
+ */
+unsigned long output_dropped (void)
+{
+    unsigned long drops;
+
+    output_lock ();
+    drops = output_drops;
+    output_unlock ();
+    return drops;
+}
@@ -0,0 +1,41 @@
+/*
+ * alarm_output.h
+ *
+ * The server's standard output. No thread writes to stdout itself
+ * while it holds alarm_mutex: if stdout is a pipe nobody is
+ * reading, the write blocks holding the stdout lock, and every
+ * thread that prints after it would block behind it, with
+ * alarm_mutex held, freezing the server. Instead, lines are added
+ * to an output buffer (output_printf, output_write), under a mutex
+ * of its own that is never held across I/O, and the output thread
+ * writes them out, holding nothing else.
+ *
+ * A stalled stdout then holds up the output thread alone: the
+ * server goes on taking, scheduling and firing alarms, and the
+ * event ring (-e) goes on being published, while the lines wait.
+ * They can only wait in so much memory: past OUTPUT_LIMIT bytes,
+ * lines are dropped, and counted, rather than have the server grow
+ * without bound behind a reader that has gone away.
+ *
+ * The output thread must be started (output_start) after any fork,
+ * and output_flush must be called before exiting, or the lines
+ * still in the buffer are lost.
+ */
+#ifndef __alarm_output_h
+#define __alarm_output_h
+
+#include <stdio.h>
+#include <time.h>
+
+#define OUTPUT_LIMIT    (16UL * 1024 * 1024)    /* bytes waiting, at most */
+
+extern FILE *output_file;       /* the buffer as a stdio stream */
+
+extern void output_start (void);
+extern void output_printf (const char *format, ...);
+extern void output_write (const char *data, size_t length);
+extern void output_flush (void);
+extern time_t output_stalled (void);
+extern unsigned long output_dropped (void);
+
+#endif
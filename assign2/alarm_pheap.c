@@ -0,0 +1,209 @@
+/*
+ * alarm_pheap.c
+ *
+ * The pairing heap backend. Each alarm record is its own heap node:
+ * "child" points to its first child, "link" to its next sibling, and
+ * "prev" to its previous sibling, or to its parent if it is a first
+ * child. Since an alarm is its own handle, rescheduling one needs no
+ * search and no separate index.
+ *
+ * Insert and meld are O(1). Pop takes the root and merges its
+ * children in two passes (pairs left to right, then the pairs right
+ * to left), amortized O(log n). Moving an alarm earlier cuts its
+ * subtree out and melds it with the root; moving one later removes
+ * and reinserts it.
+ *
+ * Alarms are ordered by expiration time, and then by id, so alarms
+ * with the same deadline leave in the order they were ingested.
+ */
+#include "errors.h"
+#include "alarm.h"
+#include "alarm_queue.h"
+
+typedef struct pheap_queue_tag {
+    queue_t             queue;
+    alarm_t             *root;
+} pheap_queue_t;
+
+#define pheap_before(a, b) \
+    ((a)->time < (b)->time || ((a)->time == (b)->time && (a)->id < (b)->id))
+
+static queue_t *pheap_create (void)
+{
+    pheap_queue_t *pq;
+
+    pq = (pheap_queue_t*)malloc (sizeof (pheap_queue_t));
+    if (pq == NULL)
+        errno_abort ("Allocate pairing heap");
+    pq->queue.ops = &pheap_queue_ops;
+    pq->queue.count = 0;
+    pq->queue.index = NULL;
+    pq->root = NULL;
+    return &pq->queue;
+}
+
+static void pheap_destroy (queue_t *queue)
+{
+    free (queue);
+}
+
+/*
+ * Meld two heaps, either of which may be empty, and return the
+ * root of the result. The root that loses becomes the first child
+ * of the other.
+ */
+static alarm_t *pheap_meld (alarm_t *a, alarm_t *b)
+{
+    alarm_t *t;
+
+    if (a == NULL)
+        return b;
+    if (b == NULL)
+        return a;
+    if (pheap_before (b, a)) {
+        t = a;
+        a = b;
+        b = t;
+    }
+    b->prev = a;
+    b->link = a->child;
+    if (a->child != NULL)
+        a->child->prev = b;
+    a->child = b;
+    a->link = NULL;
+    a->prev = NULL;
+    return a;
+}
+
+/*
+ * Merge a list of sibling heaps into one: meld them in pairs from
+ * left to right, pushing each pair onto a stack (threaded through
+ * "link"), and then meld the stack from the top, which is the right
+ * hand end.
+ */
+static alarm_t *pheap_merge_pairs (alarm_t *first)
+{
+    alarm_t *a, *b, *next, *stack = NULL, *root;
+
+    while (first != NULL) {
+        a = first;
+        b = a->link;
+        next = b != NULL ? b->link : NULL;
+        a->link = a->prev = NULL;
+        if (b != NULL)
+            b->link = b->prev = NULL;
+        a = pheap_meld (a, b);
+        a->link = stack;
+        stack = a;
+        first = next;
+    }
+    root = NULL;
+    while (stack != NULL) {
+        next = stack->link;
+        stack->link = NULL;
+        root = pheap_meld (root, stack);
+        stack = next;
+    }
+    return root;
+}
+
+/*
+ * Cut a node other than the root, with its subtree, out of the heap.
+ */
+static void pheap_cut (alarm_t *alarm)
+{
+    if (alarm->prev->child == alarm)
+        alarm->prev->child = alarm->link;
+    else
+        alarm->prev->link = alarm->link;
+    if (alarm->link != NULL)
+        alarm->link->prev = alarm->prev;
+    alarm->link = NULL;
+    alarm->prev = NULL;
+}
+
+static void pheap_insert (queue_t *queue, alarm_t *alarm)
+{
+    pheap_queue_t *pq = (pheap_queue_t*)queue;
+
+    alarm->child = alarm->link = alarm->prev = NULL;
+    pq->root = pheap_meld (pq->root, alarm);
+    queue->count++;
+}
+
+static void pheap_insert_batch (queue_t *queue, alarm_t *batch)
+{
+    alarm_t *next;
+
+    while (batch != NULL) {
+        next = batch->link;
+        pheap_insert (queue, batch);
+        batch = next;
+    }
+}
+
+static alarm_t *pheap_peek (queue_t *queue)
+{
+    return ((pheap_queue_t*)queue)->root;
+}
+
+static alarm_t *pheap_pop (queue_t *queue)
+{
+    pheap_queue_t *pq = (pheap_queue_t*)queue;
+    alarm_t *alarm = pq->root;
+
+    if (alarm != NULL) {
+        pq->root = pheap_merge_pairs (alarm->child);
+        alarm->child = NULL;
+        queue->count--;
+    }
+    return alarm;
+}
+
+static void pheap_remove (queue_t *queue, alarm_t *alarm)
+{
+    pheap_queue_t *pq = (pheap_queue_t*)queue;
+
+    if (alarm == pq->root) {
+        pheap_pop (queue);
+        return;
+    }
+    pheap_cut (alarm);
+    pq->root = pheap_meld (pq->root, pheap_merge_pairs (alarm->child));
+    alarm->child = NULL;
+    queue->count--;
+}
+
+static void pheap_reschedule (queue_t *queue, alarm_t *alarm, time_t time)
+{
+    pheap_queue_t *pq = (pheap_queue_t*)queue;
+
+    if (time > alarm->time) {
+        pheap_remove (queue, alarm);
+        alarm->time = time;
+        pheap_insert (queue, alarm);
+        return;
+    }
+
+    /*
+     * Decrease key: the alarm's subtree is still heap ordered, so
+     * it only has to be cut out and melded with the root.
+     */
+    alarm->time = time;
+    if (alarm != pq->root) {
+        pheap_cut (alarm);
+        pq->root = pheap_meld (pq->root, alarm);
+    }
+}
+
+const queue_ops_t pheap_queue_ops = {
+    "pheap",
+    pheap_create,
+    pheap_destroy,
+    pheap_insert,
+    pheap_insert_batch,
+    pheap_peek,
+    pheap_pop,
+    pheap_remove,
+    pheap_reschedule,
+};
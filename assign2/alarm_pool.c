@@ -0,0 +1,220 @@
+/*
+ * alarm_pool.c
+ *
+ * Huge page aware mappings, and the fixed size object pool built on
+ * them. See alarm_pool.h.
+ */
+#include <pthread.h>
+#include <sys/mman.h>
+#include "errors.h"
+#include "alarm_pool.h"
+
+#define HUGE_PAGE_SIZE  (2 * 1024 * 1024)
+
+static int huge_mode = POOL_HUGE_NONE;
+static int explicit_warned = 0;
+
+/*
+ * Translate a -H argument into a mode, or -1 if it isn't one.
+ */
+int pool_huge_mode (const char *name)
+{
+    if (strcmp (name, "none") == 0)
+        return POOL_HUGE_NONE;
+    if (strcmp (name, "thp") == 0)
+        return POOL_HUGE_THP;
+    if (strcmp (name, "explicit") == 0)
+        return POOL_HUGE_EXPLICIT;
+    return -1;
+}
+
+/*
+ * Select the page size for mappings made from now on. Existing
+ * mappings keep whatever they were given.
+ */
+void pool_set_huge (int mode)
+{
+    huge_mode = mode;
+}
+
+int pool_get_huge (void)
+{
+    return huge_mode;
+}
+
+/*
+ * Round a mapping size the way pool_map does, so that pool_unmap
+ * can release exactly what was mapped. Anything mapped with huge
+ * pages in mind is a whole number of huge pages.
+ */
+static size_t map_size (size_t size, int mode)
+{
+    size_t unit = mode == POOL_HUGE_NONE ?
+        (size_t)sysconf (_SC_PAGESIZE) : HUGE_PAGE_SIZE;
+
+    return (size + unit - 1) & ~(unit - 1);
+}
+
+/*
+ * Map a huge page aligned region, and ask for transparent huge
+ * pages on it. mmap only promises page alignment, so map an extra
+ * huge page and trim the ends.
+ */
+static void *map_thp (size_t size)
+{
+    char *addr, *aligned;
+    size_t head, tail;
+
+    addr = (char*)mmap (NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+        return NULL;
+    aligned = (char*)(((unsigned long)addr + HUGE_PAGE_SIZE - 1)
+        & ~(unsigned long)(HUGE_PAGE_SIZE - 1));
+    head = aligned - addr;
+    tail = HUGE_PAGE_SIZE - head;
+    if (head > 0)
+        munmap (addr, head);
+    if (tail > 0)
+        munmap (aligned + size, tail);
+#ifdef MADV_HUGEPAGE
+    madvise (aligned, size, MADV_HUGEPAGE);
+#endif
+    return aligned;
+}
+
+/*
+ * Map "size" bytes of zeroed memory. Aborts if memory is exhausted.
+ */
+void *pool_map (size_t size)
+{
+    int mode = huge_mode;
+    void *addr = NULL;
+
+    size = map_size (size, mode);
+    if (mode == POOL_HUGE_EXPLICIT) {
+#ifdef MAP_HUGETLB
+        addr = mmap (NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (addr == MAP_FAILED)
+            addr = NULL;
+#endif
+        if (addr == NULL && !explicit_warned) {
+            explicit_warned = 1;
+            fprintf (stderr, "No explicit huge pages available, "
+                "using transparent huge pages\n");
+        }
+    }
+    if (addr == NULL && mode != POOL_HUGE_NONE)
+        addr = map_thp (size);
+    if (addr == NULL) {
+        addr = mmap (NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED)
+            errno_abort ("Map pool memory");
+    }
+    return addr;
+}
+
+void pool_unmap (void *addr, size_t size)
+{
+    munmap (addr, map_size (size, huge_mode));
+}
+
+void pool_init (pool_t *pool, size_t object_size)
+{
+    int status;
+
+    memset (pool, 0, sizeof (pool_t));
+    status = pthread_mutex_init (&pool->mutex, NULL);
+    if (status != 0)
+        err_abort (status, "Init pool mutex");
+    pool->object_size = object_size;
+}
+
+/*
+ * Release every chunk of the pool. Any object still in use goes
+ * with it.
+ */
+void pool_destroy (pool_t *pool)
+{
+    void *chunk, *next;
+
+    for (chunk = pool->chunks; chunk != NULL; chunk = next) {
+        next = *(void**)chunk;
+        pool_unmap (chunk, POOL_CHUNK_SIZE);
+    }
+    pthread_mutex_destroy (&pool->mutex);
+}
+
+/*
+ * Take an object from the free list, or carve a new one from the
+ * current chunk, mapping a new chunk when that runs out. The first
+ * word of each chunk links it into the pool's chunk list, and the
+ * first word of each free object links it into the free list.
+ */
+void *pool_get (pool_t *pool)
+{
+    void *object;
+    size_t size = (pool->object_size + sizeof (void*) - 1)
+        & ~(sizeof (void*) - 1);
+    int status;
+
+    status = pthread_mutex_lock (&pool->mutex);
+    if (status != 0)
+        err_abort (status, "Lock pool mutex");
+    if (pool->free != NULL) {
+        object = pool->free;
+        pool->free = *(void**)object;
+    } else {
+        if (pool->next == NULL || pool->next + size > pool->end) {
+            pool->next = (char*)pool_map (POOL_CHUNK_SIZE);
+            pool->end = pool->next + POOL_CHUNK_SIZE;
+            *(void**)pool->next = pool->chunks;
+            pool->chunks = pool->next;
+            pool->next += sizeof (void*);
+            pool->nchunks++;
+        }
+        object = pool->next;
+        pool->next += size;
+    }
+    pool->in_use++;
+    status = pthread_mutex_unlock (&pool->mutex);
+    if (status != 0)
+        err_abort (status, "Unlock pool mutex");
+    return object;
+}
+
+void pool_put (pool_t *pool, void *object)
+{
+    int status;
+
+    status = pthread_mutex_lock (&pool->mutex);
+    if (status != 0)
+        err_abort (status, "Lock pool mutex");
+    *(void**)object = pool->free;
+    pool->free = object;
+    pool->in_use--;
+    status = pthread_mutex_unlock (&pool->mutex);
+    if (status != 0)
+        err_abort (status, "Unlock pool mutex");
+}
+
+/*
+ * Memory mapped for the pool's chunks, whether or not any of their
+ * objects are in use.
+ */
+size_t pool_bytes (pool_t *pool)
+{
+    size_t bytes;
+    int status;
+
+    status = pthread_mutex_lock (&pool->mutex);
+    if (status != 0)
+        err_abort (status, "Lock pool mutex");
+    bytes = pool->nchunks * POOL_CHUNK_SIZE;
+    status = pthread_mutex_unlock (&pool->mutex);
+    if (status != 0)
+        err_abort (status, "Unlock pool mutex");
+    return bytes;
+}
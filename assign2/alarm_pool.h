@@ -0,0 +1,57 @@
+/*
+ * alarm_pool.h
+ *
+ * Memory for the alarm server's bulk structures. pool_map hands out
+ * zeroed memory straight from mmap, optionally backed by huge pages
+ * so that tens of millions of alarm records don't cost a TLB miss
+ * per record touched:
+ *
+ *      none        ordinary pages (the default)
+ *      thp         transparent huge pages, requested with madvise
+ *                  on 2MB aligned regions
+ *      explicit    MAP_HUGETLB pages from the kernel's huge page
+ *                  pool, falling back to thp when none are free
+ *
+ * A pool_t is a free list allocator for fixed size objects, which
+ * carves its objects out of 2MB chunks from pool_map. Alarm records
+ * come from such a pool (alarm_alloc), as does the wheel.
+ */
+#ifndef __alarm_pool_h
+#define __alarm_pool_h
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define POOL_HUGE_NONE          0
+#define POOL_HUGE_THP           1
+#define POOL_HUGE_EXPLICIT      2
+
+#define POOL_CHUNK_SIZE         (2 * 1024 * 1024)
+
+typedef struct pool_tag {
+    pthread_mutex_t     mutex;
+    size_t              object_size;
+    void                *free;          /* free list of objects */
+    char                *next;          /* unused space in chunk */
+    char                *end;
+    void                *chunks;        /* list of chunks, to unmap */
+    unsigned long       nchunks;
+    unsigned long       in_use;
+} pool_t;
+
+#define POOL_INITIALIZER(size) \
+    {PTHREAD_MUTEX_INITIALIZER, (size), NULL, NULL, NULL, NULL, 0, 0}
+
+extern int pool_huge_mode (const char *name);
+extern void pool_set_huge (int mode);
+extern int pool_get_huge (void);
+extern void *pool_map (size_t size);
+extern void pool_unmap (void *addr, size_t size);
+
+extern void pool_init (pool_t *pool, size_t object_size);
+extern void pool_destroy (pool_t *pool);
+extern void *pool_get (pool_t *pool);
+extern void pool_put (pool_t *pool, void *object);
+extern size_t pool_bytes (pool_t *pool);
+
+#endif
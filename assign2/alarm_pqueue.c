@@ -0,0 +1,736 @@
+/*
+ * alarm_pqueue.c
+ *
+ * The mapped queue file. See alarm_pqueue.h.
+ *
+ * The file is laid out as the header (one page), then the heap,
+ * the record states, the alarm records, and the id table, each
+ * array sized by the capacity given when the file was created and
+ * aligned on a cache line. The file is created sparse, so disk
+ * space is only taken as records are used.
+ *
+ * Record numbers in the free and in-flight lists and in the id
+ * table are stored plus one, so that zero means none.
+ */
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "errors.h"
+#include "alarm.h"
+#include "alarm_queue.h"
+#include "alarm_pqueue.h"
+
+#define PQUEUE_MAGIC    "ALPQ"
+#define PQUEUE_VERSION  1
+#define PQUEUE_HEADER   4096
+
+#define STATE_FREE      0
+#define STATE_NEW       1
+#define STATE_QUEUED    2
+#define STATE_FIRING    3
+
+typedef struct pqueue_header_tag {
+    char                magic[4];
+    unsigned int        version;
+    unsigned long       capacity;       /* records */
+    unsigned long       record_size;    /* sizeof (alarm_t) */
+    unsigned long       table_size;     /* id table slots, power of 2 */
+    unsigned long       count;          /* heap entries */
+    unsigned long       unused;         /* records never used start here */
+    unsigned long       max_id;         /* highest id queued */
+    unsigned int        free;           /* free list */
+    unsigned int        inflight;       /* new and firing records */
+    unsigned int        generation;     /* opens of the file */
+    unsigned int        busy;           /* updates under way */
+} pqueue_header_t;
+
+typedef struct pqueue_entry_tag {
+    time_t              time;
+    unsigned long       id;
+    unsigned int        record;
+} pqueue_entry_t;
+
+typedef struct pqueue_meta_tag {
+    unsigned int        pos;            /* in the heap, if queued */
+    unsigned int        next;           /* free or in-flight list */
+    unsigned int        prev;           /* in-flight list */
+    unsigned short      state;
+    unsigned short      generation;     /* pointers set in this open */
+} pqueue_meta_t;
+
+typedef struct pqueue_tag {
+    queue_t             queue;
+    pthread_mutex_t     mutex;          /* free and in-flight lists */
+    int                 fd;
+    char                *base;
+    size_t              size;
+    pqueue_header_t     *header;
+    pqueue_entry_t      *heap;
+    pqueue_meta_t       *meta;
+    alarm_t             *record;
+    unsigned int        *table;
+    unsigned long       updates;        /* since the last sync */
+} pqueue_t;
+
+queue_t *pqueue_records = NULL;
+
+#define ALIGN(n)        (((n) + 63) & ~(size_t)63)
+#define entry_before(a, b) \
+    ((a)->time < (b)->time || ((a)->time == (b)->time && (a)->id < (b)->id))
+#define table_hash(pq, id) \
+    ((unsigned long)((id) * 0x9e3779b97f4a7c15ULL) \
+        & ((pq)->header->table_size - 1))
+
+/*
+ * Point the arrays into a mapping of a file with "capacity" records
+ * and an id table of "table_size" slots, and return the file size.
+ */
+static size_t pqueue_layout (pqueue_t *pq, unsigned long capacity,
+    unsigned long table_size)
+{
+    size_t offset = PQUEUE_HEADER;
+
+    pq->heap = (pqueue_entry_t*)(pq->base + offset);
+    offset += ALIGN (capacity * sizeof (pqueue_entry_t));
+    pq->meta = (pqueue_meta_t*)(pq->base + offset);
+    offset += ALIGN (capacity * sizeof (pqueue_meta_t));
+    pq->record = (alarm_t*)(pq->base + offset);
+    offset += ALIGN (capacity * sizeof (alarm_t));
+    pq->table = (unsigned int*)(pq->base + offset);
+    offset += ALIGN (table_size * sizeof (unsigned int));
+    return offset;
+}
+
+static void pqueue_lock (pqueue_t *pq)
+{
+    int status;
+
+    status = pthread_mutex_lock (&pq->mutex);
+    if (status != 0)
+        err_abort (status, "Lock queue file mutex");
+}
+
+static void pqueue_unlock (pqueue_t *pq)
+{
+    int status;
+
+    status = pthread_mutex_unlock (&pq->mutex);
+    if (status != 0)
+        err_abort (status, "Unlock queue file mutex");
+}
+
+/*
+ * Mark updates to the file as under way, or done. The lists are
+ * updated under the mutex while the heap is updated under
+ * alarm_mutex, so "busy" counts them.
+ */
+static void pqueue_busy (pqueue_t *pq)
+{
+    __atomic_add_fetch (&pq->header->busy, 1, __ATOMIC_RELAXED);
+}
+
+static void pqueue_done (pqueue_t *pq)
+{
+    __atomic_sub_fetch (&pq->header->busy, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Count an update, and sync the mapping once a batch of them has
+ * built up.
+ */
+static void pqueue_updated (pqueue_t *pq)
+{
+    if (++pq->updates >= PQUEUE_SYNC)
+        pqueue_sync (&pq->queue, 0);
+}
+
+/*
+ * Give a record from an earlier run fresh pointers, the first time
+ * this run touches it.
+ */
+static alarm_t *pqueue_fresh (pqueue_t *pq, unsigned int r)
+{
+    alarm_t *alarm = &pq->record[r];
+
+    if (pq->meta[r].generation != (unsigned short)pq->header->generation) {
+        alarm->link = NULL;
+        alarm->chain = NULL;
+        alarm->child = NULL;
+        alarm->prev = NULL;
+        alarm->owner = NULL;
+        alarm->source = NULL;
+        pq->meta[r].generation = (unsigned short)pq->header->generation;
+    }
+    return alarm;
+}
+
+/*
+ * The in-flight list. Called with the mutex locked.
+ */
+static void inflight_add (pqueue_t *pq, unsigned int r)
+{
+    pq->meta[r].prev = 0;
+    pq->meta[r].next = pq->header->inflight;
+    if (pq->header->inflight != 0)
+        pq->meta[pq->header->inflight - 1].prev = r + 1;
+    pq->header->inflight = r + 1;
+}
+
+static void inflight_remove (pqueue_t *pq, unsigned int r)
+{
+    pqueue_meta_t *m = &pq->meta[r];
+
+    if (m->prev != 0)
+        pq->meta[m->prev - 1].next = m->next;
+    else
+        pq->header->inflight = m->next;
+    if (m->next != 0)
+        pq->meta[m->next - 1].prev = m->prev;
+}
+
+/*
+ * Move a record between states, keeping the in-flight list in
+ * step.
+ */
+static void pqueue_state (pqueue_t *pq, unsigned int r, int state)
+{
+    int old = pq->meta[r].state;
+
+    pqueue_lock (pq);
+    if (old == STATE_NEW || old == STATE_FIRING)
+        inflight_remove (pq, r);
+    if (state == STATE_NEW || state == STATE_FIRING)
+        inflight_add (pq, r);
+    pq->meta[r].state = state;
+    pqueue_unlock (pq);
+}
+
+/*
+ * The heap. Each record's heap position is kept in its state, so
+ * that remove and reschedule can find its entry.
+ */
+static void heap_set (pqueue_t *pq, unsigned long i, pqueue_entry_t *entry)
+{
+    pq->heap[i] = *entry;
+    pq->meta[entry->record].pos = i;
+}
+
+static void heap_up (pqueue_t *pq, unsigned long i)
+{
+    pqueue_entry_t entry = pq->heap[i];
+    unsigned long parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!entry_before (&entry, &pq->heap[parent]))
+            break;
+        heap_set (pq, i, &pq->heap[parent]);
+        i = parent;
+    }
+    heap_set (pq, i, &entry);
+}
+
+static void heap_down (pqueue_t *pq, unsigned long i)
+{
+    pqueue_entry_t entry = pq->heap[i];
+    unsigned long child, n = pq->header->count;
+
+    while ((child = 2 * i + 1) < n) {
+        if (child + 1 < n && entry_before (&pq->heap[child + 1],
+                &pq->heap[child]))
+            child++;
+        if (!entry_before (&pq->heap[child], &entry))
+            break;
+        heap_set (pq, i, &pq->heap[child]);
+        i = child;
+    }
+    heap_set (pq, i, &entry);
+}
+
+static void heap_push (pqueue_t *pq, unsigned int r)
+{
+    pqueue_entry_t entry;
+
+    entry.time = pq->record[r].time;
+    entry.id = pq->record[r].id;
+    entry.record = r;
+    pq->heap[pq->header->count] = entry;
+    heap_up (pq, pq->header->count++);
+}
+
+static void heap_delete (pqueue_t *pq, unsigned long i)
+{
+    unsigned long last = --pq->header->count;
+
+    if (i == last)
+        return;
+    heap_set (pq, i, &pq->heap[last]);
+    if (i > 0 && entry_before (&pq->heap[i], &pq->heap[(i - 1) / 2]))
+        heap_up (pq, i);
+    else
+        heap_down (pq, i);
+}
+
+/*
+ * The id table: open addressing, linear probing, with deleted
+ * entries closed up as in the queue index (alarm_queue.c).
+ */
+static void table_add (pqueue_t *pq, unsigned int r)
+{
+    unsigned long i = table_hash (pq, pq->record[r].id);
+    unsigned long mask = pq->header->table_size - 1;
+
+    while (pq->table[i] != 0)
+        i = (i + 1) & mask;
+    pq->table[i] = r + 1;
+}
+
+static long table_slot (pqueue_t *pq, unsigned long id)
+{
+    unsigned long i = table_hash (pq, id);
+    unsigned long mask = pq->header->table_size - 1;
+
+    while (pq->table[i] != 0) {
+        if (pq->record[pq->table[i] - 1].id == id)
+            return i;
+        i = (i + 1) & mask;
+    }
+    return -1;
+}
+
+static void table_delete (pqueue_t *pq, unsigned long id)
+{
+    unsigned long mask = pq->header->table_size - 1;
+    unsigned long i, j, home;
+    long slot = table_slot (pq, id);
+
+    if (slot < 0)
+        return;
+    i = slot;
+    pq->table[i] = 0;
+    for (j = (i + 1) & mask; pq->table[j] != 0; j = (j + 1) & mask) {
+        home = table_hash (pq, pq->record[pq->table[j] - 1].id);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            pq->table[i] = pq->table[j];
+            pq->table[j] = 0;
+            i = j;
+        }
+    }
+}
+
+/*
+ * Rebuild the heap, id table and lists from the record states,
+ * after an update was cut short.
+ */
+static void pqueue_repair (pqueue_t *pq)
+{
+    pqueue_header_t *h = pq->header;
+    unsigned long r;
+
+    memset (pq->table, 0, h->table_size * sizeof (unsigned int));
+    h->count = 0;
+    h->free = 0;
+    h->inflight = 0;
+    for (r = h->unused; r-- > 0; ) {
+        switch (pq->meta[r].state) {
+        case STATE_QUEUED:
+            heap_push (pq, r);
+            table_add (pq, r);
+            break;
+        case STATE_FREE:
+            pq->meta[r].next = h->free;
+            h->free = r + 1;
+            break;
+        default:
+            inflight_add (pq, r);
+            break;
+        }
+    }
+}
+
+/*
+ * Settle the records in flight when an earlier run stopped: queue
+ * again those that were firing, and free those that were never
+ * queued.
+ */
+static void pqueue_settle (pqueue_t *pq)
+{
+    pqueue_header_t *h = pq->header;
+    unsigned int r, next;
+
+    for (next = h->inflight; next != 0; ) {
+        r = next - 1;
+        next = pq->meta[r].next;
+        if (pq->meta[r].state == STATE_FIRING) {
+            pq->meta[r].state = STATE_QUEUED;
+            heap_push (pq, r);
+            table_add (pq, r);
+        } else {
+            pq->meta[r].state = STATE_FREE;
+            pq->meta[r].next = h->free;
+            h->free = r + 1;
+        }
+    }
+    h->inflight = 0;
+}
+
+/*
+ * Open the queue file at "path", creating it with room for
+ * "capacity" records if it doesn't exist. An existing file keeps
+ * the capacity it was created with.
+ */
+queue_t *pqueue_open (const char *path, unsigned long capacity)
+{
+    pqueue_t *pq;
+    pqueue_header_t header;
+    unsigned long table_size = 1024;
+    struct stat st;
+    int status, created;
+
+    pq = (pqueue_t*)malloc (sizeof (pqueue_t));
+    if (pq == NULL)
+        errno_abort ("Allocate queue file");
+    memset (pq, 0, sizeof (pqueue_t));
+    status = pthread_mutex_init (&pq->mutex, NULL);
+    if (status != 0)
+        err_abort (status, "Init queue file mutex");
+    pq->fd = open (path, O_RDWR | O_CREAT, 0644);
+    if (pq->fd < 0 || fstat (pq->fd, &st) < 0)
+        errno_abort ("Open queue file");
+    created = st.st_size == 0;
+    if (created) {
+        memset (&header, 0, sizeof (header));
+        memcpy (header.magic, PQUEUE_MAGIC, 4);
+        header.version = PQUEUE_VERSION;
+        header.capacity = capacity;
+        header.record_size = sizeof (alarm_t);
+        while (table_size < 2 * capacity)
+            table_size *= 2;
+        header.table_size = table_size;
+    } else if (pread (pq->fd, &header, sizeof (header), 0) != sizeof (header)
+            || memcmp (header.magic, PQUEUE_MAGIC, 4) != 0
+            || header.version != PQUEUE_VERSION
+            || header.record_size != sizeof (alarm_t)) {
+        fprintf (stderr, "%s is not a queue file of this server\n", path);
+        exit (1);
+    }
+    pq->size = pqueue_layout (pq, header.capacity, header.table_size);
+    if (created && ftruncate (pq->fd, pq->size) < 0)
+        errno_abort ("Size queue file");
+    pq->base = (char*)mmap (NULL, pq->size, PROT_READ | PROT_WRITE,
+        MAP_SHARED, pq->fd, 0);
+    if (pq->base == MAP_FAILED)
+        errno_abort ("Map queue file");
+    pqueue_layout (pq, header.capacity, header.table_size);
+    pq->header = (pqueue_header_t*)pq->base;
+    if (created)
+        *pq->header = header;
+    pq->header->generation++;
+    if (pq->header->busy != 0) {
+        fprintf (stderr, "Queue file %s was left mid-update, "
+            "rebuilding it\n", path);
+        pqueue_repair (pq);
+    }
+    pqueue_busy (pq);
+    pqueue_settle (pq);
+    pq->header->busy = 0;
+    pq->queue.ops = &pqueue_ops;
+    pq->queue.count = pq->header->count;
+    pq->queue.index = NULL;
+    return &pq->queue;
+}
+
+void pqueue_sync (queue_t *queue, int wait)
+{
+    pqueue_t *pq = (pqueue_t*)queue;
+
+    if (msync (pq->base, pq->size, wait ? MS_SYNC : MS_ASYNC) < 0)
+        errno_abort ("Sync queue file");
+    pq->updates = 0;
+}
+
+void pqueue_close (queue_t *queue)
+{
+    pqueue_t *pq = (pqueue_t*)queue;
+
+    if (pqueue_records == queue)
+        pqueue_records = NULL;
+    pqueue_sync (queue, 1);
+    munmap (pq->base, pq->size);
+    close (pq->fd);
+    pthread_mutex_destroy (&pq->mutex);
+    free (pq);
+}
+
+unsigned long pqueue_capacity (queue_t *queue)
+{
+    return ((pqueue_t*)queue)->header->capacity;
+}
+
+/*
+ * Records ever used: the file's high water mark.
+ */
+unsigned long pqueue_used (queue_t *queue)
+{
+    return ((pqueue_t*)queue)->header->unused;
+}
+
+/*
+ * The highest id in the file, so that a restarted server can give
+ * out ids above it.
+ */
+unsigned long pqueue_max_id (queue_t *queue)
+{
+    return ((pqueue_t*)queue)->header->max_id;
+}
+
+/*
+ * Allocate a record from the file, or return NULL if it is full.
+ * The caller initializes it, as alarm_alloc_due does.
+ */
+alarm_t *pqueue_alloc (queue_t *queue)
+{
+    pqueue_t *pq = (pqueue_t*)queue;
+    pqueue_header_t *h = pq->header;
+    unsigned int r;
+
+    pqueue_lock (pq);
+    pqueue_busy (pq);
+    if (h->free != 0) {
+        r = h->free - 1;
+        h->free = pq->meta[r].next;
+    } else if (h->unused < h->capacity)
+        r = h->unused++;
+    else {
+        pqueue_done (pq);
+        pqueue_unlock (pq);
+        return NULL;
+    }
+    pq->meta[r].state = STATE_NEW;
+    pq->meta[r].generation = (unsigned short)h->generation;
+    inflight_add (pq, r);
+    pqueue_done (pq);
+    pqueue_unlock (pq);
+    return &pq->record[r];
+}
+
+int pqueue_owns (queue_t *queue, alarm_t *alarm)
+{
+    pqueue_t *pq = (pqueue_t*)queue;
+
+    return alarm >= pq->record && alarm < pq->record + pq->header->capacity;
+}
+
+void pqueue_free (queue_t *queue, alarm_t *alarm)
+{
+    pqueue_t *pq = (pqueue_t*)queue;
+    unsigned int r = alarm - pq->record;
+
+    pqueue_lock (pq);
+    pqueue_busy (pq);
+    if (pq->meta[r].state == STATE_NEW || pq->meta[r].state == STATE_FIRING)
+        inflight_remove (pq, r);
+    pq->meta[r].state = STATE_FREE;
+    pq->meta[r].next = pq->header->free;
+    pq->header->free = r + 1;
+    pqueue_done (pq);
+    pqueue_unlock (pq);
+}
+
+/*
+ * The file is opened with pqueue_open, not queue_create.
+ */
+static void pqueue_destroy (queue_t *queue)
+{
+    pqueue_close (queue);
+}
+
+static void pqueue_insert (queue_t *queue, alarm_t *alarm)
+{
+    pqueue_t *pq = (pqueue_t*)queue;
+    unsigned int r;
+
+    /*
+     * Records from outside the file can't be queued in it; the
+     * server refuses them before they get here (alarm_queueable).
+     */
+    if (!pqueue_owns (queue, alarm)) {
+        fprintf (stderr, "Record outside the queue file\n");
+        abort ();
+    }
+    r = alarm - pq->record;
+    pqueue_busy (pq);
+    pqueue_state (pq, r, STATE_QUEUED);
+    heap_push (pq, r);
+    table_add (pq, r);
+    if (alarm->id > pq->header->max_id)
+        pq->header->max_id = alarm->id;
+    pqueue_done (pq);
+    queue->count++;
+    pqueue_updated (pq);
+}
+
+static void pqueue_insert_batch (queue_t *queue, alarm_t *batch)
+{
+    alarm_t *next;
+
+    while (batch != NULL) {
+        next = batch->link;
+        pqueue_insert (queue, batch);
+        batch = next;
+    }
+}
+
+static alarm_t *pqueue_peek (queue_t *queue)
+{
+    pqueue_t *pq = (pqueue_t*)queue;
+
+    if (pq->header->count == 0)
+        return NULL;
+    return pqueue_fresh (pq, pq->heap[0].record);
+}
+
+/*
+ * Take a queued record out of the heap and the table, into "state".
+ */
+static void pqueue_take (pqueue_t *pq, unsigned int r, int state)
+{
+    pqueue_busy (pq);
+    table_delete (pq, pq->record[r].id);
+    heap_delete (pq, pq->meta[r].pos);
+    pqueue_state (pq, r, state);
+    pqueue_done (pq);
+    pq->queue.count--;
+    pqueue_updated (pq);
+}
+
+static alarm_t *pqueue_pop (queue_t *queue)
+{
+    pqueue_t *pq = (pqueue_t*)queue;
+    unsigned int r;
+
+    if (pq->header->count == 0)
+        return NULL;
+    r = pq->heap[0].record;
+    pqueue_take (pq, r, STATE_FIRING);
+    return pqueue_fresh (pq, r);
+}
+
+static void pqueue_remove (queue_t *queue, alarm_t *alarm)
+{
+    pqueue_t *pq = (pqueue_t*)queue;
+
+    pqueue_take (pq, alarm - pq->record, STATE_NEW);
+}
+
+static void pqueue_reschedule (queue_t *queue, alarm_t *alarm, time_t time)
+{
+    pqueue_t *pq = (pqueue_t*)queue;
+    unsigned long i = pq->meta[alarm - pq->record].pos;
+
+    pqueue_busy (pq);
+    alarm->time = time;
+    pq->heap[i].time = time;
+    if (i > 0 && entry_before (&pq->heap[i], &pq->heap[(i - 1) / 2]))
+        heap_up (pq, i);
+    else
+        heap_down (pq, i);
+    pqueue_done (pq);
+    pqueue_updated (pq);
+}
+
+/*
+ * Gather the queued alarms due from "from" to "to", sorted, from a
+ * scan of the heap array.
+ */
+static long pqueue_gather (pqueue_t *pq, time_t from, time_t to,
+    alarm_t ***found)
+{
+    alarm_t **list = NULL;
+    unsigned long i;
+    long n = 0, size = 0;
+
+    for (i = 0; i < pq->header->count; i++) {
+        if (pq->heap[i].time < from || pq->heap[i].time > to)
+            continue;
+        if (n == size) {
+            size = size ? size * 2 : 64;
+            list = (alarm_t**)realloc (list, size * sizeof (alarm_t*));
+            if (list == NULL)
+                errno_abort ("Allocate range");
+        }
+        list[n++] = pqueue_fresh (pq, pq->heap[i].record);
+    }
+    if (n > 0)
+        queue_sort (list, n);
+    *found = list;
+    return n;
+}
+
+static long pqueue_range (queue_t *queue, time_t from, time_t to,
+    void (*func) (alarm_t *alarm, void *arg), void *arg)
+{
+    alarm_t **list;
+    long i, n;
+
+    n = pqueue_gather ((pqueue_t*)queue, from, to, &list);
+    for (i = 0; i < n; i++)
+        func (list[i], arg);
+    free (list);
+    return n;
+}
+
+static long pqueue_remove_range (queue_t *queue, time_t from, time_t to,
+    void (*func) (alarm_t *alarm, void *arg), void *arg)
+{
+    alarm_t **list;
+    long i, n;
+
+    n = pqueue_gather ((pqueue_t*)queue, from, to, &list);
+    for (i = 0; i < n; i++) {
+        pqueue_remove (queue, list[i]);
+        func (list[i], arg);
+    }
+    free (list);
+    return n;
+}
+
+static alarm_t *pqueue_find (queue_t *queue, unsigned long id)
+{
+    pqueue_t *pq = (pqueue_t*)queue;
+    long slot = table_slot (pq, id);
+
+    return slot < 0 ? NULL : pqueue_fresh (pq, pq->table[slot] - 1);
+}
+
+/*
+ * The file is sparse: count the id table, and the heap entry, meta
+ * data and record of every record ever used.
+ */
+static size_t pqueue_bytes (queue_t *queue)
+{
+    pqueue_t *pq = (pqueue_t*)queue;
+
+    return sizeof (pqueue_header_t)
+        + pq->header->table_size * sizeof (unsigned int)
+        + pq->header->unused * (sizeof (pqueue_entry_t)
+            + sizeof (pqueue_meta_t) + pq->header->record_size);
+}
+
+const queue_ops_t pqueue_ops = {
+    "file",
+    NULL,                       /* see pqueue_open */
+    pqueue_destroy,
+    pqueue_insert,
+    pqueue_insert_batch,
+    pqueue_peek,
+    pqueue_pop,
+    pqueue_remove,
+    pqueue_reschedule,
+    NULL,
+    pqueue_range,
+    pqueue_remove_range,
+    pqueue_find,
+    pqueue_bytes,
+};
@@ -0,0 +1,67 @@
+/*
+ * alarm_pqueue.h
+ *
+ * A queue backend whose every structure lives in a file mapped
+ * with MAP_SHARED (-M): the alarm records themselves, a binary heap
+ * of (expiry time, id, record) entries, and a hash table from id to
+ * record. Everything in the file refers to everything else by
+ * record number, never by address, so the file means the same
+ * wherever it is mapped. A restarted server maps the file and
+ * carries on firing from the top of the heap, without reading, let
+ * alone replaying, the alarms in it (compare the write-ahead log,
+ * alarm_wal.h, which has to rebuild the queue).
+ *
+ * While the file is open, new alarm records come from it (see
+ * alarm_alloc_due), and alarm_free gives them back to it. Each
+ * record is in one of four states:
+ *
+ *      free    on the free list
+ *      new     allocated, and not queued (or cancelled, and not
+ *              freed yet)
+ *      queued  in the heap and the id table
+ *      firing  popped by the alarm thread, and not freed yet
+ *
+ * New and firing records are kept on an in-flight list. At restart
+ * the firing ones are queued again, since they may not have fired
+ * (an alarm fires at least once), and the new ones are freed.
+ *
+ * Writes to the mapping reach the file as soon as the process
+ * makes them, so a server that is killed loses nothing. Against
+ * the machine going down, the mapping is synced every PQUEUE_SYNC
+ * updates, and whenever the server flushes its output. An update
+ * that was cut short leaves the file marked busy, and at restart
+ * the heap, table and lists are then rebuilt from the records'
+ * states.
+ *
+ * Pointers in a record (its chain, for instance) mean nothing to a
+ * later process, so records from an earlier run are given fresh
+ * ones as they are first touched. Chains are not carried across a
+ * restart; their armed stages are, as plain alarms.
+ */
+#ifndef __alarm_pqueue_h
+#define __alarm_pqueue_h
+
+#include "alarm.h"
+#include "alarm_queue.h"
+
+#define PQUEUE_CAPACITY (1UL << 24)     /* records in a new file */
+#define PQUEUE_SYNC     65536           /* updates between msyncs */
+
+extern const queue_ops_t pqueue_ops;
+
+/*
+ * The open file new alarm records are allocated from, or NULL.
+ */
+extern queue_t *pqueue_records;
+
+extern queue_t *pqueue_open (const char *path, unsigned long capacity);
+extern void pqueue_close (queue_t *queue);
+extern void pqueue_sync (queue_t *queue, int wait);
+extern unsigned long pqueue_capacity (queue_t *queue);
+extern unsigned long pqueue_max_id (queue_t *queue);
+extern unsigned long pqueue_used (queue_t *queue);
+extern alarm_t *pqueue_alloc (queue_t *queue);
+extern int pqueue_owns (queue_t *queue, alarm_t *alarm);
+extern void pqueue_free (queue_t *queue, alarm_t *alarm);
+
+#endif
@@ -0,0 +1,466 @@
+/*
+ * alarm_queue.c
+ *
+ * Backend selection, the index of pending alarms by id, and the
+ * list backend: the sorted alarm list the server has always used,
+ * built on alarm_insert.
+ */
+#include "errors.h"
+#include "alarm.h"
+#include "alarm_queue.h"
+
+static const queue_ops_t *backends[] = {
+    &list_queue_ops,
+    &wheel_queue_ops,
+    &pheap_queue_ops,
+    &adapt_queue_ops,
+    &merge_queue_ops,
+    &lsm_queue_ops,
+    &btree_queue_ops,
+};
+
+#define NBACKENDS (sizeof (backends) / sizeof (backends[0]))
+
+FILE *queue_log = NULL;
+
+static const queue_ops_t *queue_lookup (const char *backend)
+{
+    int i;
+
+    for (i = 0; i < NBACKENDS; i++)
+        if (strcmp (backends[i]->name, backend) == 0)
+            return backends[i];
+    return NULL;
+}
+
+int queue_backend_valid (const char *backend)
+{
+    return queue_lookup (backend) != NULL;
+}
+
+/*
+ * Create an empty queue using the named backend. Aborts if there
+ * is no such backend, since callers check names with
+ * queue_backend_valid when parsing options.
+ */
+queue_t *queue_create (const char *backend)
+{
+    const queue_ops_t *ops = queue_lookup (backend);
+
+    if (ops == NULL) {
+        fprintf (stderr, "Unknown queue backend %s\n", backend);
+        abort ();
+    }
+    return ops->create ();
+}
+
+/*
+ * The index is an open addressing hash table of alarm pointers,
+ * keyed by id, kept at most half full. Deleting an entry shifts
+ * later entries of its probe run back into the hole, so lookups
+ * never need tombstones.
+ */
+#define index_hash(ix, id) \
+    ((unsigned long)((id) * 0x9e3779b97f4a7c15ULL) & ((ix)->size - 1))
+
+static void index_add (queue_index_t *ix, alarm_t *alarm);
+
+static void index_grow (queue_index_t *ix)
+{
+    alarm_t **old = ix->slot;
+    unsigned long i, old_size = ix->size;
+
+    ix->size = old_size ? old_size * 2 : 1024;
+    ix->slot = (alarm_t**)calloc (ix->size, sizeof (alarm_t*));
+    if (ix->slot == NULL)
+        errno_abort ("Allocate queue index");
+    ix->count = 0;
+    for (i = 0; i < old_size; i++)
+        if (old[i] != NULL)
+            index_add (ix, old[i]);
+    free (old);
+}
+
+static void index_add (queue_index_t *ix, alarm_t *alarm)
+{
+    unsigned long i;
+
+    if (2 * (ix->count + 1) > ix->size)
+        index_grow (ix);
+    for (i = index_hash (ix, alarm->id); ix->slot[i] != NULL;
+            i = (i + 1) & (ix->size - 1))
+        ;
+    ix->slot[i] = alarm;
+    ix->count++;
+}
+
+static unsigned long index_slot (queue_index_t *ix, unsigned long id)
+{
+    unsigned long i;
+
+    if (ix->size == 0)
+        return (unsigned long)-1;
+    for (i = index_hash (ix, id); ix->slot[i] != NULL;
+            i = (i + 1) & (ix->size - 1))
+        if (ix->slot[i]->id == id)
+            return i;
+    return (unsigned long)-1;
+}
+
+static void index_delete (queue_index_t *ix, unsigned long id)
+{
+    unsigned long hole, i, home, mask = ix->size - 1;
+
+    hole = index_slot (ix, id);
+    if (hole == (unsigned long)-1)
+        return;
+    ix->slot[hole] = NULL;
+    ix->count--;
+
+    /*
+     * Move back any later entry of the run whose home slot is not
+     * cyclically between the hole and its current slot.
+     */
+    for (i = (hole + 1) & mask; ix->slot[i] != NULL; i = (i + 1) & mask) {
+        home = index_hash (ix, ix->slot[i]->id);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            ix->slot[hole] = ix->slot[i];
+            ix->slot[i] = NULL;
+            hole = i;
+        }
+    }
+}
+
+/*
+ * Start keeping the index of pending alarms by id. Only alarms
+ * inserted from now on are indexed.
+ */
+void queue_index (queue_t *queue)
+{
+    if (queue->index != NULL || queue->ops->find != NULL)
+        return;
+    queue->index = (queue_index_t*)calloc (1, sizeof (queue_index_t));
+    if (queue->index == NULL)
+        errno_abort ("Allocate queue index");
+}
+
+void queue_destroy (queue_t *queue)
+{
+    if (queue->index != NULL) {
+        free (queue->index->slot);
+        free (queue->index);
+    }
+    queue->ops->destroy (queue);
+}
+
+void queue_insert (queue_t *queue, alarm_t *alarm)
+{
+    if (queue->index != NULL)
+        index_add (queue->index, alarm);
+    queue->ops->insert (queue, alarm);
+}
+
+void queue_insert_batch (queue_t *queue, alarm_t *batch)
+{
+    alarm_t *alarm;
+
+    if (queue->index != NULL)
+        for (alarm = batch; alarm != NULL; alarm = alarm->link)
+            index_add (queue->index, alarm);
+    queue->ops->insert_batch (queue, batch);
+}
+
+static int compare_alarms (const void *a, const void *b)
+{
+    const alarm_t *x = *(alarm_t* const*)a, *y = *(alarm_t* const*)b;
+
+    if (x->time != y->time)
+        return x->time < y->time ? -1 : 1;
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+/*
+ * Sort alarms by expiration time and id, for queue_load. This needs
+ * no lock, so loaders do it before taking alarm_mutex.
+ */
+void queue_sort (alarm_t **alarms, long n)
+{
+    qsort (alarms, n, sizeof (alarm_t*), compare_alarms);
+}
+
+/*
+ * Add a batch of alarms sorted by queue_sort.
+ */
+void queue_load (queue_t *queue, alarm_t **alarms, long n)
+{
+    long i;
+
+    if (queue->index != NULL)
+        for (i = 0; i < n; i++)
+            index_add (queue->index, alarms[i]);
+    if (queue->ops->load != NULL)
+        queue->ops->load (queue, alarms, n);
+    else
+        for (i = 0; i < n; i++)
+            queue->ops->insert (queue, alarms[i]);
+}
+
+alarm_t *queue_pop (queue_t *queue)
+{
+    alarm_t *alarm = queue->ops->pop (queue);
+
+    if (alarm != NULL && queue->index != NULL)
+        index_delete (queue->index, alarm->id);
+    return alarm;
+}
+
+/*
+ * Take a pending alarm out of the queue, without it firing.
+ */
+void queue_remove (queue_t *queue, alarm_t *alarm)
+{
+    if (queue->index != NULL)
+        index_delete (queue->index, alarm->id);
+    queue->ops->remove (queue, alarm);
+}
+
+/*
+ * Give a pending alarm a new expiration time.
+ */
+void queue_reschedule (queue_t *queue, alarm_t *alarm, time_t time)
+{
+    queue->ops->reschedule (queue, alarm, time);
+}
+
+/*
+ * Find a pending alarm by id. Returns NULL if there is no such
+ * alarm in the queue, or if the queue isn't indexed and the backend
+ * can't find it itself.
+ */
+alarm_t *queue_find (queue_t *queue, unsigned long id)
+{
+    unsigned long i;
+
+    if (queue->ops->find != NULL)
+        return queue->ops->find (queue, id);
+    if (queue->index == NULL)
+        return NULL;
+    i = index_slot (queue->index, id);
+    return i == (unsigned long)-1 ? NULL : queue->index->slot[i];
+}
+
+/*
+ * Memory held by the queue, and by its index, apart from the alarm
+ * records.
+ */
+size_t queue_bytes (queue_t *queue)
+{
+    return queue->ops->bytes != NULL ? queue->ops->bytes (queue) : 0;
+}
+
+size_t queue_index_bytes (queue_t *queue)
+{
+    if (queue->index == NULL)
+        return 0;
+    return sizeof (queue_index_t) + queue->index->size * sizeof (alarm_t*);
+}
+
+/*
+ * Call "func" for every alarm in the queue, in no particular order.
+ * Only an indexed queue can do this; returns -1 for any other.
+ */
+int queue_foreach (queue_t *queue,
+    void (*func) (alarm_t *alarm, void *arg), void *arg)
+{
+    unsigned long i;
+
+    if (queue->index == NULL)
+        return -1;
+    for (i = 0; i < queue->index->size; i++)
+        if (queue->index->slot[i] != NULL)
+            func (queue->index->slot[i], arg);
+    return 0;
+}
+
+/*
+ * Gather the alarms of an indexed queue due from "from" to "to",
+ * sorted, for the backends without range operations. Returns the
+ * number found, and sets *found to a malloc'd array of them, or
+ * returns -1 if the queue isn't indexed.
+ */
+static long queue_gather (queue_t *queue, time_t from, time_t to,
+    alarm_t ***found)
+{
+    alarm_t **list = NULL, *alarm;
+    unsigned long i;
+    long n = 0, size = 0;
+
+    if (queue->index == NULL)
+        return -1;
+    for (i = 0; i < queue->index->size; i++) {
+        alarm = queue->index->slot[i];
+        if (alarm == NULL || alarm->time < from || alarm->time > to)
+            continue;
+        if (n == size) {
+            size = size ? size * 2 : 64;
+            list = (alarm_t**)realloc (list, size * sizeof (alarm_t*));
+            if (list == NULL)
+                errno_abort ("Allocate range");
+        }
+        list[n++] = alarm;
+    }
+    if (n > 0)
+        queue_sort (list, n);
+    *found = list;
+    return n;
+}
+
+/*
+ * Call "func" for every alarm due from "from" to "to" (inclusive),
+ * in deadline order. "func" must not change the queue. Returns the
+ * number of alarms visited, or -1 if the backend can't do it and
+ * the queue isn't indexed.
+ */
+long queue_range (queue_t *queue, time_t from, time_t to,
+    void (*func) (alarm_t *alarm, void *arg), void *arg)
+{
+    alarm_t **list;
+    long i, n;
+
+    if (queue->ops->range != NULL)
+        return queue->ops->range (queue, from, to, func, arg);
+    n = queue_gather (queue, from, to, &list);
+    for (i = 0; i < n; i++)
+        func (list[i], arg);
+    if (n >= 0)
+        free (list);
+    return n;
+}
+
+typedef struct range_call_tag {
+    queue_t             *queue;
+    void                (*func) (alarm_t *alarm, void *arg);
+    void                *arg;
+} range_call_t;
+
+static void range_unindex (alarm_t *alarm, void *arg)
+{
+    range_call_t *call = (range_call_t*)arg;
+
+    if (call->queue->index != NULL)
+        index_delete (call->queue->index, alarm->id);
+    call->func (alarm, call->arg);
+}
+
+/*
+ * Take every alarm due from "from" to "to" out of the queue, and
+ * call "func" for each, in deadline order, once it is out. Returns
+ * the number removed, or -1 as for queue_range.
+ */
+long queue_remove_range (queue_t *queue, time_t from, time_t to,
+    void (*func) (alarm_t *alarm, void *arg), void *arg)
+{
+    range_call_t call;
+    alarm_t **list;
+    long i, n;
+
+    if (queue->ops->remove_range != NULL) {
+        call.queue = queue;
+        call.func = func;
+        call.arg = arg;
+        return queue->ops->remove_range (queue, from, to,
+            range_unindex, &call);
+    }
+    n = queue_gather (queue, from, to, &list);
+    for (i = 0; i < n; i++) {
+        queue_remove (queue, list[i]);
+        func (list[i], arg);
+    }
+    if (n >= 0)
+        free (list);
+    return n;
+}
+
+typedef struct list_queue_tag {
+    queue_t             queue;
+    alarm_t             *list;
+} list_queue_t;
+
+static queue_t *list_create (void)
+{
+    list_queue_t *lq;
+
+    lq = (list_queue_t*)malloc (sizeof (list_queue_t));
+    if (lq == NULL)
+        errno_abort ("Allocate list queue");
+    lq->queue.ops = &list_queue_ops;
+    lq->queue.count = 0;
+    lq->queue.index = NULL;
+    lq->list = NULL;
+    return &lq->queue;
+}
+
+static void list_destroy (queue_t *queue)
+{
+    free (queue);
+}
+
+static void list_insert (queue_t *queue, alarm_t *alarm)
+{
+    list_queue_t *lq = (list_queue_t*)queue;
+
+    alarm_insert (&lq->list, alarm);
+    queue->count++;
+}
+
+static void list_insert_batch (queue_t *queue, alarm_t *batch)
+{
+    list_queue_t *lq = (list_queue_t*)queue;
+    alarm_t *alarm;
+
+    for (alarm = batch; alarm != NULL; alarm = alarm->link)
+        queue->count++;
+    alarm_insert_batch (&lq->list, batch);
+}
+
+static alarm_t *list_peek (queue_t *queue)
+{
+    return ((list_queue_t*)queue)->list;
+}
+
+static alarm_t *list_pop (queue_t *queue)
+{
+    list_queue_t *lq = (list_queue_t*)queue;
+    alarm_t *alarm = lq->list;
+
+    if (alarm != NULL) {
+        lq->list = alarm->link;
+        queue->count--;
+    }
+    return alarm;
+}
+
+static void list_remove (queue_t *queue, alarm_t *alarm)
+{
+    if (alarm_unlink (&((list_queue_t*)queue)->list, alarm) == 0)
+        queue->count--;
+}
+
+static void list_reschedule (queue_t *queue, alarm_t *alarm, time_t time)
+{
+    list_remove (queue, alarm);
+    alarm->time = time;
+    list_insert (queue, alarm);
+}
+
+const queue_ops_t list_queue_ops = {
+    "list",
+    list_create,
+    list_destroy,
+    list_insert,
+    list_insert_batch,
+    list_peek,
+    list_pop,
+    list_remove,
+    list_reschedule,
+};
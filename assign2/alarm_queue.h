@@ -0,0 +1,145 @@
+/*
+ * alarm_queue.h
+ *
+ * The queue of pending alarms, ordered by expiration time. The
+ * main thread inserts into it, and the alarm thread takes alarms
+ * off the front. There is more than one way to build such a
+ * queue, so the queue is a small table of operations and each
+ * backend supplies its own:
+ *
+ *      list    the original sorted, singly linked list
+ *      wheel   one bucket per second, with a bitmap index over
+ *              the buckets (alarm_wheel.c)
+ *      pheap   a pairing heap, with O(1) insert and decrease-key
+ *              (alarm_pheap.c)
+ *      adaptive  watches the workload, and moves the pending alarms
+ *              to whichever of the others suits it (alarm_adapt.c)
+ *      merge   partitions the alarms by id across MERGE_SHARDS
+ *              pairing heaps, with a tree of losers over their
+ *              heads (alarm_merge.c)
+ *      lsm     keeps preloaded alarms in immutable sorted runs,
+ *              and live ones in a small pairing heap (alarm_lsm.c)
+ *      btree   a B+tree of cache line aligned nodes, with linked
+ *              leaves for range scans (alarm_btree.c)
+ *
+ * A large batch of alarms, sorted with queue_sort, can be given to
+ * the queue at once with queue_load. Backends with a load operation
+ * take the batch as it is; the others have it inserted one by one.
+ *
+ * queue_range visits the alarms due within a span of time in
+ * deadline order, and queue_remove_range takes them all out. A
+ * backend with range operations does these in place; for the
+ * others, the alarms are gathered from the index and sorted, so
+ * the queue must be indexed.
+ *
+ * Besides insert and pop, a pending alarm can be removed (cancel)
+ * or given a new expiration time (reschedule). The server finds
+ * pending alarms by id through an index kept by the queue, which
+ * is only built if queue_index is called; alarm_bench holds its own
+ * pointers and leaves it off. A backend that keeps its own table
+ * by id (the queue file, alarm_pqueue.h) has a find operation, and
+ * needs no index.
+ *
+ * queue_bytes gives the memory a queue holds beyond the alarm
+ * records in it, for the -U report; queue_index_bytes that of its
+ * index. A backend without a bytes operation counts as holding
+ * none.
+ *
+ * All operations must be called with alarm_mutex locked (or, in
+ * alarm_bench, from a single thread).
+ */
+#ifndef __alarm_queue_h
+#define __alarm_queue_h
+
+#include <stdio.h>
+#include "alarm.h"
+
+typedef struct queue_tag queue_t;
+
+typedef struct queue_ops_tag {
+    const char          *name;
+    queue_t             *(*create) (void);
+    void                (*destroy) (queue_t *queue);
+    void                (*insert) (queue_t *queue, alarm_t *alarm);
+    void                (*insert_batch) (queue_t *queue, alarm_t *batch);
+    alarm_t             *(*peek) (queue_t *queue);
+    alarm_t             *(*pop) (queue_t *queue);
+    void                (*remove) (queue_t *queue, alarm_t *alarm);
+    void                (*reschedule) (
+                            queue_t *queue, alarm_t *alarm, time_t time);
+    void                (*load) (       /* optional */
+                            queue_t *queue, alarm_t **alarms, long n);
+    long                (*range) (      /* optional */
+                            queue_t *queue, time_t from, time_t to,
+                            void (*func) (alarm_t *alarm, void *arg),
+                            void *arg);
+    long                (*remove_range) (       /* optional */
+                            queue_t *queue, time_t from, time_t to,
+                            void (*func) (alarm_t *alarm, void *arg),
+                            void *arg);
+    alarm_t             *(*find) (      /* optional */
+                            queue_t *queue, unsigned long id);
+    size_t              (*bytes) (      /* optional */
+                            queue_t *queue);
+} queue_ops_t;
+
+/*
+ * Index of pending alarms by id: open addressing, linear probing.
+ */
+typedef struct queue_index_tag {
+    unsigned long       size;   /* power of 2 */
+    unsigned long       count;
+    alarm_t             **slot;
+} queue_index_t;
+
+/*
+ * Every backend's queue structure begins with this header.
+ */
+struct queue_tag {
+    const queue_ops_t   *ops;
+    unsigned long       count;  /* alarms in the queue */
+    queue_index_t       *index; /* by id, or NULL */
+};
+
+extern const queue_ops_t list_queue_ops;
+extern const queue_ops_t wheel_queue_ops;
+extern const queue_ops_t pheap_queue_ops;
+extern const queue_ops_t adapt_queue_ops;
+extern const queue_ops_t merge_queue_ops;
+extern const queue_ops_t lsm_queue_ops;
+extern const queue_ops_t btree_queue_ops;
+
+#define MERGE_SHARDS    16      /* shards of the merge backend */
+#define MERGE_TREE      0       /* find the earliest head: loser tree */
+#define MERGE_SCAN      1       /* or scan every head */
+
+extern FILE *queue_log;         /* backend changes, or NULL */
+
+extern queue_t *queue_create (const char *backend);
+extern int queue_backend_valid (const char *backend);
+extern void queue_destroy (queue_t *queue);
+extern void queue_index (queue_t *queue);
+extern void queue_insert (queue_t *queue, alarm_t *alarm);
+extern void queue_insert_batch (queue_t *queue, alarm_t *batch);
+extern void queue_sort (alarm_t **alarms, long n);
+extern void queue_load (queue_t *queue, alarm_t **alarms, long n);
+extern alarm_t *queue_pop (queue_t *queue);
+extern void queue_remove (queue_t *queue, alarm_t *alarm);
+extern void queue_reschedule (queue_t *queue, alarm_t *alarm, time_t time);
+extern alarm_t *queue_find (queue_t *queue, unsigned long id);
+extern int queue_foreach (queue_t *queue,
+    void (*func) (alarm_t *alarm, void *arg), void *arg);
+extern long queue_range (queue_t *queue, time_t from, time_t to,
+    void (*func) (alarm_t *alarm, void *arg), void *arg);
+extern long queue_remove_range (queue_t *queue, time_t from, time_t to,
+    void (*func) (alarm_t *alarm, void *arg), void *arg);
+extern size_t queue_bytes (queue_t *queue);
+extern size_t queue_index_bytes (queue_t *queue);
+extern queue_t *merge_queue_create (int shards, int method);
+
+#define queue_peek(q)           ((q)->ops->peek (q))
+#define queue_count(q)          ((q)->count)
+#define queue_name(q)           ((q)->ops->name)
+#define queue_can_load(q)       ((q)->ops->load != NULL)
+
+#endif
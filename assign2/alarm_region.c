@@ -0,0 +1,213 @@
+/*
+ * alarm_region.c
+ *
+ * Deadline regions for alarm records. See alarm_region.h.
+ */
+#include <pthread.h>
+#include "errors.h"
+#include "alarm_region.h"
+
+/*
+ * The header at the start of each region. "live" counts the records
+ * carved from the region that have not been freed, plus one while
+ * the region is open, so that it cannot be recycled while records
+ * are still being carved from it. Whoever takes it to zero puts the
+ * region on the spare list.
+ *
+ * The first record of a region to be freed closes it, if it is
+ * still open: its alarms are expiring, and so its bucket will
+ * hardly get any more, and a region left open would be held until
+ * some other bucket needed its slot.
+ */
+typedef struct region_tag {
+    struct region_tag   *link;          /* on the spare list */
+    time_t              bucket;         /* deadline / REGION_SECONDS */
+    long                live;
+    int                 open;
+    char                *next;          /* unused space */
+    char                *end;
+} region_t;
+
+#define REGION_HEADER \
+    ((sizeof (region_t) + 63) & ~(size_t)63)
+#define region_hash(bucket) \
+    ((unsigned long)(bucket) * 0x9e3779b97f4a7c15ULL)
+#define region_of(object) \
+    ((region_t*)((unsigned long)(object) & ~(unsigned long)(REGION_SIZE - 1)))
+
+static pthread_mutex_t region_mutex = PTHREAD_MUTEX_INITIALIZER;
+static region_t *region_open[REGION_OPEN];
+static region_t *region_spare = NULL;
+static unsigned long region_mapped = 0, region_spares = 0;
+static unsigned long region_opened = 0, region_recycled = 0;
+static unsigned long region_objects = 0;         /* atomic */
+
+/*
+ * Put a region nobody refers to any more back on the spare list.
+ * Called with region_mutex locked.
+ */
+static void region_recycle (region_t *region)
+{
+    region->link = region_spare;
+    region_spare = region;
+    region_spares++;
+    region_recycled++;
+}
+
+/*
+ * Close an open region: drop its open reference, and recycle it if
+ * all of its records have been freed already. Called with
+ * region_mutex locked.
+ */
+static void region_close (region_t *region)
+{
+    __atomic_store_n (&region->open, 0, __ATOMIC_RELEASE);
+    if (__atomic_sub_fetch (&region->live, 1, __ATOMIC_ACQ_REL) == 0)
+        region_recycle (region);
+}
+
+/*
+ * Find the slot of the open region for "bucket", or a slot for a
+ * new one: an empty slot, or else the one with the earliest bucket,
+ * whose region is closed. Called with region_mutex locked.
+ */
+static region_t **region_slot (time_t bucket)
+{
+    region_t **slot, **best = NULL;
+    unsigned long h = region_hash (bucket);
+    int i;
+
+    for (i = 0; i < REGION_PROBE; i++) {
+        slot = &region_open[(h + i) & (REGION_OPEN - 1)];
+        if (*slot != NULL && (*slot)->bucket == bucket)
+            return slot;
+        if (best == NULL || (*best != NULL
+                && (*slot == NULL || (*slot)->bucket < (*best)->bucket)))
+            best = slot;
+    }
+    if (*best != NULL) {
+        region_close (*best);
+        *best = NULL;
+    }
+    return best;
+}
+
+/*
+ * Carve "size" bytes from the open region for the bucket "due"
+ * falls in, opening a new region (from the spare list, if it has
+ * one) when there is none or it is full. Aborts if memory is
+ * exhausted.
+ */
+void *region_get (time_t due, size_t size)
+{
+    time_t bucket = due / REGION_SECONDS;
+    region_t **slot, *region;
+    void *object;
+    int status;
+
+    size = (size + sizeof (void*) - 1) & ~(sizeof (void*) - 1);
+    status = pthread_mutex_lock (&region_mutex);
+    if (status != 0)
+        err_abort (status, "Lock region mutex");
+    slot = region_slot (bucket);
+    region = *slot;
+    if (region == NULL || region->next + size > region->end) {
+        if (region != NULL)
+            region_close (region);
+        if (region_spare != NULL) {
+            region = region_spare;
+            region_spare = region->link;
+            region_spares--;
+        } else {
+            status = posix_memalign ((void**)&region,
+                REGION_SIZE, REGION_SIZE);
+            if (status != 0)
+                err_abort (status, "Allocate region");
+            region_mapped++;
+        }
+        region->bucket = bucket;
+        region->live = 1;
+        region->open = 1;
+        region->next = (char*)region + REGION_HEADER;
+        region->end = (char*)region + REGION_SIZE;
+        *slot = region;
+        region_opened++;
+    }
+    object = region->next;
+    region->next += size;
+    __atomic_add_fetch (&region->live, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&region_objects, 1, __ATOMIC_RELAXED);
+    status = pthread_mutex_unlock (&region_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock region mutex");
+    return object;
+}
+
+/*
+ * Take an open region out of the table and close it. Called with
+ * region_mutex locked.
+ */
+static void region_detach (region_t *region)
+{
+    region_t **slot;
+    unsigned long h = region_hash (region->bucket);
+    int i;
+
+    for (i = 0; i < REGION_PROBE; i++) {
+        slot = &region_open[(h + i) & (REGION_OPEN - 1)];
+        if (*slot == region) {
+            *slot = NULL;
+            region_close (region);
+            return;
+        }
+    }
+}
+
+/*
+ * Free a record. Only the first record freed from a region that is
+ * still open, and the last record of a closed one, take the mutex:
+ * to close the region, and to recycle it.
+ */
+void region_put (void *object)
+{
+    region_t *region = region_of (object);
+    int status;
+
+    __atomic_sub_fetch (&region_objects, 1, __ATOMIC_RELAXED);
+    if (__atomic_load_n (&region->open, __ATOMIC_ACQUIRE)) {
+        status = pthread_mutex_lock (&region_mutex);
+        if (status != 0)
+            err_abort (status, "Lock region mutex");
+        if (region->open)
+            region_detach (region);
+        status = pthread_mutex_unlock (&region_mutex);
+        if (status != 0)
+            err_abort (status, "Unlock region mutex");
+    }
+    if (__atomic_sub_fetch (&region->live, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    status = pthread_mutex_lock (&region_mutex);
+    if (status != 0)
+        err_abort (status, "Lock region mutex");
+    region_recycle (region);
+    status = pthread_mutex_unlock (&region_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock region mutex");
+}
+
+void region_summarize (region_summary_t *summary)
+{
+    int status;
+
+    status = pthread_mutex_lock (&region_mutex);
+    if (status != 0)
+        err_abort (status, "Lock region mutex");
+    summary->mapped = region_mapped;
+    summary->spare = region_spares;
+    summary->objects = __atomic_load_n (&region_objects, __ATOMIC_RELAXED);
+    summary->opened = region_opened;
+    summary->recycled = region_recycled;
+    status = pthread_mutex_unlock (&region_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock region mutex");
+}
@@ -0,0 +1,52 @@
+/*
+ * alarm_region.h
+ *
+ * Region allocation of alarm records by deadline (-a region).
+ * Alarms due at about the same time expire together, so alarms due
+ * within the same REGION_SECONDS are carved from the same
+ * REGION_SIZE regions: a bump pointer while a region is open, and
+ * nothing at all to free an individual record but decrementing its
+ * region's count of live records. When a region has been closed to
+ * new records and its last record is freed, the whole region goes
+ * back on the spare list at once.
+ *
+ * The open regions are found by deadline bucket in a table of
+ * REGION_OPEN slots, probing REGION_PROBE slots from the bucket's
+ * hash. A region is closed when it fills, or when a new bucket
+ * finds every slot of its probe taken, in which case the region
+ * for the earliest bucket is closed, since its alarms are the
+ * likeliest to have been due already, or when the first of its
+ * records is freed.
+ *
+ * Regions are aligned on their size, so a record's region is found
+ * from its address. region_put takes no lock unless it closes or
+ * frees the region, which is what lets display threads release thousands of
+ * expired records without contending on the allocator.
+ */
+#ifndef __alarm_region_h
+#define __alarm_region_h
+
+#include <stdio.h>
+#include <time.h>
+
+#define REGION_SIZE     (16 * 1024)     /* power of 2 */
+#define REGION_SECONDS  4               /* deadlines per bucket */
+#define REGION_OPEN     1024            /* open regions, power of 2 */
+#define REGION_PROBE    8
+
+/*
+ * Counters, as copied out by region_summarize.
+ */
+typedef struct region_summary_tag {
+    unsigned long       mapped;         /* regions ever allocated */
+    unsigned long       spare;          /* of which on the spare list */
+    unsigned long       objects;        /* live records */
+    unsigned long       opened;         /* regions handed out */
+    unsigned long       recycled;       /* regions freed in bulk */
+} region_summary_t;
+
+extern void *region_get (time_t due, size_t size);
+extern void region_put (void *object);
+extern void region_summarize (region_summary_t *summary);
+
+#endif
@@ -0,0 +1,212 @@
+/*
+ * alarm_reorder.c
+ *
+ * The reorder buffer. See alarm_reorder.h. Events live in a fixed
+ * array of entries, with a binary heap of their indexes giving the
+ * release order, and a ring of their indexes in the order they
+ * were put. An entry is released from the heap, but its slot is
+ * only reused once it reaches the head of the ring, which is how
+ * the buffer knows the oldest event still held.
+ */
+#include "errors.h"
+#include "alarm_reorder.h"
+
+long long reorder_clock (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+reorder_t *reorder_create (long long budget, int size,
+    reorder_emit_t emit, void *arg)
+{
+    reorder_t *reorder;
+    int i;
+
+    reorder = (reorder_t*)calloc (1, sizeof (reorder_t));
+    if (reorder == NULL)
+        errno_abort ("Allocate reorder buffer");
+    reorder->entry = (reorder_entry_t*)malloc (
+        size * sizeof (reorder_entry_t));
+    reorder->heap = (int*)malloc (size * sizeof (int));
+    reorder->fifo = (int*)malloc (size * sizeof (int));
+    reorder->free = (int*)malloc (size * sizeof (int));
+    if (reorder->entry == NULL || reorder->heap == NULL
+            || reorder->fifo == NULL || reorder->free == NULL)
+        errno_abort ("Allocate reorder buffer");
+    reorder->budget = budget;
+    reorder->size = size;
+    reorder->emit = emit;
+    reorder->arg = arg;
+    for (i = 0; i < size; i++)
+        reorder->free[i] = size - 1 - i;
+    reorder->nfree = size;
+    return reorder;
+}
+
+void reorder_destroy (reorder_t *reorder)
+{
+    free (reorder->entry);
+    free (reorder->heap);
+    free (reorder->fifo);
+    free (reorder->free);
+    free (reorder);
+}
+
+static int before (reorder_t *reorder, int a, int b)
+{
+    reorder_entry_t *ea = &reorder->entry[a], *eb = &reorder->entry[b];
+
+    if (ea->deadline != eb->deadline)
+        return ea->deadline < eb->deadline;
+    return ea->id < eb->id;
+}
+
+static void heap_push (reorder_t *reorder, int index)
+{
+    int *heap = reorder->heap;
+    int i = reorder->nheap++, parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!before (reorder, index, heap[parent]))
+            break;
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = index;
+}
+
+static int heap_pop (reorder_t *reorder)
+{
+    int *heap = reorder->heap;
+    int top = heap[0], last = heap[--reorder->nheap];
+    int i = 0, child, n = reorder->nheap;
+
+    while ((child = 2 * i + 1) < n) {
+        if (child + 1 < n && before (reorder, heap[child + 1], heap[child]))
+            child++;
+        if (!before (reorder, heap[child], last))
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+/*
+ * Release the first event in order.
+ */
+static void release_first (reorder_t *reorder, long long now)
+{
+    reorder_entry_t *entry = &reorder->entry[heap_pop (reorder)];
+    long long hold = now - entry->held;
+
+    if (reorder->events > 0 && (entry->deadline < reorder->last_deadline
+            || (entry->deadline == reorder->last_deadline
+                && entry->id < reorder->last_id)))
+        reorder->disordered++;
+    else {
+        reorder->last_deadline = entry->deadline;
+        reorder->last_id = entry->id;
+    }
+    reorder->events++;
+    reorder->hold_total += hold;
+    if (hold > reorder->hold_max)
+        reorder->hold_max = hold;
+    entry->released = 1;
+    reorder->emit (entry, reorder->arg);
+}
+
+/*
+ * Free the slots of released events at the head of the ring.
+ */
+static void reclaim (reorder_t *reorder)
+{
+    int index;
+
+    while (reorder->count > 0) {
+        index = reorder->fifo[reorder->head];
+        if (!reorder->entry[index].released)
+            break;
+        reorder->free[reorder->nfree++] = index;
+        reorder->head = (reorder->head + 1) % reorder->size;
+        reorder->count--;
+    }
+}
+
+/*
+ * Hold an event. If the buffer is full, release events in order
+ * until a slot comes free.
+ */
+void reorder_put (reorder_t *reorder,
+    const reorder_entry_t *entry, long long now)
+{
+    int index;
+
+    if (reorder->nfree == 0) {
+        reorder->forced++;
+        while (reorder->nfree == 0) {
+            release_first (reorder, now);
+            reclaim (reorder);
+        }
+    }
+    index = reorder->free[--reorder->nfree];
+    reorder->entry[index] = *entry;
+    reorder->entry[index].held = now;
+    reorder->entry[index].released = 0;
+    reorder->fifo[(reorder->head + reorder->count) % reorder->size] = index;
+    reorder->count++;
+    heap_push (reorder, index);
+}
+
+/*
+ * Release every event held for the budget, along with the events
+ * ahead of it in order.
+ */
+void reorder_drain (reorder_t *reorder, long long now)
+{
+    while (1) {
+        reclaim (reorder);
+        if (reorder->count == 0 || reorder->entry[reorder->fifo[
+                reorder->head]].held + reorder->budget > now)
+            break;
+        release_first (reorder, now);
+    }
+}
+
+/*
+ * When reorder_drain will next have something to release, or -1
+ * if the buffer is empty.
+ */
+long long reorder_next (reorder_t *reorder)
+{
+    reclaim (reorder);
+    if (reorder->count == 0)
+        return -1;
+    return reorder->entry[reorder->fifo[reorder->head]].held
+        + reorder->budget;
+}
+
+void reorder_flush (reorder_t *reorder, long long now)
+{
+    while (reorder->nheap > 0)
+        release_first (reorder, now);
+    reclaim (reorder);
+}
+
+void reorder_print (FILE *out, const reorder_t *reorder)
+{
+    fprintf (out, "Reorder buffer:\n");
+    fprintf (out, "  released   %lu\n", reorder->events);
+    fprintf (out, "  out of order %lu (held up past the budget)\n",
+        reorder->disordered);
+    fprintf (out, "  forced     %lu (buffer full)\n", reorder->forced);
+    fprintf (out, "  held       mean %.3fms, max %.3fms (budget %.3fms)\n",
+        reorder->events > 0 ?
+            reorder->hold_total / 1e6 / reorder->events : 0.0,
+        reorder->hold_max / 1e6, reorder->budget / 1e6);
+}
@@ -0,0 +1,80 @@
+/*
+ * alarm_reorder.h
+ *
+ * A reorder buffer for fired alarms (-O). The display threads and
+ * the alarm thread report expiries as they happen, so two alarms
+ * due in the same second may come out in either order, and a late
+ * alarm comes out long after alarms due after it. Consumers that
+ * expect the output in deadline order can have the server hold each
+ * fire event for a latency budget, and release them in (deadline,
+ * id) order; ids are given in order of submission, so alarms due
+ * at the same time come out in the order they were asked for.
+ *
+ * An event is released once it has been held for the budget, after
+ * every event ahead of it in that order, so nothing waits longer
+ * than the budget. The buffer holds a bounded number of events: if
+ * it fills, the first in order goes out early. An event that turns
+ * up after one that belongs behind it has already gone out (it was
+ * held up by more than the budget) is released anyway, and counted
+ * as out of order.
+ *
+ * All calls must be made with alarm_mutex locked. Times are
+ * CLOCK_MONOTONIC nanoseconds.
+ */
+#ifndef __alarm_reorder_h
+#define __alarm_reorder_h
+
+#include <stdio.h>
+#include <time.h>
+
+#define REORDER_SIZE    4096            /* events held at most */
+
+typedef struct reorder_entry_tag {
+    unsigned long       id;
+    time_t              deadline;
+    time_t              fired;
+    int                 seconds;
+    int                 display;        /* 0 for the alarm thread */
+    int                 length;
+    char                text[64];
+    char                line[128];      /* as it is printed */
+    long long           held;           /* when it was put */
+    int                 released;
+} reorder_entry_t;
+
+typedef void (*reorder_emit_t) (const reorder_entry_t *entry, void *arg);
+
+typedef struct reorder_tag {
+    long long           budget;
+    int                 size;
+    reorder_entry_t     *entry;
+    int                 *heap;          /* in (deadline, id) order */
+    int                 nheap;
+    int                 *fifo;          /* in the order put */
+    int                 head;
+    int                 count;
+    int                 *free;
+    int                 nfree;
+    reorder_emit_t      emit;
+    void                *arg;
+    time_t              last_deadline;  /* last released */
+    unsigned long       last_id;
+    unsigned long       events;
+    unsigned long       disordered;
+    unsigned long       forced;
+    long long           hold_total;
+    long long           hold_max;
+} reorder_t;
+
+extern long long reorder_clock (void);
+extern reorder_t *reorder_create (long long budget, int size,
+    reorder_emit_t emit, void *arg);
+extern void reorder_destroy (reorder_t *reorder);
+extern void reorder_put (reorder_t *reorder,
+    const reorder_entry_t *entry, long long now);
+extern void reorder_drain (reorder_t *reorder, long long now);
+extern long long reorder_next (reorder_t *reorder);
+extern void reorder_flush (reorder_t *reorder, long long now);
+extern void reorder_print (FILE *out, const reorder_t *reorder);
+
+#endif
@@ -0,0 +1,240 @@
+/*
+ * alarm_shard.c
+ *
+ * Shared memory request rings for the sharded server, and the
+ * rebalancer's plan and forwarding table. See alarm_shard.h.
+ */
+#include <pthread.h>
+#include <sys/mman.h>
+#include "errors.h"
+#include "alarm_shard.h"
+
+/*
+ * Initialize a ring with process shared attributes.
+ */
+static void ring_init (ring_t *ring,
+    pthread_mutexattr_t *mattr, pthread_condattr_t *cattr)
+{
+    int status;
+
+    status = pthread_mutex_init (&ring->mutex, mattr);
+    if (status != 0)
+        err_abort (status, "Init ring mutex");
+    status = pthread_cond_init (&ring->not_empty, cattr);
+    if (status != 0)
+        err_abort (status, "Init ring cond");
+    status = pthread_cond_init (&ring->not_full, cattr);
+    if (status != 0)
+        err_abort (status, "Init ring cond");
+}
+
+/*
+ * Map and initialize one shard_t per scheduler, in memory that the
+ * processes forked afterwards will share with us.
+ */
+shard_t *shard_create (int shards)
+{
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+    shard_t *shard;
+    int status, i;
+
+    shard = (shard_t*)mmap (NULL, shards * sizeof (shard_t),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shard == MAP_FAILED)
+        errno_abort ("Map shards");
+    status = pthread_mutexattr_init (&mattr);
+    if (status != 0)
+        err_abort (status, "Init mutex attr");
+    status = pthread_mutexattr_setpshared (&mattr, PTHREAD_PROCESS_SHARED);
+    if (status != 0)
+        err_abort (status, "Set mutex pshared");
+    status = pthread_condattr_init (&cattr);
+    if (status != 0)
+        err_abort (status, "Init cond attr");
+    status = pthread_condattr_setpshared (&cattr, PTHREAD_PROCESS_SHARED);
+    if (status != 0)
+        err_abort (status, "Set cond pshared");
+    for (i = 0; i < shards; i++) {
+        ring_init (&shard[i].ring, &mattr, &cattr);
+        ring_init (&shard[i].inbox, &mattr, &cattr);
+    }
+    pthread_mutexattr_destroy (&mattr);
+    pthread_condattr_destroy (&cattr);
+    return shard;
+}
+
+/*
+ * Add a request to a ring, waiting while it is full. Only the
+ * string part of the text is copied.
+ */
+void ring_put (ring_t *ring, const request_t *request)
+{
+    request_t *slot;
+    int status;
+
+    status = pthread_mutex_lock (&ring->mutex);
+    if (status != 0)
+        err_abort (status, "Lock ring mutex");
+    while (ring->tail - ring->head == RING_SIZE) {
+        status = pthread_cond_wait (&ring->not_full, &ring->mutex);
+        if (status != 0)
+            err_abort (status, "Wait for ring space");
+    }
+    slot = &ring->slot[ring->tail & (RING_SIZE - 1)];
+    slot->kind = request->kind;
+    slot->seconds = request->seconds;
+    slot->id = request->id;
+    slot->until = request->until;
+    strcpy (slot->text, request->text);
+    ring->tail++;
+    status = pthread_cond_signal (&ring->not_empty);
+    if (status != 0)
+        err_abort (status, "Signal ring");
+    status = pthread_mutex_unlock (&ring->mutex);
+    if (status != 0)
+        err_abort (status, "Unlock ring mutex");
+}
+
+/*
+ * Take the next request from a ring, waiting while it is empty.
+ * Returns 0, or -1 once the ring is empty and closed.
+ */
+int ring_get (ring_t *ring, request_t *request)
+{
+    int status, result = 0;
+
+    status = pthread_mutex_lock (&ring->mutex);
+    if (status != 0)
+        err_abort (status, "Lock ring mutex");
+    while (ring->head == ring->tail && !ring->closed) {
+        status = pthread_cond_wait (&ring->not_empty, &ring->mutex);
+        if (status != 0)
+            err_abort (status, "Wait for ring");
+    }
+    if (ring->head == ring->tail)
+        result = -1;
+    else {
+        *request = ring->slot[ring->head & (RING_SIZE - 1)];
+        ring->head++;
+        status = pthread_cond_signal (&ring->not_full);
+        if (status != 0)
+            err_abort (status, "Signal ring");
+    }
+    status = pthread_mutex_unlock (&ring->mutex);
+    if (status != 0)
+        err_abort (status, "Unlock ring mutex");
+    return result;
+}
+
+/*
+ * Mark the end of the requests for a ring.
+ */
+void ring_close (ring_t *ring)
+{
+    int status;
+
+    status = pthread_mutex_lock (&ring->mutex);
+    if (status != 0)
+        err_abort (status, "Lock ring mutex");
+    ring->closed = 1;
+    status = pthread_cond_signal (&ring->not_empty);
+    if (status != 0)
+        err_abort (status, "Signal ring");
+    status = pthread_mutex_unlock (&ring->mutex);
+    if (status != 0)
+        err_abort (status, "Unlock ring mutex");
+}
+
+/*
+ * Decide whether to move alarms between schedulers, given the depth
+ * of each one's queue and the number of its alarms that left in the
+ * last interval. The donor is the deepest scheduler, unless it is
+ * leaving fast enough to drain within REBALANCE_HORIZON intervals,
+ * and the recipient the shallowest. A move is only worth making if
+ * the donor holds REBALANCE_EXCESS percent more than the mean, and
+ * REBALANCE_MIN more than the recipient; half the difference is
+ * moved, at most MIGRATE_BATCH. Returns the number of alarms to move, or 0.
+ */
+int shard_plan (const unsigned long *depth, const unsigned long *rate,
+    int shards, int *donor, int *recipient)
+{
+    unsigned long total = 0, move;
+    int i, d = 0, r = 0;
+
+    for (i = 0; i < shards; i++) {
+        total += depth[i];
+        if (depth[i] > depth[d])
+            d = i;
+        if (depth[i] < depth[r])
+            r = i;
+    }
+    if (d == r || depth[d] * shards * 100 < (100 + REBALANCE_EXCESS) * total
+            || depth[d] - depth[r] < REBALANCE_MIN
+            || depth[d] <= rate[d] * REBALANCE_HORIZON)
+        return 0;
+    move = (depth[d] - depth[r]) / 2;
+    if (move > MIGRATE_BATCH)
+        move = MIGRATE_BATCH;
+    *donor = d;
+    *recipient = r;
+    return move;
+}
+
+#define forward_hash(f, id) \
+    ((unsigned long)((id) * 0x9e3779b97f4a7c15ULL) & ((f)->size - 1))
+
+static unsigned long forward_slot (forward_t *forward, unsigned long id)
+{
+    unsigned long i = forward_hash (forward, id);
+
+    while (forward->id[i] != 0 && forward->id[i] != id)
+        i = (i + 1) & (forward->size - 1);
+    return i;
+}
+
+/*
+ * Remember that alarm "id" was moved to "shard". The table is
+ * doubled whenever it is half full.
+ */
+void forward_add (forward_t *forward, unsigned long id, int shard)
+{
+    unsigned long *old_id = forward->id, old_size = forward->size, i, j;
+    int *old_shard = forward->shard;
+
+    if (2 * (forward->count + 1) > forward->size) {
+        forward->size = old_size ? old_size * 2 : 1024;
+        forward->id = (unsigned long*)calloc (
+            forward->size, sizeof (unsigned long));
+        forward->shard = (int*)malloc (forward->size * sizeof (int));
+        if (forward->id == NULL || forward->shard == NULL)
+            errno_abort ("Allocate forwarding table");
+        for (i = 0; i < old_size; i++) {
+            if (old_id[i] == 0)
+                continue;
+            j = forward_slot (forward, old_id[i]);
+            forward->id[j] = old_id[i];
+            forward->shard[j] = old_shard[i];
+        }
+        free (old_id);
+        free (old_shard);
+    }
+    i = forward_slot (forward, id);
+    if (forward->id[i] == 0)
+        forward->count++;
+    forward->id[i] = id;
+    forward->shard[i] = shard;
+}
+
+/*
+ * Return the shard alarm "id" was moved to, or -1.
+ */
+int forward_find (forward_t *forward, unsigned long id)
+{
+    unsigned long i;
+
+    if (forward->size == 0)
+        return -1;
+    i = forward_slot (forward, id);
+    return forward->id[i] == 0 ? -1 : forward->shard[i];
+}
@@ -0,0 +1,127 @@
+/*
+ * alarm_shard.h
+ *
+ * Sharding the server over several processes (-P). The process
+ * started from the shell becomes a front end: it reads and parses
+ * requests, and routes each one over a ring in shared memory to
+ * one of the scheduler processes it forked. Each scheduler is a
+ * whole alarm server (alarm thread, display threads, queue) with
+ * its own heap and its own output file, alarm-shard<N>.out, for the
+ * alarms it owns.
+ *
+ * New alarms go to the schedulers in turn. Scheduler N (from 0)
+ * gives its alarms the ids N + 1, N + 1 + shards, and so on (see
+ * stats_ids), so the front end can route cancel and reschedule
+ * commands to the scheduler that owns the id.
+ *
+ * Round robin spreads the requests evenly, but not the load: one
+ * scheduler can be left holding far more pending alarms than the
+ * others, when its share happens to be due later, or to be chains.
+ * With -R, a rebalancer thread in the front end reads the depth of
+ * each scheduler's queue and the rate at which its alarms leave,
+ * which the schedulers publish here once a second, and (shard_plan)
+ * asks the deepest to move a batch of alarms to the shallowest. The
+ * request to move them goes through the donor's ring like any
+ * other, so that commands the front end routed to it before are
+ * carried out first. The donor takes the alarms out of its queue
+ * and sends each on to the recipient's inbox, a second ring read
+ * by a thread of its own, which queues them there with the ids and
+ * expiry times they had. Only alarms a scheduler ingested itself,
+ * due at least MIGRATE_AHEAD seconds on, and not part of a chain,
+ * are moved, and only one batch is in flight at a time. The donor
+ * remembers where each alarm went, and forwards any later cancel or
+ * reschedule for it to the recipient's inbox, behind the alarm
+ * itself. Neither ring is ever written with alarm_mutex held.
+ *
+ * At end of input the front end closes the rings. Each scheduler
+ * leaves the totals from its accounting in shared memory as it
+ * exits, and the front end merges them into one report.
+ */
+#ifndef __alarm_shard_h
+#define __alarm_shard_h
+
+#include <pthread.h>
+#include "alarm_stats.h"
+
+#define SHARD_MAX       64
+#define RING_SIZE       1024            /* requests, power of 2 */
+
+#define REQUEST_ALARM   0
+#define REQUEST_CHAIN   1
+#define REQUEST_CANCEL  2
+#define REQUEST_RESCHEDULE 3
+#define REQUEST_LIST    4
+#define REQUEST_PURGE   5
+#define REQUEST_MIGRATE 6               /* "seconds" alarms to shard "id" */
+#define REQUEST_ADOPT   7               /* one alarm, due at "until" */
+
+#define MIGRATE_BATCH   256             /* most alarms moved at once */
+#define MIGRATE_AHEAD   2               /* seconds, least time to run */
+#define REBALANCE_EXCESS 25             /* percent the deepest is over the mean */
+#define REBALANCE_MIN   64              /* least difference in depth */
+#define REBALANCE_HORIZON 5             /* seconds a queue may take to drain */
+
+/*
+ * A parsed request. An alarm's message, or a chain's whole line,
+ * is in "text".
+ */
+typedef struct request_tag {
+    int                 kind;
+    int                 seconds;
+    unsigned long       id;             /* cancel and reschedule */
+    int                 until;          /* list and purge: window end;
+                                           alarm: spread window, or -1 */
+    char                text[512];
+} request_t;
+
+/*
+ * A ring of requests, with one consumer and any number of
+ * producers: a scheduler's ring is fed by the front end and its
+ * rebalancer, and its inbox by the other schedulers. Both ends lock
+ * the (process shared) mutex, and wait on the condition variables
+ * when the ring is full or empty. Every put and get signals the
+ * other end, since with several producers waiting for space, each
+ * slot freed must wake one of them.
+ */
+typedef struct ring_tag {
+    pthread_mutex_t     mutex;
+    pthread_cond_t      not_empty;
+    pthread_cond_t      not_full;
+    unsigned long       head;           /* next to get */
+    unsigned long       tail;           /* next to put */
+    int                 closed;
+    request_t           slot[RING_SIZE];
+} ring_t;
+
+/*
+ * Where a scheduler has sent the alarms it migrated: ids and shard
+ * numbers, open addressing, linear probing.
+ */
+typedef struct forward_tag {
+    unsigned long       size;           /* power of 2 */
+    unsigned long       count;
+    unsigned long       *id;
+    int                 *shard;
+} forward_t;
+
+typedef struct shard_tag {
+    ring_t              ring;
+    ring_t              inbox;          /* from other schedulers */
+    unsigned long       depth;          /* pending alarms */
+    unsigned long       progress;       /* alarms that have left */
+    int                 migrating;      /* a batch is being sent */
+    unsigned long       moved_out, moved_in;
+    int                 reported;       /* summary is valid */
+    stats_summary_t     summary;
+} shard_t;
+
+extern shard_t *shard_create (int shards);
+extern void ring_put (ring_t *ring, const request_t *request);
+extern int ring_get (ring_t *ring, request_t *request);
+extern void ring_close (ring_t *ring);
+extern int shard_plan (const unsigned long *depth, const unsigned long *rate,
+    int shards, int *donor, int *recipient);
+extern void forward_add (forward_t *forward, unsigned long id, int shard);
+extern int forward_find (forward_t *forward, unsigned long id);
+
+#endif
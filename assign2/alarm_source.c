@@ -0,0 +1,137 @@
+/*
+ * alarm_source.c
+ *
+ * Mapped schedule files. See alarm_source.h.
+ */
+#include <pthread.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "errors.h"
+#include "alarm.h"
+#include "alarm_source.h"
+
+/*
+ * Map a schedule file. Returns NULL, with errno set, if it can't be
+ * opened or mapped. The caller holds the first reference.
+ */
+source_t *source_open (const char *path)
+{
+    source_t *source;
+    struct stat st;
+    void *addr;
+    int fd, status;
+
+    fd = open (path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat (fd, &st) < 0) {
+        close (fd);
+        return NULL;
+    }
+    if (st.st_size == 0)
+        addr = NULL;
+    else {
+        addr = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            close (fd);
+            return NULL;
+        }
+        /*
+         * The loader reads the file front to back once; the messages
+         * are read again in deadline order, which is anyone's guess.
+         */
+        madvise (addr, st.st_size, MADV_SEQUENTIAL);
+    }
+    close (fd);
+
+    source = (source_t*)malloc (sizeof (source_t));
+    if (source == NULL)
+        errno_abort ("Allocate source");
+    status = pthread_mutex_init (&source->mutex, NULL);
+    if (status != 0)
+        err_abort (status, "Init source mutex");
+    source->addr = (const char*)addr;
+    source->size = st.st_size;
+    source->refs = 1;
+    return source;
+}
+
+void source_hold (source_t *source)
+{
+    int status;
+
+    status = pthread_mutex_lock (&source->mutex);
+    if (status != 0)
+        err_abort (status, "Lock source mutex");
+    source->refs++;
+    status = pthread_mutex_unlock (&source->mutex);
+    if (status != 0)
+        err_abort (status, "Unlock source mutex");
+}
+
+void source_release (source_t *source)
+{
+    unsigned long refs;
+    int status;
+
+    status = pthread_mutex_lock (&source->mutex);
+    if (status != 0)
+        err_abort (status, "Lock source mutex");
+    refs = --source->refs;
+    status = pthread_mutex_unlock (&source->mutex);
+    if (status != 0)
+        err_abort (status, "Unlock source mutex");
+    if (refs > 0)
+        return;
+    if (source->addr != NULL)
+        munmap ((void*)source->addr, source->size);
+    pthread_mutex_destroy (&source->mutex);
+    free (source);
+}
+
+/*
+ * Parse the request on the line running from "start" up to "end"
+ * (not including the newline), as alarm_parse would: seconds, white
+ * space, and a message of which the first 64 characters are kept.
+ * The mapping isn't NUL terminated, so this can't use sscanf.
+ * Returns a mapped alarm holding a reference to the source, or NULL
+ * if the line is not a valid request.
+ */
+alarm_t *source_parse (source_t *source, size_t start, size_t end)
+{
+    const char *p = source->addr + start, *e = source->addr + end;
+    const char *text;
+    alarm_t *alarm;
+    long seconds = 0;
+    int negative = 0, digits = 0;
+
+    while (p < e && isspace ((unsigned char)*p))
+        p++;
+    if (p < e && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+    while (p < e && isdigit ((unsigned char)*p)) {
+        if (seconds < 100000000)
+            seconds = seconds * 10 + (*p - '0');
+        p++;
+        digits++;
+    }
+    if (digits == 0 || p == e || !isspace ((unsigned char)*p))
+        return NULL;
+    while (p < e && isspace ((unsigned char)*p))
+        p++;
+    if (p == e)
+        return NULL;
+    text = p;
+    if (e - text > 64)
+        e = text + 64;
+
+    alarm = alarm_alloc_mapped ();
+    alarm->seconds = negative ? -seconds : seconds;
+    alarm->source = source;
+    alarm->offset = text - source->addr;
+    alarm->length = e - text;
+    source_hold (source);
+    return alarm;
+}
@@ -0,0 +1,35 @@
+/*
+ * alarm_source.h
+ *
+ * Schedule files, mapped into memory instead of read. An alarm
+ * loaded from a mapped schedule doesn't copy its message: the
+ * record holds the offset and length of the message in the file,
+ * and it is read from the mapping when the alarm is printed. Such
+ * records are allocated without the message array (alarm_alloc_
+ * mapped), so a large schedule costs little more memory than the
+ * page cache already holds for the file.
+ *
+ * Each mapped alarm holds a reference to its source, as does the
+ * loader while it is reading. The file is unmapped when the last
+ * reference goes.
+ */
+#ifndef __alarm_source_h
+#define __alarm_source_h
+
+#include <pthread.h>
+#include <stddef.h>
+#include "alarm.h"
+
+typedef struct source_tag {
+    pthread_mutex_t     mutex;
+    const char          *addr;
+    size_t              size;
+    unsigned long       refs;
+} source_t;
+
+extern source_t *source_open (const char *path);
+extern void source_hold (source_t *source);
+extern void source_release (source_t *source);
+extern alarm_t *source_parse (source_t *source, size_t start, size_t end);
+
+#endif
@@ -0,0 +1,684 @@
+/*
+ * alarm_stats.c
+ *
+ * Per-alarm accounting for the alarm server. The table is indexed
+ * by alarm id (ids are handed out in ingest order, starting at 1,
+ * or as set by stats_ids), and holds the deadline of the alarm and
+ * the number of times it has fired. Everything else is kept as
+ * running totals.
+ */
+#include <pthread.h>
+#include <time.h>
+#include "errors.h"
+#include "alarm_stats.h"
+
+#define STATE_DROPPED   0x80    /* handoff overwritten, or shed */
+#define STATE_FIRES     0x7f    /* number of times fired */
+
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static time_t *stats_deadline = NULL;  /* deadline, by id */
+static unsigned char *stats_state = NULL;      /* fire count, by id */
+static unsigned long stats_size = 0;    /* allocated entries */
+static unsigned long stats_next_id = 1; /* next table index */
+static unsigned long id_first = 1, id_stride = 1;
+static long late_threshold = 1;         /* seconds */
+
+/*
+ * Alarms adopted from another scheduler keep the ids they were
+ * given there, so they are kept in a table of their own, by id:
+ * open addressing, linear probing, kept at most half full.
+ */
+static unsigned long *adopt_id = NULL;
+static time_t *adopt_deadline = NULL;
+static unsigned char *adopt_state = NULL;
+static unsigned long adopt_size = 0, adopt_count = 0;
+
+#define adopt_hash(id) \
+    ((unsigned long)((id) * 0x9e3779b97f4a7c15ULL) & (adopt_size - 1))
+
+static unsigned long ingested, handed_off, fired, dropped,
+    duplicated, late, shed, cancelled, rescheduled, migrated, adopted;
+static unsigned long spread, spread_seconds;
+static time_t max_deadline;
+static double max_lateness, total_lateness;
+static double first_ingest, last_ingest, last_fire;
+static time_t profile_start;
+static long profile_width;
+static unsigned long profile[STATS_PROFILE];
+
+/*
+ * Return the current wall clock time in seconds, with nanosecond
+ * resolution, so that lateness can be measured against deadlines
+ * expressed in seconds from the Epoch.
+ */
+static double stats_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void stats_lock (void)
+{
+    int status;
+
+    status = pthread_mutex_lock (&stats_mutex);
+    if (status != 0)
+        err_abort (status, "Lock stats mutex");
+}
+
+static void stats_unlock (void)
+{
+    int status;
+
+    status = pthread_mutex_unlock (&stats_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock stats mutex");
+}
+
+void stats_init (int late_seconds)
+{
+    late_threshold = late_seconds;
+}
+
+/*
+ * Hand out ids first, first + stride, first + 2 * stride, and so
+ * on, so that processes sharing out the alarms (see alarm_shard.h)
+ * give them ids that are unique between them. Must be called
+ * before the first alarm is ingested.
+ */
+void stats_ids (unsigned long first, unsigned long stride)
+{
+    id_first = first;
+    id_stride = stride;
+}
+
+/*
+ * Hand out only ids above "last", such as those of alarms resumed
+ * from a queue file (alarm_pqueue.h), which are then unknown here.
+ * Must be called before the first alarm is ingested.
+ */
+void stats_skip (unsigned long last)
+{
+    if (last >= id_first)
+        id_first += ((last - id_first) / id_stride + 1) * id_stride;
+}
+
+/*
+ * Return the table index of an id, or 0 if it isn't one of ours.
+ */
+static unsigned long stats_index (unsigned long id)
+{
+    unsigned long index;
+
+    if (id < id_first || (id - id_first) % id_stride != 0)
+        return 0;
+    index = (id - id_first) / id_stride + 1;
+    return index < stats_next_id ? index : 0;
+}
+
+/*
+ * Return the slot of an adopted id, or of the empty slot it would
+ * go in. Called with stats_mutex locked, and the table allocated.
+ */
+static unsigned long adopt_slot (unsigned long id)
+{
+    unsigned long i = adopt_hash (id);
+
+    while (adopt_id[i] != 0 && adopt_id[i] != id)
+        i = (i + 1) & (adopt_size - 1);
+    return i;
+}
+
+/*
+ * Find the deadline and state of an id, ours or adopted. Returns 0
+ * if there is no such id. Called with stats_mutex locked.
+ */
+static int stats_entry (unsigned long id,
+    time_t **deadline, unsigned char **state)
+{
+    unsigned long index = stats_index (id);
+
+    if (index == 0 && adopt_size > 0) {
+        index = adopt_slot (id);
+        if (adopt_id[index] == 0)
+            return 0;
+        *deadline = &adopt_deadline[index];
+        *state = &adopt_state[index];
+        return 1;
+    }
+    if (index == 0)
+        return 0;
+    *deadline = &stats_deadline[index];
+    *state = &stats_state[index];
+    return 1;
+}
+
+/*
+ * Record a newly ingested alarm, and return its id. The table is
+ * doubled whenever it fills up.
+ */
+unsigned long stats_ingest (time_t deadline)
+{
+    unsigned long id, index, size;
+    double now = stats_now ();
+
+    stats_lock ();
+    index = stats_next_id++;
+    id = id_first + (index - 1) * id_stride;
+    if (index >= stats_size) {
+        size = stats_size ? stats_size * 2 : 1024;
+        stats_deadline = (time_t*)realloc (
+            stats_deadline, size * sizeof (time_t));
+        stats_state = (unsigned char*)realloc (stats_state, size);
+        if (stats_deadline == NULL || stats_state == NULL)
+            errno_abort ("Allocate stats table");
+        memset (stats_state + stats_size, 0, size - stats_size);
+        stats_size = size;
+    }
+    stats_deadline[index] = deadline;
+    stats_state[index] = 0;
+    if (ingested++ == 0)
+        first_ingest = now;
+    last_ingest = now;
+    if (deadline > max_deadline)
+        max_deadline = deadline;
+    stats_unlock ();
+    return id;
+}
+
+void stats_handoff (unsigned long id)
+{
+    stats_lock ();
+    handed_off++;
+    stats_unlock ();
+}
+
+/*
+ * The alarm thread found that the previous alarm it handed off was
+ * never picked up by a display thread.
+ */
+void stats_drop (unsigned long id)
+{
+    time_t *deadline;
+    unsigned char *state;
+
+    stats_lock ();
+    if (stats_entry (id, &deadline, &state) && !(*state & STATE_DROPPED)) {
+        *state |= STATE_DROPPED;
+        dropped++;
+    }
+    stats_unlock ();
+}
+
+/*
+ * Halve the resolution of a fire profile: each pair of buckets is
+ * folded into one twice as wide.
+ */
+static void profile_widen (time_t *start, long *width, unsigned long *count)
+{
+    unsigned long folded[STATS_PROFILE];
+    time_t first = *start / 2;
+    int i;
+
+    memset (folded, 0, sizeof (folded));
+    for (i = 0; i < STATS_PROFILE; i++)
+        folded[(*start + i) / 2 - first] += count[i];
+    memcpy (count, folded, sizeof (folded));
+    *start = first;
+    *width *= 2;
+}
+
+/*
+ * Count "n" fires at second "when" into a profile. The first fire
+ * starts the profile at one second per bucket. A fire past the last
+ * bucket widens the buckets until it fits; one before the first
+ * moves the profile back if the later buckets are empty, and widens
+ * it otherwise.
+ */
+static void profile_add (time_t *start, long *width, unsigned long *count,
+    time_t when, unsigned long n)
+{
+    time_t bucket;
+    int i, shift, last;
+
+    if (*width == 0) {
+        *width = 1;
+        *start = when;
+    }
+    while (1) {
+        bucket = when / *width;
+        if (bucket >= *start + STATS_PROFILE) {
+            profile_widen (start, width, count);
+            continue;
+        }
+        if (bucket >= *start)
+            break;
+        for (last = STATS_PROFILE - 1; last > 0 && count[last] == 0; last--)
+            ;
+        if (*start - bucket + last >= STATS_PROFILE) {
+            profile_widen (start, width, count);
+            continue;
+        }
+        shift = *start - bucket;
+        for (i = last; i >= 0; i--)
+            count[i + shift] = count[i];
+        memset (count, 0, shift * sizeof (unsigned long));
+        *start = bucket;
+    }
+    count[bucket - *start] += n;
+}
+
+/*
+ * Record an alarm expiring. The first expiry counts towards the
+ * fired total and the lateness figures; any later one for the
+ * same id is a duplicate.
+ */
+void stats_fire (unsigned long id)
+{
+    double now = stats_now ();
+    double lateness;
+    time_t *deadline;
+    unsigned char *state;
+
+    stats_lock ();
+    if (!stats_entry (id, &deadline, &state)) {
+        stats_unlock ();
+        return;
+    }
+    if ((*state & STATE_FIRES) != 0)
+        duplicated++;
+    else {
+        fired++;
+        lateness = now - *deadline;
+        if (lateness > 0) {
+            total_lateness += lateness;
+            if (lateness > max_lateness)
+                max_lateness = lateness;
+        }
+        if (lateness >= late_threshold)
+            late++;
+        profile_add (&profile_start, &profile_width, profile,
+            (time_t)now, 1);
+    }
+    if ((*state & STATE_FIRES) != STATE_FIRES)
+        (*state)++;
+    last_fire = now;
+    stats_unlock ();
+}
+
+/*
+ * The late alarm policy discarded an alarm that was too far past
+ * its deadline. Shedding is deliberate, so it is counted apart
+ * from dropped alarms.
+ */
+void stats_shed (unsigned long id)
+{
+    time_t *deadline;
+    unsigned char *state;
+
+    stats_lock ();
+    if (stats_entry (id, &deadline, &state) && *state == 0) {
+        *state |= STATE_DROPPED;
+        shed++;
+    }
+    stats_unlock ();
+}
+
+/*
+ * A client cancelled a pending alarm. Like a shed alarm, it will
+ * never fire, and isn't counted as unfired.
+ */
+void stats_cancel (unsigned long id)
+{
+    time_t *deadline;
+    unsigned char *state;
+
+    stats_lock ();
+    if (stats_entry (id, &deadline, &state) && *state == 0) {
+        *state |= STATE_DROPPED;
+        cancelled++;
+    }
+    stats_unlock ();
+}
+
+/*
+ * A client gave a pending alarm a new deadline, which lateness is
+ * measured against from now on.
+ */
+void stats_reschedule (unsigned long id, time_t deadline)
+{
+    time_t *entry;
+    unsigned char *state;
+
+    stats_lock ();
+    if (stats_entry (id, &entry, &state)) {
+        *entry = deadline;
+        if (deadline > max_deadline)
+            max_deadline = deadline;
+        rescheduled++;
+    }
+    stats_unlock ();
+}
+
+/*
+ * A new alarm's fire was spread "offset" seconds past its deadline
+ * (-J). It is held to the later time from now on.
+ */
+void stats_spread (unsigned long id, int offset)
+{
+    time_t *deadline;
+    unsigned char *state;
+
+    stats_lock ();
+    if (stats_entry (id, &deadline, &state)) {
+        *deadline += offset;
+        if (*deadline > max_deadline)
+            max_deadline = *deadline;
+        spread++;
+        spread_seconds += offset;
+    }
+    stats_unlock ();
+}
+
+/*
+ * A pending alarm was moved to another scheduler, which accounts
+ * for it from now on. Like a cancelled alarm, it will never fire
+ * here, and isn't counted as unfired.
+ */
+void stats_migrate (unsigned long id)
+{
+    time_t *deadline;
+    unsigned char *state;
+
+    stats_lock ();
+    if (stats_entry (id, &deadline, &state) && *state == 0) {
+        *state |= STATE_DROPPED;
+        migrated++;
+    }
+    stats_unlock ();
+}
+
+/*
+ * Take over the accounting of an alarm moved here from another
+ * scheduler, under the id it was given there. The table is doubled
+ * whenever it is half full.
+ */
+void stats_adopt (unsigned long id, time_t deadline)
+{
+    unsigned long *old_id, old_size, i, j;
+    time_t *old_deadline;
+    unsigned char *old_state;
+
+    stats_lock ();
+    if (2 * (adopt_count + 1) > adopt_size) {
+        old_id = adopt_id;
+        old_size = adopt_size;
+        old_deadline = adopt_deadline;
+        old_state = adopt_state;
+        adopt_size = adopt_size ? adopt_size * 2 : 1024;
+        adopt_id = (unsigned long*)calloc (adopt_size, sizeof (unsigned long));
+        adopt_deadline = (time_t*)malloc (adopt_size * sizeof (time_t));
+        adopt_state = (unsigned char*)malloc (adopt_size);
+        if (adopt_id == NULL || adopt_deadline == NULL || adopt_state == NULL)
+            errno_abort ("Allocate adopted alarms");
+        for (i = 0; i < old_size; i++) {
+            if (old_id[i] == 0)
+                continue;
+            j = adopt_slot (old_id[i]);
+            adopt_id[j] = old_id[i];
+            adopt_deadline[j] = old_deadline[i];
+            adopt_state[j] = old_state[i];
+        }
+        free (old_id);
+        free (old_deadline);
+        free (old_state);
+    }
+    i = adopt_slot (id);
+    if (adopt_id[i] == 0)
+        adopt_count++;
+    adopt_id[i] = id;
+    adopt_deadline[i] = deadline;
+    adopt_state[i] = 0;
+    adopted++;
+    if (deadline > max_deadline)
+        max_deadline = deadline;
+    stats_unlock ();
+}
+
+/*
+ * Number of alarms that have been ingested or adopted, but have
+ * neither fired, nor been dropped, shed, cancelled or migrated.
+ */
+unsigned long stats_pending (void)
+{
+    unsigned long pending;
+
+    stats_lock ();
+    pending = ingested + adopted - fired - dropped - shed - cancelled
+        - migrated;
+    stats_unlock ();
+    return pending;
+}
+
+/*
+ * Memory held by the accounting tables.
+ */
+size_t stats_bytes (void)
+{
+    size_t bytes;
+
+    stats_lock ();
+    bytes = stats_size * (sizeof (time_t) + 1) + adopt_size
+        * (sizeof (unsigned long) + sizeof (time_t) + 1);
+    stats_unlock ();
+    return bytes;
+}
+
+/*
+ * A counter that moves whenever an alarm leaves the server, so
+ * that a caller waiting for the server to drain can tell whether
+ * it is still making progress.
+ */
+unsigned long stats_progress (void)
+{
+    unsigned long progress;
+
+    stats_lock ();
+    progress = fired + duplicated + dropped + shed + cancelled;
+    stats_unlock ();
+    return progress;
+}
+
+time_t stats_last_deadline (void)
+{
+    time_t deadline;
+
+    stats_lock ();
+    deadline = max_deadline;
+    stats_unlock ();
+    return deadline;
+}
+
+/*
+ * Take a copy of the totals, which can be merged with those of
+ * other processes and printed.
+ */
+void stats_summarize (stats_summary_t *summary)
+{
+    unsigned long index;
+
+    stats_lock ();
+    memset (summary, 0, sizeof (stats_summary_t));
+    for (index = 1; index < stats_next_id; index++)
+        if (stats_state[index] == 0)
+            summary->unfired++;
+    for (index = 0; index < adopt_size; index++)
+        if (adopt_id[index] != 0 && adopt_state[index] == 0)
+            summary->unfired++;
+    summary->ingested = ingested;
+    summary->handed_off = handed_off;
+    summary->fired = fired;
+    summary->dropped = dropped;
+    summary->duplicated = duplicated;
+    summary->shed = shed;
+    summary->cancelled = cancelled;
+    summary->rescheduled = rescheduled;
+    summary->migrated = migrated;
+    summary->adopted = adopted;
+    summary->spread = spread;
+    summary->spread_seconds = spread_seconds;
+    summary->late = late;
+    summary->late_threshold = late_threshold;
+    summary->max_lateness = max_lateness;
+    summary->total_lateness = total_lateness;
+    summary->first_ingest = first_ingest;
+    summary->last_ingest = last_ingest;
+    summary->last_fire = last_fire;
+    summary->profile_start = profile_start;
+    summary->profile_width = profile_width;
+    memcpy (summary->profile, profile, sizeof (profile));
+    stats_unlock ();
+}
+
+/*
+ * Add the totals of "from" into "into". Rates are measured from the
+ * earliest ingest to the latest ingest or fire of either. Profiles
+ * are merged at the wider of their two bucket widths.
+ */
+void stats_merge (stats_summary_t *into, const stats_summary_t *from)
+{
+    int i;
+
+    if (from->ingested == 0 && from->adopted == 0)
+        return;
+    if (from->profile_width > 0) {
+        while (into->profile_width > 0
+                && into->profile_width < from->profile_width)
+            profile_widen (&into->profile_start, &into->profile_width,
+                into->profile);
+        if (into->profile_width == 0) {
+            into->profile_width = from->profile_width;
+            into->profile_start = from->profile_start;
+        }
+        for (i = 0; i < STATS_PROFILE; i++)
+            if (from->profile[i] > 0)
+                profile_add (&into->profile_start, &into->profile_width,
+                    into->profile,
+                    (from->profile_start + i) * from->profile_width,
+                    from->profile[i]);
+    }
+    if (from->ingested > 0 && (into->ingested == 0
+            || from->first_ingest < into->first_ingest))
+        into->first_ingest = from->first_ingest;
+    if (from->last_ingest > into->last_ingest)
+        into->last_ingest = from->last_ingest;
+    if (from->last_fire > into->last_fire)
+        into->last_fire = from->last_fire;
+    if (from->max_lateness > into->max_lateness)
+        into->max_lateness = from->max_lateness;
+    into->ingested += from->ingested;
+    into->handed_off += from->handed_off;
+    into->fired += from->fired;
+    into->dropped += from->dropped;
+    into->duplicated += from->duplicated;
+    into->shed += from->shed;
+    into->cancelled += from->cancelled;
+    into->rescheduled += from->rescheduled;
+    into->migrated += from->migrated;
+    into->adopted += from->adopted;
+    into->spread += from->spread;
+    into->spread_seconds += from->spread_seconds;
+    into->unfired += from->unfired;
+    into->late += from->late;
+    into->late_threshold = from->late_threshold;
+    into->total_lateness += from->total_lateness;
+}
+
+/*
+ * Print the fire profile, at most PROFILE_ROWS rows of buckets
+ * from the first fire to the last, each with its mean rate and a
+ * bar scaled to the busiest row.
+ */
+#define PROFILE_ROWS    16
+#define PROFILE_BAR     40
+
+static void profile_print (FILE *out, const stats_summary_t *s)
+{
+    unsigned long n;
+    double rate, peak = 0;
+    int first, last, group, row, rows, i, bar;
+
+    for (first = 0; first < STATS_PROFILE && s->profile[first] == 0; first++)
+        ;
+    for (last = STATS_PROFILE - 1; last > first && s->profile[last] == 0;
+            last--)
+        ;
+    if (first == STATS_PROFILE)
+        return;
+    group = (last - first + PROFILE_ROWS) / PROFILE_ROWS;
+    rows = (last - first) / group + 1;
+    for (row = 0; row < rows; row++) {
+        for (n = 0, i = first + row * group;
+                i < first + (row + 1) * group && i < STATS_PROFILE; i++)
+            n += s->profile[i];
+        rate = (double)n / (group * s->profile_width);
+        if (rate > peak)
+            peak = rate;
+    }
+    fprintf (out, "  fire profile, %lds per row, peak %.1f alarms/s\n",
+        group * s->profile_width, peak);
+    for (row = 0; row < rows; row++) {
+        for (n = 0, i = first + row * group;
+                i < first + (row + 1) * group && i < STATS_PROFILE; i++)
+            n += s->profile[i];
+        rate = (double)n / (group * s->profile_width);
+        bar = peak > 0 ? (int)(rate / peak * PROFILE_BAR + 0.5) : 0;
+        fprintf (out, "    +%-6ld %10.1f/s |%.*s\n",
+            (long)(row * group * s->profile_width), rate, bar,
+            "########################################");
+    }
+}
+
+void stats_print (FILE *out, const stats_summary_t *s)
+{
+    double ingest_span, fire_span;
+
+    ingest_span = s->last_ingest - s->first_ingest;
+    fire_span = s->last_fire - s->first_ingest;
+    fprintf (out, "Alarm accounting:\n");
+    fprintf (out, "  ingested   %lu\n", s->ingested);
+    fprintf (out, "  handed off %lu\n", s->handed_off);
+    fprintf (out, "  fired      %lu\n", s->fired);
+    fprintf (out, "  dropped    %lu\n", s->dropped);
+    fprintf (out, "  duplicated %lu\n", s->duplicated);
+    fprintf (out, "  shed       %lu\n", s->shed);
+    fprintf (out, "  cancelled  %lu\n", s->cancelled);
+    fprintf (out, "  rescheduled %lu\n", s->rescheduled);
+    if (s->migrated > 0 || s->adopted > 0)
+        fprintf (out, "  migrated   %lu (%lu adopted)\n", s->migrated,
+            s->adopted);
+    fprintf (out, "  unfired    %lu\n", s->unfired);
+    fprintf (out, "  late       %lu (>= %lds after deadline)\n",
+        s->late, s->late_threshold);
+    fprintf (out, "  lateness   max %.3fs, mean %.3fs\n", s->max_lateness,
+        s->fired ? s->total_lateness / s->fired : 0.0);
+    fprintf (out, "  ingest     %.1f alarms/s\n",
+        ingest_span > 0 ? s->ingested / ingest_span : 0.0);
+    fprintf (out, "  fire       %.1f alarms/s\n",
+        fire_span > 0 ? s->fired / fire_span : 0.0);
+    if (s->spread > 0)
+        fprintf (out, "  spread     %lu alarms, mean +%.1fs\n", s->spread,
+            (double)s->spread_seconds / s->spread);
+    if (s->profile_width > 0)
+        profile_print (out, s);
+}
+
+void stats_report (FILE *out)
+{
+    stats_summary_t summary;
+
+    stats_summarize (&summary);
+    stats_print (out, &summary);
+}
@@ -0,0 +1,74 @@
+/*
+ * alarm_stats.h
+ *
+ * Alarm accounting. Every alarm is given an id when the main
+ * thread ingests it, and each later event for that id (handoff to
+ * a display thread, expiry, or being dropped because the display
+ * thread never picked it up) is recorded against it. At the end of
+ * a run the counters tell us whether every alarm fired exactly
+ * once, how late the late ones were, and at what rate the server
+ * ingested and fired them.
+ *
+ * An alarm whose fire was spread past its deadline (-J) is held to
+ * the time it was spread to. Fires are also counted by the second
+ * they happened in, into a profile of STATS_PROFILE buckets whose
+ * width doubles as the run goes on, so that the report can show
+ * how evenly the server fired.
+ *
+ * In a sharded server, an alarm moved to another scheduler (see
+ * alarm_shard.h) is accounted as migrated where it was ingested,
+ * and from then on by the scheduler that adopted it.
+ *
+ * All of the routines lock their own mutex, so they may be called
+ * with or without alarm_mutex held.
+ */
+#ifndef __alarm_stats_h
+#define __alarm_stats_h
+
+#include <stdio.h>
+#include <time.h>
+
+#define STATS_PROFILE   64              /* buckets in the fire profile */
+
+/*
+ * The totals, as copied out by stats_summarize. The profile counts
+ * the alarms fired in each profile_width seconds, from second
+ * profile_start * profile_width; a width of 0 means nothing fired.
+ */
+typedef struct stats_summary_tag {
+    unsigned long       ingested, handed_off, fired, dropped;
+    unsigned long       duplicated, shed, cancelled, rescheduled;
+    unsigned long       unfired, late;
+    unsigned long       migrated, adopted;
+    unsigned long       spread, spread_seconds;
+    long                late_threshold;
+    double              max_lateness, total_lateness;
+    double              first_ingest, last_ingest, last_fire;
+    time_t              profile_start;
+    long                profile_width;
+    unsigned long       profile[STATS_PROFILE];
+} stats_summary_t;
+
+extern void stats_init (int late_seconds);
+extern void stats_ids (unsigned long first, unsigned long stride);
+extern void stats_skip (unsigned long last);
+extern unsigned long stats_ingest (time_t deadline);
+extern void stats_handoff (unsigned long id);
+extern void stats_drop (unsigned long id);
+extern void stats_fire (unsigned long id);
+extern void stats_shed (unsigned long id);
+extern void stats_cancel (unsigned long id);
+extern void stats_reschedule (unsigned long id, time_t deadline);
+extern void stats_spread (unsigned long id, int offset);
+extern void stats_migrate (unsigned long id);
+extern void stats_adopt (unsigned long id, time_t deadline);
+extern unsigned long stats_pending (void);
+extern size_t stats_bytes (void);
+extern unsigned long stats_progress (void);
+extern time_t stats_last_deadline (void);
+extern void stats_report (FILE *out);
+extern void stats_summarize (stats_summary_t *summary);
+extern void stats_merge (stats_summary_t *into, const stats_summary_t *from);
+extern void stats_print (FILE *out, const stats_summary_t *summary);
+
+#endif
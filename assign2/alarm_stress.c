@@ -0,0 +1,73 @@
+/*
+ * alarm_stress.c
+ *
+ * Load generator for the alarm server. Writes alarm requests, one
+ * per line, to stdout at a fixed rate, so that the server can be
+ * driven much harder than by typing at it:
+ *
+ *      ./alarm_stress -n 1000 -r 50 -m 5 | ./a.out -s > /dev/null
+ *
+ * With -s the server waits for the alarms to drain once input runs
+ * out, and prints its accounting report (dropped, duplicated and
+ * late alarms, and throughput) on stderr.
+ */
+#include <time.h>
+#include "errors.h"
+
+int main (int argc, char *argv[])
+{
+    int c;
+    unsigned long count = 100, i;
+    double rate = 10.0;         /* requests per second, 0 = flat out */
+    int max_seconds = 5;
+    unsigned int seed = 3221;
+    struct timespec start, now, delay;
+    double due, elapsed;
+
+    while ((c = getopt (argc, argv, "n:r:m:S:")) != -1) {
+        switch (c) {
+        case 'n':
+            count = strtoul (optarg, NULL, 10);
+            break;
+        case 'r':
+            rate = atof (optarg);
+            break;
+        case 'm':
+            max_seconds = atoi (optarg);
+            break;
+        case 'S':
+            seed = (unsigned int)strtoul (optarg, NULL, 10);
+            break;
+        default:
+            fprintf (stderr, "Usage: %s [-n count] [-r per_second] "
+                "[-m max_seconds] [-S seed]\n", argv[0]);
+            exit (1);
+        }
+    }
+    srand (seed);
+    clock_gettime (CLOCK_MONOTONIC, &start);
+
+    for (i = 1; i <= count; i++) {
+        /*
+         * Pace the requests against the start time rather than
+         * sleeping a fixed interval, so that time spent blocked on
+         * a full pipe is made up rather than accumulated.
+         */
+        if (rate > 0) {
+            due = (i - 1) / rate;
+            clock_gettime (CLOCK_MONOTONIC, &now);
+            elapsed = (now.tv_sec - start.tv_sec)
+                + (now.tv_nsec - start.tv_nsec) / 1e9;
+            if (due > elapsed) {
+                fflush (stdout);
+                delay.tv_sec = (time_t)(due - elapsed);
+                delay.tv_nsec = (long)((due - elapsed - delay.tv_sec) * 1e9);
+                nanosleep (&delay, NULL);
+            }
+        }
+        printf ("%d stress %lu\n",
+            max_seconds > 0 ? rand () % (max_seconds + 1) : 0, i);
+    }
+    fflush (stdout);
+    return 0;
+}
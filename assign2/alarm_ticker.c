@@ -0,0 +1,207 @@
+/*
+ * alarm_ticker.c
+ *
+ * The ticker table and its scan kernels. A scan computes, for each
+ * entry, the seconds remaining until its deadline, and collects the
+ * indexes of the entries that have expired (deadline <= now) and of
+ * those still running whose next countdown line is due
+ * (next_tick <= now), all in one pass.
+ */
+#include "errors.h"
+#include "alarm.h"
+#include "alarm_ticker.h"
+
+#if defined (__x86_64__) || defined (__i386__)
+# include <immintrin.h>
+# define TICKER_AVX2
+#endif
+
+static void ticker_dispatch (const long long *deadline,
+    const long long *next_tick, int n, long long now,
+    long long *remaining, int *expired, int *nexpired,
+    int *due, int *ndue);
+
+/*
+ * The kernel used by display threads. It starts out pointing at
+ * the dispatcher, which replaces it with the best kernel for this
+ * CPU on first use.
+ */
+ticker_kernel_t ticker_scan = ticker_dispatch;
+
+void ticker_init (ticker_t *ticker)
+{
+    memset (ticker, 0, sizeof (ticker_t));
+}
+
+/*
+ * Grow every array of the table together, doubling its size.
+ */
+static void ticker_grow (ticker_t *ticker)
+{
+    int size = ticker->size ? ticker->size * 2 : 64;
+
+    ticker->deadline = (long long*)realloc (
+        ticker->deadline, size * sizeof (long long));
+    ticker->next_tick = (long long*)realloc (
+        ticker->next_tick, size * sizeof (long long));
+    ticker->received = (long long*)realloc (
+        ticker->received, size * sizeof (long long));
+    ticker->remaining = (long long*)realloc (
+        ticker->remaining, size * sizeof (long long));
+    ticker->alarm = (alarm_t**)realloc (
+        ticker->alarm, size * sizeof (alarm_t*));
+    ticker->expired = (int*)realloc (ticker->expired, size * sizeof (int));
+    ticker->due = (int*)realloc (ticker->due, size * sizeof (int));
+    if (ticker->deadline == NULL || ticker->next_tick == NULL
+            || ticker->received == NULL || ticker->remaining == NULL
+            || ticker->alarm == NULL || ticker->expired == NULL
+            || ticker->due == NULL)
+        errno_abort ("Allocate ticker");
+    ticker->size = size;
+}
+
+/*
+ * Add an alarm the display thread has just received. Its first
+ * countdown line is due straight away, as in the sleeping mode.
+ */
+void ticker_add (ticker_t *ticker, alarm_t *alarm, time_t now)
+{
+    int i;
+
+    if (ticker->count == ticker->size)
+        ticker_grow (ticker);
+    i = ticker->count++;
+    ticker->deadline[i] = alarm->time;
+    ticker->next_tick[i] = now;
+    ticker->received[i] = now;
+    ticker->alarm[i] = alarm;
+}
+
+/*
+ * Remove an entry by moving the last entry into its place. Callers
+ * removing several entries after a scan must remove them from the
+ * highest index down, so that no index they hold is moved.
+ */
+void ticker_remove (ticker_t *ticker, int index)
+{
+    int last = --ticker->count;
+
+    ticker->deadline[index] = ticker->deadline[last];
+    ticker->next_tick[index] = ticker->next_tick[last];
+    ticker->received[index] = ticker->received[last];
+    ticker->alarm[index] = ticker->alarm[last];
+}
+
+/*
+ * Move an entry to another display thread's table, keeping when it
+ * was received and when its next line is due. As for ticker_remove,
+ * several entries must be moved from the highest index down.
+ */
+void ticker_move (ticker_t *from, int index, ticker_t *to)
+{
+    int i;
+
+    if (to->count == to->size)
+        ticker_grow (to);
+    i = to->count++;
+    to->deadline[i] = from->deadline[index];
+    to->next_tick[i] = from->next_tick[index];
+    to->received[i] = from->received[index];
+    to->alarm[i] = from->alarm[index];
+    ticker_remove (from, index);
+}
+
+void ticker_scan_scalar (const long long *deadline,
+    const long long *next_tick, int n, long long now,
+    long long *remaining, int *expired, int *nexpired,
+    int *due, int *ndue)
+{
+    int i, ne = 0, nd = 0;
+
+    for (i = 0; i < n; i++) {
+        remaining[i] = deadline[i] - now;
+        if (deadline[i] <= now)
+            expired[ne++] = i;
+        else if (next_tick[i] <= now)
+            due[nd++] = i;
+    }
+    *nexpired = ne;
+    *ndue = nd;
+}
+
+#ifdef TICKER_AVX2
+/*
+ * AVX2 kernel: four entries per step. The comparisons produce a
+ * lane mask each, which is turned into a 4 bit mask and walked
+ * with count trailing zeros to append the matching indexes. The
+ * entries left over after the last full step go through the
+ * scalar loop.
+ */
+__attribute__ ((target ("avx2")))
+static void ticker_scan_avx2 (const long long *deadline,
+    const long long *next_tick, int n, long long now,
+    long long *remaining, int *expired, int *nexpired,
+    int *due, int *ndue)
+{
+    __m256i nowv = _mm256_set1_epi64x (now);
+    __m256i d, t, live, ready;
+    unsigned exp_bits, due_bits;
+    int i, ne = 0, nd = 0, te, td;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        d = _mm256_loadu_si256 ((const __m256i*)(deadline + i));
+        t = _mm256_loadu_si256 ((const __m256i*)(next_tick + i));
+        _mm256_storeu_si256 ((__m256i*)(remaining + i),
+            _mm256_sub_epi64 (d, nowv));
+        live = _mm256_cmpgt_epi64 (d, nowv);            /* d > now */
+        ready = _mm256_cmpgt_epi64 (t, nowv);           /* t > now */
+        exp_bits = ~_mm256_movemask_pd (_mm256_castsi256_pd (live)) & 0xf;
+        due_bits = _mm256_movemask_pd (_mm256_castsi256_pd (
+            _mm256_andnot_si256 (ready, live)));
+        while (exp_bits) {
+            expired[ne++] = i + __builtin_ctz (exp_bits);
+            exp_bits &= exp_bits - 1;
+        }
+        while (due_bits) {
+            due[nd++] = i + __builtin_ctz (due_bits);
+            due_bits &= due_bits - 1;
+        }
+    }
+    ticker_scan_scalar (deadline + i, next_tick + i, n - i, now,
+        remaining + i, expired + ne, &te, due + nd, &td);
+    while (te-- > 0)
+        expired[ne++] += i;
+    while (td-- > 0)
+        due[nd++] += i;
+    *nexpired = ne;
+    *ndue = nd;
+}
+#endif
+
+/*
+ * Return the best kernel this CPU supports, and its name.
+ */
+ticker_kernel_t ticker_kernel (const char **name)
+{
+#ifdef TICKER_AVX2
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2")) {
+        if (name != NULL)
+            *name = "avx2";
+        return ticker_scan_avx2;
+    }
+#endif
+    if (name != NULL)
+        *name = "scalar";
+    return ticker_scan_scalar;
+}
+
+static void ticker_dispatch (const long long *deadline,
+    const long long *next_tick, int n, long long now,
+    long long *remaining, int *expired, int *nexpired,
+    int *due, int *ndue)
+{
+    ticker_scan = ticker_kernel (NULL);
+    ticker_scan (deadline, next_tick, n, now,
+        remaining, expired, nexpired, due, ndue);
+}
@@ -0,0 +1,54 @@
+/*
+ * alarm_ticker.h
+ *
+ * The ticker: a display thread's table of the alarms it is counting
+ * down, for the bulk countdown mode (-t). Rather than sleeping two
+ * seconds at a time on one alarm, a display thread in this mode
+ * holds any number of alarms, and once a second scans the whole
+ * table to find those that have expired, and those due for their
+ * "Number of Seconds Left" line.
+ *
+ * The table is kept as a structure of arrays, so that the scan
+ * runs over densely packed deadlines instead of chasing a pointer
+ * per alarm, and can be vectorized. ticker_scan points to the best
+ * kernel for the CPU the server is running on, chosen the first
+ * time it is called; the scalar kernel is always available.
+ */
+#ifndef __alarm_ticker_h
+#define __alarm_ticker_h
+
+#include <time.h>
+#include "alarm.h"
+
+#define TICKER_INTERVAL 2       /* seconds between countdown lines */
+
+typedef struct ticker_tag {
+    int                 count;
+    int                 size;
+    long long           *deadline;      /* alarm->time */
+    long long           *next_tick;     /* when the next line is due */
+    long long           *received;      /* when the thread got it */
+    alarm_t             **alarm;
+    long long           *remaining;     /* scan output, per entry */
+    int                 *expired;       /* scan output, indexes */
+    int                 *due;           /* scan output, indexes */
+} ticker_t;
+
+typedef void (*ticker_kernel_t) (const long long *deadline,
+    const long long *next_tick, int n, long long now,
+    long long *remaining, int *expired, int *nexpired,
+    int *due, int *ndue);
+
+extern void ticker_init (ticker_t *ticker);
+extern void ticker_add (ticker_t *ticker, alarm_t *alarm, time_t now);
+extern void ticker_remove (ticker_t *ticker, int index);
+extern void ticker_move (ticker_t *from, int index, ticker_t *to);
+
+extern void ticker_scan_scalar (const long long *deadline,
+    const long long *next_tick, int n, long long now,
+    long long *remaining, int *expired, int *nexpired,
+    int *due, int *ndue);
+extern ticker_kernel_t ticker_kernel (const char **name);
+extern ticker_kernel_t ticker_scan;
+
+#endif
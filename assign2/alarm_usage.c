@@ -0,0 +1,171 @@
+/*
+ * alarm_usage.c
+ *
+ * Per-thread CPU and context switch reporting. See alarm_usage.h.
+ */
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "errors.h"
+#include "alarm_usage.h"
+
+typedef struct usage_thread_tag {
+    char                name[16];       /* as pthread_setname_np takes */
+    pthread_t           thread;
+    clockid_t           clock;          /* its CPU-time clock */
+    pid_t               tid;
+    int                 exited;
+    double              cpu, last_cpu;  /* seconds */
+    long                vcsw, ivcsw;
+} usage_thread_t;
+
+static pthread_mutex_t usage_mutex = PTHREAD_MUTEX_INITIALIZER;
+static usage_thread_t usage_table[USAGE_THREADS];
+static int usage_count = 0;
+static double usage_last = 0;           /* time of the last report */
+static double usage_last_cpu = 0;       /* of the process, then */
+
+static double usage_now (void)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void usage_lock (void)
+{
+    int status;
+
+    status = pthread_mutex_lock (&usage_mutex);
+    if (status != 0)
+        err_abort (status, "Lock usage mutex");
+}
+
+static void usage_unlock (void)
+{
+    int status;
+
+    status = pthread_mutex_unlock (&usage_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock usage mutex");
+}
+
+/*
+ * Name the calling thread (at most 15 characters), and enter it in
+ * the table. Threads past USAGE_THREADS are named, but not
+ * reported.
+ */
+void usage_register (const char *name)
+{
+    usage_thread_t *entry;
+    int status;
+
+    status = pthread_setname_np (pthread_self (), name);
+    if (status != 0)
+        err_abort (status, "Name thread");
+    usage_lock ();
+    if (usage_last == 0)
+        usage_last = usage_now ();
+    if (usage_count < USAGE_THREADS) {
+        entry = &usage_table[usage_count];
+        memset (entry, 0, sizeof (usage_thread_t));
+        snprintf (entry->name, sizeof (entry->name), "%s", name);
+        entry->thread = pthread_self ();
+        entry->tid = (pid_t)syscall (SYS_gettid);
+        status = pthread_getcpuclockid (entry->thread, &entry->clock);
+        if (status != 0)
+            err_abort (status, "Get thread clock");
+        usage_count++;
+    }
+    usage_unlock ();
+}
+
+/*
+ * Read the context switches of another thread from its status
+ * file. Returns 0, or -1 if the thread is gone.
+ */
+static int usage_switches (usage_thread_t *entry)
+{
+    char path[64], line[128];
+    FILE *file;
+
+    snprintf (path, sizeof (path), "/proc/self/task/%d/status",
+        (int)entry->tid);
+    file = fopen (path, "r");
+    if (file == NULL)
+        return -1;
+    while (fgets (line, sizeof (line), file) != NULL)
+        if (sscanf (line, "voluntary_ctxt_switches: %ld",
+                &entry->vcsw) != 1)
+            sscanf (line, "nonvoluntary_ctxt_switches: %ld", &entry->ivcsw);
+    fclose (file);
+    return 0;
+}
+
+/*
+ * Bring a thread's figures up to date, unless it has exited.
+ */
+static void usage_sample (usage_thread_t *entry)
+{
+    struct timespec cpu;
+    struct rusage usage;
+
+    if (entry->exited)
+        return;
+    if (pthread_equal (entry->thread, pthread_self ())) {
+        if (getrusage (RUSAGE_THREAD, &usage) != 0)
+            errno_abort ("Get thread usage");
+        entry->vcsw = usage.ru_nvcsw;
+        entry->ivcsw = usage.ru_nivcsw;
+    } else if (usage_switches (entry) != 0) {
+        entry->exited = 1;
+        return;
+    }
+    if (clock_gettime (entry->clock, &cpu) != 0) {
+        entry->exited = 1;
+        return;
+    }
+    entry->cpu = cpu.tv_sec + cpu.tv_nsec / 1e9;
+}
+
+/*
+ * Print the usage of every registered thread, and of the process,
+ * headed by "label" (the server, or one of its processes).
+ */
+void usage_report (FILE *out, const char *label)
+{
+    usage_thread_t *entry;
+    struct rusage usage;
+    double now, interval, cpu;
+    int i;
+
+    usage_lock ();
+    now = usage_now ();
+    interval = now - usage_last;
+    fprintf (out, "Usage of %s, %.1fs since the last report:\n", label,
+        interval);
+    fprintf (out, "  %-15s %10s %6s %10s %10s\n", "thread", "cpu ms",
+        "cpu", "vcsw", "ivcsw");
+    for (i = 0; i < usage_count; i++) {
+        entry = &usage_table[i];
+        usage_sample (entry);
+        fprintf (out, "  %-15s %10.1f %5.1f%% %10ld %10ld%s\n", entry->name,
+            entry->cpu * 1e3, interval > 0 ?
+                (entry->cpu - entry->last_cpu) / interval * 100 : 0.0,
+            entry->vcsw, entry->ivcsw, entry->exited ? " (exited)" : "");
+        entry->last_cpu = entry->cpu;
+    }
+    if (getrusage (RUSAGE_SELF, &usage) != 0)
+        errno_abort ("Get process usage");
+    cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+        + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    fprintf (out, "  %-15s %10.1f %5.1f%% %10ld %10ld, peak rss %ldKB\n",
+        "process", cpu * 1e3, interval > 0 ?
+            (cpu - usage_last_cpu) / interval * 100 : 0.0,
+        usage.ru_nvcsw, usage.ru_nivcsw, usage.ru_maxrss);
+    usage_last_cpu = cpu;
+    usage_last = now;
+    usage_unlock ();
+}
@@ -0,0 +1,35 @@
+/*
+ * alarm_usage.h
+ *
+ * Where the server's CPU goes, by thread. Each thread names itself
+ * as it starts (usage_register), with pthread_setname_np, so that
+ * top -H and ps -L tell them apart, and is entered in a table. A
+ * report (usage_report) gives, for every thread in the table:
+ *
+ *      cpu     the time it has run, from its CPU-time clock (its
+ *              CLOCK_THREAD_CPUTIME_ID, which another thread reads
+ *              through pthread_getcpuclockid), in total and as a
+ *              share of the time since the last report
+ *      vcsw    voluntary context switches: it blocked, on a mutex,
+ *              a condition variable, a sleep or I/O
+ *      ivcsw   involuntary ones: it was preempted
+ *
+ * getrusage (RUSAGE_THREAD) only describes the thread that calls
+ * it, so the reporting thread counts its own switches with it, and
+ * those of the others are read from /proc/self/task/<tid>/status.
+ * The report ends with the process as a whole, from getrusage
+ * (RUSAGE_SELF), including its peak resident size.
+ *
+ * A thread that has exited keeps the figures of the last report.
+ */
+#ifndef __alarm_usage_h
+#define __alarm_usage_h
+
+#include <stdio.h>
+
+#define USAGE_THREADS   32              /* most threads in the table */
+
+extern void usage_register (const char *name);
+extern void usage_report (FILE *out, const char *label);
+
+#endif
@@ -0,0 +1,663 @@
+/*
+ * alarm_wal.c
+ *
+ * The write-ahead log and snapshots. See alarm_wal.h.
+ */
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "errors.h"
+#include "alarm.h"
+#include "alarm_lz.h"
+#include "alarm_queue.h"
+#include "alarm_wal.h"
+
+#define WAL_HEADER      16      /* magic, flags, generation */
+
+#define RECORD_INGEST   'I'
+#define RECORD_DONE     'D'
+#define RECORD_RESCHEDULE 'R'
+
+wal_t *alarm_wal = NULL;
+
+/*
+ * Translate a -Z argument into flags, or -1 if it isn't one.
+ */
+int wal_flags (const char *name)
+{
+    if (strcmp (name, "none") == 0)
+        return 0;
+    if (strcmp (name, "dict") == 0)
+        return WAL_DICT;
+    if (strcmp (name, "lz") == 0)
+        return WAL_LZ;
+    if (strcmp (name, "all") == 0)
+        return WAL_DICT | WAL_LZ;
+    return -1;
+}
+
+/*
+ * A record as read back.
+ */
+typedef struct wal_record_tag {
+    int                 type;
+    unsigned long       id;
+    unsigned long       time;
+    int                 seconds;
+    int                 length;
+    char                text[65];
+} wal_record_t;
+
+/*
+ * A file being read: the block being read follows the one before
+ * it in the window, as when it was written.
+ */
+typedef struct wal_reader_tag {
+    int                 fd;
+    int                 flags;
+    unsigned long       gen;
+    size_t              prev;
+    size_t              used;
+    size_t              pos;
+    char                window[2 * WAL_BLOCK];
+    char                in[LZ_BOUND (WAL_BLOCK)];
+    wal_dict_t          dict;
+} wal_reader_t;
+
+/*
+ * Message dictionary: messages numbered in order of first
+ * appearance, with a hash table from text to number.
+ */
+static void dict_reset (wal_dict_t *dict)
+{
+    dict->count = 0;
+    memset (dict->hash, 0, sizeof (dict->hash));
+}
+
+static unsigned dict_hash (const char *text, int length)
+{
+    unsigned h = 2166136261u;
+
+    while (length-- > 0)
+        h = (h ^ (unsigned char)*text++) * 16777619u;
+    return h & (2 * WAL_DICT_SIZE - 1);
+}
+
+static int dict_find (wal_dict_t *dict, const char *text, int length)
+{
+    unsigned h = dict_hash (text, length);
+    int i;
+
+    while ((i = dict->hash[h] - 1) >= 0) {
+        if (dict->length[i] == length
+                && memcmp (dict->text[i], text, length) == 0)
+            return i;
+        h = (h + 1) & (2 * WAL_DICT_SIZE - 1);
+    }
+    return -1;
+}
+
+/*
+ * Number a message, unless the dictionary is full, in which case
+ * it is written out every time. Reader and writer make the same
+ * choice.
+ */
+static void dict_add (wal_dict_t *dict, const char *text, int length)
+{
+    unsigned h = dict_hash (text, length);
+
+    if (dict->count == WAL_DICT_SIZE)
+        return;
+    while (dict->hash[h] != 0)
+        h = (h + 1) & (2 * WAL_DICT_SIZE - 1);
+    dict->hash[h] = dict->count + 1;
+    dict->length[dict->count] = length;
+    memcpy (dict->text[dict->count], text, length);
+    dict->count++;
+}
+
+static char *wal_path (const char *dir, const char *name)
+{
+    char *path = (char*)malloc (strlen (dir) + strlen (name) + 2);
+
+    if (path == NULL)
+        errno_abort ("Allocate path");
+    sprintf (path, "%s/%s", dir, name);
+    return path;
+}
+
+static void file_write (wal_file_t *file, const char *buf, size_t n)
+{
+    ssize_t written;
+
+    while (n > 0) {
+        written = write (file->fd, buf, n);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            errno_abort ("Write log");
+        }
+        buf += written;
+        n -= written;
+        file->bytes += written;
+    }
+}
+
+static void file_start (wal_file_t *file, int fd, int flags,
+    const char *magic, unsigned long gen)
+{
+    char header[WAL_HEADER];
+    unsigned int f = flags;
+
+    file->fd = fd;
+    file->flags = flags;
+    file->bytes = 0;
+    file->prev = file->used = 0;
+    dict_reset (&file->dict);
+    memcpy (header, magic, 4);
+    memcpy (header + 4, &f, 4);
+    memcpy (header + 8, &gen, 8);
+    file_write (file, header, WAL_HEADER);
+}
+
+/*
+ * Write the block being filled, compressed against the block
+ * before it if WAL_LZ is set, and make it the dictionary for the
+ * next. Each block is preceded by its raw and stored sizes.
+ */
+static void file_flush (wal_file_t *file)
+{
+    unsigned int raw = file->used, stored;
+
+    if (raw == 0)
+        return;
+    if (file->flags & WAL_LZ)
+        stored = lz_compress (file->window, file->prev,
+            file->prev + raw, file->out + 8);
+    else {
+        memcpy (file->out + 8, file->window + file->prev, raw);
+        stored = raw;
+    }
+    memcpy (file->out, &raw, 4);
+    memcpy (file->out + 4, &stored, 4);
+    file_write (file, file->out, 8 + stored);
+    memmove (file->window, file->window + file->prev, raw);
+    file->prev = raw;
+    file->used = 0;
+}
+
+static void put_varint (char **p, unsigned long v)
+{
+    while (v >= 0x80) {
+        *(*p)++ = (char)(v | 0x80);
+        v >>= 7;
+    }
+    *(*p)++ = (char)v;
+}
+
+static unsigned long zigzag (long v)
+{
+    return v < 0 ? ((unsigned long)-v << 1) - 1 : (unsigned long)v << 1;
+}
+
+/*
+ * Append a record to the block being filled, writing the block
+ * first if the record might not fit. A done record has no time,
+ * seconds or text, and only an ingest record has text.
+ */
+static void file_record (wal_file_t *file, int type, unsigned long id,
+    time_t time, int seconds, const char *text, int length)
+{
+    char *start, *p;
+    int index;
+
+    if (file->used + WAL_RECORD_MAX > WAL_BLOCK)
+        file_flush (file);
+    start = p = file->window + file->prev + file->used;
+    *p++ = (char)type;
+    put_varint (&p, id);
+    if (type != RECORD_DONE) {
+        put_varint (&p, time);
+        put_varint (&p, zigzag (seconds));
+    }
+    if (type == RECORD_INGEST) {
+        if (length > 64)
+            length = 64;
+        index = (file->flags & WAL_DICT) ?
+            dict_find (&file->dict, text, length) : -1;
+        if (index >= 0)
+            put_varint (&p, index + 1);
+        else {
+            if (file->flags & WAL_DICT) {
+                put_varint (&p, 0);
+                dict_add (&file->dict, text, length);
+            }
+            *p++ = (char)length;
+            memcpy (p, text, length);
+            p += length;
+        }
+    }
+    file->used += p - start;
+}
+
+/*
+ * Open a file for reading and check its header. Returns NULL if it
+ * doesn't exist, or isn't the kind of file expected.
+ */
+static wal_reader_t *reader_open (const char *path, const char *magic)
+{
+    wal_reader_t *reader;
+    char header[WAL_HEADER];
+    unsigned int flags;
+    int fd;
+
+    fd = open (path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (read (fd, header, WAL_HEADER) != WAL_HEADER
+            || memcmp (header, magic, 4) != 0) {
+        close (fd);
+        return NULL;
+    }
+    reader = (wal_reader_t*)malloc (sizeof (wal_reader_t));
+    if (reader == NULL)
+        errno_abort ("Allocate log reader");
+    memcpy (&flags, header + 4, 4);
+    reader->fd = fd;
+    reader->flags = flags;
+    memcpy (&reader->gen, header + 8, 8);
+    reader->prev = reader->used = reader->pos = 0;
+    dict_reset (&reader->dict);
+    return reader;
+}
+
+static void reader_close (wal_reader_t *reader)
+{
+    close (reader->fd);
+    free (reader);
+}
+
+static int read_full (int fd, char *buf, size_t n)
+{
+    ssize_t got;
+
+    while (n > 0) {
+        got = read (fd, buf, n);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        buf += got;
+        n -= got;
+    }
+    return 0;
+}
+
+/*
+ * Read the next block. Returns 0 at the end of the file, or at a
+ * block that is incomplete (the server stopped while writing it)
+ * or corrupt.
+ */
+static int reader_block (wal_reader_t *reader)
+{
+    char sizes[8];
+    unsigned int raw, stored;
+    long n;
+
+    if (read_full (reader->fd, sizes, 8) != 0)
+        return 0;
+    memcpy (&raw, sizes, 4);
+    memcpy (&stored, sizes + 4, 4);
+    if (raw > WAL_BLOCK || stored > sizeof (reader->in)
+            || read_full (reader->fd, reader->in, stored) != 0)
+        return 0;
+    memmove (reader->window, reader->window + reader->prev, reader->used);
+    reader->prev = reader->used;
+    if (reader->flags & WAL_LZ) {
+        n = lz_decompress (reader->in, stored, reader->window,
+            reader->prev, WAL_BLOCK);
+        if (n != raw)
+            return 0;
+    } else if (stored != raw)
+        return 0;
+    else
+        memcpy (reader->window + reader->prev, reader->in, raw);
+    reader->used = raw;
+    reader->pos = 0;
+    return 1;
+}
+
+static int get_varint (const char **p, const char *end, unsigned long *v)
+{
+    int shift = 0;
+    unsigned char b;
+
+    *v = 0;
+    do {
+        if (*p >= end || shift > 63)
+            return -1;
+        b = *(*p)++;
+        *v |= (unsigned long)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return 0;
+}
+
+/*
+ * Decode the next record. Returns 0 at the end of the records.
+ */
+static int reader_next (wal_reader_t *reader, wal_record_t *record)
+{
+    const char *p, *end;
+    unsigned long v;
+
+    while (reader->pos == reader->used)
+        if (!reader_block (reader))
+            return 0;
+    p = reader->window + reader->prev + reader->pos;
+    end = reader->window + reader->prev + reader->used;
+    record->type = *p++;
+    if (get_varint (&p, end, &record->id) != 0)
+        return 0;
+    if (record->type != RECORD_DONE) {
+        if (get_varint (&p, end, &record->time) != 0
+                || get_varint (&p, end, &v) != 0)
+            return 0;
+        record->seconds = (v & 1) ? -(long)((v + 1) >> 1) : (long)(v >> 1);
+    }
+    if (record->type == RECORD_INGEST) {
+        v = 0;
+        if ((reader->flags & WAL_DICT) && get_varint (&p, end, &v) != 0)
+            return 0;
+        if (v > 0) {
+            if (v > reader->dict.count)
+                return 0;
+            record->length = reader->dict.length[v - 1];
+            memcpy (record->text, reader->dict.text[v - 1], record->length);
+        } else {
+            if (p >= end || (record->length = (unsigned char)*p++) > 64
+                    || end - p < record->length)
+                return 0;
+            memcpy (record->text, p, record->length);
+            p += record->length;
+            if (reader->flags & WAL_DICT)
+                dict_add (&reader->dict, record->text, record->length);
+        }
+        record->text[record->length] = '\0';
+    }
+    reader->pos = p - (reader->window + reader->prev);
+    return 1;
+}
+
+/*
+ * Apply one file's records to the queue being rebuilt.
+ */
+static void wal_replay (wal_reader_t *reader, queue_t *queue)
+{
+    wal_record_t record;
+    alarm_t *alarm;
+
+    while (reader_next (reader, &record)) {
+        alarm = queue_find (queue, record.id);
+        switch (record.type) {
+        case RECORD_INGEST:
+            if (alarm != NULL)
+                break;
+            alarm = alarm_alloc_due (record.time);
+            alarm->id = record.id;
+            alarm->time = record.time;
+            alarm->seconds = record.seconds;
+            strcpy (alarm->message, record.text);
+            queue_insert (queue, alarm);
+            break;
+        case RECORD_DONE:
+            if (alarm != NULL) {
+                queue_remove (queue, alarm);
+                alarm_free (alarm);
+            }
+            break;
+        case RECORD_RESCHEDULE:
+            if (alarm != NULL) {
+                alarm->seconds = record.seconds;
+                queue_reschedule (queue, alarm, record.time);
+            }
+            break;
+        }
+    }
+}
+
+/*
+ * The generation of the snapshot in "dir", or 0 if there is none.
+ */
+static unsigned long wal_generation (const char *dir)
+{
+    char *path = wal_path (dir, "snapshot");
+    wal_reader_t *reader = reader_open (path, "ALSN");
+    unsigned long gen = 0;
+
+    if (reader != NULL) {
+        gen = reader->gen;
+        reader_close (reader);
+    }
+    free (path);
+    return gen;
+}
+
+/*
+ * Rebuild the pending alarms left by an earlier run in "dir", into
+ * "queue", which must be indexed. The alarms keep their old ids.
+ * Returns the number recovered.
+ */
+long wal_recover (const char *dir, queue_t *queue)
+{
+    char *path;
+    wal_reader_t *reader;
+    unsigned long gen = 0;
+    int snapshot = 0;
+
+    path = wal_path (dir, "snapshot");
+    reader = reader_open (path, "ALSN");
+    free (path);
+    if (reader != NULL) {
+        snapshot = 1;
+        gen = reader->gen;
+        wal_replay (reader, queue);
+        reader_close (reader);
+    }
+    path = wal_path (dir, "wal");
+    reader = reader_open (path, "ALWL");
+    free (path);
+    if (reader != NULL) {
+        if (!snapshot || reader->gen == gen)
+            wal_replay (reader, queue);
+        reader_close (reader);
+    }
+
+    /*
+     * A log started for a snapshot that was still being written:
+     * it follows the log above if the snapshot was never installed,
+     * and replaces it if it was.
+     */
+    path = wal_path (dir, "wal.new");
+    reader = reader_open (path, "ALWL");
+    free (path);
+    if (reader != NULL) {
+        if (!snapshot || reader->gen == gen || reader->gen == gen + 1)
+            wal_replay (reader, queue);
+        reader_close (reader);
+    }
+    return queue_count (queue);
+}
+
+/*
+ * A pending alarm, as copied for a snapshot.
+ */
+typedef struct wal_entry_tag {
+    unsigned long       id;
+    time_t              time;
+    int                 seconds;
+    int                 length;
+    char                text[64];
+} wal_entry_t;
+
+static void snapshot_copy (alarm_t *alarm, void *arg)
+{
+    wal_t *wal = (wal_t*)arg;
+    wal_entry_t *entry;
+
+    if (wal->nentries == wal->size) {
+        wal->size = wal->size ? wal->size * 2 : 1024;
+        wal->entry = (wal_entry_t*)realloc (
+            wal->entry, wal->size * sizeof (wal_entry_t));
+        if (wal->entry == NULL)
+            errno_abort ("Allocate snapshot");
+    }
+    entry = &wal->entry[wal->nentries++];
+    entry->id = alarm->id;
+    entry->time = alarm->time;
+    entry->seconds = alarm->seconds;
+    entry->length = alarm_length (alarm);
+    if (entry->length > sizeof (entry->text))
+        entry->length = sizeof (entry->text);
+    memcpy (entry->text, alarm_text (alarm), entry->length);
+}
+
+/*
+ * Start a snapshot: copy the pending alarms (those in the queue,
+ * and "extra", if it isn't NULL), and move logging to a new file,
+ * dir/wal.new, in the next generation. The copies are written out
+ * by wal_snapshot_write, which can be called with alarm_mutex
+ * unlocked, so that the server only pauses for the copy.
+ */
+void wal_snapshot_begin (wal_t *wal, queue_t *queue, alarm_t *extra)
+{
+    char *path;
+    int fd;
+
+    wal->nentries = 0;
+    queue_foreach (queue, snapshot_copy, wal);
+    if (extra != NULL)
+        snapshot_copy (extra, wal);
+    if (wal->log.fd >= 0) {
+        file_flush (&wal->log);
+        close (wal->log.fd);
+    }
+    wal->gen++;
+    path = wal_path (wal->dir, "wal.new");
+    fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        errno_abort ("Create log");
+    free (path);
+    file_start (&wal->log, fd, wal->flags, "ALWL", wal->gen);
+    wal->records = 0;
+}
+
+/*
+ * Write the alarms copied by wal_snapshot_begin to a new snapshot,
+ * under another name, sync it, and rename it into place; then the
+ * new log takes the place of the old. Only the thread that began
+ * the snapshot may call this, and it need not lock alarm_mutex.
+ */
+void wal_snapshot_write (wal_t *wal)
+{
+    wal_entry_t *entry;
+    char *path, *tmp;
+    long i;
+    int fd;
+
+    tmp = wal_path (wal->dir, "snapshot.new");
+    fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        errno_abort ("Create snapshot");
+    file_start (&wal->snap, fd, wal->flags, "ALSN", wal->gen);
+    for (i = 0; i < wal->nentries; i++) {
+        entry = &wal->entry[i];
+        file_record (&wal->snap, RECORD_INGEST, entry->id, entry->time,
+            entry->seconds, entry->text, entry->length);
+    }
+    file_flush (&wal->snap);
+    if (fsync (fd) < 0)
+        errno_abort ("Sync snapshot");
+    close (fd);
+    path = wal_path (wal->dir, "snapshot");
+    if (rename (tmp, path) < 0)
+        errno_abort ("Install snapshot");
+    free (tmp);
+    free (path);
+
+    tmp = wal_path (wal->dir, "wal.new");
+    path = wal_path (wal->dir, "wal");
+    if (rename (tmp, path) < 0)
+        errno_abort ("Install log");
+    free (tmp);
+    free (path);
+}
+
+/*
+ * Take a snapshot all at once.
+ */
+void wal_snapshot (wal_t *wal, queue_t *queue, alarm_t *extra)
+{
+    wal_snapshot_begin (wal, queue, extra);
+    wal_snapshot_write (wal);
+}
+
+/*
+ * Start logging to "dir", which is created if need be, beginning
+ * with a snapshot of the pending alarms (which will be those
+ * wal_recover found, at startup).
+ */
+wal_t *wal_open (const char *dir, int flags, queue_t *queue, alarm_t *extra)
+{
+    wal_t *wal;
+
+    if (mkdir (dir, 0755) < 0 && errno != EEXIST)
+        errno_abort ("Create log directory");
+    wal = (wal_t*)malloc (sizeof (wal_t));
+    if (wal == NULL)
+        errno_abort ("Allocate log");
+    wal->dir = strdup (dir);
+    wal->flags = flags;
+    wal->gen = wal_generation (dir);
+    wal->log.fd = -1;
+    wal->entry = NULL;
+    wal->nentries = wal->size = 0;
+    wal_snapshot (wal, queue, extra);
+    return wal;
+}
+
+void wal_ingest (wal_t *wal, alarm_t *alarm)
+{
+    file_record (&wal->log, RECORD_INGEST, alarm->id, alarm->time,
+        alarm->seconds, alarm_text (alarm), alarm_length (alarm));
+    wal->records++;
+}
+
+/*
+ * An alarm has left the server, whether it fired or not.
+ */
+void wal_done (wal_t *wal, unsigned long id)
+{
+    file_record (&wal->log, RECORD_DONE, id, 0, 0, NULL, 0);
+    wal->records++;
+}
+
+void wal_reschedule (wal_t *wal, alarm_t *alarm)
+{
+    file_record (&wal->log, RECORD_RESCHEDULE, alarm->id, alarm->time,
+        alarm->seconds, NULL, 0);
+    wal->records++;
+}
+
+void wal_flush (wal_t *wal)
+{
+    file_flush (&wal->log);
+}
+
+void wal_close (wal_t *wal)
+{
+    file_flush (&wal->log);
+    close (wal->log.fd);
+    free (wal->entry);
+    free (wal->dir);
+    free (wal);
+}
@@ -0,0 +1,107 @@
+/*
+ * alarm_wal.h
+ *
+ * A write-ahead log of alarm traffic (-W dir), so that a restarted
+ * server can recover its pending alarms. Every alarm received, and
+ * every alarm that leaves the server (fired, shed, dropped or
+ * cancelled) or is rescheduled, is appended to dir/wal as a record.
+ * Now and then, once the log has grown, the pending alarms are
+ * written to dir/snapshot and the log starts again empty.
+ *
+ * Records are gathered into blocks of up to WAL_BLOCK bytes, written
+ * when full and once a second by the alarm thread. Two options cut
+ * the bytes written, since records mostly repeat the same messages:
+ *
+ *      WAL_DICT  the first time a message appears in a file it is
+ *                written out, and numbered; after that the record
+ *                gives its number.
+ *      WAL_LZ    each block is compressed with the LZ codec in
+ *                alarm_lz.h, using the previous block of the file as
+ *                its dictionary.
+ *
+ * Both files start with a header giving the options and a
+ * generation number. A snapshot and the log written after it share
+ * a generation, and a log from any other generation is ignored, so
+ * a crash while a snapshot is being taken can't replay alarms twice.
+ *
+ * A snapshot is taken in two steps. wal_snapshot_begin copies the
+ * pending alarms and moves logging to dir/wal.new, in the next
+ * generation; wal_snapshot_write, with alarm_mutex unlocked, writes
+ * and syncs the copies, renames the snapshot into place, and then
+ * wal.new over the old log. Recovery replays wal.new after the log
+ * if the snapshot was never installed, and in its place if it was.
+ *
+ * Alarms of a chain are recovered as plain alarms, and alarms that a
+ * display thread already holds when a snapshot is taken are not in
+ * it. The log is not synced, so it survives the server crashing but
+ * not the machine, and a record only reaches the file when its block
+ * is written: a server killed outright loses the alarms it received
+ * (and had acknowledged) in the last second or so.
+ *
+ * All calls but wal_snapshot_write must be made with alarm_mutex
+ * locked.
+ */
+#ifndef __alarm_wal_h
+#define __alarm_wal_h
+
+#include "alarm.h"
+#include "alarm_lz.h"
+#include "alarm_queue.h"
+
+#define WAL_LZ          1
+#define WAL_DICT        2
+
+#define WAL_BLOCK       (64 * 1024)
+#define WAL_RECORD_MAX  128             /* encoded size of a record */
+#define WAL_DICT_SIZE   4096            /* messages numbered per file */
+#define WAL_SNAPSHOT_BYTES (64 * 1024 * 1024)
+
+typedef struct wal_dict_tag {
+    int                 count;
+    int                 hash[2 * WAL_DICT_SIZE];        /* index + 1 */
+    unsigned char       length[WAL_DICT_SIZE];
+    char                text[WAL_DICT_SIZE][64];
+} wal_dict_t;
+
+/*
+ * One file being written: the block being filled follows the last
+ * block written, which is kept as the compression dictionary.
+ */
+typedef struct wal_file_tag {
+    int                 fd;
+    int                 flags;
+    unsigned long       bytes;          /* written to the file */
+    size_t              prev;           /* bytes of the last block */
+    size_t              used;           /* bytes of this block */
+    char                window[2 * WAL_BLOCK];
+    char                out[8 + LZ_BOUND (WAL_BLOCK)];
+    wal_dict_t          dict;
+} wal_file_t;
+
+typedef struct wal_tag {
+    char                *dir;
+    int                 flags;
+    unsigned long       gen;
+    unsigned long       records;        /* since the last snapshot */
+    wal_file_t          log;
+    wal_file_t          snap;
+    struct wal_entry_tag *entry;        /* alarms copied for a snapshot */
+    long                nentries, size;
+} wal_t;
+
+extern wal_t *alarm_wal;         /* the server's log (-W), or NULL */
+
+extern int wal_flags (const char *name);
+extern long wal_recover (const char *dir, queue_t *queue);
+extern wal_t *wal_open (const char *dir, int flags,
+    queue_t *queue, alarm_t *extra);
+extern void wal_ingest (wal_t *wal, alarm_t *alarm);
+extern void wal_done (wal_t *wal, unsigned long id);
+extern void wal_reschedule (wal_t *wal, alarm_t *alarm);
+extern void wal_flush (wal_t *wal);
+extern void wal_snapshot (wal_t *wal, queue_t *queue, alarm_t *extra);
+extern void wal_snapshot_begin (wal_t *wal, queue_t *queue, alarm_t *extra);
+extern void wal_snapshot_write (wal_t *wal);
+extern void wal_close (wal_t *wal);
+
+#endif
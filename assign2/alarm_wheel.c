@@ -0,0 +1,239 @@
+/*
+ * alarm_wheel.c
+ *
+ * The wheel backend: a ring of 4096 buckets, one per second,
+ * starting at the wheel's cursor. An alarm due at second t lives
+ * in bucket t % 4096, as long as t is within 4096 seconds of the
+ * cursor; alarms further out wait on a sorted overflow list, and
+ * move onto the wheel as the cursor advances towards them.
+ *
+ * Finding the next alarm means finding the next occupied bucket
+ * after the cursor, which the occupancy bitmap (alarm_bitmap.h)
+ * does in a few instructions, instead of stepping through empty
+ * buckets one by one when the schedule is sparse.
+ *
+ * Alarms with the same deadline are kept in arrival order, and an
+ * alarm already overdue when it is inserted goes into the cursor's
+ * bucket, in deadline order ahead of the rest.
+ */
+#include "errors.h"
+#include "alarm.h"
+#include "alarm_bitmap.h"
+#include "alarm_pool.h"
+#include "alarm_queue.h"
+
+#define WHEEL_SIZE      BITMAP_BITS
+#define WHEEL_MASK      (WHEEL_SIZE - 1)
+
+typedef struct bucket_tag {
+    alarm_t             *head;
+    alarm_t             *tail;
+} bucket_t;
+
+typedef struct wheel_queue_tag {
+    queue_t             queue;
+    time_t              cursor;         /* first second on the wheel */
+    alarm_t             *overflow;      /* beyond cursor + WHEEL_SIZE */
+    bitmap_t            occupied;
+    bucket_t            bucket[WHEEL_SIZE];
+} wheel_queue_t;
+
+static queue_t *wheel_create (void)
+{
+    wheel_queue_t *wq;
+
+    /*
+     * The bucket array is 64KB, touched at random as deadlines
+     * come and go, so map it from the pool, where it can have huge
+     * pages. pool_map memory is already zeroed.
+     */
+    wq = (wheel_queue_t*)pool_map (sizeof (wheel_queue_t));
+    wq->queue.ops = &wheel_queue_ops;
+    return &wq->queue;
+}
+
+static void wheel_destroy (queue_t *queue)
+{
+    pool_unmap (queue, sizeof (wheel_queue_t));
+}
+
+/*
+ * Add an alarm to the bucket for its deadline (or for the cursor,
+ * if it is overdue). Alarms nearly always arrive in deadline order
+ * within a bucket, so they are appended at the tail; only overdue
+ * alarms need a sorted insert.
+ */
+static void bucket_add (wheel_queue_t *wq, alarm_t *alarm)
+{
+    time_t t = alarm->time < wq->cursor ? wq->cursor : alarm->time;
+    unsigned slot = t & WHEEL_MASK;
+    bucket_t *b = &wq->bucket[slot];
+
+    if (b->head == NULL) {
+        alarm->link = NULL;
+        b->head = b->tail = alarm;
+        bitmap_set (&wq->occupied, slot);
+    } else if (alarm->time >= b->tail->time) {
+        alarm->link = NULL;
+        b->tail->link = alarm;
+        b->tail = alarm;
+    } else
+        alarm_insert (&b->head, alarm);
+}
+
+/*
+ * Move alarms from the overflow list onto the wheel, once the
+ * cursor has come within WHEEL_SIZE seconds of them.
+ */
+static void wheel_migrate (wheel_queue_t *wq)
+{
+    alarm_t *alarm;
+
+    while ((alarm = wq->overflow) != NULL
+            && alarm->time < wq->cursor + WHEEL_SIZE) {
+        wq->overflow = alarm->link;
+        bucket_add (wq, alarm);
+    }
+}
+
+static void wheel_insert (queue_t *queue, alarm_t *alarm)
+{
+    wheel_queue_t *wq = (wheel_queue_t*)queue;
+
+    /*
+     * An empty wheel can start wherever the new alarm is due.
+     */
+    if (queue->count++ == 0)
+        wq->cursor = alarm->time;
+    if (alarm->time >= wq->cursor + WHEEL_SIZE)
+        alarm_insert (&wq->overflow, alarm);
+    else
+        bucket_add (wq, alarm);
+}
+
+static void wheel_insert_batch (queue_t *queue, alarm_t *batch)
+{
+    alarm_t *next;
+
+    while (batch != NULL) {
+        next = batch->link;
+        wheel_insert (queue, batch);
+        batch = next;
+    }
+}
+
+/*
+ * Find the bucket holding the earliest alarm, and advance the
+ * cursor to it. Returns the bucket, or NULL if the queue is empty.
+ */
+static bucket_t *wheel_first (wheel_queue_t *wq)
+{
+    int slot;
+
+    if (wq->queue.count == 0)
+        return NULL;
+    slot = bitmap_next_cyclic (&wq->occupied, wq->cursor & WHEEL_MASK);
+    if (slot < 0) {
+        /*
+         * Nothing on the wheel, so everything is on the overflow
+         * list. Restart the wheel at its first alarm.
+         */
+        wq->cursor = wq->overflow->time;
+        wheel_migrate (wq);
+        slot = wq->cursor & WHEEL_MASK;
+    } else if (slot != (wq->cursor & WHEEL_MASK)) {
+        wq->cursor += (slot - wq->cursor) & WHEEL_MASK;
+        wheel_migrate (wq);
+    }
+    return &wq->bucket[slot];
+}
+
+static alarm_t *wheel_peek (queue_t *queue)
+{
+    bucket_t *b = wheel_first ((wheel_queue_t*)queue);
+
+    return b != NULL ? b->head : NULL;
+}
+
+static alarm_t *wheel_pop (queue_t *queue)
+{
+    wheel_queue_t *wq = (wheel_queue_t*)queue;
+    bucket_t *b = wheel_first (wq);
+    alarm_t *alarm;
+
+    if (b == NULL)
+        return NULL;
+    alarm = b->head;
+    b->head = alarm->link;
+    if (b->head == NULL) {
+        b->tail = NULL;
+        bitmap_clear (&wq->occupied, b - wq->bucket);
+    }
+    queue->count--;
+    return alarm;
+}
+
+/*
+ * Remove a pending alarm. It is on the overflow list if it is due
+ * beyond the wheel; otherwise it is in the bucket bucket_add chose
+ * for it, which is its deadline's, or the cursor's if it was
+ * overdue (the cursor never moves past an occupied bucket).
+ */
+static void wheel_remove (queue_t *queue, alarm_t *alarm)
+{
+    wheel_queue_t *wq = (wheel_queue_t*)queue;
+    time_t t = alarm->time < wq->cursor ? wq->cursor : alarm->time;
+    unsigned slot = t & WHEEL_MASK;
+    bucket_t *b = &wq->bucket[slot];
+    alarm_t *prev;
+
+    if (alarm->time >= wq->cursor + WHEEL_SIZE) {
+        alarm_unlink (&wq->overflow, alarm);
+        queue->count--;
+        return;
+    }
+    if (b->head == alarm)
+        prev = NULL;
+    else
+        for (prev = b->head; prev->link != alarm; prev = prev->link)
+            ;
+    if (prev == NULL)
+        b->head = alarm->link;
+    else
+        prev->link = alarm->link;
+    if (b->tail == alarm)
+        b->tail = prev;
+    if (b->head == NULL)
+        bitmap_clear (&wq->occupied, slot);
+    alarm->link = NULL;
+    queue->count--;
+}
+
+static void wheel_reschedule (queue_t *queue, alarm_t *alarm, time_t time)
+{
+    wheel_remove (queue, alarm);
+    alarm->time = time;
+    wheel_insert (queue, alarm);
+}
+
+static size_t wheel_bytes (queue_t *queue)
+{
+    return sizeof (wheel_queue_t);
+}
+
+const queue_ops_t wheel_queue_ops = {
+    "wheel",
+    wheel_create,
+    wheel_destroy,
+    wheel_insert,
+    wheel_insert_batch,
+    wheel_peek,
+    wheel_pop,
+    wheel_remove,
+    wheel_reschedule,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    wheel_bytes,
+};